@@ -0,0 +1,193 @@
+// The Linux implementations of the platform-specific parts of Helpers.h.  The
+// Windows versions are in Windows/Helpers.cpp.
+
+#include "Helpers.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+#include <stdexcept>
+using namespace std;
+using namespace SMX;
+
+void SMX::SetThreadName(thread &thread, const string &name)
+{
+    // Linux limits thread names to 15 characters.
+    pthread_setname_np(thread.native_handle(), name.substr(0, 15).c_str());
+}
+
+void SMX::SetThreadHighPriority(thread &thread)
+{
+    // Raising thread priority normally requires privileges on Linux.  Try to give the
+    // thread a realtime priority, and just leave it alone if we're not allowed to.
+    sched_param param;
+    param.sched_priority = sched_get_priority_min(SCHED_RR);
+    pthread_setschedparam(thread.native_handle(), SCHED_RR, &param);
+}
+
+wstring SMX::GetErrorString(int err)
+{
+    string sError = strerror(err);
+    return wstring(sError.begin(), sError.end());
+}
+
+wstring SMX::wvssprintf(const wchar_t *szFormat, va_list argList)
+{
+    // vswprintf can't tell us the size of the result, so retry with a larger
+    // buffer until it fits.
+    wstring sStr;
+    for(int iSize = 256; iSize <= 1024*1024; iSize *= 2)
+    {
+        sStr.resize(iSize);
+
+        va_list argListCopy;
+        va_copy(argListCopy, argList);
+        int iChars = vswprintf((wchar_t *) sStr.data(), iSize, szFormat, argListCopy);
+        va_end(argListCopy);
+
+        if(iChars >= 0)
+        {
+            sStr.resize(iChars);
+            return sStr;
+        }
+    }
+
+    return wstring(L"Error formatting string: ") + szFormat;
+}
+
+bool SMX::GetRandomBytes(void *pData, int iBytes)
+{
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+        return false;
+
+    uint8_t *p = (uint8_t *) pData;
+    while(iBytes > 0)
+    {
+        ssize_t iRead = read(fd, p, iBytes);
+        if(iRead == -1 && errno == EINTR)
+            continue;
+        if(iRead <= 0)
+        {
+            close(fd);
+            return false;
+        }
+
+        p += iRead;
+        iBytes -= iRead;
+    }
+
+    close(fd);
+    return true;
+}
+
+// Return the time elapsed since the first call to GetMonotonicTime, in seconds.
+// CLOCK_MONOTONIC doesn't advance during suspend, like the Windows version.
+double SMX::GetMonotonicTime()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    int64_t iTime = int64_t(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+
+    static int64_t iStartTime = iTime;
+    return (iTime - iStartTime) / 1000000000.0;
+}
+
+void SMX::GenerateRandom(void *pOut, int iSize)
+{
+    // This shouldn't fail.
+    if(!GetRandomBytes(pOut, iSize))
+        throw runtime_error("Error reading /dev/urandom");
+}
+
+string SMX::WideStringToUTF8(wstring s)
+{
+    // wchar_t is UTF-32 on Linux.
+    string ret;
+    for(wchar_t wc: s)
+    {
+        uint32_t c = (uint32_t) wc;
+        if(c < 0x80)
+            ret.push_back((char) c);
+        else if(c < 0x800)
+        {
+            ret.push_back((char) (0xC0 | (c >> 6)));
+            ret.push_back((char) (0x80 | (c & 0x3F)));
+        }
+        else if(c < 0x10000)
+        {
+            ret.push_back((char) (0xE0 | (c >> 12)));
+            ret.push_back((char) (0x80 | ((c >> 6) & 0x3F)));
+            ret.push_back((char) (0x80 | (c & 0x3F)));
+        }
+        else
+        {
+            ret.push_back((char) (0xF0 | (c >> 18)));
+            ret.push_back((char) (0x80 | ((c >> 12) & 0x3F)));
+            ret.push_back((char) (0x80 | ((c >> 6) & 0x3F)));
+            ret.push_back((char) (0x80 | (c & 0x3F)));
+        }
+    }
+    return ret;
+}
+
+SMX::AutoCloseHandle::AutoCloseHandle(HANDLE h)
+{
+    handle = h;
+}
+
+SMX::AutoCloseHandle::~AutoCloseHandle()
+{
+    if(handle != INVALID_HANDLE_VALUE)
+        close(handle);
+}
+
+bool SMX::MappedFile::Open(const string &sPath, string &sError)
+{
+    Close();
+
+    AutoCloseHandle fd(open(sPath.c_str(), O_RDONLY | O_CLOEXEC));
+    if(fd.value() == INVALID_HANDLE_VALUE)
+    {
+        sError = ssprintf("Couldn't open %s: %s", sPath.c_str(), strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if(fstat(fd.value(), &st) == -1)
+    {
+        sError = ssprintf("Couldn't read %s: %s", sPath.c_str(), strerror(errno));
+        return false;
+    }
+
+    // Empty files can't be mapped.
+    if(st.st_size == 0)
+        return true;
+
+    // The mapping stays valid after the file is closed.  Callers read the whole file, so
+    // fault it all in now rather than a page at a time.
+    void *pData = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd.value(), 0);
+    if(pData == MAP_FAILED)
+    {
+        sError = ssprintf("Couldn't map %s: %s", sPath.c_str(), strerror(errno));
+        return false;
+    }
+
+    m_pData = (const uint8_t *) pData;
+    m_iSize = st.st_size;
+    return true;
+}
+
+void SMX::MappedFile::Close()
+{
+    if(m_pData != nullptr)
+        munmap((void *) m_pData, m_iSize);
+    m_pData = nullptr;
+    m_iSize = 0;
+}
@@ -0,0 +1,260 @@
+// The Linux implementation of SMXDeviceSearch, using hidraw.  The Windows version is
+// in Windows/SMXDeviceSearch.cpp.
+
+#include "SMXDeviceSearch.h"
+
+#include "SMXHidrawTransport.h"
+#include "Helpers.h"
+
+#include <string>
+#include <memory>
+#include <set>
+using namespace std;
+using namespace SMX;
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+
+// Older kernel headers don't have this, but it's harmless to call on kernels that don't
+// support it: the ioctl just fails.
+#ifndef HIDIOCGRAWUNIQ
+#define HIDIOCGRAWUNIQ(len) _IOC(_IOC_READ, 'H', 0x08, len)
+#endif
+
+// Find all hidraw device paths.  This doesn't open the device to filter just our devices.
+// Return false if the list couldn't be read.
+static bool GetAllHIDDevicePaths(set<wstring> &paths, wstring &error)
+{
+    DIR *pDir = opendir("/sys/class/hidraw");
+    if(pDir == nullptr)
+    {
+        // This doesn't exist if hidraw isn't loaded, which just means there are no devices.
+        if(errno == ENOENT)
+            return true;
+
+        error = L"Couldn't read /sys/class/hidraw: " + GetErrorString(errno);
+        return false;
+    }
+
+    while(dirent *pEntry = readdir(pDir))
+    {
+        string sName = pEntry->d_name;
+        if(sName.compare(0, 6, "hidraw") != 0)
+            continue;
+
+        string sPath = "/dev/" + sName;
+        paths.insert(wstring(sPath.begin(), sPath.end()));
+    }
+
+    closedir(pDir);
+
+    return true;
+}
+
+// Open the device at sDevicePath, and return it if it's ours.  Whatever we find out about
+// it is stored in info, so we remember it even if it isn't ours.  Failures are only logged,
+// since many unrelated devices will fail to open.
+static shared_ptr<AutoCloseHandle> OpenUSBDevice(const wstring &sDevicePath, SMXDeviceSearch::CachedDevice &info)
+{
+    string sPath = WideStringToUTF8(sDevicePath);
+    HANDLE OpenDevice = open(sPath.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if(OpenDevice == INVALID_HANDLE_VALUE)
+    {
+        Log(ssprintf("Error opening device %s: %ls", sPath.c_str(), GetErrorString(errno).c_str()));
+        return nullptr;
+    }
+
+    auto result = make_shared<AutoCloseHandle>(OpenDevice);
+
+    // Get the HID attributes to check the IDs.
+    hidraw_devinfo DevInfo;
+    if(ioctl(result->value(), HIDIOCGRAWINFO, &DevInfo) == -1)
+    {
+        Log(ssprintf("Error opening device %s: HIDIOCGRAWINFO failed", sPath.c_str()));
+        return nullptr;
+    }
+
+    info.m_iVendorID = (uint16_t) DevInfo.vendor;
+    info.m_iProductID = (uint16_t) DevInfo.product;
+    if(info.m_iVendorID != 0x2341 || info.m_iProductID != 0x8037)
+    {
+        Log(ssprintf("Device %s: not our device (ID %04x:%04x)", sPath.c_str(), info.m_iVendorID, info.m_iProductID));
+        return nullptr;
+    }
+
+    // Since we're using the default Arduino IDs, check the product name to make sure
+    // this isn't some other Arduino device.  hidraw gives us the manufacturer and product
+    // name together, separated by a space.
+    char ProductName[256];
+    memset(ProductName, 0, sizeof(ProductName));
+    if(ioctl(result->value(), HIDIOCGRAWNAME(sizeof(ProductName)-1), ProductName) == -1)
+    {
+        Log(ssprintf("Error opening device %s: HIDIOCGRAWNAME failed", sPath.c_str()));
+        return nullptr;
+    }
+
+    string sProductName = ProductName;
+    info.m_sProductName = wstring(sProductName.begin(), sProductName.end());
+    const string sSuffix = " StepManiaX";
+    bool bMatches = sProductName == "StepManiaX" ||
+        (sProductName.size() > sSuffix.size() &&
+         sProductName.compare(sProductName.size() - sSuffix.size(), sSuffix.size(), sSuffix) == 0);
+    if(!bMatches)
+    {
+        Log(ssprintf("Device %s: not our device (%s)", sPath.c_str(), ProductName));
+        return nullptr;
+    }
+
+    // The serial number is only informational, so it's not an error if there isn't one.
+    char SerialNumber[256];
+    memset(SerialNumber, 0, sizeof(SerialNumber));
+    if(ioctl(result->value(), HIDIOCGRAWUNIQ(sizeof(SerialNumber)-1), SerialNumber) != -1)
+    {
+        string sSerialNumber = SerialNumber;
+        info.m_sSerialNumber = wstring(sSerialNumber.begin(), sSerialNumber.end());
+    }
+
+    return result;
+}
+
+SMX::SMXDeviceSearch::SMXDeviceSearch()
+{
+    // Watch /dev for hidraw devices being added and removed, so we don't need to poll.
+    // If this fails, GetChangeHandle returns INVALID_HANDLE_VALUE and we'll be polled.
+    HANDLE hNotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(hNotify == INVALID_HANDLE_VALUE)
+    {
+        Log(ssprintf("inotify_init1 failed: %ls", GetErrorString(errno).c_str()));
+        return;
+    }
+
+    auto pNotify = make_shared<AutoCloseHandle>(hNotify);
+    if(inotify_add_watch(hNotify, "/dev", IN_CREATE | IN_DELETE | IN_ATTRIB | IN_MOVED_TO | IN_MOVED_FROM) == -1)
+    {
+        Log(ssprintf("Error watching /dev: %ls", GetErrorString(errno).c_str()));
+        return;
+    }
+
+    m_hDeviceNotify = pNotify;
+}
+
+HANDLE SMX::SMXDeviceSearch::GetChangeHandle() const
+{
+    return m_hDeviceNotify? m_hDeviceNotify->value():INVALID_HANDLE_VALUE;
+}
+
+bool SMX::SMXDeviceSearch::CheckForChanges()
+{
+    if(m_hDeviceNotify == nullptr)
+        return true;
+
+    // Read all queued events.  Most of these are for other devices, which we ignore.
+    bool bChanged = false;
+    alignas(inotify_event) char Buffer[4096];
+    while(true)
+    {
+        ssize_t iSize = read(m_hDeviceNotify->value(), Buffer, sizeof(Buffer));
+        if(iSize <= 0)
+            break;
+
+        for(ssize_t iPos = 0; iPos < iSize; )
+        {
+            const inotify_event *pEvent = (const inotify_event *) (Buffer + iPos);
+            iPos += sizeof(inotify_event) + pEvent->len;
+
+            // If events were lost, we don't know what changed.
+            if(pEvent->mask & IN_Q_OVERFLOW)
+            {
+                bChanged = true;
+                continue;
+            }
+
+            if(pEvent->len == 0 || strncmp(pEvent->name, "hidraw", 6) != 0)
+                continue;
+
+            bChanged = true;
+
+            // udev sets the permissions of new devices after they're created, so we may have
+            // tried to open this device before we were allowed to.  If we don't have it open,
+            // forget we've seen it, so we'll try again.
+            if(pEvent->mask & IN_ATTRIB)
+            {
+                string sPath = string("/dev/") + pEvent->name;
+                auto it = m_DeviceCache.find(wstring(sPath.begin(), sPath.end()));
+                if(it != m_DeviceCache.end() && it->second.m_pTransport == nullptr)
+                    m_DeviceCache.erase(it);
+            }
+        }
+    }
+
+    return bChanged;
+}
+
+vector<shared_ptr<SMXTransport>> SMX::SMXDeviceSearch::GetDevices(wstring &error)
+{
+    // If we couldn't get the device list, leave the cache alone.  If we cleared it, we'd
+    // open every device again next time.
+    set<wstring> aDevicePaths;
+    if(!GetAllHIDDevicePaths(aDevicePaths, error))
+        return {};
+
+    // Forget about paths that are gone.
+    for(auto it = m_DeviceCache.begin(); it != m_DeviceCache.end(); )
+    {
+        if(aDevicePaths.find(it->first) != aDevicePaths.end())
+        {
+            ++it;
+            continue;
+        }
+
+        if(it->second.m_pTransport)
+            Log(ssprintf("Device removed: %ls", it->first.c_str()));
+        it = m_DeviceCache.erase(it);
+    }
+
+    // Check paths we haven't seen before.  Paths we've already seen are in the cache
+    // whether or not they're ours, since OpenUSBDevice has to open the device and causes
+    // requests to be sent to it.
+    for(const wstring &sPath: aDevicePaths)
+    {
+        if(m_DeviceCache.find(sPath) != m_DeviceCache.end())
+            continue;
+
+        // This will return NULL if this isn't our device.
+        CachedDevice &device = m_DeviceCache[sPath];
+        shared_ptr<AutoCloseHandle> hDevice = OpenUSBDevice(sPath, device);
+        if(hDevice == nullptr)
+            continue;
+
+        Log(ssprintf("Device added: %ls", sPath.c_str()));
+        device.m_pTransport = make_shared<SMXHidrawTransport>(hDevice);
+    }
+
+    vector<shared_ptr<SMXTransport>> aDevices;
+    for(const auto &it: m_DeviceCache)
+    {
+        if(it.second.m_pTransport)
+            aDevices.push_back(it.second.m_pTransport);
+    }
+
+    return aDevices;
+}
+
+void SMX::SMXDeviceSearch::DeviceWasClosed(shared_ptr<SMXTransport> pDevice)
+{
+    // Forget about the device, so we'll open it again if it's still there.
+    for(auto it = m_DeviceCache.begin(); it != m_DeviceCache.end(); ++it)
+    {
+        if(it->second.m_pTransport == pDevice)
+        {
+            m_DeviceCache.erase(it);
+            break;
+        }
+    }
+}
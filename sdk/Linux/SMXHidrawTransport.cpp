@@ -0,0 +1,228 @@
+#include "SMXHidrawTransport.h"
+#include "Helpers.h"
+
+#include <string>
+#include <memory>
+using namespace std;
+using namespace SMX;
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+SMX::SMXHidrawTransport::SMXHidrawTransport(shared_ptr<AutoCloseHandle> hDevice):
+    m_hDevice(hDevice)
+{
+}
+
+SMX::SMXHidrawTransport::~SMXHidrawTransport()
+{
+    Close();
+}
+
+bool SMX::SMXHidrawTransport::Open(wstring &sError)
+{
+    // hidraw buffers input reports in the kernel, so there's nothing to set up.
+    return true;
+}
+
+void SMX::SMXHidrawTransport::Close()
+{
+    m_sFreeWrites.splice(m_sFreeWrites.end(), m_sPendingWrites);
+}
+
+bool SMX::SMXHidrawTransport::ReadReport(string &sReport, wstring &sError)
+{
+    while(1)
+    {
+        ssize_t iBytes = read(m_hDevice->value(), m_ReadBuffer, sizeof(m_ReadBuffer));
+        if(iBytes == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                sError = wstring(L"Error reading device: ") + GetErrorString(errno).c_str();
+            return false;
+        }
+
+        // A zero-length read means the device was unplugged.
+        if(iBytes == 0)
+        {
+            sError = L"Device disconnected";
+            return false;
+        }
+
+        sReport.assign(m_ReadBuffer, iBytes);
+        return true;
+    }
+}
+
+void SMX::SMXHidrawTransport::WriteReport(const string &sReport, wstring &sError)
+{
+    if(m_sFreeWrites.empty())
+        m_sPendingWrites.push_back(sReport);
+    else
+    {
+        m_sPendingWrites.splice(m_sPendingWrites.end(), m_sFreeWrites, m_sFreeWrites.begin());
+        m_sPendingWrites.back() = sReport;
+    }
+    FlushWrites(sError);
+}
+
+void SMX::SMXHidrawTransport::FlushWrites(wstring &sError)
+{
+    while(!m_sPendingWrites.empty())
+    {
+        const string &sData = m_sPendingWrites.front();
+        ssize_t iBytes = write(m_hDevice->value(), sData.data(), sData.size());
+        if(iBytes == -1)
+        {
+            if(errno == EINTR)
+                continue;
+
+            // If the device isn't ready for more data, leave the rest queued.  SMXIOWaiter
+            // will wake us up when it's writable.
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                sError = wstring(L"Error writing to device: ") + GetErrorString(errno).c_str();
+                m_sFreeWrites.splice(m_sFreeWrites.end(), m_sPendingWrites);
+            }
+            return;
+        }
+
+        m_sFreeWrites.splice(m_sFreeWrites.end(), m_sPendingWrites, m_sPendingWrites.begin());
+    }
+}
+
+bool SMX::SMXHidrawTransport::GetWritesComplete(wstring &sError)
+{
+    FlushWrites(sError);
+    return m_sPendingWrites.empty();
+}
+
+void SMX::SMXHidrawTransport::CancelWrites()
+{
+    // Writes that were accepted by the kernel can't be cancelled, but they'll complete
+    // on their own.  Just discard anything we haven't sent yet.
+    m_sFreeWrites.splice(m_sFreeWrites.end(), m_sPendingWrites);
+}
+
+SMX::SMXIOWaiter::SMXIOWaiter()
+{
+    m_hEventFd = make_shared<AutoCloseHandle>(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+    m_hEpoll = make_shared<AutoCloseHandle>(epoll_create1(EPOLL_CLOEXEC));
+
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = m_hEventFd->value();
+    if(epoll_ctl(m_hEpoll->value(), EPOLL_CTL_ADD, m_hEventFd->value(), &event) == -1)
+        Log(ssprintf("Error: epoll_ctl: %ls", GetErrorString(errno).c_str()));
+}
+
+SMX::SMXIOWaiter::~SMXIOWaiter()
+{
+}
+
+void SMX::SMXIOWaiter::Wake()
+{
+    uint64_t iValue = 1;
+    if(write(m_hEventFd->value(), &iValue, sizeof(iValue)) == -1 && errno != EAGAIN)
+        Log(ssprintf("Error: eventfd write: %ls", GetErrorString(errno).c_str()));
+}
+
+void SMX::SMXIOWaiter::AddHandle(HANDLE hHandle)
+{
+    // This stays registered for good, and isn't in m_RegisteredHandles, so Wait leaves it alone.
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = hHandle;
+    if(epoll_ctl(m_hEpoll->value(), EPOLL_CTL_ADD, hHandle, &event) == -1)
+        Log(ssprintf("Error: epoll_ctl: %ls", GetErrorString(errno).c_str()));
+}
+
+void SMX::SMXIOWaiter::Wait(const vector<shared_ptr<SMXTransport>> &apTransports, int iDelayMS)
+{
+    // Update the epoll set to match the transports we were given.  Transports come and go
+    // as devices connect and disconnect, and a new device can reuse a closed device's file
+    // descriptor, so compare transports and not just file descriptors.
+    auto FindHandle = [](vector<RegisteredHandle> &aHandles, int fd) {
+        for(RegisteredHandle &handle: aHandles)
+            if(handle.m_iFd == fd)
+                return &handle;
+        return (RegisteredHandle *) nullptr;
+    };
+
+    m_NewHandles.clear();
+    for(const shared_ptr<SMXTransport> &pTransport: apTransports)
+    {
+        // Transports without a handle tell us how long we can wait instead.
+        int iWakeupDelayMS = pTransport->GetWakeupDelayMS();
+        if(iWakeupDelayMS != -1 && (iDelayMS == -1 || iWakeupDelayMS < iDelayMS))
+            iDelayMS = iWakeupDelayMS;
+
+        int fd = pTransport->GetWaitHandle();
+        if(fd == INVALID_HANDLE_VALUE)
+            continue;
+
+        RegisteredHandle *pHandle = FindHandle(m_NewHandles, fd);
+        if(pHandle == nullptr)
+        {
+            m_NewHandles.emplace_back();
+            pHandle = &m_NewHandles.back();
+        }
+
+        pHandle->m_iFd = fd;
+        pHandle->m_pTransport = pTransport;
+        pHandle->m_iEvents = EPOLLIN;
+        if(pTransport->GetWantsWriteWakeup())
+            pHandle->m_iEvents |= EPOLLOUT;
+    }
+
+    // Remove handles that are no longer in use.  If the fd was already closed, the kernel
+    // removed it for us and this will fail, which is fine.
+    for(RegisteredHandle &handle: m_RegisteredHandles)
+    {
+        if(FindHandle(m_NewHandles, handle.m_iFd) == nullptr)
+            epoll_ctl(m_hEpoll->value(), EPOLL_CTL_DEL, handle.m_iFd, nullptr);
+    }
+
+    for(RegisteredHandle &handle: m_NewHandles)
+    {
+        int fd = handle.m_iFd;
+
+        epoll_event event = {};
+        event.events = handle.m_iEvents;
+        event.data.fd = fd;
+
+        RegisteredHandle *pOld = FindHandle(m_RegisteredHandles, fd);
+        bool bSameTransport = pOld != nullptr &&
+            !pOld->m_pTransport.owner_before(handle.m_pTransport) &&
+            !handle.m_pTransport.owner_before(pOld->m_pTransport);
+
+        if(!bSameTransport)
+        {
+            // This is a new fd, or a reused one.  A reused fd was removed from the epoll set
+            // when it was closed, but if it's still registered (it was dup'd), modify it instead.
+            if(epoll_ctl(m_hEpoll->value(), EPOLL_CTL_ADD, fd, &event) == -1)
+            {
+                if(errno != EEXIST || epoll_ctl(m_hEpoll->value(), EPOLL_CTL_MOD, fd, &event) == -1)
+                    Log(ssprintf("Error: epoll_ctl: %ls", GetErrorString(errno).c_str()));
+            }
+        }
+        else if(pOld->m_iEvents != handle.m_iEvents)
+        {
+            if(epoll_ctl(m_hEpoll->value(), EPOLL_CTL_MOD, fd, &event) == -1)
+                Log(ssprintf("Error: epoll_ctl: %ls", GetErrorString(errno).c_str()));
+        }
+    }
+    m_RegisteredHandles.swap(m_NewHandles);
+
+    epoll_event events[16];
+    epoll_wait(m_hEpoll->value(), events, 16, iDelayMS);
+
+    // Clear the eventfd, so the next call will block again.
+    uint64_t iValue;
+    while(read(m_hEventFd->value(), &iValue, sizeof(iValue)) > 0)
+        ;
+}
@@ -0,0 +1,49 @@
+#ifndef SMXHidrawTransport_h
+#define SMXHidrawTransport_h
+
+#include <memory>
+#include <string>
+#include <list>
+using namespace std;
+
+#include "Helpers.h"
+#include "SMXTransport.h"
+
+namespace SMX
+{
+
+// The Linux transport, using a nonblocking /dev/hidraw device.
+//
+// hidraw reads return one report at a time, and writes are sent immediately or
+// refused with EAGAIN.  If a write is refused, we queue the rest and ask SMXIOWaiter
+// to wake us up when the device becomes writable.
+class SMXHidrawTransport: public SMXTransport
+{
+public:
+    SMXHidrawTransport(shared_ptr<AutoCloseHandle> hDevice);
+    ~SMXHidrawTransport();
+
+    bool Open(wstring &sError) override;
+    void Close() override;
+    bool ReadReport(string &sReport, wstring &sError) override;
+    void WriteReport(const string &sReport, wstring &sError) override;
+    bool GetWritesComplete(wstring &sError) override;
+    void CancelWrites() override;
+    HANDLE GetWaitHandle() const override { return m_hDevice->value(); }
+    bool GetWantsWriteWakeup() const override { return !m_sPendingWrites.empty(); }
+
+private:
+    // Write as much of m_sPendingWrites as the device will accept.
+    void FlushWrites(wstring &sError);
+
+    shared_ptr<AutoCloseHandle> m_hDevice;
+    char m_ReadBuffer[64];
+
+    // Reports that the device hasn't accepted yet, in order.  Buffers are moved to
+    // m_sFreeWrites once they're written, and reused for later reports.
+    list<string> m_sPendingWrites;
+    list<string> m_sFreeWrites;
+};
+}
+
+#endif
@@ -0,0 +1,319 @@
+// Check the timing of automatic panel animations.
+//
+// Auto animations play on a timeline of 30 FPS ticks, and each update shows the frame for
+// the tick it runs on.  This loads an animation with mixed frame delays and a loop frame,
+// and checks that:
+//
+// - frame timings in ticks match the ones uploaded to the panels,
+// - SMXPanelAnimation::GetFrameAtTick matches playing the frames out tick by tick,
+// - updates with late, uneven waits show the frame for the time they run, on both pads,
+// - SMX_LightsAnimation_GetPhase and SMX_LightsAnimation_SetPhase move the timeline.
+//
+// It also simulates ten minutes of updates with late waits, and reports how far the old
+// way of advancing animations by the time between updates drifts from the timeline.
+//
+// Build with "make benchmarks" in sdk/Linux, and run build/benchmarks/AnimationTiming.
+
+#include "SMXPanelAnimation.h"
+#include "SMXLightsEncoding.h"
+#include "SMXGif.h"
+#include "Helpers.h"
+#include "BenchmarkHelpers.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+using namespace SMX;
+using namespace BenchmarkHelpers;
+
+namespace
+{
+    // Frame delays in GIF units of 10ms.  30ms and 40ms are both one tick.
+    const int FrameDelays[] = { 3, 3, 4, 5, 10, 2, 7, 3, 1, 6, 4, 15 };
+    const int FrameCount = sizeof(FrameDelays) / sizeof(FrameDelays[0]);
+    const int LoopFrame = 4;
+
+    // Make a 23x24 animation where every light on frame N is color N+1, so the frame being
+    // shown can be read back from the lights.  Color 15 is white, for the loop frame marker.
+    string MakeGIF()
+    {
+        const int iWidth = 23, iHeight = 24;
+        string s = "GIF89a";
+        AddLE16(s, iWidth);
+        AddLE16(s, iHeight);
+        s.push_back(char(0xF3)); // 16-color global palette
+        s.push_back(0);
+        s.push_back(0);
+        for(int i = 0; i < 16; ++i)
+        {
+            s.push_back(char(i == 15? 255:i * 16));
+            s.push_back(char(i == 15? 255:40));
+            s.push_back(char(i == 15? 255:200 - i * 10));
+        }
+
+        for(int frame = 0; frame < FrameCount; ++frame)
+        {
+            s += "\x21\xF9\x04";
+            s.push_back(0);
+            AddLE16(s, FrameDelays[frame]);
+            s.push_back(0);
+            s.push_back(0);
+
+            s.push_back(0x2C);
+            AddLE16(s, 0);
+            AddLE16(s, 0);
+            AddLE16(s, iWidth);
+            AddLE16(s, iHeight);
+            s.push_back(0);
+
+            vector<uint8_t> pixels(iWidth * iHeight, uint8_t(frame + 1));
+            for(int x = 0; x < iWidth; ++x)
+                pixels[(iHeight-1) * iWidth + x] = 0;
+            if(frame == LoopFrame)
+                pixels[(iHeight-1) * iWidth] = 15;
+            AddImageData(s, pixels);
+        }
+
+        s.push_back(0x3B);
+        return s;
+    }
+
+    // The way frame durations and animations were timed before the tick timeline.
+    namespace Reference
+    {
+        vector<float> GetFrameDurations()
+        {
+            vector<float> durations;
+            for(int delay: FrameDelays)
+                durations.push_back(delay == 3 || delay == 4? 1 / 30.0f:delay * 10 / 1000.0);
+            return durations;
+        }
+
+        // The frame delays sent to the panels with an uploaded animation.
+        vector<uint8_t> GetFrameDelays(const vector<float> &durations)
+        {
+            vector<uint8_t> result;
+            int current_frame = 0;
+
+            float time_left_in_frame = durations[0];
+            result.push_back(0);
+            while(1)
+            {
+                time_left_in_frame -= 1.0f / 30;
+                result.back()++;
+
+                if(time_left_in_frame <= 0.00001f)
+                {
+                    if(current_frame + 1 == durations.size())
+                        break;
+
+                    current_frame += 1;
+                    result.push_back(0);
+                    time_left_in_frame += durations[current_frame];
+
+                    if(time_left_in_frame < 0.00001)
+                        time_left_in_frame = 0;
+                }
+            }
+            return result;
+        }
+
+        // Advance by the time since the last update, never more than one frame at a time.
+        // fPosition counts the time of every frame played, including loops.
+        struct AnimationState
+        {
+            float fTime = 0;
+            int iCurrentFrame = 0;
+            double fPosition = 0;
+
+            void Update(const vector<float> &durations, double fSeconds)
+            {
+                fTime += fSeconds;
+
+                float fFrameDuration = durations[iCurrentFrame];
+                if(fTime - 0.00001f < fFrameDuration)
+                    return;
+
+                fTime -= fFrameDuration;
+                if(fTime > 0)
+                    fTime = 0;
+
+                fPosition += fFrameDuration;
+                iCurrentFrame++;
+                if(iCurrentFrame == durations.size())
+                    iCurrentFrame = LoopFrame;
+            }
+        };
+    }
+
+    // Return the frame shown by lights commands, or -1 if they don't match a frame.
+    int GetFrameFromLights(const EncodedLights &lights, const SMXPanelAnimation &animation)
+    {
+        for(int frame = 0; frame < animation.m_aEncodedFrames.size(); ++frame)
+        {
+            if(!memcmp(&lights.m_Command2[1], animation.m_aEncodedFrames[frame].m_iColors, 3))
+                return frame;
+        }
+        return -1;
+    }
+
+    bool CheckFrameTicks(const SMXPanelAnimation &animation)
+    {
+        vector<uint8_t> expected = Reference::GetFrameDelays(Reference::GetFrameDurations());
+        bool bSame = expected.size() == animation.m_iFrameTicks.size();
+        for(size_t i = 0; bSame && i < expected.size(); ++i)
+            bSame = expected[i] == animation.m_iFrameTicks[i];
+
+        printf("frame ticks:");
+        for(int ticks: animation.m_iFrameTicks)
+            printf(" %i", ticks);
+        printf(", %s the uploaded delays\n", bSame? "same as":"DIFFERENT FROM");
+        return bSame;
+    }
+
+    // Play the frames out tick by tick, looping from the loop frame, and compare.
+    bool CheckFrameAtTick(const SMXPanelAnimation &animation)
+    {
+        int iFrame = 0, iTicksLeft = animation.m_iFrameTicks[0];
+        int iMismatches = 0;
+        const int iTicks = 100000;
+        for(int iTick = 0; iTick < iTicks; ++iTick)
+        {
+            if(iTicksLeft == 0)
+            {
+                iFrame = iFrame + 1 == FrameCount? animation.m_iLoopFrame:iFrame + 1;
+                iTicksLeft = animation.m_iFrameTicks[iFrame];
+            }
+            iTicksLeft--;
+
+            if(animation.GetFrameAtTick(iTick) != iFrame)
+                iMismatches++;
+        }
+
+        printf("GetFrameAtTick: %i of %i ticks different from playing frames in order\n", iMismatches, iTicks);
+        return iMismatches == 0;
+    }
+
+    // Run updates with waits that often oversleep, and check that each shows the frame for
+    // the time it ran, and the same frame on both pads.
+    bool CheckUpdates(const SMXPanelAnimation &animation)
+    {
+        SMXConfig config;
+        config.flags = 0;
+        config.autoLightPanelMask = 0x1FF;
+
+        uint32_t iRandom = 1;
+        int iUpdates = 0, iWrongFrame = 0, iOutOfSync = 0;
+        double fStart = GetMonotonicTime();
+        while(GetMonotonicTime() - fStart < 2)
+        {
+            iRandom = iRandom * 1103515245 + 12345;
+            int iOversleepMS = (iRandom >> 16) % 8 == 0? 20:(iRandom >> 16) % 5;
+            this_thread::sleep_for(chrono::milliseconds(33 + iOversleepMS));
+
+            // Update pad 0 on both sides of pad 1.  If they're the same, pad 1 should be too.
+            EncodedLights lights[3];
+            double fBefore = SMX_LightsAnimation_GetPhase();
+            SMXAutoPanelAnimations::GetLightsCommands(0, 0, config, lights[0]);
+            SMXAutoPanelAnimations::GetLightsCommands(1, 0, config, lights[1]);
+            SMXAutoPanelAnimations::GetLightsCommands(0, 0, config, lights[2]);
+            double fAfter = SMX_LightsAnimation_GetPhase();
+
+            // The update ran somewhere between fBefore and fAfter.
+            int iFrame = GetFrameFromLights(lights[0], animation);
+            bool bFound = false;
+            for(int64_t iTick = (int64_t) floor(fBefore * 30); iTick <= (int64_t) floor(fAfter * 30); ++iTick)
+                bFound |= animation.GetFrameAtTick(iTick) == iFrame;
+
+            iUpdates++;
+            if(!bFound)
+                iWrongFrame++;
+            if(!memcmp(&lights[0], &lights[2], sizeof(EncodedLights)) && memcmp(&lights[0], &lights[1], sizeof(EncodedLights)))
+                iOutOfSync++;
+        }
+
+        printf("%i updates with late waits, %i showing the wrong frame, %i with pads out of sync\n",
+            iUpdates, iWrongFrame, iOutOfSync);
+        return iWrongFrame == 0 && iOutOfSync == 0;
+    }
+
+    bool CheckPhase()
+    {
+        SMX_LightsAnimation_SetPhase(12.5);
+        double fPhase = SMX_LightsAnimation_GetPhase();
+        this_thread::sleep_for(chrono::milliseconds(100));
+        double fLater = SMX_LightsAnimation_GetPhase();
+
+        SMX_LightsAnimation_SetPhase(-1);
+        double fClamped = SMX_LightsAnimation_GetPhase();
+
+        printf("phase after setting 12.5: %.3f, 100ms later: %.3f, after setting -1: %.3f\n", fPhase, fLater, fClamped);
+        return fabs(fPhase - 12.5) < 0.01 && fabs(fLater - 12.6) < 0.05 && fClamped >= 0 && fClamped < 0.01;
+    }
+
+    // Simulate ten minutes of updates that wait 33ms and usually oversleep by a few ms,
+    // and report how far the old animations fall behind.
+    void SimulateDrift()
+    {
+        vector<float> durations = Reference::GetFrameDurations();
+        Reference::AnimationState old;
+
+        uint32_t iRandom = 1;
+        double fTime = 0;
+        while(fTime < 600)
+        {
+            iRandom = iRandom * 1103515245 + 12345;
+            double fWait = 0.033 + ((iRandom >> 16) % 5) / 1000.0;
+            fTime += fWait;
+            old.Update(durations, fWait);
+        }
+
+        printf("after 10 minutes of updates with late waits, old animations were %.1f seconds behind\n",
+            fTime - old.fPosition - old.fTime);
+    }
+}
+
+int main()
+{
+    SetLogCallback([](const string &log) { });
+
+    string sGIF = MakeGIF();
+    vector<SMXGif::SMXGifFrame> frames;
+    if(!SMXGif::DecodeGIF(sGIF, frames) || frames.size() != FrameCount)
+    {
+        printf("Error decoding the test GIF\n");
+        return 1;
+    }
+
+    SMXPanelAnimation animation;
+    animation.Load(frames, 0);
+
+    bool bPassed = animation.m_iLoopFrame == LoopFrame;
+    bPassed &= CheckFrameTicks(animation);
+    bPassed &= CheckFrameAtTick(animation);
+
+    // Load the animation on both pads, and check updates against the timeline.
+    for(int pad = 0; pad < 2; ++pad)
+    {
+        const char *error = nullptr;
+        if(!SMX_LightsAnimation_Load(sGIF.data(), (int) sGIF.size(), pad, SMX_LightsType_Released, &error))
+        {
+            printf("Couldn't load animation: %s\n", error);
+            return 1;
+        }
+    }
+    bPassed &= CheckUpdates(animation);
+    bPassed &= CheckPhase();
+
+    SimulateDrift();
+
+    printf("%s\n", bPassed? "PASS":"FAIL");
+    return bPassed? 0:1;
+}
@@ -0,0 +1,263 @@
+// Check and measure the lights commands built by SMX_LightsAnimation_SetAuto.
+//
+// Auto animations are encoded for lights commands when they're loaded, and each update
+// copies them into the commands.  We load animations with transparent lights, and compare
+// the commands for a range of input states and configurations against the way they used
+// to be built: by looking up each light in the palette, overlaying the pressed animation,
+// and encoding the result with EncodeLightsCommands.  We report the time per update both
+// ways.  This exits with an error if the commands differ, or if an update allocates.
+//
+// Build with "make benchmarks" in sdk/Linux, and run build/benchmarks/AutoLights.
+
+#include "SMXPanelAnimation.h"
+#include "SMXLightsEncoding.h"
+#include "SMXGif.h"
+#include "Helpers.h"
+#include "BenchmarkHelpers.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+using namespace std;
+using namespace SMX;
+using namespace BenchmarkHelpers;
+
+namespace
+{
+    // Make a single-frame animation from 11 colors, with color 0 transparent.  Each seed
+    // makes a different pattern, and a different share of transparent lights.
+    string MakeGIF(int iWidth, int iHeight, int iSeed)
+    {
+        string s = "GIF89a";
+        AddLE16(s, iWidth);
+        AddLE16(s, iHeight);
+        s.push_back(char(0xF3)); // 16-color global palette
+        s.push_back(0);
+        s.push_back(0);
+        for(int i = 0; i < 16; ++i)
+        {
+            s.push_back(char(i * 15 + iSeed * 7));
+            s.push_back(char(250 - i * 11));
+            s.push_back(char(i * 37 + iSeed));
+        }
+
+        // Graphics control extension, with color 0 transparent.
+        s += "\x21\xF9\x04";
+        s.push_back(1);
+        AddLE16(s, 3);
+        s.push_back(0);
+        s.push_back(0);
+
+        s.push_back(0x2C);
+        AddLE16(s, 0);
+        AddLE16(s, 0);
+        AddLE16(s, iWidth);
+        AddLE16(s, iHeight);
+        s.push_back(0);
+
+        vector<uint8_t> pixels(iWidth * iHeight);
+        uint32_t iRandom = 12345 + iSeed * 7919;
+        for(uint8_t &pixel: pixels)
+        {
+            iRandom = iRandom * 1103515245 + 12345;
+            int iValue = (iRandom >> 16) % 11;
+            pixel = uint8_t(iValue < iSeed % 4? 0:iValue);
+        }
+
+        // Keep the loop frame marker transparent.
+        pixels[(iHeight-1) * iWidth] = 0;
+        AddImageData(s, pixels);
+
+        s.push_back(0x3B);
+        return s;
+    }
+
+    // The way lights commands were built before animations were encoded in advance.
+    namespace Reference
+    {
+        void OverlayLights(char *asLightsData, const SMXPanelAnimation *pAnimation)
+        {
+            if(pAnimation == nullptr || pAnimation->m_aPanelGraphics.empty())
+                return;
+
+            const vector<uint8_t> &graphic = pAnimation->m_aPanelGraphics[0];
+            const SMXGif::Palette &palette = *pAnimation->m_pPalette;
+            for(int i = 0; i < graphic.size() && i < 25; ++i)
+            {
+                const SMXGif::Color &color = palette[graphic[i]];
+                if(color.color[3] == 0)
+                    continue;
+
+                asLightsData[i*3+0] = color.color[0];
+                asLightsData[i*3+1] = color.color[1];
+                asLightsData[i*3+2] = color.color[2];
+            }
+        }
+
+        // released and pressed are null if no animation is loaded.
+        void GetLightsCommands(const SMXPanelAnimation *released, const SMXPanelAnimation *pressed,
+            int iPadState, const SMXConfig &config, EncodedLights &out)
+        {
+            bool bUsePressedAnimations = config.flags & PlatformFlags_AutoLightingUsePressedAnimations;
+
+            const int iBytesPerPanel = 25*3;
+            string result(9*iBytesPerPanel, 0);
+            for(int panel = 0; panel < 9; ++panel)
+            {
+                char *out = &result[panel*iBytesPerPanel];
+                if(!(config.autoLightPanelMask & (1 << panel)))
+                    continue;
+
+                OverlayLights(out, released? &released[panel]:nullptr);
+                bool bPressed = bool(iPadState & (1 << panel));
+                if(bPressed && bUsePressedAnimations)
+                    OverlayLights(out, pressed? &pressed[panel]:nullptr);
+                else if(bPressed && !bUsePressedAnimations)
+                {
+                    double LightsScaleFactor = 0.666666f;
+                    const uint8_t *color = &config.stepColor[panel*3];
+                    for(int light = 0; light < 25; ++light)
+                    {
+                        for(int i = 0; i < 3; ++i)
+                        {
+                            uint8_t c = color[i];
+                            c = (uint8_t) lrintf(min(255.0, c / LightsScaleFactor));
+                            out[light*3+i] = c;
+                        }
+                    }
+                }
+            }
+
+            EncodeLightsCommands((const uint8_t *) result.data(), (int) result.size(),
+                out.m_Command4, out.m_Command2, out.m_Command3);
+        }
+    }
+
+    struct Animation
+    {
+        string sGIF;
+        SMXPanelAnimation panels[9];
+    };
+
+    bool LoadAnimation(const string &sGIF, SMX_LightsType type, Animation &animation)
+    {
+        const char *error = nullptr;
+        if(!SMX_LightsAnimation_Load(sGIF.data(), (int) sGIF.size(), 0, type, &error))
+        {
+            printf("Couldn't load animation: %s\n", error);
+            return false;
+        }
+
+        vector<SMXGif::SMXGifFrame> frames;
+        SMXGif::DecodeGIF(sGIF, frames);
+        animation.sGIF = sGIF;
+        for(int panel = 0; panel < 9; ++panel)
+            animation.panels[panel].Load(frames, panel);
+        return true;
+    }
+
+    // Compare the commands for a range of input states and configurations.  Return the
+    // number of cases that differed.
+    int CompareCommands(const Animation *pReleased, const Animation *pPressed, int &iCases)
+    {
+        int iMismatches = 0;
+        const int aiPadStates[] = { 0, 0x1FF, 0x001, 0x010, 0x0AA, 0x155, 0x123 };
+        const int aiPanelMasks[] = { 0x1FF, 0x000, 0x0F0, 0x16D };
+        for(int iFlags: { 0, int(PlatformFlags_AutoLightingUsePressedAnimations) })
+        {
+            for(int iMask: aiPanelMasks)
+            {
+                for(int iPadState: aiPadStates)
+                {
+                    SMXConfig config;
+                    config.flags = uint8_t(iFlags);
+                    config.autoLightPanelMask = uint16_t(iMask);
+                    for(int i = 0; i < 27; ++i)
+                        config.stepColor[i] = uint8_t(i * 9 + iPadState);
+
+                    EncodedLights actual, expected;
+                    SMXAutoPanelAnimations::GetLightsCommands(0, iPadState, config, actual);
+                    Reference::GetLightsCommands(pReleased? pReleased->panels:nullptr, pPressed? pPressed->panels:nullptr,
+                        iPadState, config, expected);
+
+                    iCases++;
+                    if(memcmp(&actual, &expected, sizeof(EncodedLights)))
+                        iMismatches++;
+                }
+            }
+        }
+        return iMismatches;
+    }
+
+    // Return the average time for a call to fn, in nanoseconds.
+    template<typename F>
+    double Measure(F fn)
+    {
+        int iIterations = 1000;
+        while(1)
+        {
+            double fStart = GetMonotonicTime();
+            for(int i = 0; i < iIterations; ++i)
+                fn(i);
+            double fTime = GetMonotonicTime() - fStart;
+            if(fTime > 0.25)
+                return fTime / iIterations * 1e9;
+            iIterations *= 2;
+        }
+    }
+}
+
+int main()
+{
+    SetLogCallback([](const string &log) { });
+
+    // Before anything is loaded, only step colors are shown.
+    int iCases = 0;
+    int iMismatches = CompareCommands(nullptr, nullptr, iCases);
+
+    Animation released, pressed;
+    for(int iSeed = 0; iSeed < 8; ++iSeed)
+    {
+        // Alternate between 25-light and 16-light animations.
+        int iWidth = iSeed & 1? 14:23, iHeight = iSeed & 1? 15:24;
+        if(!LoadAnimation(MakeGIF(iWidth, iHeight, iSeed), SMX_LightsType_Released, released))
+            return 1;
+
+        // Compare with only a released animation when there's no pressed animation yet.
+        if(iSeed == 0)
+            iMismatches += CompareCommands(&released, nullptr, iCases);
+
+        if(!LoadAnimation(MakeGIF(iWidth, iHeight, iSeed + 3), SMX_LightsType_Pressed, pressed))
+            return 1;
+        iMismatches += CompareCommands(&released, &pressed, iCases);
+    }
+    printf("%i cases, %i different from the reference\n", iCases, iMismatches);
+
+    // Time an update with half of the panels pressed and pressed animations enabled, and
+    // count allocations in the new path.
+    SMXConfig config;
+    config.flags = PlatformFlags_AutoLightingUsePressedAnimations;
+    config.autoLightPanelMask = 0x1FF;
+
+    EncodedLights lights;
+    double fReference = Measure([&](int i) {
+        Reference::GetLightsCommands(released.panels, pressed.panels, 0x155 ^ (i & 1), config, lights);
+    });
+
+    StartCountingAllocations();
+    double fEncoded = Measure([&](int i) {
+        SMXAutoPanelAnimations::GetLightsCommands(0, 0x155 ^ (i & 1), config, lights);
+    });
+    int iAllocations = (int) StopCountingAllocations();
+
+    printf("palette lookup and encode: %8.1f ns per pad\n", fReference);
+    printf("encoded frames:            %8.1f ns per pad, %i allocations\n", fEncoded, iAllocations);
+
+    bool bPassed = iMismatches == 0 && iAllocations == 0;
+    printf("%s\n", bPassed? "PASS":"FAIL");
+    return bPassed? 0:1;
+}
@@ -0,0 +1,109 @@
+// Helpers shared by the benchmarks.
+//
+// Each benchmark is a single source file built into its own program, so this also replaces
+// operator new and delete, to count allocations.  Including it in more than one source
+// file of a program won't link.
+
+#ifndef BENCHMARK_HELPERS_H
+#define BENCHMARK_HELPERS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <string>
+#include <vector>
+using namespace std;
+
+namespace BenchmarkHelpers
+{
+    inline void AddLE16(string &s, int value)
+    {
+        s.push_back(char(value & 0xFF));
+        s.push_back(char(value >> 8));
+    }
+
+    // Write pixels to a GIF as uncompressed LZW: every pixel is a literal 9-bit code, with
+    // a clear code often enough that the decoder never widens its codes.
+    inline void AddImageData(string &s, const vector<uint8_t> &pixels)
+    {
+        s.push_back(8);
+
+        string data;
+        uint32_t bits = 0;
+        int bits_in_buffer = 0;
+        auto AddCode = [&](int code) {
+            bits |= code << bits_in_buffer;
+            bits_in_buffer += 9;
+            while(bits_in_buffer >= 8)
+            {
+                data.push_back(char(bits & 0xFF));
+                bits >>= 8;
+                bits_in_buffer -= 8;
+            }
+        };
+
+        for(size_t i = 0; i < pixels.size(); ++i)
+        {
+            if(i % 250 == 0)
+                AddCode(256);
+            AddCode(pixels[i]);
+        }
+        AddCode(257);
+        if(bits_in_buffer > 0)
+            data.push_back(char(bits & 0xFF));
+
+        for(size_t i = 0; i < data.size(); i += 255)
+        {
+            size_t iBlockSize = min<size_t>(255, data.size() - i);
+            s.push_back(char(iBlockSize));
+            s.append(data, i, iBlockSize);
+        }
+        s.push_back(0);
+    }
+
+    // Allocations are counted between StartCountingAllocations and StopCountingAllocations.
+    // If pShouldCount is set, only allocations it returns true for are counted.  It's called
+    // from inside operator new on any thread, so it mustn't allocate.
+    typedef bool (*ShouldCountAllocation)(size_t iSize);
+
+    atomic<bool> g_bCountingAllocations(false);
+    atomic<ShouldCountAllocation> g_pShouldCountAllocation(nullptr);
+    atomic<int64_t> g_iAllocations(0);
+
+    inline void StartCountingAllocations(ShouldCountAllocation pShouldCount = nullptr)
+    {
+        g_pShouldCountAllocation = pShouldCount;
+        g_iAllocations = 0;
+        g_bCountingAllocations = true;
+    }
+
+    // Stop counting, and return the number of allocations counted.
+    inline int64_t StopCountingAllocations()
+    {
+        g_bCountingAllocations = false;
+        return g_iAllocations;
+    }
+}
+
+void *operator new(size_t iSize)
+{
+    using namespace BenchmarkHelpers;
+    if(g_bCountingAllocations)
+    {
+        ShouldCountAllocation pShouldCount = g_pShouldCountAllocation;
+        if(pShouldCount == nullptr || pShouldCount(iSize))
+            g_iAllocations++;
+    }
+
+    void *p = malloc(iSize? iSize:1);
+    if(p == nullptr)
+        throw bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t iSize) noexcept { free(p); }
+
+#endif
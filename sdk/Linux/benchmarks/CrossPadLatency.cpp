@@ -0,0 +1,146 @@
+// Measure one pad's input latency while another pad is busy.
+//
+// Two simulated pads are connected.  The second pad's writes block for a while, like a
+// slow USB write, and in the flooded phase a thread keeps it busy with commands.  The main
+// thread toggles the first pad's inputs and measures how long it takes for the change to
+// show up in SMX_GetInputState.  If the pads are serviced independently, the flooded pad
+// doesn't affect the other pad's latency.
+//
+// Build with "make benchmarks" in sdk/Linux, and run build/benchmarks/CrossPadLatency.
+
+#include "SMXManager.h"
+#include "SMXDevice.h"
+#include "SMXSimulatedDevice.h"
+#include "Helpers.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+using namespace std;
+using namespace SMX;
+
+namespace
+{
+    // A simulated device whose writes take fWriteTime to return.
+    class SlowWriteTransport: public SMXSimulatedDevice
+    {
+    public:
+        SlowWriteTransport(const SMXSimulatedDeviceOptions &options, double fWriteTime):
+            SMXSimulatedDevice(options), m_fWriteTime(fWriteTime) { }
+
+        void WriteReport(const string &sReport, wstring &sError) override
+        {
+            this_thread::sleep_for(chrono::microseconds(int(m_fWriteTime * 1e6)));
+            SMXSimulatedDevice::WriteReport(sReport, sError);
+        }
+
+    private:
+        double m_fWriteTime;
+    };
+
+    struct Result
+    {
+        int iSamples = 0;
+        double fP50 = 0, fP99 = 0, fMax = 0;
+    };
+
+    // Toggle pSim's inputs iSamples times, and measure how long each change takes to be
+    // returned by GetInputState.
+    Result MeasureInputLatency(shared_ptr<SMXSimulatedDevice> pSim, int pad, int iSamples)
+    {
+        vector<double> aSamples;
+        for(int i = 0; i < iSamples; ++i)
+        {
+            uint16_t iState = (i & 1)? 0x10:0;
+            double fStart = GetMonotonicTime();
+            pSim->SetInputState(iState);
+
+            while(SMXManager::g_pSMX->GetInputState(pad) != iState && GetMonotonicTime() - fStart < 1)
+                this_thread::yield();
+
+            aSamples.push_back(GetMonotonicTime() - fStart);
+            this_thread::sleep_for(chrono::milliseconds(2));
+        }
+
+        Result result;
+        result.iSamples = aSamples.size();
+        sort(aSamples.begin(), aSamples.end());
+        result.fP50 = aSamples[aSamples.size() / 2];
+        result.fP99 = aSamples[aSamples.size() * 99 / 100];
+        result.fMax = aSamples.back();
+        return result;
+    }
+
+    void PrintResult(const char *szName, const Result &result)
+    {
+        printf("%-22s %5i samples   p50 %8.1f us   p99 %8.1f us   max %8.1f us\n",
+            szName, result.iSamples, result.fP50 * 1e6, result.fP99 * 1e6, result.fMax * 1e6);
+    }
+}
+
+int main()
+{
+    SetLogCallback([](const string &log) { });
+
+    SMXManager::g_pSMX = make_shared<SMXManager>([](int pad, const SMXUpdateDetails &details) { });
+
+    SMXSimulatedDeviceOptions options;
+    options.DefaultTiming.fLatency = 0;
+    shared_ptr<SMXSimulatedDevice> pSim = make_shared<SMXSimulatedDevice>(options);
+    options.bPlayer2 = true;
+    shared_ptr<SMXSimulatedDevice> pSlowSim = make_shared<SlowWriteTransport>(options, 0.002);
+    SMXManager::g_pSMX->AddSimulatedDevice(pSim);
+    SMXManager::g_pSMX->AddSimulatedDevice(pSlowSim);
+
+    // Wait for both pads to connect.
+    double fStart = GetMonotonicTime();
+    SMXInfo info[2];
+    do {
+        this_thread::sleep_for(chrono::milliseconds(10));
+        SMXManager::g_pSMX->GetInfo(0, info[0]);
+        SMXManager::g_pSMX->GetInfo(1, info[1]);
+    } while((!info[0].m_bConnected || !info[1].m_bConnected) && GetMonotonicTime() - fStart < 5);
+    if(!info[0].m_bConnected || !info[1].m_bConnected)
+    {
+        printf("Simulated devices didn't connect\n");
+        return 1;
+    }
+
+    const int iSamples = 300;
+    Result Idle = MeasureInputLatency(pSim, 0, iSamples);
+
+    // Keep a few commands queued on the slow pad at all times.
+    atomic<bool> bShutdown(false);
+    atomic<int> iInFlight(0);
+    atomic<int> iCommandsSent(0);
+    shared_ptr<SMXDevice> pSlowDevice = SMXManager::g_pSMX->GetDevice(1);
+    thread FloodThread([&] {
+        while(!bShutdown)
+        {
+            if(iInFlight >= 8)
+            {
+                this_thread::sleep_for(chrono::microseconds(200));
+                continue;
+            }
+
+            iInFlight++;
+            iCommandsSent++;
+            pSlowDevice->SendCommand("G", [&](string response) { iInFlight--; });
+        }
+    });
+
+    Result Flooded = MeasureInputLatency(pSim, 0, iSamples);
+
+    bShutdown = true;
+    FloodThread.join();
+
+    PrintResult("other pad idle", Idle);
+    PrintResult("other pad flooded", Flooded);
+    printf("%i commands sent to the flooded pad\n", int(iCommandsSent));
+
+    pSlowDevice.reset();
+    SMXManager::g_pSMX.reset();
+    return 0;
+}
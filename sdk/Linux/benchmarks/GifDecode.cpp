@@ -0,0 +1,196 @@
+// Measure loading a library of animated GIFs.
+//
+// We write a set of long 23x24 animations to /tmp, like a library of panel animations
+// loaded at startup, then load them two ways: by reading each file into a string and
+// decoding that, and by mapping each file and decoding it in place.  We report the time
+// per file and how many allocations were as large as the file, which are copies of it.
+// This exits with an error if decoding a mapped file copies it, or if the two ways of
+// loading decode different frames.
+//
+// Build with "make benchmarks" in sdk/Linux, and run build/benchmarks/GifDecode.
+
+#include "SMXGif.h"
+#include "Helpers.h"
+#include "BenchmarkHelpers.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <string>
+#include <vector>
+using namespace std;
+using namespace SMX;
+using namespace BenchmarkHelpers;
+
+namespace
+{
+    atomic<size_t> g_iLargeAllocationSize(0);
+
+    const int Width = 23, Height = 24;
+    const int FilesInLibrary = 16;
+    const int FramesPerFile = 400;
+
+    string MakeGIF(int iSeed)
+    {
+        string s = "GIF89a";
+        AddLE16(s, Width);
+        AddLE16(s, Height);
+        s.push_back(char(0xF7)); // 256-color global palette
+        s.push_back(0);
+        s.push_back(0);
+        for(int i = 0; i < 256; ++i)
+        {
+            s.push_back(char(i));
+            s.push_back(char(255 - i));
+            s.push_back(char(i * 7));
+        }
+
+        vector<uint8_t> pixels(Width * Height);
+        for(int frame = 0; frame < FramesPerFile; ++frame)
+        {
+            // Graphics control extension with a 30ms delay.
+            s += "\x21\xF9\x04";
+            s.push_back(0);
+            AddLE16(s, 3);
+            s.push_back(0);
+            s.push_back(0);
+
+            s.push_back(0x2C);
+            AddLE16(s, 0);
+            AddLE16(s, 0);
+            AddLE16(s, Width);
+            AddLE16(s, Height);
+            s.push_back(0);
+
+            for(int i = 0; i < Width * Height; ++i)
+                pixels[i] = uint8_t(i + frame * 3 + iSeed);
+            AddImageData(s, pixels);
+        }
+
+        s.push_back(0x3B);
+        return s;
+    }
+
+    string GetPath(int i)
+    {
+        return ssprintf("/tmp/smx-gif-decode-%i.gif", i);
+    }
+
+    bool ReadFile(const string &sPath, string &sData)
+    {
+        FILE *pFile = fopen(sPath.c_str(), "rb");
+        if(pFile == nullptr)
+            return false;
+        fseek(pFile, 0, SEEK_END);
+        sData.resize(ftell(pFile));
+        fseek(pFile, 0, SEEK_SET);
+        bool bResult = fread(&sData[0], sData.size(), 1, pFile) == 1;
+        fclose(pFile);
+        return bResult;
+    }
+
+    struct LoadResult
+    {
+        double fSecondsPerFile = 0;
+        int iCopiesPerFile = 0;
+        bool bDecoded = true;
+    };
+
+    // Load every file in the library using Load, counting allocations the size of a file.
+    template<typename T>
+    LoadResult LoadLibrary(size_t iFileSize, vector<vector<SMXGif::SMXGifFrame>> &aFrames, T Load)
+    {
+        aFrames.clear();
+        aFrames.resize(FilesInLibrary);
+
+        g_iLargeAllocationSize = iFileSize;
+        StartCountingAllocations([](size_t iSize) { return iSize >= g_iLargeAllocationSize; });
+
+        LoadResult result;
+        double fStart = GetMonotonicTime();
+        for(int i = 0; i < FilesInLibrary; ++i)
+            result.bDecoded &= Load(GetPath(i), aFrames[i]);
+        result.fSecondsPerFile = (GetMonotonicTime() - fStart) / FilesInLibrary;
+
+        result.iCopiesPerFile = int(StopCountingAllocations() / FilesInLibrary);
+        return result;
+    }
+
+    void PrintResult(const char *szName, const LoadResult &result)
+    {
+        printf("%-30s %8.3f ms per file, %i copies of each file%s\n", szName,
+            result.fSecondsPerFile * 1000, result.iCopiesPerFile, result.bDecoded? "":", DECODE FAILED");
+    }
+}
+
+int main()
+{
+    size_t iFileSize = 0;
+    for(int i = 0; i < FilesInLibrary; ++i)
+    {
+        string sGIF = MakeGIF(i);
+        iFileSize = sGIF.size();
+
+        FILE *pFile = fopen(GetPath(i).c_str(), "wb");
+        if(pFile == nullptr || fwrite(sGIF.data(), sGIF.size(), 1, pFile) != 1)
+        {
+            printf("Couldn't write %s\n", GetPath(i).c_str());
+            return 1;
+        }
+        fclose(pFile);
+    }
+    printf("%i files, %i frames and %i bytes each\n", FilesInLibrary, FramesPerFile, int(iFileSize));
+
+    // Each run loads every file once.  Run both twice, so the first pass warms up the
+    // page cache and the heap.
+    vector<vector<SMXGif::SMXGifFrame>> aBuffered, aMapped;
+    LoadResult buffered, mapped;
+    for(int iPass = 0; iPass < 2; ++iPass)
+    {
+        buffered = LoadLibrary(iFileSize, aBuffered, [](const string &sPath, vector<SMXGif::SMXGifFrame> &frames) {
+            string sData;
+            return ReadFile(sPath, sData) && SMXGif::DecodeGIF(sData, frames);
+        });
+
+        mapped = LoadLibrary(iFileSize, aMapped, [](const string &sPath, vector<SMXGif::SMXGifFrame> &frames) {
+            MappedFile file;
+            string sError;
+            return file.Open(sPath, sError) && SMXGif::DecodeGIF(file.data(), file.size(), frames);
+        });
+    }
+
+    PrintResult("read into a buffer:", buffered);
+    PrintResult("mapped:", mapped);
+
+    bool bSame = true;
+    for(int i = 0; i < FilesInLibrary; ++i)
+    {
+        bSame &= aBuffered[i].size() == aMapped[i].size();
+        for(size_t frame = 0; bSame && frame < aMapped[i].size(); ++frame)
+            bSame &= aBuffered[i][frame].frame == aMapped[i][frame].frame && aBuffered[i][frame].milliseconds == aMapped[i][frame].milliseconds;
+    }
+    if(!bSame)
+        printf("The mapped and buffered files decoded differently\n");
+
+    // Truncated files should fail cleanly, not read past the end.
+    {
+        string sGIF;
+        ReadFile(GetPath(0), sGIF);
+        vector<SMXGif::SMXGifFrame> frames;
+        for(size_t iSize: { size_t(0), size_t(5), size_t(13), sGIF.size() / 2, sGIF.size() - 1 })
+        {
+            if(SMXGif::DecodeGIF((const uint8_t *) sGIF.data(), iSize, frames))
+            {
+                printf("A GIF truncated to %i bytes was decoded\n", int(iSize));
+                bSame = false;
+            }
+        }
+    }
+
+    for(int i = 0; i < FilesInLibrary; ++i)
+        remove(GetPath(i).c_str());
+
+    bool bPassed = bSame && buffered.bDecoded && mapped.bDecoded && mapped.iCopiesPerFile == 0 && aMapped[0].size() == FramesPerFile;
+    printf("%s\n", bPassed? "PASS":"FAIL");
+    return bPassed? 0:1;
+}
@@ -0,0 +1,210 @@
+// Measure how long it takes to notice a device being plugged in, and how often we search
+// for devices while nothing changes.
+//
+// Real devices can't be plugged in from a test, so this replaces SMXDeviceSearch with one
+// that returns simulated devices.  "Plugging in" a device adds it to the list, and if
+// notifications are enabled, signals an eventfd like the inotify handle SMXDeviceSearch
+// uses on Linux.  Without notifications, SMXDeviceSearchThreaded polls, like it does on
+// platforms where we can't be notified.
+//
+// For each plug, we measure the time until the pad is connected and until the input
+// state it was plugged in with is visible from SMXManager::GetInputState.  The device is
+// then unplugged, and we wait for it to disconnect.
+//
+// Build with "make benchmarks" in sdk/Linux, and run build/benchmarks/HotplugLatency.
+
+#include "SMXManager.h"
+#include "SMXDeviceSearch.h"
+#include "SMXSimulatedDevice.h"
+#include "Helpers.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+using namespace SMX;
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace
+{
+    // A device search that returns devices added with Plug.
+    class SimulatedDeviceSearch: public SMXDeviceSearch
+    {
+    public:
+        SimulatedDeviceSearch(bool bNotify)
+        {
+            if(bNotify)
+                m_hNotify = make_shared<AutoCloseHandle>(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+        }
+
+        void Plug(shared_ptr<SMXTransport> pDevice)
+        {
+            {
+                lock_guard<mutex> L(m_Lock);
+                m_apDevices.push_back(pDevice);
+            }
+            Notify();
+        }
+
+        void Unplug(shared_ptr<SMXSimulatedDevice> pDevice)
+        {
+            pDevice->Disconnect();
+            {
+                lock_guard<mutex> L(m_Lock);
+                m_apDevices.erase(remove(m_apDevices.begin(), m_apDevices.end(), pDevice), m_apDevices.end());
+            }
+            Notify();
+        }
+
+        int GetSearchCount() const { return m_iSearches; }
+
+        vector<shared_ptr<SMXTransport>> GetDevices(wstring &error) override
+        {
+            m_iSearches++;
+            lock_guard<mutex> L(m_Lock);
+            return m_apDevices;
+        }
+
+        void DeviceWasClosed(shared_ptr<SMXTransport> pDevice) override { }
+
+        HANDLE GetChangeHandle() const override
+        {
+            return m_hNotify? m_hNotify->value():INVALID_HANDLE_VALUE;
+        }
+
+        bool CheckForChanges() override
+        {
+            if(m_hNotify == nullptr)
+                return true;
+
+            uint64_t iValue = 0;
+            return read(m_hNotify->value(), &iValue, sizeof(iValue)) > 0;
+        }
+
+    private:
+        void Notify()
+        {
+            uint64_t iValue = 1;
+            if(m_hNotify && write(m_hNotify->value(), &iValue, sizeof(iValue)) == -1)
+                printf("eventfd write failed\n");
+        }
+
+        shared_ptr<AutoCloseHandle> m_hNotify;
+        mutex m_Lock;
+        vector<shared_ptr<SMXTransport>> m_apDevices;
+        atomic<int> m_iSearches{0};
+    };
+
+    struct Result
+    {
+        double fSearchesPerSecond = 0;
+        vector<double> aConnectTimes;
+        vector<double> aInputTimes;
+    };
+
+    bool WaitFor(function<bool()> pDone, double fTimeout)
+    {
+        double fStart = GetMonotonicTime();
+        while(!pDone())
+        {
+            if(GetMonotonicTime() - fStart > fTimeout)
+                return false;
+            this_thread::sleep_for(chrono::microseconds(100));
+        }
+        return true;
+    }
+
+    bool IsConnected(SMXManager &manager)
+    {
+        SMXInfo info;
+        manager.GetInfo(0, info);
+        return info.m_bConnected;
+    }
+
+    bool Run(bool bNotify, int iPlugs, Result &result)
+    {
+        auto pSearch = make_shared<SimulatedDeviceSearch>(bNotify);
+        auto pManager = make_shared<SMXManager>([](int pad, const SMXUpdateDetails &details) { }, pSearch);
+
+        // Count searches while nothing is connected or changing.  Give the first search time
+        // to finish before we start counting.
+        const double fIdleTime = 2;
+        this_thread::sleep_for(chrono::milliseconds(100));
+        int iSearchesBefore = pSearch->GetSearchCount();
+        this_thread::sleep_for(chrono::milliseconds(int(fIdleTime * 1000)));
+        result.fSearchesPerSecond = (pSearch->GetSearchCount() - iSearchesBefore) / fIdleTime;
+
+        for(int i = 0; i < iPlugs; ++i)
+        {
+            SMXSimulatedDeviceOptions options;
+            options.DefaultTiming.fLatency = 0;
+            options.iRandomSeed = i;
+            auto pSim = make_shared<SMXSimulatedDevice>(options);
+            pSim->SetInputState(0x10);
+
+            double fStart = GetMonotonicTime();
+            pSearch->Plug(pSim);
+
+            if(!WaitFor([&] { return IsConnected(*pManager); }, 5))
+            {
+                printf("Simulated device didn't connect\n");
+                return false;
+            }
+            result.aConnectTimes.push_back(GetMonotonicTime() - fStart);
+
+            if(!WaitFor([&] { return pManager->GetInputState(0) == 0x10; }, 5))
+            {
+                printf("Didn't receive input from the simulated device\n");
+                return false;
+            }
+            result.aInputTimes.push_back(GetMonotonicTime() - fStart);
+
+            pSearch->Unplug(pSim);
+            if(!WaitFor([&] { return !IsConnected(*pManager); }, 5))
+            {
+                printf("Simulated device didn't disconnect\n");
+                return false;
+            }
+
+            // Closing the device starts a search, so vary the time before the next plug to
+            // land at different points in the polling interval.
+            this_thread::sleep_for(chrono::milliseconds(i * 37 % 250));
+        }
+
+        pManager->Shutdown();
+        return true;
+    }
+
+    void PrintTimes(const char *szName, vector<double> aTimes)
+    {
+        sort(aTimes.begin(), aTimes.end());
+        printf("  %-18s p50 %8.2f ms   max %8.2f ms\n", szName,
+            aTimes[aTimes.size() / 2] * 1000, aTimes.back() * 1000);
+    }
+
+    void PrintResult(const char *szName, const Result &result)
+    {
+        printf("%s: %.1f searches per second while idle\n", szName, result.fSearchesPerSecond);
+        PrintTimes("plug to connect", result.aConnectTimes);
+        PrintTimes("plug to input", result.aInputTimes);
+    }
+}
+
+int main()
+{
+    SetLogCallback([](const string &log) { });
+
+    const int iPlugs = 20;
+    Result Polled, Notified;
+    if(!Run(false, iPlugs, Polled) || !Run(true, iPlugs, Notified))
+        return 1;
+
+    PrintResult("polled", Polled);
+    PrintResult("notified", Notified);
+    return 0;
+}
@@ -0,0 +1,124 @@
+// Measure how long SMX_GetInputState takes while the I/O thread is busy.
+//
+// A simulated pad is connected, and one thread sends lights as fast as it can while another
+// toggles the pad's inputs.  The main thread polls the input state and records how long each
+// call takes, first through SMXDevice (which locks the I/O thread's mutex) and then through
+// the snapshot published by SMXManager (which is what SMX_GetInputState uses).
+//
+// Build with "make benchmarks" in sdk/Linux, and run build/benchmarks/InputContention.
+
+#include "SMXManager.h"
+#include "SMXDevice.h"
+#include "SMXSimulatedDevice.h"
+#include "Helpers.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+using namespace std;
+using namespace SMX;
+
+namespace
+{
+    volatile uint16_t g_iSink;
+
+    struct Result
+    {
+        int iPolls = 0;
+        double fSeconds = 0;
+        double fP50 = 0, fP99 = 0, fMax = 0;
+    };
+
+    Result RunPoller(function<uint16_t()> pPoll, double fSeconds)
+    {
+        vector<double> aSamples;
+        aSamples.reserve(1000000);
+
+        double fStart = GetMonotonicTime();
+        double fNow = fStart;
+        while(fNow - fStart < fSeconds)
+        {
+            double fBefore = GetMonotonicTime();
+            g_iSink = pPoll();
+            fNow = GetMonotonicTime();
+            aSamples.push_back(fNow - fBefore);
+        }
+
+        Result result;
+        result.iPolls = aSamples.size();
+        result.fSeconds = fNow - fStart;
+        sort(aSamples.begin(), aSamples.end());
+        if(!aSamples.empty())
+        {
+            result.fP50 = aSamples[aSamples.size() / 2];
+            result.fP99 = aSamples[aSamples.size() * 99 / 100];
+            result.fMax = aSamples.back();
+        }
+        return result;
+    }
+
+    void PrintResult(const char *szName, const Result &result)
+    {
+        printf("%-10s %10.0f polls/s   p50 %8.0f ns   p99 %8.0f ns   max %10.0f ns\n",
+            szName, result.iPolls / result.fSeconds,
+            result.fP50 * 1e9, result.fP99 * 1e9, result.fMax * 1e9);
+    }
+}
+
+int main()
+{
+    SetLogCallback([](const string &log) { });
+
+    SMXManager::g_pSMX = make_shared<SMXManager>([](int pad, const SMXUpdateDetails &details) { });
+    shared_ptr<SMXSimulatedDevice> pSim = make_shared<SMXSimulatedDevice>();
+    SMXManager::g_pSMX->AddSimulatedDevice(pSim);
+
+    // Wait for the pad to connect.
+    double fStart = GetMonotonicTime();
+    SMXInfo info;
+    do {
+        this_thread::sleep_for(chrono::milliseconds(10));
+        SMXManager::g_pSMX->GetInfo(0, info);
+    } while(!info.m_bConnected && GetMonotonicTime() - fStart < 5);
+    if(!info.m_bConnected)
+    {
+        printf("Simulated device didn't connect\n");
+        return 1;
+    }
+
+    atomic<bool> bShutdown(false);
+
+    thread LightsThread([&] {
+        string sLights[2];
+        sLights[0] = string(9*25*3, '\x80');
+        while(!bShutdown)
+            SMXManager::g_pSMX->SetLights(sLights, 2);
+    });
+
+    thread InputThread([&] {
+        int i = 0;
+        while(!bShutdown)
+        {
+            pSim->SetInputState((++i & 1)? 0x10:0);
+            this_thread::sleep_for(chrono::microseconds(500));
+        }
+    });
+
+    const double fSeconds = 2;
+    shared_ptr<SMXDevice> pDevice = SMXManager::g_pSMX->GetDevice(0);
+    Result Locked = RunPoller([&] { return pDevice->GetInputState(); }, fSeconds);
+    Result Snapshot = RunPoller([&] { return SMXManager::g_pSMX->GetInputState(0); }, fSeconds);
+
+    bShutdown = true;
+    LightsThread.join();
+    InputThread.join();
+
+    PrintResult("locked", Locked);
+    PrintResult("snapshot", Snapshot);
+
+    pDevice.reset();
+    SMXManager::g_pSMX.reset();
+    return 0;
+}
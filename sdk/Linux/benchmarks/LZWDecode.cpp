@@ -0,0 +1,433 @@
+// Check and time the GIF LZW decoder.
+//
+// We LZW-compress a corpus of images: noise, flat areas, gradients and repeating patterns,
+// at panel animation size and larger, at several code sizes, with and without clear
+// codes when the dictionary fills up.  Each one is decoded with SMXGif::DecodeLZW and with
+// a reference decoder, which is the decoder SMXGif used before it was table-driven, and
+// the results are compared.  Truncated and corrupt data has to be handled the same way
+// by both.  Then we time both decoders over the corpus.
+//
+// Build with "make benchmarks" in sdk/Linux, and run build/benchmarks/LZWDecode.
+
+#include "SMXGif.h"
+#include "Helpers.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+using namespace SMX;
+
+namespace
+{
+    // The previous SMXGif LZW decoder.  It walks each code's list into a buffer, then
+    // appends it to the result in reverse.
+    namespace Reference
+    {
+        class Error: public exception { };
+
+        class DataStream
+        {
+        public:
+            DataStream(const uint8_t *data_, size_t size_): data(data_), size(size_) { }
+
+            uint8_t ReadByte()
+            {
+                if(pos >= size)
+                    throw Error();
+                return data[pos++];
+            }
+
+            void skip(int bytes) { pos += bytes; }
+
+        private:
+            const uint8_t *data;
+            size_t size;
+            size_t pos = 0;
+        };
+
+        class LWZStream
+        {
+        public:
+            LWZStream(DataStream &stream_): stream(stream_) { }
+
+            uint32_t ReadLZWCode(uint32_t bit_count)
+            {
+                while(bits_in_buffer < bit_count)
+                {
+                    if(bytes_remaining == 0)
+                    {
+                        bytes_remaining = stream.ReadByte();
+                        if(bytes_remaining == 0)
+                            throw Error();
+                    }
+
+                    bits |= stream.ReadByte() << bits_in_buffer;
+                    bits_in_buffer += 8;
+                    bytes_remaining -= 1;
+                }
+
+                uint32_t result = bits & ((1 << bit_count) - 1);
+                bits >>= bit_count;
+                bits_in_buffer -= bit_count;
+                return result;
+            }
+
+            void Flush()
+            {
+                stream.skip(bytes_remaining);
+                bytes_remaining = 0;
+                while(1)
+                {
+                    uint8_t blocksize = stream.ReadByte();
+                    if(blocksize == 0)
+                        break;
+                    stream.skip(blocksize);
+                }
+            }
+
+        private:
+            DataStream &stream;
+            uint32_t bits = 0;
+            int bytes_remaining = 0;
+            uint32_t bits_in_buffer = 0;
+        };
+
+        string DecodeImage(DataStream &stream)
+        {
+            uint16_t code_bits = stream.ReadByte();
+            if(code_bits >= 12)
+                throw Error();
+            LWZStream lzw_stream(stream);
+
+            uint32_t dictionary_bits = code_bits + 1;
+            int prev_code1 = -1;
+            int prev_code2 = -1;
+
+            uint32_t clear = 1 << code_bits;
+            uint32_t end = clear + 1;
+            uint32_t next_free_slot = clear + 2;
+
+            vector<pair<int,int>> dictionary;
+            dictionary.resize(1 << 12);
+
+            string append_buffer;
+            string result;
+            while(1)
+            {
+                for(int i = append_buffer.size() - 1; i >= 0; --i)
+                    result.push_back(append_buffer[i]);
+                append_buffer.clear();
+
+                uint32_t code1 = lzw_stream.ReadLZWCode(dictionary_bits);
+                if(code1 == end)
+                    break;
+
+                if(code1 == clear)
+                {
+                    dictionary_bits = code_bits + 1;
+                    next_free_slot = clear + 2;
+                    prev_code1 = -1;
+                    prev_code2 = -1;
+                    continue;
+                }
+
+                int code2;
+                if(code1 < next_free_slot)
+                    code2 = code1;
+                else if(code1 == next_free_slot && prev_code2 != -1)
+                {
+                    append_buffer.push_back(prev_code2);
+                    code2 = prev_code1;
+                }
+                else
+                    throw Error();
+
+                while(code2 >= int(clear + 2))
+                {
+                    uint8_t append_char = dictionary[code2].first;
+                    code2 = dictionary[code2].second;
+                    append_buffer.push_back(append_char);
+                }
+                append_buffer.push_back(code2);
+
+                if(next_free_slot < uint32_t(1 << dictionary_bits))
+                {
+                    if(prev_code1 != -1)
+                    {
+                        dictionary[next_free_slot] = make_pair(code2, prev_code1);
+                        next_free_slot += 1;
+                    }
+                    if(next_free_slot >= uint32_t(1 << dictionary_bits) && dictionary_bits < 12)
+                        dictionary_bits += 1;
+                }
+
+                prev_code1 = code1;
+                prev_code2 = code2;
+            }
+
+            lzw_stream.Flush();
+            return result;
+        }
+
+        // Return the decoded pixels, or false on error.
+        bool DecodeLZW(const string &data, string &result)
+        {
+            DataStream stream((const uint8_t *) data.data(), data.size());
+            try {
+                result = DecodeImage(stream);
+            } catch(Error &) {
+                return false;
+            }
+            return true;
+        }
+    }
+
+    // Compress pixels the way a GIF encoder does, including the code size byte and the
+    // data sub-blocks.  If bClearWhenFull is false, we keep going with a full dictionary
+    // instead of clearing it, which encoders are allowed to do.
+    string EncodeLZW(const vector<uint8_t> &pixels, int code_bits, bool bClearWhenFull)
+    {
+        const int clear = 1 << code_bits;
+        const int end = clear + 1;
+
+        string data;
+        uint32_t bits = 0;
+        int bits_in_buffer = 0;
+        int width = code_bits + 1;
+        auto AddCode = [&](int code) {
+            bits |= code << bits_in_buffer;
+            bits_in_buffer += width;
+            while(bits_in_buffer >= 8)
+            {
+                data.push_back(char(bits & 0xFF));
+                bits >>= 8;
+                bits_in_buffer -= 8;
+            }
+        };
+
+        unordered_map<int, int> dictionary;
+        int next = clear + 2;
+        AddCode(clear);
+
+        int prefix = -1;
+        for(uint8_t pixel: pixels)
+        {
+            if(prefix == -1)
+            {
+                prefix = pixel;
+                continue;
+            }
+
+            auto it = dictionary.find((prefix << 8) | pixel);
+            if(it != dictionary.end())
+            {
+                prefix = it->second;
+                continue;
+            }
+
+            AddCode(prefix);
+            if(next < 4096)
+            {
+                dictionary[(prefix << 8) | pixel] = next++;
+
+                // The decoder adds each code one code later than we do, so it widens
+                // its codes one code later.
+                if(next > (1 << width) && width < 12)
+                    width++;
+            }
+            else if(bClearWhenFull)
+            {
+                AddCode(clear);
+                dictionary.clear();
+                next = clear + 2;
+                width = code_bits + 1;
+            }
+            prefix = pixel;
+        }
+
+        if(prefix != -1)
+            AddCode(prefix);
+        AddCode(end);
+        if(bits_in_buffer > 0)
+            data.push_back(char(bits & 0xFF));
+
+        string result(1, char(code_bits));
+        for(size_t i = 0; i < data.size(); i += 255)
+        {
+            size_t iBlockSize = min<size_t>(255, data.size() - i);
+            result.push_back(char(iBlockSize));
+            result.append(data, i, iBlockSize);
+        }
+        result.push_back(0);
+        return result;
+    }
+
+    struct Sample
+    {
+        string sName;
+        vector<uint8_t> pixels;
+        string sCompressed;
+    };
+
+    vector<Sample> MakeCorpus()
+    {
+        vector<Sample> aCorpus;
+        auto Add = [&](string sName, int code_bits, bool bClearWhenFull, vector<uint8_t> pixels) {
+            for(uint8_t &pixel: pixels)
+                pixel &= (1 << code_bits) - 1;
+
+            Sample sample;
+            sample.sName = ssprintf("%s, %i bits%s", sName.c_str(), code_bits, bClearWhenFull? "":", no clear");
+            sample.sCompressed = EncodeLZW(pixels, code_bits, bClearWhenFull);
+            sample.pixels = move(pixels);
+            aCorpus.push_back(move(sample));
+        };
+
+        srand(1);
+        for(int code_bits: { 2, 4, 8 })
+        {
+            for(bool bClearWhenFull: { true, false })
+            {
+                // Panel animation frames are 23x24, but test large images too, so the
+                // dictionary fills up.
+                for(int iSize: { 23*24, 256*256 })
+                {
+                    const char *szSize = iSize == 23*24? "small":"large";
+                    vector<uint8_t> pixels(iSize);
+
+                    for(uint8_t &pixel: pixels)
+                        pixel = uint8_t(rand());
+                    Add(ssprintf("noise, %s", szSize), code_bits, bClearWhenFull, pixels);
+
+                    for(int i = 0; i < iSize; ++i)
+                        pixels[i] = uint8_t(i / 97);
+                    Add(ssprintf("flat, %s", szSize), code_bits, bClearWhenFull, pixels);
+
+                    for(int i = 0; i < iSize; ++i)
+                        pixels[i] = uint8_t((i % 23) * 11 + (i / 23));
+                    Add(ssprintf("gradient, %s", szSize), code_bits, bClearWhenFull, pixels);
+
+                    // A single repeated value makes every code the one being added.
+                    for(int i = 0; i < iSize; ++i)
+                        pixels[i] = 1;
+                    Add(ssprintf("solid, %s", szSize), code_bits, bClearWhenFull, pixels);
+
+                    for(int i = 0; i < iSize; ++i)
+                        pixels[i] = uint8_t((i * i) % 7 + (rand() % 16 == 0? rand():0));
+                    Add(ssprintf("pattern, %s", szSize), code_bits, bClearWhenFull, pixels);
+                }
+            }
+        }
+        return aCorpus;
+    }
+
+    bool Check(const Sample &sample)
+    {
+        const string &sData = sample.sCompressed;
+        const uint8_t *pData = (const uint8_t *) sData.data();
+
+        string sReference;
+        if(!Reference::DecodeLZW(sData, sReference) || sReference != string(sample.pixels.begin(), sample.pixels.end()))
+        {
+            printf("%s: the reference decoder failed\n", sample.sName.c_str());
+            return false;
+        }
+
+        bool bPassed = true;
+        vector<uint8_t> pixels(sample.pixels.size());
+        int iDecoded = SMXGif::DecodeLZW(pData, sData.size(), pixels.data(), int(pixels.size()));
+        if(iDecoded != int(sample.pixels.size()) || pixels != sample.pixels)
+        {
+            printf("%s: decoded differently\n", sample.sName.c_str());
+            bPassed = false;
+        }
+
+        // Decoding into a smaller buffer should give the start of the image, and still
+        // count every pixel.
+        vector<uint8_t> partial(sample.pixels.size() / 3);
+        iDecoded = SMXGif::DecodeLZW(pData, sData.size(), partial.data(), int(partial.size()));
+        if(iDecoded != int(sample.pixels.size()) || !equal(partial.begin(), partial.end(), sample.pixels.begin()))
+        {
+            printf("%s: partial decode was different\n", sample.sName.c_str());
+            bPassed = false;
+        }
+
+        // Both decoders should agree on whether damaged data can be decoded, and if it
+        // can, on what it decodes to.
+        for(int i = 0; i < 20; ++i)
+        {
+            string sDamaged = sData;
+            if(i < 5)
+                sDamaged.resize(sData.size() * i / 5);
+            else
+                sDamaged[1 + rand() % (sDamaged.size() - 1)] ^= uint8_t(1 << (rand() % 8));
+
+            bool bReference = Reference::DecodeLZW(sDamaged, sReference);
+            vector<uint8_t> damaged(sample.pixels.size());
+            iDecoded = SMXGif::DecodeLZW((const uint8_t *) sDamaged.data(), sDamaged.size(), damaged.data(), int(damaged.size()));
+            bool bSame = bReference == (iDecoded != -1);
+            if(bSame && bReference)
+            {
+                size_t iCompare = min<size_t>(sReference.size(), damaged.size());
+                bSame = iDecoded == int(sReference.size()) && !memcmp(damaged.data(), sReference.data(), iCompare);
+            }
+            if(!bSame)
+            {
+                printf("%s: damaged data (%i) was handled differently\n", sample.sName.c_str(), i);
+                bPassed = false;
+            }
+        }
+
+        return bPassed;
+    }
+
+    // Return the time to decode the corpus once, in seconds.
+    template<typename T>
+    double Time(const vector<Sample> &aCorpus, T Decode)
+    {
+        double fBest = 1e10;
+        for(int iRun = 0; iRun < 5; ++iRun)
+        {
+            double fStart = GetMonotonicTime();
+            for(const Sample &sample: aCorpus)
+                Decode(sample);
+            fBest = min(fBest, GetMonotonicTime() - fStart);
+        }
+        return fBest;
+    }
+}
+
+int main()
+{
+    vector<Sample> aCorpus = MakeCorpus();
+
+    size_t iPixels = 0;
+    bool bPassed = true;
+    for(const Sample &sample: aCorpus)
+    {
+        bPassed &= Check(sample);
+        iPixels += sample.pixels.size();
+    }
+    printf("%i images, %.1f million pixels\n", int(aCorpus.size()), iPixels / 1000000.0);
+
+    double fReference = Time(aCorpus, [](const Sample &sample) {
+        string sResult;
+        Reference::DecodeLZW(sample.sCompressed, sResult);
+    });
+
+    vector<uint8_t> pixels;
+    double fTable = Time(aCorpus, [&pixels](const Sample &sample) {
+        pixels.resize(sample.pixels.size());
+        SMXGif::DecodeLZW((const uint8_t *) sample.sCompressed.data(), sample.sCompressed.size(), pixels.data(), int(pixels.size()));
+    });
+
+    printf("reference: %7.2f ms, %6.1f Mpixels/s\n", fReference * 1000, iPixels / fReference / 1000000);
+    printf("table:     %7.2f ms, %6.1f Mpixels/s (%.1fx)\n", fTable * 1000, iPixels / fTable / 1000000, fReference / fTable);
+
+    printf("%s\n", bPassed? "PASS":"FAIL");
+    return bPassed? 0:1;
+}
@@ -0,0 +1,139 @@
+// Count heap allocations made while sending lights.
+//
+// Two simulated pads are connected, and we call SMX_SetLights2 at 60 FPS.  Once the
+// lights path has warmed up, every allocation made by the calling thread or the SMXManager
+// thread is counted.  Allocations made inside the simulated devices are excluded, since
+// they stand in for hardware.  This exits with an error if any allocations were made.
+//
+// Build with "make benchmarks" in sdk/Linux, and run build/benchmarks/LightsAllocations.
+
+#include "SMXManager.h"
+#include "SMXSimulatedDevice.h"
+#include "Helpers.h"
+#include "BenchmarkHelpers.h"
+#include "../SMX.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <thread>
+using namespace std;
+using namespace SMX;
+using namespace BenchmarkHelpers;
+
+namespace
+{
+    thread_local bool t_bCountThread = false;
+    thread_local bool t_bInSimulator = false;
+
+    bool ShouldCount(size_t iSize)
+    {
+        if(t_bInSimulator)
+            return false;
+        if(t_bCountThread)
+            return true;
+
+        // Count the SMXManager thread.  This doesn't allocate.
+        char szName[16] = "";
+        prctl(PR_GET_NAME, szName);
+        return !strcmp(szName, "SMXManager");
+    }
+
+    struct SimulatorScope
+    {
+        SimulatorScope() { t_bInSimulator = true; }
+        ~SimulatorScope() { t_bInSimulator = false; }
+    };
+
+    // Forward to a simulated device, and don't count allocations it makes.
+    class UncountedTransport: public SMXTransport
+    {
+    public:
+        UncountedTransport(shared_ptr<SMXSimulatedDevice> pDevice): m_pDevice(pDevice) { }
+        bool Open(wstring &sError) override { SimulatorScope S; return m_pDevice->Open(sError); }
+        void Close() override { SimulatorScope S; m_pDevice->Close(); }
+        bool ReadReport(string &sReport, wstring &sError) override { SimulatorScope S; return m_pDevice->ReadReport(sReport, sError); }
+        void WriteReport(const string &sReport, wstring &sError) override { SimulatorScope S; m_pDevice->WriteReport(sReport, sError); }
+        bool GetWritesComplete(wstring &sError) override { SimulatorScope S; return m_pDevice->GetWritesComplete(sError); }
+        void CancelWrites() override { SimulatorScope S; m_pDevice->CancelWrites(); }
+        HANDLE GetWaitHandle() const override { return m_pDevice->GetWaitHandle(); }
+        int GetWakeupDelayMS() const override { SimulatorScope S; return m_pDevice->GetWakeupDelayMS(); }
+        void SetWakeupCallback(function<void()> pCallback) override { SimulatorScope S; m_pDevice->SetWakeupCallback(pCallback); }
+
+    private:
+        shared_ptr<SMXSimulatedDevice> m_pDevice;
+    };
+
+    void RunFrames(const char *pLights, int iFrames)
+    {
+        for(int i = 0; i < iFrames; ++i)
+        {
+            SMX_SetLights2(pLights, 2*9*25*3);
+            this_thread::sleep_for(chrono::microseconds(16667));
+        }
+    }
+}
+
+int main()
+{
+    SetLogCallback([](const string &log) { });
+    t_bCountThread = true;
+
+    SMXManager::g_pSMX = make_shared<SMXManager>([](int pad, const SMXUpdateDetails &details) { });
+
+    shared_ptr<SMXSimulatedDevice> pSim[2];
+    for(int pad = 0; pad < 2; ++pad)
+    {
+        SMXSimulatedDeviceOptions options;
+        options.bPlayer2 = pad == 1;
+        pSim[pad] = make_shared<SMXSimulatedDevice>(options);
+        SMXManager::g_pSMX->AddSimulatedDevice(make_shared<UncountedTransport>(pSim[pad]));
+    }
+
+    // Wait for both pads to connect.
+    double fStart = GetMonotonicTime();
+    while(GetMonotonicTime() - fStart < 5)
+    {
+        SMXInfo info[2];
+        SMXManager::g_pSMX->GetInfo(0, info[0]);
+        SMXManager::g_pSMX->GetInfo(1, info[1]);
+        if(info[0].m_bConnected && info[1].m_bConnected)
+            break;
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+
+    char lights[2*9*25*3];
+    for(int i = 0; i < sizeof(lights); ++i)
+        lights[i] = char(i * 7);
+
+    // Warm up, so buffers that are reused have been allocated.
+    RunFrames(lights, 30);
+
+    const int iFrames = 120;
+    int iCommandsBefore = pSim[0]->GetStats().iCommandsReceived['2'] + pSim[1]->GetStats().iCommandsReceived['2'];
+    StartCountingAllocations(ShouldCount);
+    RunFrames(lights, iFrames);
+    int iAllocations = (int) StopCountingAllocations();
+    int iCommandsAfter = pSim[0]->GetStats().iCommandsReceived['2'] + pSim[1]->GetStats().iCommandsReceived['2'];
+
+    int iUpdates = iCommandsAfter - iCommandsBefore;
+    printf("%i frames, %i lights updates sent, %i allocations (%.2f per frame)\n",
+        iFrames, iUpdates, iAllocations, double(iAllocations) / iFrames);
+
+    t_bCountThread = false;
+    SMXManager::g_pSMX.reset();
+
+    if(iUpdates == 0)
+    {
+        printf("FAIL: no lights were sent\n");
+        return 1;
+    }
+    if(iAllocations != 0)
+    {
+        printf("FAIL: the lights path allocated memory\n");
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,160 @@
+// Compare the lights encoder in SMXLightsEncoding with the byte-at-a-time encoder
+// SMXManager::SetLights used to use, and check that their output is identical.
+//
+// Build with "make benchmarks" in sdk/Linux, and run build/benchmarks/LightsEncoding.
+
+#include "SMXLightsEncoding.h"
+#include "Helpers.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <random>
+using namespace std;
+using namespace SMX;
+
+namespace
+{
+    // The original encoder from SMXManager::SetLights.
+    void EncodeLightsCommandsReference(const uint8_t *pLights, int iSize, string sLightCommands[3])
+    {
+        string sLightsDataForPad((const char *) pLights, iSize);
+        if(sLightsDataForPad.size() == 9*4*4*3)
+            sLightsDataForPad.append(9*5*5*3 - 9*4*4*3, '\0');
+
+        sLightCommands[0] = "4";
+        sLightCommands[1] = "2";
+        sLightCommands[2] = "3";
+        int iNextInputByte = 0;
+        auto scaleLight = [](uint8_t iColor) {
+            return uint8_t(iColor * 0.6666f);
+        };
+        for(int iPanel = 0; iPanel < 9; ++iPanel)
+        {
+            for(int iByte = 0; iByte < 4*4*3; ++iByte)
+            {
+                uint8_t iColor = sLightsDataForPad[iNextInputByte++];
+                iColor = scaleLight(iColor);
+
+                int iCommandIndex = iByte < 4*2*3? 1:2;
+                sLightCommands[iCommandIndex].append(1, iColor);
+            }
+
+            for(int iByte = 0; iByte < 3*3*3; ++iByte)
+            {
+                uint8_t iColor = sLightsDataForPad[iNextInputByte++];
+                iColor = scaleLight(iColor);
+                sLightCommands[0].append(1, iColor);
+            }
+        }
+
+        sLightCommands[0].push_back('\n');
+        sLightCommands[1].push_back('\n');
+        sLightCommands[2].push_back('\n');
+    }
+
+    bool CheckScaling()
+    {
+        uint8_t in[256], scalar[256], simd[256];
+        for(int i = 0; i < 256; ++i)
+            in[i] = uint8_t(i);
+        ScaleLightColorsScalar(in, scalar, 256);
+        ScaleLightColors(in, simd, 256);
+
+        for(int i = 0; i < 256; ++i)
+        {
+            uint8_t iExpected = uint8_t(uint8_t(i) * 0.6666f);
+            if(scalar[i] != iExpected || simd[i] != iExpected || ScaleLightColor(uint8_t(i)) != iExpected)
+            {
+                printf("Scaling mismatch for %i: expected %i, scalar %i, SIMD %i\n", i, iExpected, scalar[i], simd[i]);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool CheckEncoding(const uint8_t *pLights, int iSize)
+    {
+        string sExpected[3];
+        EncodeLightsCommandsReference(pLights, iSize, sExpected);
+
+        uint8_t commands[3][LightsCommand4Size];
+        EncodeLightsCommands(pLights, iSize, commands[0], commands[1], commands[2]);
+
+        const int iSizes[3] = { LightsCommand4Size, LightsCommand2Size, LightsCommand3Size };
+        for(int i = 0; i < 3; ++i)
+        {
+            if(sExpected[i].size() != iSizes[i] || memcmp(sExpected[i].data(), commands[i], iSizes[i]))
+            {
+                printf("Command %c doesn't match for %i bytes of input\n", sExpected[i][0], iSize);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template<typename F>
+    double TimeNsPerOp(F func)
+    {
+        // Run for about half a second.
+        int iIterations = 0;
+        double fStart = GetMonotonicTime(), fElapsed = 0;
+        while(fElapsed < 0.5)
+        {
+            for(int i = 0; i < 1000; ++i)
+                func();
+            iIterations += 1000;
+            fElapsed = GetMonotonicTime() - fStart;
+        }
+        return fElapsed * 1e9 / iIterations;
+    }
+}
+
+int main()
+{
+    bool bOK = CheckScaling();
+
+    mt19937 random(1);
+    uint8_t lights[9*5*5*3];
+    for(int iTry = 0; iTry < 1000 && bOK; ++iTry)
+    {
+        for(uint8_t &c: lights)
+            c = uint8_t(random());
+        bOK = CheckEncoding(lights, 9*5*5*3) && CheckEncoding(lights, 9*4*4*3);
+    }
+
+    if(!bOK)
+    {
+        printf("FAIL\n");
+        return 1;
+    }
+    printf("Output matches the reference encoder\n");
+
+    string sReference[3];
+    uint8_t commands[3][LightsCommand4Size];
+    uint8_t scaled[sizeof(lights)];
+    volatile uint8_t iSink;
+
+    double fReference = TimeNsPerOp([&] {
+        EncodeLightsCommandsReference(lights, sizeof(lights), sReference);
+        iSink = sReference[0][1];
+    });
+    double fScalar = TimeNsPerOp([&] {
+        ScaleLightColorsScalar(lights, scaled, sizeof(lights));
+        iSink = scaled[1];
+    });
+    double fSIMD = TimeNsPerOp([&] {
+        ScaleLightColors(lights, scaled, sizeof(lights));
+        iSink = scaled[1];
+    });
+    double fEncode = TimeNsPerOp([&] {
+        EncodeLightsCommands(lights, sizeof(lights), commands[0], commands[1], commands[2]);
+        iSink = commands[0][1];
+    });
+
+    printf("%-32s %8.1f ns/pad\n", "reference encoder", fReference);
+    printf("%-32s %8.1f ns/pad\n", "ScaleLightColorsScalar", fScalar);
+    printf("%-32s %8.1f ns/pad\n", "ScaleLightColors", fSIMD);
+    printf("%-32s %8.1f ns/pad\n", "EncodeLightsCommands", fEncode);
+    return 0;
+}
@@ -0,0 +1,195 @@
+// Measure when lights are shown for a 60 FPS game, with and without presentation times.
+//
+// Two simulated pads are connected.  The second pad takes longer to acknowledge lights
+// commands, like a pad with more panels or a slower USB connection.  A game loop sends
+// lights every 1/60 of a second, for the frame that will be displayed two frames later.
+// Each update is sent once without a presentation time (SetLights2), and once with the
+// frame's display time (SetLights3).
+//
+// We record when each pad finishes receiving each update, and report:
+//  - how far the two pads are from showing the same update at the same time
+//  - how far the updates land from the game's frame boundaries
+//  - what SMX_GetStats reports for lights latency, jitter and timing error
+//
+// Build with "make benchmarks" in sdk/Linux, and run build/benchmarks/LightsPacing.
+
+#include "SMXManager.h"
+#include "SMXDevice.h"
+#include "SMXSimulatedDevice.h"
+#include "Helpers.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+using namespace SMX;
+
+namespace
+{
+    // A simulated device that records when each new '3' lights command finishes, which
+    // is the last part of a lights update.  The pad shows it once the command has been
+    // processed, m_fLightsLatency later.
+    class RecordingDevice: public SMXSimulatedDevice
+    {
+    public:
+        RecordingDevice(const SMXSimulatedDeviceOptions &options, double fLightsLatency):
+            SMXSimulatedDevice(options), m_fLightsLatency(fLightsLatency) { }
+
+        void WriteReport(const string &sReport, wstring &sError) override
+        {
+            SMXSimulatedDevice::WriteReport(sReport, sError);
+
+            string sCommand = GetLastCommand('3');
+            lock_guard<mutex> L(m_Lock);
+            if(sCommand != m_sLastCommand)
+            {
+                m_sLastCommand = sCommand;
+                m_aShownAt.push_back(GetMonotonicTime() + m_fLightsLatency);
+            }
+        }
+
+        vector<double> TakeShownTimes()
+        {
+            lock_guard<mutex> L(m_Lock);
+            vector<double> aResult;
+            swap(aResult, m_aShownAt);
+            return aResult;
+        }
+
+    private:
+        const double m_fLightsLatency;
+        mutex m_Lock;
+        string m_sLastCommand;
+        vector<double> m_aShownAt;
+    };
+
+    shared_ptr<RecordingDevice> CreateDevice(bool bPlayer2, double fLightsLatency)
+    {
+        SMXSimulatedDeviceOptions options;
+        options.bPlayer2 = bPlayer2;
+        options.DefaultTiming.fLatency = 0.001;
+        for(char c: { '2', '3', '4' })
+            options.CommandTiming[c].fLatency = fLightsLatency;
+        return make_shared<RecordingDevice>(options, fLightsLatency);
+    }
+
+    // Run a 60 FPS game loop for iFrames frames.  If bTimed is true, each update is given
+    // the time its frame is displayed.
+    void RunGameLoop(bool bTimed, int iFrames, double &fFirstFrame)
+    {
+        const double fFrameTime = 1/60.0;
+        char lights[2][9*25*3];
+        fFirstFrame = GetMonotonicTime() + 0.1;
+        for(int iFrame = 0; iFrame < iFrames; ++iFrame)
+        {
+            double fFrameStart = fFirstFrame + iFrame * fFrameTime;
+            while(GetMonotonicTime() < fFrameStart)
+                this_thread::sleep_for(chrono::microseconds(500));
+
+            // Change every LED, so every update that's shown is different from the one
+            // before it, whether every frame or every other frame is shown.
+            const uint8_t iColors[] = { 0x40, 0x80, 0xFF };
+            memset(lights, iColors[iFrame % 3], sizeof(lights));
+            const char *apLights[] = { lights[0], lights[1] };
+            int aiSizes[] = { sizeof(lights[0]), sizeof(lights[1]) };
+            double fPresentAt = bTimed? fFrameStart + 2*fFrameTime:0;
+            SMXManager::g_pSMX->SetLights(apLights, aiSizes, 2, fPresentAt);
+        }
+
+        this_thread::sleep_for(chrono::milliseconds(200));
+    }
+
+    // Return the mean distance from each time in aTimes to the nearest time in aOther.
+    double MeanDistance(const vector<double> &aTimes, const vector<double> &aOther)
+    {
+        if(aTimes.empty() || aOther.empty())
+            return 0;
+
+        double fTotal = 0;
+        for(double fTime: aTimes)
+        {
+            auto it = lower_bound(aOther.begin(), aOther.end(), fTime);
+            double fDistance = 1e9;
+            if(it != aOther.end())
+                fDistance = min(fDistance, *it - fTime);
+            if(it != aOther.begin())
+                fDistance = min(fDistance, fTime - *(it-1));
+            fTotal += fDistance;
+        }
+        return fTotal / aTimes.size();
+    }
+
+    // Return the mean distance from each time to the nearest frame boundary.
+    double MeanFrameOffset(const vector<double> &aTimes, double fFirstFrame)
+    {
+        const double fFrameTime = 1/60.0;
+        double fTotal = 0;
+        for(double fTime: aTimes)
+        {
+            double fFrames = (fTime - fFirstFrame) / fFrameTime;
+            fTotal += fabs(fFrames - floor(fFrames + 0.5)) * fFrameTime;
+        }
+        return aTimes.empty()? 0:fTotal / aTimes.size();
+    }
+
+    void Run(const char *szName, bool bTimed, shared_ptr<RecordingDevice> pDevices[2])
+    {
+        SMXManager::g_pSMX->ResetStats();
+        pDevices[0]->TakeShownTimes();
+        pDevices[1]->TakeShownTimes();
+
+        double fFirstFrame;
+        RunGameLoop(bTimed, 300, fFirstFrame);
+
+        vector<double> aShown[2] = { pDevices[0]->TakeShownTimes(), pDevices[1]->TakeShownTimes() };
+        printf("%s:\n", szName);
+        printf("  updates shown          %i, %i\n", int(aShown[0].size()), int(aShown[1].size()));
+        printf("  pad 1 to pad 2 skew    %6.2f ms\n", MeanDistance(aShown[0], aShown[1]) * 1000);
+        for(int iPad = 0; iPad < 2; ++iPad)
+        {
+            SMXStats stats;
+            SMXManager::g_pSMX->GetStats(iPad, stats);
+            printf("  pad %i: frame offset %6.2f ms   latency %6.2f ms (p99 %6.2f)   jitter %5.2f ms",
+                iPad + 1, MeanFrameOffset(aShown[iPad], fFirstFrame) * 1000,
+                stats.m_fLightsLatencyMean * 1000, stats.m_fLightsLatencyP99 * 1000,
+                stats.m_fLightsJitter * 1000);
+            if(bTimed)
+                printf("   timing error %5.2f ms (max %5.2f)",
+                    stats.m_fLightsTimingErrorMean * 1000, stats.m_fLightsTimingErrorMax * 1000);
+            printf("\n");
+        }
+    }
+}
+
+int main()
+{
+    SetLogCallback([](const string &log) { });
+
+    SMXManager::g_pSMX = make_shared<SMXManager>([](int pad, const SMXUpdateDetails &details) { });
+
+    shared_ptr<RecordingDevice> pDevices[2] = { CreateDevice(false, 0.002), CreateDevice(true, 0.006) };
+    SMXManager::g_pSMX->AddSimulatedDevice(pDevices[0]);
+    SMXManager::g_pSMX->AddSimulatedDevice(pDevices[1]);
+
+    double fStart = GetMonotonicTime();
+    SMXInfo info[2];
+    do {
+        this_thread::sleep_for(chrono::milliseconds(10));
+        SMXManager::g_pSMX->GetInfo(0, info[0]);
+        SMXManager::g_pSMX->GetInfo(1, info[1]);
+    } while((!info[0].m_bConnected || !info[1].m_bConnected) && GetMonotonicTime() - fStart < 5);
+    if(!info[0].m_bConnected || !info[1].m_bConnected)
+    {
+        printf("Simulated devices didn't connect\n");
+        return 1;
+    }
+
+    Run("as soon as possible", false, pDevices);
+    Run("with presentation times", true, pDevices);
+
+    SMXManager::g_pSMX.reset();
+    return 0;
+}
@@ -0,0 +1,743 @@
+// Microbenchmarks for the SDK's hot paths.
+//
+// Each benchmark reports the time and the number of heap allocations per operation.
+// Devices are simulated, so this runs without hardware.  The simulated master's responses
+// are recorded once and then replayed, so the simulator itself isn't part of the timings.
+//
+// Build with "make benchmarks" in sdk/Linux, and run build/benchmarks/Microbenchmarks.
+//
+// Usage: Microbenchmarks [--json] [--time=seconds] [filter]
+//
+// --json prints the results as a JSON array, so they can be saved and compared between
+// builds.  If filter is given, only benchmarks with filter in their name are run.
+
+#include "SMXDevice.h"
+#include "SMXDeviceConnection.h"
+#include "SMXHelperThread.h"
+#include "SMXManager.h"
+#include "SMXSimulatedDevice.h"
+#include "SMXTransport.h"
+#include "SMXGif.h"
+#include "SMXPanelAnimation.h"
+#include "SMXPanelAnimationUpload.h"
+#include "SMXSensorTestData.h"
+#include "Helpers.h"
+#include "BenchmarkHelpers.h"
+#include "../SMX.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <map>
+#include <random>
+#include <thread>
+#include <unordered_map>
+using namespace std;
+using namespace SMX;
+using namespace BenchmarkHelpers;
+
+namespace
+{
+    // Packet flags, from SMXDeviceConnection.cpp.
+    const uint8_t PacketFlagStartOfCommand = 0x04;
+    const uint8_t PacketFlagEndOfCommand = 0x01;
+    const uint8_t PacketFlagDeviceInfo = 0x80;
+
+    // Allocations are only counted on the benchmark thread while a benchmark is running,
+    // and not while fixtures are doing work on its behalf.
+    thread_local bool t_bBenchmarkThread = false;
+    thread_local int t_iFixtureDepth = 0;
+
+    bool ShouldCount(size_t iSize)
+    {
+        return t_bBenchmarkThread && t_iFixtureDepth == 0;
+    }
+
+    struct FixtureScope
+    {
+        FixtureScope() { t_iFixtureDepth++; }
+        ~FixtureScope() { t_iFixtureDepth--; }
+    };
+
+    // Stand in for a master controller.  The first time each command is received, it's
+    // forwarded to a simulated device and the response is recorded.  Sensor test requests
+    // are recorded separately for each mode.  After that, the
+    // recorded response is queued as soon as the command is written, which makes this
+    // cheap enough not to affect the timings.
+    //
+    // Reports can also be queued directly with QueueReport.
+    class ReplayTransport: public SMXTransport
+    {
+    public:
+        ReplayTransport(shared_ptr<SMXSimulatedDevice> pDevice): m_pDevice(pDevice) { }
+
+        bool Open(wstring &sError) override
+        {
+            FixtureScope S;
+            return m_pDevice->Open(sError);
+        }
+
+        void Close() override { }
+
+        bool ReadReport(string &sReport, wstring &sError) override
+        {
+            if(m_iNextRead == m_iQueued)
+                return false;
+
+            sReport.assign(m_Queue[m_iNextRead++]);
+            if(m_iNextRead == m_iQueued)
+                m_iNextRead = m_iQueued = 0;
+            return true;
+        }
+
+        void WriteReport(const string &sReport, wstring &sError) override
+        {
+            FixtureScope S;
+            if(sReport.size() < 4)
+                return;
+
+            uint8_t iFlags = sReport[1];
+            if(iFlags & PacketFlagDeviceInfo)
+                m_sCommand = "I";
+            else if(iFlags & PacketFlagStartOfCommand)
+                m_sCommand.assign(sReport, 3, sReport[3] == 'y'? 2:1);
+
+            auto it = m_Responses.find(m_sCommand);
+            if(it == m_Responses.end())
+            {
+                // We haven't seen this command yet.  Forward it to the simulator, and record
+                // the response once the command is complete.
+                m_pDevice->WriteReport(sReport, sError);
+                if(!(iFlags & (PacketFlagEndOfCommand | PacketFlagDeviceInfo)))
+                    return;
+
+                vector<string> &aResponse = m_Responses[m_sCommand];
+                string sResponse;
+                while(m_pDevice->ReadReport(sResponse, sError))
+                {
+                    // Only record serial packets.  Input reports aren't part of the response.
+                    if(!sResponse.empty() && sResponse[0] == 6)
+                        aResponse.push_back(sResponse);
+                }
+                it = m_Responses.find(m_sCommand);
+            }
+            else if(!(iFlags & (PacketFlagEndOfCommand | PacketFlagDeviceInfo)))
+                return;
+
+            for(const string &sResponse: it->second)
+                QueueReport(sResponse);
+        }
+
+        bool GetWritesComplete(wstring &sError) override { return true; }
+        void CancelWrites() override { }
+        HANDLE GetWaitHandle() const override { return INVALID_HANDLE_VALUE; }
+
+        void QueueReport(const string &sReport)
+        {
+            FixtureScope S;
+            if(m_iQueued == m_Queue.size())
+                m_Queue.emplace_back();
+            m_Queue[m_iQueued++].assign(sReport);
+        }
+
+        // Return the recorded response to sCommand, or an empty list if it hasn't been seen.
+        const vector<string> &GetResponse(const string &sCommand) { return m_Responses[sCommand]; }
+
+    private:
+        shared_ptr<SMXSimulatedDevice> m_pDevice;
+        map<string, vector<string>> m_Responses;
+        string m_sCommand;
+
+        // Queued reports.  Strings are reused, so reading reports doesn't allocate.
+        vector<string> m_Queue;
+        size_t m_iQueued = 0;
+        size_t m_iNextRead = 0;
+    };
+
+    shared_ptr<SMXSimulatedDevice> CreateSimulatedDevice()
+    {
+        SMXSimulatedDeviceOptions options;
+        options.DefaultTiming.fLatency = 0;
+        shared_ptr<SMXSimulatedDevice> pDevice = make_shared<SMXSimulatedDevice>(options);
+
+        // Give each sensor a different value, so test data isn't all zeroes.
+        for(int iPanel = 0; iPanel < 9; ++iPanel)
+            for(int iSensor = 0; iSensor < 4; ++iSensor)
+                pDevice->SetSensorLevel(iPanel, iSensor, int16_t(iPanel * 100 + iSensor * 25 - 200));
+        return pDevice;
+    }
+
+    // Write a GIF with the given frames, with LZW compression like an image editor would
+    // produce.  Each frame is width*height palette indexes.  Palette index 0 is transparent.
+    string EncodeGIF(int iWidth, int iHeight, const vector<SMXGif::Color> &aPalette,
+        const vector<vector<uint8_t>> &aFrames, int iDelayMS)
+    {
+        string sOut = "GIF89a";
+        auto Write16 = [&sOut](int i) { sOut.push_back(char(i & 0xFF)); sOut.push_back(char(i >> 8)); };
+
+        // The global palette always has 16 entries.
+        Write16(iWidth);
+        Write16(iHeight);
+        sOut.push_back(char(0xB3));
+        sOut.push_back(0); // background color
+        sOut.push_back(0); // aspect ratio
+        for(int i = 0; i < 16; ++i)
+        {
+            SMXGif::Color color = i < aPalette.size()? aPalette[i]:SMXGif::Color();
+            sOut.append((const char *) color.color, 3);
+        }
+
+        const int iMinCodeSize = 4;
+        const int iClearCode = 1 << iMinCodeSize;
+        for(const vector<uint8_t> &aPixels: aFrames)
+        {
+            // Graphic control extension: restore to background, transparent index 0.
+            sOut.append("\x21\xF9\x04\x09", 4);
+            Write16(iDelayMS / 10);
+            sOut.push_back(0);
+            sOut.push_back(0);
+
+            // Image descriptor, with no local palette.
+            sOut.push_back(0x2C);
+            Write16(0);
+            Write16(0);
+            Write16(iWidth);
+            Write16(iHeight);
+            sOut.push_back(0);
+
+            // Compress the image.
+            string sData;
+            uint32_t iBits = 0;
+            int iBitCount = 0;
+            int iCodeSize = iMinCodeSize + 1;
+            auto WriteCode = [&](int iCode) {
+                iBits |= iCode << iBitCount;
+                iBitCount += iCodeSize;
+                while(iBitCount >= 8)
+                {
+                    sData.push_back(char(iBits & 0xFF));
+                    iBits >>= 8;
+                    iBitCount -= 8;
+                }
+            };
+
+            unordered_map<int, int> Codes;
+            int iMaxCode = iClearCode + 1;
+            WriteCode(iClearCode);
+            int iCurrent = aPixels[0];
+            for(size_t i = 1; i < aPixels.size(); ++i)
+            {
+                int iKey = (iCurrent << 8) | aPixels[i];
+                auto it = Codes.find(iKey);
+                if(it != Codes.end())
+                {
+                    iCurrent = it->second;
+                    continue;
+                }
+
+                WriteCode(iCurrent);
+                Codes[iKey] = ++iMaxCode;
+                if(iMaxCode >= (1 << iCodeSize))
+                    iCodeSize++;
+                if(iMaxCode == 4095)
+                {
+                    WriteCode(iClearCode);
+                    Codes.clear();
+                    iCodeSize = iMinCodeSize + 1;
+                    iMaxCode = iClearCode + 1;
+                }
+                iCurrent = aPixels[i];
+            }
+
+            WriteCode(iCurrent);
+            WriteCode(iClearCode);
+            iCodeSize = iMinCodeSize + 1;
+            WriteCode(iClearCode + 1);
+            if(iBitCount > 0)
+                sData.push_back(char(iBits & 0xFF));
+
+            // Write the data in sub-blocks.
+            sOut.push_back(char(iMinCodeSize));
+            for(size_t i = 0; i < sData.size(); i += 255)
+            {
+                size_t iSize = min<size_t>(255, sData.size() - i);
+                sOut.push_back(char(iSize));
+                sOut.append(sData, i, iSize);
+            }
+            sOut.push_back(0);
+        }
+
+        sOut.push_back(0x3B);
+        return sOut;
+    }
+
+    // Create a 25-light animation with 32 frames, like the animations SMXConfig uploads.
+    // Each panel uses 12 colors, which fits in a panel palette.
+    string CreateAnimationGIF()
+    {
+        vector<SMXGif::Color> aPalette;
+        aPalette.push_back(SMXGif::Color());
+        for(int i = 1; i < 16; ++i)
+            aPalette.push_back(SMXGif::Color(uint8_t(i * 16), uint8_t(255 - i * 12), uint8_t(i * 40), 0xFF));
+
+        const int iWidth = 23, iHeight = 24;
+        vector<vector<uint8_t>> aFrames;
+        for(int iFrame = 0; iFrame < 32; ++iFrame)
+        {
+            vector<uint8_t> aPixels(iWidth * iHeight);
+            for(int y = 0; y < iHeight; ++y)
+                for(int x = 0; x < iWidth; ++x)
+                    aPixels[y*iWidth + x] = uint8_t(1 + (x/2 + y/3 + iFrame) % 12);
+
+            // The bottom-left pixel marks the loop frame.  Keep it black on every frame.
+            aPixels[(iHeight-1)*iWidth] = 0;
+            aFrames.push_back(aPixels);
+        }
+
+        return EncodeGIF(iWidth, iHeight, aPalette, aFrames, 30);
+    }
+
+    struct BenchmarkResult
+    {
+        string sName;
+        int64_t iIterations = 0;
+        double fNsPerOp = 0;
+        double fAllocsPerOp = 0;
+    };
+
+    struct BenchmarkOptions
+    {
+        double fMinTime = 0.25;
+        string sFilter;
+    };
+
+    BenchmarkOptions g_Options;
+    vector<BenchmarkResult> g_Results;
+
+    // Return the CPU time used by the calling thread, in seconds.
+    double GetThreadCPUTime()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+    // Run fn repeatedly, and record the time and allocations per call.  Time is measured
+    // with GetTime, which is wall time by default.
+    template<typename F>
+    void RunBenchmark(const string &sName, F fn, double (*GetTime)() = GetMonotonicTime)
+    {
+        if(!g_Options.sFilter.empty() && sName.find(g_Options.sFilter) == string::npos)
+            return;
+
+        // Warm up, so buffers that are reused are already allocated.
+        for(int i = 0; i < 100; ++i)
+            fn();
+
+        // Increase the iteration count until a run takes long enough to be accurate.
+        int64_t iIterations = 100;
+        while(1)
+        {
+            t_bBenchmarkThread = true;
+            StartCountingAllocations(ShouldCount);
+            double fStart = GetTime();
+            for(int64_t i = 0; i < iIterations; ++i)
+                fn();
+            double fTime = GetTime() - fStart;
+            int64_t iAllocations = StopCountingAllocations();
+            t_bBenchmarkThread = false;
+
+            if(fTime >= g_Options.fMinTime || iIterations >= (int64_t(1) << 40))
+            {
+                BenchmarkResult result;
+                result.sName = sName;
+                result.iIterations = iIterations;
+                result.fNsPerOp = fTime * 1e9 / iIterations;
+                result.fAllocsPerOp = double(iAllocations) / iIterations;
+                g_Results.push_back(result);
+                return;
+            }
+
+            // Aim for a little over the minimum time.
+            double fScale = fTime > 0? g_Options.fMinTime * 1.2 / fTime:100;
+            iIterations = int64_t(iIterations * min(max(fScale, 2.0), 100.0));
+        }
+    }
+
+    void BenchmarkSetLights()
+    {
+        SMXManager manager([](int pad, const SMXUpdateDetails &details) { });
+
+        for(int iLights: { 9*4*4*3, 9*5*5*3 })
+        {
+            vector<char> lights(iLights*2);
+            for(int i = 0; i < lights.size(); ++i)
+                lights[i] = char(i * 7);
+
+            const char *pLights[2] = { lights.data(), lights.data() + iLights };
+            const int iSize[2] = { iLights, iLights };
+            string sName = ssprintf("SMXManager::SetLights (%i lights, 2 pads)", iLights / 27);
+            RunBenchmark(sName, [&] {
+                manager.SetLights(pLights, iSize, 2);
+            });
+        }
+
+        manager.Shutdown();
+    }
+
+    // Measure the cost of a lights frame as more pads are connected.  Unlike
+    // BenchmarkSetLights, the pads are connected, so lights are queued for each of them.
+    //
+    // Each call wakes every pad's I/O thread, which sends the lights to its simulated
+    // device.  On a machine with fewer CPUs than pads, that work runs in between our calls,
+    // so wall time grows faster than the pad count, and varies from run to run depending on
+    // how many updates the I/O threads fall behind on and replace.  The calling thread's CPU
+    // time is measured separately.  That's the cost to the caller, without the I/O threads.
+    void BenchmarkSetLightsPadCount()
+    {
+        const int iLights = 9*5*5*3;
+        for(int iPads: { 1, 2, 4, 8 })
+        {
+            string sName = ssprintf("SMXManager::SetLights (25 lights, %i connected pads)", iPads);
+            if(!g_Options.sFilter.empty() && sName.find(g_Options.sFilter) == string::npos)
+                continue;
+
+            SMXManager manager([](int pad, const SMXUpdateDetails &details) { });
+            for(int i = 0; i < iPads; ++i)
+                manager.AddSimulatedDevice(make_shared<SMXSimulatedDevice>());
+
+            // Wait for the pads to connect.
+            double fStart = GetMonotonicTime();
+            int iConnected = 0;
+            while(iConnected < iPads && GetMonotonicTime() - fStart < 5)
+            {
+                this_thread::sleep_for(chrono::milliseconds(10));
+                iConnected = 0;
+                for(int pad = 0; pad < manager.GetPadCount(); ++pad)
+                {
+                    SMXInfo info;
+                    manager.GetInfo(pad, info);
+                    if(info.m_bConnected)
+                        iConnected++;
+                }
+            }
+
+            if(iConnected < iPads)
+            {
+                fprintf(stderr, "%s: only %i pads connected\n", sName.c_str(), iConnected);
+                manager.Shutdown();
+                continue;
+            }
+
+            vector<char> lights(iLights*iPads);
+            for(int i = 0; i < lights.size(); ++i)
+                lights[i] = char(i * 7);
+
+            vector<const char *> pLights;
+            vector<int> iSize;
+            for(int pad = 0; pad < iPads; ++pad)
+            {
+                pLights.push_back(lights.data() + iLights*pad);
+                iSize.push_back(iLights);
+            }
+
+            RunBenchmark(sName, [&] {
+                manager.SetLights(pLights.data(), iSize.data(), iPads);
+            });
+            RunBenchmark(ssprintf("SMXManager::SetLights (25 lights, %i connected pads, caller CPU)", iPads), [&] {
+                manager.SetLights(pLights.data(), iSize.data(), iPads);
+            }, GetThreadCPUTime);
+
+            manager.Shutdown();
+        }
+    }
+
+    // Open a connection to a replayed device and activate it.
+    shared_ptr<SMXDeviceConnection> OpenConnection(shared_ptr<ReplayTransport> pTransport)
+    {
+        shared_ptr<SMXDeviceConnection> pConnection = SMXDeviceConnection::Create();
+        wstring sError;
+        pConnection->Open(pTransport, sError);
+        while(sError.empty() && !pConnection->IsConnectedWithDeviceInfo())
+            pConnection->Update(sError);
+        pConnection->SetActive(true);
+        return pConnection;
+    }
+
+    void BenchmarkSendCommand()
+    {
+        shared_ptr<ReplayTransport> pTransport = make_shared<ReplayTransport>(CreateSimulatedDevice());
+        shared_ptr<SMXDeviceConnection> pConnection = OpenConnection(pTransport);
+
+        // Send a lights command, and process the master's acknowledgement.
+        char sCommand[218];
+        memset(sCommand, 0x40, sizeof(sCommand));
+        sCommand[0] = '2';
+        sCommand[sizeof(sCommand)-1] = '\n';
+
+        wstring sError;
+        RunBenchmark("SMXDeviceConnection::SendCommand (218 bytes)", [&] {
+            pConnection->SendCommand(sCommand, sizeof(sCommand));
+            pConnection->Update(sError);
+            pConnection->Update(sError);
+        });
+
+        pConnection->Close();
+    }
+
+    void BenchmarkHandleUsbPacket()
+    {
+        shared_ptr<ReplayTransport> pTransport = make_shared<ReplayTransport>(CreateSimulatedDevice());
+        shared_ptr<SMXDeviceConnection> pConnection = OpenConnection(pTransport);
+
+        // Record a sensor test response, so we can feed it back in.
+        wstring sError;
+        string sCommand = ssprintf("y%c\n", SensorTestMode_CalibratedValues);
+        pConnection->SendCommand(sCommand);
+        pConnection->Update(sError);
+        pConnection->Update(sError);
+        string sPacket;
+        while(pConnection->ReadPacket(sPacket)) { }
+
+        const vector<string> &aResponse = pTransport->GetResponse(sCommand.substr(0, 2));
+
+        // An input report with the panels changing, and a multi-packet sensor test response.
+        string sInputReport[2] = { string("\x03\x00\x00", 3), string("\x03\x55\x01", 3) };
+        int iInputReport = 0;
+        RunBenchmark(ssprintf("SMXDeviceConnection::HandleUsbPacket (input + %i-packet response)", int(aResponse.size())), [&] {
+            pTransport->QueueReport(sInputReport[iInputReport]);
+            iInputReport ^= 1;
+            for(const string &sReport: aResponse)
+                pTransport->QueueReport(sReport);
+            pConnection->Update(sError);
+            while(pConnection->ReadPacket(sPacket)) { }
+        });
+
+        pConnection->Close();
+    }
+
+    void BenchmarkSensorTestMode()
+    {
+        SMX::Mutex lock;
+        shared_ptr<SMXIOWaiter> pWaiter = make_shared<SMXIOWaiter>();
+        shared_ptr<SMXDevice> pDevice = SMXDevice::Create(pWaiter, lock);
+        shared_ptr<ReplayTransport> pTransport = make_shared<ReplayTransport>(CreateSimulatedDevice());
+
+        wstring sError;
+        {
+            LockMutex L(lock);
+            pDevice->OpenDevice(pTransport, sError);
+        }
+
+        while(sError.empty() && !pDevice->IsConnected())
+        {
+            LockMutex L(lock);
+            pDevice->Update(sError);
+        }
+
+        for(SensorTestMode mode: { SensorTestMode_CalibratedValues, SensorTestMode_Noise })
+        {
+            pDevice->SetSensorTestMode(mode);
+
+            // One operation is one sample: the first update sends the request, and the second
+            // reads the response and decodes it.
+            string sName = ssprintf("SMXDevice::HandleSensorTestDataResponse (mode '%c')", mode);
+            RunBenchmark(sName, [&] {
+                LockMutex L(lock);
+                pDevice->Update(sError);
+                pDevice->Update(sError);
+            });
+
+            SMXSensorTestModeData data;
+            if(!g_Results.empty() && g_Results.back().sName == sName && !pDevice->GetTestData(data))
+                printf("Warning: %s didn't receive test data\n", sName.c_str());
+        }
+
+        LockMutex L(lock);
+        pDevice->CloseDevice();
+    }
+
+    // The sensor test data decoder SMXDevice used to use, one panel and one bit at a time.
+    void ReadDataForPanelReference(const uint8_t *pWords, int iWords, int iPanel, uint8_t *pOut, int iOutSize)
+    {
+        int iBit = 0;
+        for(int i = 0; i < iOutSize; ++i)
+        {
+            uint8_t result = 0;
+            for(int j = 0; j < 8; ++j)
+            {
+                bool bit = false;
+                if(iBit < iWords)
+                {
+                    int iWord = pWords[iBit*2] | (pWords[iBit*2+1] << 8);
+                    bit = iWord & (1 << iPanel);
+                    iBit++;
+                }
+                result |= bit << j;
+            }
+            pOut[i] = result;
+        }
+    }
+
+    void BenchmarkTransposeSensorTestData()
+    {
+        // Check both decoders against the reference with random data, including responses
+        // that are shorter and longer than the output.
+        mt19937 random(1);
+        uint8_t words[256];
+        for(int iTest = 0; iTest < 10000; ++iTest)
+        {
+            int iWords = random() % 128;
+            int iBytesPerPanel = 1 + random() % 12;
+            for(uint8_t &i: words)
+                i = uint8_t(random());
+
+            uint8_t expected[9][12], actual[9*12], actualScalar[9*12];
+            for(int iPanel = 0; iPanel < 9; ++iPanel)
+                ReadDataForPanelReference(words, iWords, iPanel, expected[iPanel], iBytesPerPanel);
+
+            TransposeSensorTestData(words, iWords, actual, iBytesPerPanel);
+            TransposeSensorTestDataScalar(words, iWords, actualScalar, iBytesPerPanel);
+            for(int iPanel = 0; iPanel < 9; ++iPanel)
+            {
+                if(memcmp(expected[iPanel], actual + iPanel*iBytesPerPanel, iBytesPerPanel) ||
+                   memcmp(expected[iPanel], actualScalar + iPanel*iBytesPerPanel, iBytesPerPanel))
+                {
+                    printf("TransposeSensorTestData mismatch (%i words, %i bytes per panel)\n", iWords, iBytesPerPanel);
+                    exit(1);
+                }
+            }
+        }
+
+        // A full response is 80 words, decoded into 10 bytes per panel.
+        uint8_t out[9][12];
+        RunBenchmark("ReadDataForPanel x9 (reference, 80 words)", [&] {
+            for(int iPanel = 0; iPanel < 9; ++iPanel)
+                ReadDataForPanelReference(words, 80, iPanel, out[iPanel], 10);
+        });
+        RunBenchmark("TransposeSensorTestDataScalar (80 words)", [&] {
+            TransposeSensorTestDataScalar(words, 80, out[0], 10);
+        });
+        RunBenchmark("TransposeSensorTestData (80 words)", [&] {
+            TransposeSensorTestData(words, 80, out[0], 10);
+        });
+    }
+
+    void BenchmarkHelperThread()
+    {
+        // Queue functions the size of an update callback.  The helper thread runs them as
+        // they arrive, so this measures the producer's side of the hop.
+        SMXHelperThread thread("Benchmark");
+        atomic<int64_t> iRun{0};
+        void *pUser = nullptr;
+        int iProgress = 0;
+        RunBenchmark("SMXHelperThread::RunInThread", [&] {
+            thread.RunInThread([&iRun, pUser, iProgress] { iRun++; });
+        });
+
+        // Queue a function and wait for it to be called.  The helper thread is usually
+        // asleep, so this includes waking it up.
+        RunBenchmark("SMXHelperThread::RunInThread (round trip)", [&] {
+            int64_t iWaitFor = iRun + 1;
+            thread.RunInThread([&iRun] { iRun++; });
+            while(iRun < iWaitFor)
+                this_thread::yield();
+        });
+
+        thread.Shutdown();
+    }
+
+    void BenchmarkDecodeGIF(const string &sGif)
+    {
+        vector<SMXGif::SMXGifFrame> frames;
+        RunBenchmark(ssprintf("SMXGif::DecodeGIF (23x24, 32 frames, %i bytes)", int(sGif.size())), [&] {
+            frames.clear();
+            SMXGif::DecodeGIF(sGif, frames);
+        });
+    }
+
+    void BenchmarkPrepareUpload(const string &sGif)
+    {
+        vector<SMXGif::SMXGifFrame> frames;
+        if(!SMXGif::DecodeGIF(sGif, frames) || frames.size() != 32)
+        {
+            printf("Error decoding the test GIF\n");
+            exit(1);
+        }
+
+        SMXPanelAnimation animations[9];
+        for(int panel = 0; panel < 9; ++panel)
+            animations[panel].Load(frames, panel);
+
+        const char *error = nullptr;
+        if(!SMX_LightsUpload_PrepareUpload(0, SMX_LightsType_Released, animations, &error))
+        {
+            printf("Error preparing upload: %s\n", error);
+            exit(1);
+        }
+
+        RunBenchmark("SMX_LightsUpload_PrepareUpload (25 lights, 32 frames)", [&] {
+            SMX_LightsUpload_PrepareUpload(0, SMX_LightsType_Released, animations, &error);
+        });
+    }
+
+    void PrintResults(bool bJSON)
+    {
+        if(bJSON)
+        {
+            printf("[\n");
+            for(size_t i = 0; i < g_Results.size(); ++i)
+            {
+                const BenchmarkResult &result = g_Results[i];
+                printf("  {\"name\": \"%s\", \"iterations\": %lli, \"ns_per_op\": %.1f, \"allocs_per_op\": %.2f}%s\n",
+                    result.sName.c_str(), (long long) result.iIterations, result.fNsPerOp, result.fAllocsPerOp,
+                    i+1 < g_Results.size()? ",":"");
+            }
+            printf("]\n");
+            return;
+        }
+
+        printf("%-64s %12s %12s %10s\n", "Benchmark", "Iterations", "ns/op", "allocs/op");
+        for(const BenchmarkResult &result: g_Results)
+            printf("%-64s %12lli %12.1f %10.2f\n", result.sName.c_str(), (long long) result.iIterations,
+                result.fNsPerOp, result.fAllocsPerOp);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    bool bJSON = false;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(!strcmp(argv[i], "--json"))
+            bJSON = true;
+        else if(!strncmp(argv[i], "--time=", 7))
+            g_Options.fMinTime = atof(argv[i] + 7);
+        else if(argv[i][0] == '-')
+        {
+            fprintf(stderr, "Usage: %s [--json] [--time=seconds] [filter]\n", argv[0]);
+            return 1;
+        }
+        else
+            g_Options.sFilter = argv[i];
+    }
+
+    SetLogCallback([](const string &log) { });
+
+    string sGif = CreateAnimationGIF();
+
+    BenchmarkSetLights();
+    BenchmarkSetLightsPadCount();
+    BenchmarkSendCommand();
+    BenchmarkHandleUsbPacket();
+    BenchmarkSensorTestMode();
+    BenchmarkTransposeSensorTestData();
+    BenchmarkHelperThread();
+    BenchmarkDecodeGIF(sGif);
+    BenchmarkPrepareUpload(sGif);
+
+    PrintResults(bJSON);
+    return 0;
+}
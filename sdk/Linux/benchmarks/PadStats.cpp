@@ -0,0 +1,122 @@
+// Print the statistics from SMXManager::GetStats for a simulated pad under load.
+//
+// A simulated pad with some latency jitter and a few dropped commands is connected, and
+// lights are sent faster than the pad accepts them while configuration reads and test
+// data requests are mixed in.  This shows what SMX_GetStats reports for a busy pad, and
+// checks that the counts match what was sent.
+//
+// Build with "make benchmarks" in sdk/Linux, and run build/benchmarks/PadStats.
+
+#include "SMXManager.h"
+#include "SMXDevice.h"
+#include "SMXSimulatedDevice.h"
+#include "Helpers.h"
+
+#include <stdio.h>
+#include <atomic>
+#include <thread>
+using namespace std;
+using namespace SMX;
+
+namespace
+{
+    void PrintStats(const SMXStats &stats)
+    {
+        printf("command  count  timeouts      min      p50      p90      p99      max  (ms)\n");
+        for(const SMXCommandStats &command: stats.m_Commands)
+        {
+            if(command.m_iCount == 0 && command.m_iTimeouts == 0)
+                continue;
+            printf("   %c    %6i  %8i %8.2f %8.2f %8.2f %8.2f %8.2f\n",
+                command.m_cCommand, command.m_iCount, command.m_iTimeouts,
+                command.m_fMin * 1000, command.m_fP50 * 1000, command.m_fP90 * 1000,
+                command.m_fP99 * 1000, command.m_fMax * 1000);
+        }
+
+        printf("queued commands:          %i (max %i)\n", stats.m_iQueuedCommands, stats.m_iMaxQueuedCommands);
+        printf("commands dropped:         %i\n", stats.m_iCommandsDropped);
+        printf("commands replaced:        %i\n", stats.m_iCommandsReplaced);
+        printf("lights updates replaced:  %i\n", stats.m_iLightsUpdatesReplaced);
+        printf("lights commands skipped:  %i\n", stats.m_iLightsCommandsSkipped);
+        printf("callbacks:                %i (lag mean %.1f us, p99 %.1f us, max %.1f us)\n",
+            stats.m_iCallbacks, stats.m_fCallbackLagMean * 1e6, stats.m_fCallbackLagP99 * 1e6,
+            stats.m_fCallbackLagMax * 1e6);
+    }
+}
+
+int main()
+{
+    SetLogCallback([](const string &log) { });
+
+    SMXManager::g_pSMX = make_shared<SMXManager>([](int pad, const SMXUpdateDetails &details) { });
+
+    SMXSimulatedDeviceOptions options;
+    options.DefaultTiming.fLatency = 0.001;
+    options.DefaultTiming.fJitter = 0.002;
+    options.CommandTiming['2'].fLatency = 0.008;
+    options.CommandTiming['3'].fLatency = 0.008;
+    options.CommandTiming['4'].fLatency = 0.008;
+    options.CommandTiming['G'].fLatency = 0.002;
+    options.CommandTiming['G'].fDropRate = 0.02;
+    shared_ptr<SMXSimulatedDevice> pSim = make_shared<SMXSimulatedDevice>(options);
+    SMXManager::g_pSMX->AddSimulatedDevice(pSim);
+
+    double fStart = GetMonotonicTime();
+    SMXInfo info;
+    do {
+        this_thread::sleep_for(chrono::milliseconds(10));
+        SMXManager::g_pSMX->GetInfo(0, info);
+    } while(!info.m_bConnected && GetMonotonicTime() - fStart < 5);
+    if(!info.m_bConnected)
+    {
+        printf("Simulated device didn't connect\n");
+        return 1;
+    }
+
+    // Only count what we send below.
+    SMXManager::g_pSMX->ResetStats();
+
+    shared_ptr<SMXDevice> pDevice = SMXManager::g_pSMX->GetDevice(0);
+    atomic<int> iConfigReads(0);
+    const int iFrames = 180;
+    char lights[9*25*3] = { };
+    for(int iFrame = 0; iFrame < iFrames; ++iFrame)
+    {
+        // Send lights at 120 FPS, which is faster than the pad's 30 FPS.
+        lights[0] = char(iFrame);
+        const char *apLights[] = { lights };
+        int aiSizes[] = { sizeof(lights) };
+        SMXManager::g_pSMX->SetLights(apLights, aiSizes, 1);
+
+        if(iFrame % 4 == 0)
+            pDevice->SendCommand("G", [&](string response) { iConfigReads++; });
+        if(iFrame % 2 == 0)
+            pSim->SetInputState(iFrame & 2? 0x10:0);
+
+        this_thread::sleep_for(chrono::microseconds(8333));
+    }
+
+    // Wait for the configuration reads, including any that timed out and were resent.
+    fStart = GetMonotonicTime();
+    while(iConfigReads < iFrames / 4 && GetMonotonicTime() - fStart < 10)
+        this_thread::sleep_for(chrono::milliseconds(10));
+
+    SMXStats stats;
+    SMXManager::g_pSMX->GetStats(0, stats);
+    PrintStats(stats);
+
+    // Every 'G' we sent should have finished, and every lights update should have been
+    // either sent or replaced.
+    bool bPassed = stats.m_Commands[3].m_cCommand == 'G' && stats.m_Commands[3].m_iCount == iFrames / 4;
+    int iLightsSent = stats.m_Commands[0].m_iCount + stats.m_iLightsCommandsSkipped;
+    bPassed &= stats.m_iLightsUpdatesReplaced > 0 && iLightsSent > 0;
+
+    SMXStats invalid;
+    bPassed &= !SMXManager::g_pSMX->GetStats(SMXManager::g_pSMX->GetPadCount(), invalid);
+
+    printf("%s\n", bPassed? "PASS":"FAIL");
+
+    pDevice.reset();
+    SMXManager::g_pSMX.reset();
+    return bPassed? 0:1;
+}
@@ -0,0 +1,243 @@
+// Record HID traffic with SMXTrafficRecorder and play it back with SMXReplayTransport.
+//
+// With no arguments, this records a session with a simulated pad: it connects, which reads
+// its configuration, and panels are pressed and released.  The capture is then replayed at
+// its original speed and as fast as possible, and we check that the replays produce the
+// same input events and configuration as the recording, and report how long they took.
+//
+// With a capture file as an argument, every device in it is replayed as fast as possible,
+// and we print what the SDK saw.  This can be used with captures from SMX_StartRecording.
+//
+// Build with "make benchmarks" in sdk/Linux, and run build/benchmarks/Replay.
+
+#include "SMXManager.h"
+#include "SMXDevice.h"
+#include "SMXReplayTransport.h"
+#include "SMXSimulatedDevice.h"
+#include "SMXTrafficCapture.h"
+#include "Helpers.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <set>
+#include <thread>
+#include <vector>
+using namespace std;
+using namespace SMX;
+
+namespace
+{
+    struct Session
+    {
+        double fDuration = 0;
+        vector<SMXInputEvent> aEvents;
+        SMXConfig config;
+        bool bHaveConfig = false;
+    };
+
+    bool WaitForConnection(int pad, double fTimeout)
+    {
+        double fStart = GetMonotonicTime();
+        SMXInfo info;
+        do {
+            this_thread::sleep_for(chrono::milliseconds(1));
+            SMXManager::g_pSMX->GetInfo(pad, info);
+        } while(!info.m_bConnected && GetMonotonicTime() - fStart < fTimeout);
+        return info.m_bConnected;
+    }
+
+    void ReadSession(int pad, Session &session)
+    {
+        SMXInputEvent events[256];
+        int iEvents = SMXManager::g_pSMX->GetDevice(pad)->GetInputEvents(events, 256);
+        session.aEvents.assign(events, events + iEvents);
+        session.bHaveConfig = SMXManager::g_pSMX->GetDevice(pad)->GetConfig(session.config);
+    }
+
+    bool Record(const string &sPath, Session &session)
+    {
+        string sError;
+        shared_ptr<SMXTrafficRecorder> pRecorder = SMXTrafficRecorder::Create(sPath, sError);
+        if(pRecorder == nullptr)
+        {
+            printf("%s\n", sError.c_str());
+            return false;
+        }
+
+        double fStart = GetMonotonicTime();
+        SMXManager::g_pSMX = make_shared<SMXManager>([](int pad, const SMXUpdateDetails &details) { });
+        SMXManager::g_pSMX->SetTrafficRecorder(pRecorder);
+
+        SMXSimulatedDeviceOptions options;
+        options.DefaultTiming.fLatency = 0.002;
+        options.DefaultTiming.fJitter = 0.002;
+        shared_ptr<SMXSimulatedDevice> pSim = make_shared<SMXSimulatedDevice>(options);
+        SMXManager::g_pSMX->AddSimulatedDevice(pSim);
+        if(!WaitForConnection(0, 5))
+        {
+            printf("Simulated device didn't connect\n");
+            return false;
+        }
+
+        // Step on a few panels, with some gaps like a player would leave.
+        for(int i = 0; i < 40; ++i)
+        {
+            pSim->SetInputState(i & 1? 0:(1 << (i % 9)));
+            this_thread::sleep_for(chrono::milliseconds(5 + (i * 7) % 30));
+        }
+
+        // Don't make any SDK calls that send commands here.  The replay doesn't make them,
+        // so it would wait for writes that never come.
+        this_thread::sleep_for(chrono::milliseconds(100));
+
+        ReadSession(0, session);
+        session.fDuration = GetMonotonicTime() - fStart;
+
+        SMXManager::g_pSMX->SetTrafficRecorder(nullptr);
+        SMXManager::g_pSMX.reset();
+        return true;
+    }
+
+    bool Replay(const vector<SMXCapturedReport> &aReports, int iDevice, bool bOriginalSpeed,
+        Session &session, SMXReplayStats &stats)
+    {
+        double fStart = GetMonotonicTime();
+        SMXManager::g_pSMX = make_shared<SMXManager>([](int pad, const SMXUpdateDetails &details) { });
+
+        shared_ptr<SMXReplayTransport> pReplay = make_shared<SMXReplayTransport>(aReports, iDevice, bOriginalSpeed);
+        SMXManager::g_pSMX->AddSimulatedDevice(pReplay);
+
+        // Wait until the whole capture has been read.
+        while(!pReplay->GetStats().bFinished && GetMonotonicTime() - fStart < 60)
+            this_thread::sleep_for(chrono::milliseconds(1));
+        session.fDuration = GetMonotonicTime() - fStart;
+        stats = pReplay->GetStats();
+
+        // Wait for the last reports to be handled, and for the SDK to finish any writes
+        // after them.
+        this_thread::sleep_for(chrono::milliseconds(20));
+        stats = pReplay->GetStats();
+
+        int pad = 0;
+        SMXInfo info;
+        SMXManager::g_pSMX->GetInfo(1, info);
+        if(info.m_bConnected)
+            pad = 1;
+        ReadSession(pad, session);
+
+        SMXManager::g_pSMX.reset();
+        return stats.bFinished;
+    }
+
+    bool SameEvents(const Session &a, const Session &b)
+    {
+        if(a.aEvents.size() != b.aEvents.size())
+            return false;
+        for(size_t i = 0; i < a.aEvents.size(); ++i)
+        {
+            if(a.aEvents[i].m_iPanel != b.aEvents[i].m_iPanel || a.aEvents[i].m_bPressed != b.aEvents[i].m_bPressed)
+                return false;
+        }
+        return true;
+    }
+
+    // Return the mean difference between the time between events in a and in b.
+    double EventTimingError(const Session &a, const Session &b)
+    {
+        if(a.aEvents.size() != b.aEvents.size() || a.aEvents.size() < 2)
+            return 0;
+
+        double fTotal = 0;
+        for(size_t i = 1; i < a.aEvents.size(); ++i)
+        {
+            double fA = a.aEvents[i].m_fTime - a.aEvents[i-1].m_fTime;
+            double fB = b.aEvents[i].m_fTime - b.aEvents[i-1].m_fTime;
+            fTotal += fabs(fA - fB);
+        }
+        return fTotal / (a.aEvents.size() - 1);
+    }
+
+    void PrintReplay(const char *szName, const Session &recorded, const Session &replayed, const SMXReplayStats &stats)
+    {
+        printf("%s: %.3fs, %i reports read, %i written (%i mismatched, %i extra, %i timeouts)\n",
+            szName, replayed.fDuration, stats.iReportsRead, stats.iReportsWritten,
+            stats.iWritesMismatched, stats.iWritesExtra, stats.iWriteTimeouts);
+        printf("  %i input events, %s, time between events differs by %.2f ms on average\n",
+            int(replayed.aEvents.size()), SameEvents(recorded, replayed)? "same as recorded":"DIFFERENT",
+            EventTimingError(recorded, replayed) * 1000);
+    }
+
+    int ReplayFile(const char *szPath)
+    {
+        vector<SMXCapturedReport> aReports;
+        string sError;
+        if(!LoadTrafficCapture(szPath, aReports, sError))
+        {
+            printf("%s\n", sError.c_str());
+            return 1;
+        }
+
+        set<int> devices;
+        for(const SMXCapturedReport &report: aReports)
+            devices.insert(report.iDevice);
+
+        for(int iDevice: devices)
+        {
+            Session session;
+            SMXReplayStats stats;
+            Replay(aReports, iDevice, false, session, stats);
+            printf("device %i: %.3fs, %i reports read, %i written (%i mismatched, %i extra, %i timeouts), %i input events\n",
+                iDevice, session.fDuration, stats.iReportsRead, stats.iReportsWritten, stats.iWritesMismatched,
+                stats.iWritesExtra, stats.iWriteTimeouts, int(session.aEvents.size()));
+        }
+        return 0;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    SetLogCallback([](const string &log) { });
+
+    if(argc > 1)
+        return ReplayFile(argv[1]);
+
+    const string sPath = "/tmp/smx-replay-test.cap";
+    Session recorded;
+    if(!Record(sPath, recorded))
+        return 1;
+
+    vector<SMXCapturedReport> aReports;
+    string sError;
+    if(!LoadTrafficCapture(sPath, aReports, sError))
+    {
+        printf("%s\n", sError.c_str());
+        return 1;
+    }
+
+    FILE *pFile = fopen(sPath.c_str(), "rb");
+    fseek(pFile, 0, SEEK_END);
+    printf("recorded: %.3fs, %i reports, %li bytes, %i input events\n",
+        recorded.fDuration, int(aReports.size()), ftell(pFile), int(recorded.aEvents.size()));
+    fclose(pFile);
+
+    Session original, fast;
+    SMXReplayStats originalStats, fastStats;
+    bool bPassed = Replay(aReports, 0, true, original, originalStats);
+    bPassed &= Replay(aReports, 0, false, fast, fastStats);
+
+    PrintReplay("original speed", recorded, original, originalStats);
+    PrintReplay("maximum speed", recorded, fast, fastStats);
+
+    for(const Session *pSession: { &original, &fast })
+    {
+        bPassed &= SameEvents(recorded, *pSession);
+        bPassed &= pSession->bHaveConfig && !memcmp(&pSession->config, &recorded.config, sizeof(SMXConfig));
+    }
+    for(const SMXReplayStats *pStats: { &originalStats, &fastStats })
+        bPassed &= pStats->iWritesMismatched == 0 && pStats->iWriteTimeouts == 0;
+
+    printf("%s\n", bPassed? "PASS":"FAIL");
+    remove(sPath.c_str());
+    return bPassed? 0:1;
+}
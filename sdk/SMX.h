@@ -4,18 +4,26 @@
 #include <stdint.h>
 #include <stddef.h> // for offsetof
 
+#if defined(_WIN32)
 #ifdef SMX_EXPORTS
 #define SMX_API extern "C" __declspec(dllexport)
 #else
 #define SMX_API extern "C" __declspec(dllimport)
 #endif
+#else
+#define SMX_API extern "C" __attribute__((visibility("default")))
+#endif
 
 struct SMXInfo;
 struct SMXConfig;
-enum SensorTestMode;
-enum PanelTestMode;
-enum SMXUpdateCallbackReason;
+enum SensorTestMode: int;
+enum PanelTestMode: int;
+enum SMXUpdateCallbackReason: int;
 struct SMXSensorTestModeData;
+struct SMXSensorTestSample;
+struct SMXInputEvent;
+struct SMXUpdateDetails;
+struct SMXStats;
 
 // All functions are nonblocking.  Getters will return the most recent state.  Setters will
 // return immediately and do their work in the background.  No functions return errors, and
@@ -31,6 +39,13 @@ struct SMXSensorTestModeData;
 typedef void SMXUpdateCallback(int pad, SMXUpdateCallbackReason reason, void *pUser);
 SMX_API void SMX_Start(SMXUpdateCallback UpdateCallback, void *pUser);
 
+// This is the same as SMX_Start, but UpdateCallback is told what changed.  See SMXUpdateDetails.
+//
+// Changes that happen before the callback for a pad is called are merged into a single
+// callback, so a burst of updates doesn't queue up a backlog of callbacks.
+typedef void SMXUpdateCallback2(int pad, const SMXUpdateDetails *details, void *pUser);
+SMX_API void SMX_Start2(SMXUpdateCallback2 UpdateCallback, void *pUser);
+
 // Shut down and disconnect from all devices.  This will wait for any user callbacks to complete,
 // and no user callbacks will be called after this returns.  This must not be called from within
 // the update callback.
@@ -44,13 +59,35 @@ SMX_API void SMX_SetLogCallback(SMXLogCallback callback);
 // Get info about a pad.  Use this to detect which pads are currently connected.
 SMX_API void SMX_GetInfo(int pad, SMXInfo *info);
 
+// Return the number of pads.  This is always at least 2, for player 1 and player 2.  If more
+// than two controllers are connected, pads are added for them, and this increases.  Pads are
+// never removed, so pads 0 to SMX_GetPadCount()-1 can always be passed to other functions.
+SMX_API int SMX_GetPadCount();
+
+// Return the pad connected with the given serial number, as in SMXInfo::m_Serial, or -1 if
+// no connected pad has that serial.  Use this to keep track of a controller when there are
+// more than two.
+SMX_API int SMX_FindPadBySerial(const char *serial);
+
 // Get a mask of the currently pressed panels.
 SMX_API uint16_t SMX_GetInputState(int pad);
 
+// Read panel presses and releases that have happened on a pad since the last call, oldest
+// first.  Up to maxEvents events are written to events, and the number written is returned.
+// Unlike SMX_GetInputState, this doesn't miss presses that are released before the next
+// poll, and each event has the time the input was received.
+//
+// Up to 256 events are buffered for each pad.  If events aren't read often enough, the
+// oldest events are discarded.
+SMX_API int SMX_GetInputEvents(int pad, SMXInputEvent *events, int maxEvents);
+
+// Return the current time on the clock used by SMXInputEvent::m_fTime, in seconds.
+SMX_API double SMX_GetMonotonicTime();
+
 // (deprecated) Equivalent to SMX_SetLights2(lightsData, 864).
 SMX_API void SMX_SetLights(const char lightData[864]);
 
-// Update the lights.  Both pads are always updated together.  lightData is a list of 8-bit RGB
+// Update the lights on pads 0 and 1.  lightData is a list of 8-bit RGB
 // colors, one for each LED.
 //
 // lightDataSize is the number of bytes in lightsData.  This should be 1350 (2 pads * 9 panels *
@@ -84,6 +121,46 @@ SMX_API void SMX_SetLights(const char lightData[864]);
 // which simply omits lights 16-24.
 SMX_API void SMX_SetLights2(const char *lightData, int lightDataSize);
 
+// This is the same as SMX_SetLights2, but the lights are shown at presentTime, on the same
+// clock as SMX_GetMonotonicTime.  Games can pass the time the frame these lights are for will
+// be displayed, so lights stay in sync with the screen.
+//
+// Lights commands are scheduled from how long each pad has been taking to accept lights, so
+// both pads show the update at about the same time.  The pads show at most 30 updates per
+// second.  If updates are sent more often, an update that's too soon after the previous one is
+// skipped, so a 60 FPS game's lights are shown on every other frame, rather than at whatever
+// time the pad is ready.  If presentTime has already passed, the lights are sent as soon as
+// possible.
+SMX_API void SMX_SetLights3(const char *lightData, int lightDataSize, double presentTime);
+
+// Update the lights on the first numPads pads.  lightData[pad] points to lightDataSize[pad] bytes
+// of lights for that pad, in the same order as one pad's data for SMX_SetLights2: 675 bytes
+// (9 panels * 25 lights * 3 RGB colors), or 432 for the old 4x4-only order.  If lightDataSize[pad]
+// is 0, that pad's lights are left alone.
+//
+// Each pad is paced separately, so a pad that can't keep up doesn't slow down the others.
+SMX_API void SMX_SetLightsForPads(const char *const *lightData, const int *lightDataSize, int numPads);
+
+// This is the same as SMX_SetLightsForPads, but the lights are shown at presentTime.  See
+// SMX_SetLights3.
+SMX_API void SMX_SetLightsForPads2(const char *const *lightData, const int *lightDataSize, int numPads, double presentTime);
+
+// Set the lights on the LED strip around the edge of the first numPads platforms.  Each
+// platform has 44 LEDs, so lightDataSize must be numPads*44*3 bytes: the RGB color of each
+// LED on the first pad, followed by the next pad.  Pads with firmware older than version 4
+// don't have these lights, and are skipped.
+SMX_API void SMX_SetPlatformLightsForPads(const char *lightData, int lightDataSize, int numPads);
+
+// If enabled, lights data that hasn't changed since it was last sent to a pad isn't sent again.
+// Each lights update is sent in several parts, and each part is checked separately, so if only
+// part of the pad changes, only that part is sent.  Unchanged lights are still resent often enough
+// that the pad doesn't return to automatic lighting, so applications should continue to send
+// lights updates continually.
+//
+// This reduces the amount of data sent to the pad when lights aren't changing, such as on
+// menus.  This is disabled by default.
+SMX_API void SMX_SetSkipUnchangedLights(bool skip);
+
 // By default, the panels light automatically when stepped on.  If a lights command is sent by
 // the application, this stops happening to allow the application to fully control lighting.
 // If no lights update is received for a few seconds, automatic lighting is reenabled by the
@@ -116,11 +193,47 @@ SMX_API void SMX_ForceRecalibration(int pad);
 SMX_API void SMX_SetTestMode(int pad, SensorTestMode mode);
 SMX_API bool SMX_GetTestData(int pad, SMXSensorTestModeData *data);
 
+// If enabled, test data for SMX_SetTestMode is requested continuously, as fast as the pad can
+// send it.  Otherwise, test data is requested one response at a time.  This is disabled by
+// default.  Use SMX_GetTestDataHistory to read every sample.
+SMX_API void SMX_SetTestDataStreaming(int pad, bool enable);
+
+// Read test data samples received from a pad since the last call, oldest first.  Up to
+// maxSamples samples are written to samples, and the number written is returned.  If sampleRate
+// isn't null, it's set to the number of samples being received per second.
+//
+// Up to 1024 samples are buffered for each pad.  If samples aren't read often enough, the
+// oldest samples are discarded.
+SMX_API int SMX_GetTestDataHistory(int pad, SMXSensorTestSample *samples, int maxSamples, double *sampleRate);
+
 // Set a panel test mode.  These only appear as debug lighting on the panel and don't
 // return data to us.  Lights can't be updated while a panel test mode is active.
 // This applies to all connected pads.
 SMX_API void SMX_SetPanelTestMode(PanelTestMode mode);
 
+// Get statistics for a pad: command round-trip times, the command queue, lights updates and
+// update callback lag.  These can be used to monitor a pad's health.  Return false if pad
+// isn't a valid pad number.
+//
+// Statistics are kept for each pad from when the SDK starts, including across reconnects,
+// until SMX_ResetStats is called.
+SMX_API bool SMX_GetStats(int pad, SMXStats *stats);
+
+// Reset statistics for all pads.
+SMX_API void SMX_ResetStats();
+
+// Record every HID report sent to and received from the controllers to a file, with the
+// time of each report.  This is opt-in, for capturing problems to send to support.  Return
+// false and set error if the file can't be created.
+//
+// Start recording before controllers are connected if possible, so the capture includes
+// each connection from the start.  Controllers that are already connected are recorded from
+// this point, and can't be replayed until they reconnect.
+SMX_API bool SMX_StartRecording(const char *path, const char **error);
+
+// Stop recording and close the file.
+SMX_API void SMX_StopRecording();
+
 // Return the build version of the DLL, which is based on the git tag at build time.  This
 // is only intended for diagnostic logging, and it's also the version we show in SMXConfig.
 SMX_API const char *SMX_Version();
@@ -141,7 +254,21 @@ struct SMXInfo
     uint16_t m_iFirmwareVersion;
 };
 
-enum SMXUpdateCallbackReason {
+// A panel press or release.  These are returned by SMX_GetInputEvents.
+struct SMXInputEvent
+{
+    // The time the input was received from the controller, in seconds.  This is on the
+    // same clock as SMX_GetMonotonicTime.
+    double m_fTime;
+
+    // The panel that changed, from 0 to 8.
+    int m_iPanel;
+
+    // True if the panel was pressed, false if it was released.
+    bool m_bPressed;
+};
+
+enum SMXUpdateCallbackReason: int {
     // This is called when a generic state change happens: connection or disconnection, inputs changed,
     // test data updated, etc.  It doesn't specify what's changed.  We simply check the whole state.
     SMXUpdateCallback_Updated,
@@ -151,6 +278,111 @@ enum SMXUpdateCallbackReason {
     SMXUpdateCallback_FactoryResetCommandComplete
 };
 
+// Bits for SMXUpdateDetails::m_iChanged.
+enum SMXUpdateFlags {
+    // The input state changed.
+    SMXUpdate_Input = 1 << 0,
+
+    // The pad connected or disconnected, or SMX_GetInfo changed.
+    SMXUpdate_Connection = 1 << 1,
+
+    // The configuration was read from the pad.
+    SMXUpdate_Config = 1 << 2,
+
+    // New test data was received.  See SMX_GetTestData.
+    SMXUpdate_TestData = 1 << 3,
+
+    // A command from SMX_LightsUpload_BeginUpload finished.
+    SMXUpdate_UploadProgress = 1 << 4,
+
+    // SMX_FactoryReset completed, and SMX_GetConfig will now return the reset configuration.
+    SMXUpdate_FactoryResetComplete = 1 << 5,
+};
+
+// This is passed to the SMX_Start2 callback.
+struct SMXUpdateDetails
+{
+    // A mask of SMXUpdateFlags that changed since the last callback for this pad.
+    int m_iChanged;
+
+    // The input state, as returned by SMX_GetInputState.
+    uint16_t m_iInputState;
+
+    // The time of the most recent change, in seconds.  This is on the same clock as
+    // SMX_GetMonotonicTime.
+    double m_fTime;
+
+    // If SMXUpdate_UploadProgress is set, the progress of the upload, from 0 to 100.
+    int m_iUploadProgress;
+};
+
+// Round-trip times for one kind of command.  These are returned in SMXStats.  Times are in
+// seconds, from when we start writing the command to the pad until the pad says it's finished.
+struct SMXCommandStats
+{
+    // The command character, like 'G' for reading the configuration, or '*' for commands
+    // that aren't counted separately.
+    char m_cCommand;
+
+    // The number of commands that finished, and the number that timed out and were resent.
+    int m_iCount;
+    int m_iTimeouts;
+
+    double m_fMin;
+    double m_fMean;
+    double m_fMax;
+
+    // Percentiles.  These are accurate to within about 3%.
+    double m_fP50;
+    double m_fP90;
+    double m_fP99;
+};
+
+// Statistics for a pad, returned by SMX_GetStats.
+struct SMXStats
+{
+    // Command round-trip times.  These are for the lights commands '2', '3' and '4', 'G'
+    // (read configuration), 'W' (write configuration), 'y' (sensor test data), 'm' (panel
+    // animation upload), and all other commands ('*'), in that order.
+    SMXCommandStats m_Commands[8];
+
+    // The number of commands waiting to be sent or waiting for a response, and the most
+    // there have been.
+    int m_iQueuedCommands;
+    int m_iMaxQueuedCommands;
+
+    // Commands discarded because too many were waiting to be sent.
+    int m_iCommandsDropped;
+
+    // Platform lights commands that were replaced by a newer one before they were sent.
+    int m_iCommandsReplaced;
+
+    // Lights updates from SMX_SetLights that were never sent, because updates were arriving
+    // faster than the pad could accept them.  These are replaced by a newer update, or for
+    // updates with a presentation time, skipped in favor of one for an earlier frame.
+    int m_iLightsUpdatesReplaced;
+
+    // Lights commands that weren't sent because they hadn't changed.  See
+    // SMX_SetSkipUnchangedLights.
+    int m_iLightsCommandsSkipped;
+
+    // The time from sending lights commands until the pad acknowledged them, and how much
+    // that varies from one update to the next.  For updates with a presentation time (see
+    // SMX_SetLights3), how far from that time they were acknowledged.
+    double m_fLightsLatencyMean;
+    double m_fLightsLatencyP99;
+    double m_fLightsJitter;
+    double m_fLightsTimingErrorMean;
+    double m_fLightsTimingErrorMax;
+
+    // The number of update callbacks, and the time from a change (SMXUpdateDetails::m_fTime)
+    // until the callback for it was called, in seconds.
+    int m_iCallbacks;
+    double m_fCallbackLagMean;
+    double m_fCallbackLagP99;
+    double m_fCallbackLagMax;
+};
+
 // Bits for SMXConfig::flags.
 enum SMXConfigFlags {
     // If set, panels will use the pressed animation when pressed, and stepColor
@@ -278,7 +510,7 @@ static_assert(offsetof(SMXConfig, padding) == 201, "Incorrect padding alignment"
 static_assert(sizeof(SMXConfig) == 250, "Expected 250 bytes");
 
 // The values (except for Off) correspond with the protocol and must not be changed.
-enum SensorTestMode {
+enum SensorTestMode: int {
     SensorTestMode_Off = 0,
     // Return the raw, uncalibrated value of each sensor.
     SensorTestMode_UncalibratedValues = '0',
@@ -309,9 +541,22 @@ struct SMXSensorTestModeData
     bool iBadJumper[9][4];
 };
 
+// A test data sample.  These are returned by SMX_GetTestDataHistory.
+struct SMXSensorTestSample
+{
+    // The time the sample was received, in seconds.  This is on the same clock as
+    // SMX_GetMonotonicTime.
+    double m_fTime;
+
+    // The SensorTestMode this sample was requested with.
+    SensorTestMode m_Mode;
+
+    SMXSensorTestModeData m_Data;
+};
+
 // The values also correspond with the protocol and must not be changed.
 // These are panel-side diagnostics modes.
-enum PanelTestMode {
+enum PanelTestMode: int {
     PanelTestMode_Off = '0',
     PanelTestMode_PressureTest = '1',
 };
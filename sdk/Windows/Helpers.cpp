@@ -1,6 +1,6 @@
 #include "Helpers.h"
-#include <windows.h>
 #include <algorithm>
+#include <stdexcept>
 using namespace std;
 using namespace SMX;
 
@@ -25,6 +25,122 @@ void SMX::SetLogCallback(function<void(const string &log)> callback)
     g_LogCallback = callback;
 }
 
+string SMX::vssprintf(const char *szFormat, va_list argList)
+{
+    // argList is read twice, so make a copy for the size query.
+    va_list argListCopy;
+    va_copy(argListCopy, argList);
+    int iChars = vsnprintf(NULL, 0, szFormat, argListCopy);
+    va_end(argListCopy);
+    if(iChars == -1)
+        return string("Error formatting string: ") + szFormat;
+
+    string sStr;
+    sStr.resize(iChars+1);
+    vsnprintf((char *) sStr.data(), iChars+1, szFormat, argList);
+    sStr.resize(iChars);
+
+    return sStr;
+}
+
+string SMX::ssprintf(const char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    string sResult = vssprintf(fmt, va);
+    va_end(va);
+    return sResult;
+}
+
+wstring SMX::wssprintf(const wchar_t *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    wstring sResult = wvssprintf(fmt, va);
+    va_end(va);
+    return sResult;
+}
+
+void SMX::StripCrnl(wstring &s)
+{
+    while(s.size() && (s[s.size()-1] == '\r' || s[s.size()-1] == '\n'))
+        s.erase(s.size()-1);
+}
+
+string SMX::BinaryToHex(const void *pData_, int iNumBytes)
+{
+    const unsigned char *pData = (const unsigned char *) pData_;
+    string s;
+    for(int i=0; i<iNumBytes; i++)
+    {
+        unsigned val = pData[i];
+        s += ssprintf("%02x", val);
+    }
+    return s;
+}
+
+string SMX::BinaryToHex(const string &sString)
+{
+    return BinaryToHex(sString.data(), sString.size());
+}
+
+const char *SMX::CreateError(string error)
+{
+    // Store the string in a static so it doesn't get deallocated.
+    static string buf;
+    buf = error;
+    return buf.c_str();
+}
+
+SMX::Mutex::Mutex()
+{
+}
+
+SMX::Mutex::~Mutex()
+{
+}
+
+void SMX::Mutex::Lock()
+{
+    m_Lock.lock();
+    m_iLockedByThread = this_thread::get_id();
+}
+
+void SMX::Mutex::Unlock()
+{
+    m_iLockedByThread = thread::id();
+    m_Lock.unlock();
+}
+
+void SMX::Mutex::AssertNotLockedByCurrentThread()
+{
+    if(m_iLockedByThread == this_thread::get_id())
+        throw runtime_error("Expected to not be locked");
+}
+
+void SMX::Mutex::AssertLockedByCurrentThread()
+{
+    if(m_iLockedByThread != this_thread::get_id())
+        throw runtime_error("Expected to be locked");
+}
+
+SMX::LockMutex::LockMutex(SMX::Mutex &mutex):
+    m_Mutex(mutex)
+{
+    m_Mutex.AssertNotLockedByCurrentThread();
+    m_Mutex.Lock();
+}
+
+SMX::LockMutex::~LockMutex()
+{
+    m_Mutex.AssertLockedByCurrentThread();
+    m_Mutex.Unlock();
+}
+
+// The rest of this file is Windows-specific.  The Linux versions of these are
+// in Linux/HelpersLinux.cpp.
+#ifdef _WIN32
+
 const DWORD MS_VC_EXCEPTION = 0x406D1388;  
 #pragma pack(push,8)  
 typedef struct tagTHREADNAME_INFO  
@@ -36,8 +152,9 @@ typedef struct tagTHREADNAME_INFO
 } THREADNAME_INFO;  
 
 #pragma pack(pop)  
-void SMX::SetThreadName(DWORD iThreadId, const string &name)
+void SMX::SetThreadName(thread &thread, const string &name)
 {
+    DWORD iThreadId = GetThreadId(thread.native_handle());
 
     THREADNAME_INFO info;  
     info.dwType = 0x1000;  
@@ -54,10 +171,9 @@ void SMX::SetThreadName(DWORD iThreadId, const string &name)
 #pragma warning(pop)  
 }  
 
-void SMX::StripCrnl(wstring &s)
+void SMX::SetThreadHighPriority(thread &thread)
 {
-    while(s.size() && (s[s.size()-1] == '\r' || s[s.size()-1] == '\n'))
-        s.erase(s.size()-1);
+    SetThreadPriority(thread.native_handle(), THREAD_PRIORITY_HIGHEST);
 }
 
 wstring SMX::GetErrorString(int err)
@@ -71,30 +187,12 @@ wstring SMX::GetErrorString(int err)
     return sResult;
 }
 
-string SMX::vssprintf(const char *szFormat, va_list argList)
-{
-    int iChars = vsnprintf(NULL, 0, szFormat, argList);
-    if(iChars == -1)
-        return string("Error formatting string: ") + szFormat;
-
-    string sStr;
-    sStr.resize(iChars+1);
-    vsnprintf((char *) sStr.data(), iChars+1, szFormat, argList);
-    sStr.resize(iChars);
-
-    return sStr;
-}
-
-string SMX::ssprintf(const char *fmt, ...)
-{
-    va_list va;
-    va_start(va, fmt);
-    return vssprintf(fmt, va);
-}
-
 wstring SMX::wvssprintf(const wchar_t *szFormat, va_list argList)
 {
-    int iChars = _vsnwprintf(NULL, 0, szFormat, argList);
+    va_list argListCopy;
+    va_copy(argListCopy, argList);
+    int iChars = _vsnwprintf(NULL, 0, szFormat, argListCopy);
+    va_end(argListCopy);
     if(iChars == -1)
         return wstring(L"Error formatting string: ") + szFormat;
 
@@ -106,30 +204,6 @@ wstring SMX::wvssprintf(const wchar_t *szFormat, va_list argList)
     return sStr;
 }
 
-wstring SMX::wssprintf(const wchar_t *fmt, ...)
-{
-    va_list va;
-    va_start(va, fmt);
-    return wvssprintf(fmt, va);
-}
-
-string SMX::BinaryToHex(const void *pData_, int iNumBytes)
-{
-    const unsigned char *pData = (const unsigned char *) pData_;
-    string s;
-    for(int i=0; i<iNumBytes; i++)
-    {
-        unsigned val = pData[i];
-        s += ssprintf("%02x", val);
-    }
-    return s;
-}
-
-string SMX::BinaryToHex(const string &sString)
-{
-    return BinaryToHex(sString.data(), sString.size());
-}
-
 bool SMX::GetRandomBytes(void *pData, int iBytes)
 {
     HCRYPTPROV hCryptProvider = 0;
@@ -237,13 +311,13 @@ void SMX::GenerateRandom(void *pOut, int iSize)
     if(!CryptAcquireContext(&cryptProv, nullptr,
         L"Microsoft Base Cryptographic Provider v1.0",
         PROV_RSA_FULL, CRYPT_VERIFYCONTEXT))
-        throw exception("CryptAcquireContext error");
+        throw runtime_error("CryptAcquireContext error");
 
     if(!CryptGenRandom(cryptProv, iSize, (BYTE *) pOut)) 
-        throw exception("CryptGenRandom error");
+        throw runtime_error("CryptGenRandom error");
 
     if(!CryptReleaseContext(cryptProv, 0))
-        throw exception("CryptReleaseContext error");
+        throw runtime_error("CryptReleaseContext error");
 }
 
 string SMX::WideStringToUTF8(wstring s)
@@ -260,14 +334,6 @@ string SMX::WideStringToUTF8(wstring s)
     return ret;
 }
 
-const char *SMX::CreateError(string error)
-{
-    // Store the string in a static so it doesn't get deallocated.
-    static string buf;
-    buf = error;
-    return buf.c_str();
-}
-
 SMX::AutoCloseHandle::AutoCloseHandle(HANDLE h)
 {
     handle = h;
@@ -279,51 +345,58 @@ SMX::AutoCloseHandle::~AutoCloseHandle()
         CloseHandle(handle);
 }
 
-SMX::Mutex::Mutex()
+bool SMX::MappedFile::Open(const string &sPath, string &sError)
 {
-    m_hLock = CreateMutex(NULL, false, NULL);
-}
+    Close();
 
-SMX::Mutex::~Mutex()
-{
-    CloseHandle(m_hLock);
-}
+    // Paths are UTF-8.
+    wstring sWidePath(MultiByteToWideChar(CP_UTF8, 0, sPath.data(), (int) sPath.size(), NULL, 0), 0);
+    MultiByteToWideChar(CP_UTF8, 0, sPath.data(), (int) sPath.size(), &sWidePath[0], (int) sWidePath.size());
 
-void SMX::Mutex::Lock()
-{
-    WaitForSingleObject(m_hLock, INFINITE);
-    m_iLockedByThread = GetCurrentThreadId();
-}
+    AutoCloseHandle hFile(CreateFileW(sWidePath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL));
+    if(hFile.value() == INVALID_HANDLE_VALUE)
+    {
+        sError = ssprintf("Couldn't open %s: %s", sPath.c_str(), WideStringToUTF8(GetErrorString(GetLastError())).c_str());
+        return false;
+    }
 
-void SMX::Mutex::Unlock()
-{
-    m_iLockedByThread = 0;
-    ReleaseMutex(m_hLock);
-}
+    LARGE_INTEGER iSize;
+    if(!GetFileSizeEx(hFile.value(), &iSize))
+    {
+        sError = ssprintf("Couldn't read %s: %s", sPath.c_str(), WideStringToUTF8(GetErrorString(GetLastError())).c_str());
+        return false;
+    }
 
-void SMX::Mutex::AssertNotLockedByCurrentThread()
-{
-    if(m_iLockedByThread == GetCurrentThreadId())
-        throw exception("Expected to not be locked");
-}
+    // Empty files can't be mapped.
+    if(iSize.QuadPart == 0)
+        return true;
 
-void SMX::Mutex::AssertLockedByCurrentThread()
-{
-    if(m_iLockedByThread != GetCurrentThreadId())
-        throw exception("Expected to be locked");
-}
+    // The view keeps the mapping open, so we don't need to keep the handles.
+    HANDLE hMapping = CreateFileMapping(hFile.value(), NULL, PAGE_READONLY, 0, 0, NULL);
+    if(hMapping == NULL)
+    {
+        sError = ssprintf("Couldn't map %s: %s", sPath.c_str(), WideStringToUTF8(GetErrorString(GetLastError())).c_str());
+        return false;
+    }
 
-SMX::LockMutex::LockMutex(SMX::Mutex &mutex):
-    m_Mutex(mutex)
-{
-    m_Mutex.AssertNotLockedByCurrentThread();
-    m_Mutex.Lock();
+    m_pData = (const uint8_t *) MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(hMapping);
+    if(m_pData == nullptr)
+    {
+        sError = ssprintf("Couldn't map %s: %s", sPath.c_str(), WideStringToUTF8(GetErrorString(GetLastError())).c_str());
+        return false;
+    }
+
+    m_iSize = (size_t) iSize.QuadPart;
+    return true;
 }
 
-SMX::LockMutex::~LockMutex()
+void SMX::MappedFile::Close()
 {
-    m_Mutex.AssertLockedByCurrentThread();
-    m_Mutex.Unlock();
+    if(m_pData != nullptr)
+        UnmapViewOfFile(m_pData);
+    m_pData = nullptr;
+    m_iSize = 0;
 }
 
 // This is a helper to let the config tool open a window, which has no freopen.
@@ -335,3 +408,5 @@ extern "C" __declspec(dllexport) void SMX_Internal_OpenConsole()
     freopen("CONOUT$","wb", stderr);
     AttachConsole(ATTACH_PARENT_PROCESS);
 }
+
+#endif
@@ -3,12 +3,30 @@
 
 #include <string>
 #include <stdarg.h>
-#include <windows.h>
+#include <stdint.h>
+#include <string.h>
 #include <functional>
 #include <memory>
 #include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 using namespace std;
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+// On Linux, handles are file descriptors.
+typedef int HANDLE;
+#define INVALID_HANDLE_VALUE (-1)
+#endif
+
+// SMX_SSE2 is defined if SSE2 can be used without checking for it at runtime.  It's always
+// available on x64, and on x86 if the compiler is targetting it.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SMX_SSE2
+#endif
+
 namespace SMX
 {
 void Log(string s);
@@ -18,7 +36,8 @@ void Log(wstring s);
 // to stdout.
 void SetLogCallback(function<void(const string &log)> callback);
 
-void SetThreadName(DWORD iThreadId, const string &name);
+void SetThreadName(thread &thread, const string &name);
+void SetThreadHighPriority(thread &thread);
 void StripCrnl(wstring &s);
 wstring GetErrorString(int err);
 string vssprintf(const char *szFormat, va_list argList);
@@ -67,7 +86,7 @@ weak_ptr<T> GetPointers(shared_ptr<T> &pSharedPtr, T *pObj)
 template<typename T, class... Args>
 shared_ptr<T> CreateObj(Args&&... args)
 {
-    shared_ptr<typename T> pResult;
+    shared_ptr<T> pResult;
     new T(pResult, std::forward<Args>(args)...);
     return dynamic_pointer_cast<T>(pResult);
 }
@@ -85,6 +104,27 @@ private:
     HANDLE handle;
 };
 
+// A read-only memory mapping of a whole file.
+class MappedFile
+{
+public:
+    MappedFile() { }
+    ~MappedFile() { Close(); }
+
+    // Map the file.  Return false and set sError on error.
+    bool Open(const string &sPath, string &sError);
+    void Close();
+
+    const uint8_t *data() const { return m_pData; }
+    size_t size() const { return m_iSize; }
+
+private:
+    MappedFile(const MappedFile &rhs);
+    MappedFile &operator=(const MappedFile &rhs);
+    const uint8_t *m_pData = nullptr;
+    size_t m_iSize = 0;
+};
+
 class Mutex
 {
 public:
@@ -97,8 +137,8 @@ public:
     void AssertLockedByCurrentThread();
 
 private:
-    HANDLE m_hLock = INVALID_HANDLE_VALUE;
-    DWORD m_iLockedByThread = 0;
+    recursive_mutex m_Lock;
+    thread::id m_iLockedByThread;
 };
 
 // A local lock helper for Mutex.
@@ -119,32 +159,40 @@ public:
     Event(Mutex &lock):
         m_Lock(lock)
     {
-        m_hEvent = make_shared<AutoCloseHandle>(CreateEvent(NULL, false, false, NULL));
     }
 
     void Set()
     {
-        SetEvent(m_hEvent->value());
+        lock_guard<mutex> L(m_SignalLock);
+        m_bSignalled = true;
+        m_Signal.notify_one();
     }
 
     // Unlock m_Lock, wait up to iDelayMilliseconds for the event to be set,
     // then lock m_Lock.  If iDelayMilliseconds is -1, wait forever.
     void Wait(int iDelayMilliseconds)
     {
-        if(iDelayMilliseconds == -1)
-            iDelayMilliseconds = INFINITE;
-
         m_Lock.AssertLockedByCurrentThread();
 
         m_Lock.Unlock();
-        vector<HANDLE> aHandles = { m_hEvent->value() };
-        WaitForSingleObjectEx(m_hEvent->value(), iDelayMilliseconds, true);
+        {
+            // This is an auto-reset event: a Set() before we wait wakes us immediately,
+            // and we clear the signal when we wake up.
+            unique_lock<mutex> L(m_SignalLock);
+            if(iDelayMilliseconds == -1)
+                m_Signal.wait(L, [this] { return m_bSignalled; });
+            else
+                m_Signal.wait_for(L, chrono::milliseconds(iDelayMilliseconds), [this] { return m_bSignalled; });
+            m_bSignalled = false;
+        }
         m_Lock.Lock();
     }
 
 private:
-    shared_ptr<SMX::AutoCloseHandle> m_hEvent;
     Mutex &m_Lock;
+    mutex m_SignalLock;
+    condition_variable m_Signal;
+    bool m_bSignalled = false;
 };
 
 }
@@ -1,16 +1,17 @@
 // This implements the public API.
 
-#include <windows.h>
 #include <memory>
 
 #include "../SMX.h"
 #include "SMXManager.h"
 #include "SMXDevice.h"
+#include "SMXTrafficCapture.h"
 #include "SMXBuildVersion.h"
 #include "SMXPanelAnimation.h" // for SMX_LightsAnimation_SetAuto
 using namespace std;
 using namespace SMX;
 
+#ifdef _WIN32
 BOOL APIENTRY DllMain(HMODULE hModule, DWORD  ul_reason_for_call, LPVOID lpReserved)
 {
     switch(ul_reason_for_call)
@@ -23,6 +24,7 @@ BOOL APIENTRY DllMain(HMODULE hModule, DWORD  ul_reason_for_call, LPVOID lpReser
     }
     return TRUE;
 }
+#endif
 
 // DLL interface:
 SMX_API void SMX_Start(SMXUpdateCallback callback, void *pUser)
@@ -32,14 +34,32 @@ SMX_API void SMX_Start(SMXUpdateCallback callback, void *pUser)
 
     // The C++ interface takes a std::function, which doesn't need a user pointer.  We add
     // one for the C interface for convenience.
-    auto UpdateCallback = [callback, pUser](int pad, SMXUpdateCallbackReason reason) {
-        callback(pad, reason, pUser);
+    //
+    // This callback doesn't say what changed, so send SMXUpdateCallback_Updated for anything
+    // other than a factory reset completing.
+    auto UpdateCallback = [callback, pUser](int pad, const SMXUpdateDetails &details) {
+        if(details.m_iChanged & ~SMXUpdate_FactoryResetComplete)
+            callback(pad, SMXUpdateCallback_Updated, pUser);
+        if(details.m_iChanged & SMXUpdate_FactoryResetComplete)
+            callback(pad, SMXUpdateCallback_FactoryResetCommandComplete, pUser);
     };
 
     // Log(ssprintf("Struct sizes (native): %i %i %i\n", sizeof(SMXConfig), sizeof(SMXInfo), sizeof(SMXSensorTestModeData)));
     SMXManager::g_pSMX = make_shared<SMXManager>(UpdateCallback);
 }
 
+SMX_API void SMX_Start2(SMXUpdateCallback2 callback, void *pUser)
+{
+    if(SMXManager::g_pSMX != NULL)
+        return;
+
+    auto UpdateCallback = [callback, pUser](int pad, const SMXUpdateDetails &details) {
+        callback(pad, &details, pUser);
+    };
+
+    SMXManager::g_pSMX = make_shared<SMXManager>(UpdateCallback);
+}
+
 SMX_API void SMX_Stop()
 {
     // If lights animation is running, shut it down first.
@@ -56,51 +76,160 @@ SMX_API void SMX_SetLogCallback(SMXLogCallback callback)
     });
 }
 
-SMX_API bool SMX_GetConfig(int pad, SMXConfig *config) { return SMXManager::g_pSMX->GetDevice(pad)->GetConfig(*config); }
-SMX_API void SMX_SetConfig(int pad, const SMXConfig *config) { SMXManager::g_pSMX->GetDevice(pad)->SetConfig(*config); }
-SMX_API void SMX_GetInfo(int pad, SMXInfo *info) { SMXManager::g_pSMX->GetDevice(pad)->GetInfo(*info); }
-SMX_API uint16_t SMX_GetInputState(int pad) { return SMXManager::g_pSMX->GetDevice(pad)->GetInputState(); }
-SMX_API void SMX_FactoryReset(int pad) { SMXManager::g_pSMX->GetDevice(pad)->FactoryReset(); }
-SMX_API void SMX_ForceRecalibration(int pad) { SMXManager::g_pSMX->GetDevice(pad)->ForceRecalibration(); }
-SMX_API void SMX_SetTestMode(int pad, SensorTestMode mode) { SMXManager::g_pSMX->GetDevice(pad)->SetSensorTestMode(mode); }
-SMX_API bool SMX_GetTestData(int pad, SMXSensorTestModeData *data) { return SMXManager::g_pSMX->GetDevice(pad)->GetTestData(*data); }
+namespace
+{
+    // Return the device for pad, or null if pad isn't a valid pad, eg. -1 from
+    // SMX_FindPadBySerial.
+    shared_ptr<SMXDevice> GetDevice(int pad)
+    {
+        return SMXManager::g_pSMX->GetDevice(pad);
+    }
+}
+
+SMX_API bool SMX_GetConfig(int pad, SMXConfig *config)
+{
+    shared_ptr<SMXDevice> pDevice = GetDevice(pad);
+    return pDevice && pDevice->GetConfig(*config);
+}
+
+SMX_API void SMX_SetConfig(int pad, const SMXConfig *config)
+{
+    if(shared_ptr<SMXDevice> pDevice = GetDevice(pad))
+        pDevice->SetConfig(*config);
+}
+
+SMX_API void SMX_GetInfo(int pad, SMXInfo *info) { SMXManager::g_pSMX->GetInfo(pad, *info); }
+SMX_API int SMX_GetPadCount() { return SMXManager::g_pSMX->GetPadCount(); }
+SMX_API int SMX_FindPadBySerial(const char *serial) { return SMXManager::g_pSMX->FindPadBySerial(serial); }
+SMX_API uint16_t SMX_GetInputState(int pad) { return SMXManager::g_pSMX->GetInputState(pad); }
+
+SMX_API int SMX_GetInputEvents(int pad, SMXInputEvent *events, int maxEvents)
+{
+    shared_ptr<SMXDevice> pDevice = GetDevice(pad);
+    return pDevice? pDevice->GetInputEvents(events, maxEvents):0;
+}
+
+SMX_API double SMX_GetMonotonicTime() { return SMX::GetMonotonicTime(); }
+
+SMX_API void SMX_FactoryReset(int pad)
+{
+    if(shared_ptr<SMXDevice> pDevice = GetDevice(pad))
+        pDevice->FactoryReset();
+}
+
+SMX_API void SMX_ForceRecalibration(int pad)
+{
+    if(shared_ptr<SMXDevice> pDevice = GetDevice(pad))
+        pDevice->ForceRecalibration();
+}
+
+SMX_API void SMX_SetTestMode(int pad, SensorTestMode mode)
+{
+    if(shared_ptr<SMXDevice> pDevice = GetDevice(pad))
+        pDevice->SetSensorTestMode(mode);
+}
+
+SMX_API bool SMX_GetTestData(int pad, SMXSensorTestModeData *data)
+{
+    shared_ptr<SMXDevice> pDevice = GetDevice(pad);
+    return pDevice && pDevice->GetTestData(*data);
+}
+
+SMX_API void SMX_SetTestDataStreaming(int pad, bool enable)
+{
+    if(shared_ptr<SMXDevice> pDevice = GetDevice(pad))
+        pDevice->SetSensorTestStreaming(enable);
+}
+
+SMX_API int SMX_GetTestDataHistory(int pad, SMXSensorTestSample *samples, int maxSamples, double *sampleRate)
+{
+    shared_ptr<SMXDevice> pDevice = GetDevice(pad);
+    return pDevice? pDevice->GetTestDataHistory(samples, maxSamples, sampleRate):0;
+}
+
 SMX_API void SMX_SetPanelTestMode(PanelTestMode mode) { SMXManager::g_pSMX->SetPanelTestMode(mode); }
+SMX_API bool SMX_GetStats(int pad, SMXStats *stats) { return SMXManager::g_pSMX->GetStats(pad, *stats); }
+SMX_API void SMX_ResetStats() { SMXManager::g_pSMX->ResetStats(); }
+SMX_API void SMX_StopRecording() { SMXManager::g_pSMX->SetTrafficRecorder(nullptr); }
+
+SMX_API bool SMX_StartRecording(const char *path, const char **error)
+{
+    string sError;
+    shared_ptr<SMXTrafficRecorder> pRecorder = SMXTrafficRecorder::Create(path, sError);
+    if(pRecorder == nullptr)
+    {
+        *error = CreateError(sError);
+        return false;
+    }
+
+    SMXManager::g_pSMX->SetTrafficRecorder(pRecorder);
+    return true;
+}
 
 SMX_API void SMX_SetLights(const char lightData[864])
 {
     SMX_SetLights2(lightData, 864);
 }
 SMX_API void SMX_SetLights2(const char *lightData, int lightDataSize)
+{
+    SMX_SetLights3(lightData, lightDataSize, 0);
+}
+SMX_API void SMX_SetLights3(const char *lightData, int lightDataSize, double presentTime)
 {
     // The lightData into data per pad depending on whether we've been
-    // given 16 or 25 lights of data.
-    string lights[2];
+    // given 16 or 25 lights of data.  Pass it through without copying it.
     const int BytesPerPad16 = 9*16*3;
     const int BytesPerPad25 = 9*25*3;
+    int iBytesPerPad;
     if(lightDataSize == 2*BytesPerPad16)
-    {
-        lights[0] = string(lightData, BytesPerPad16);
-        lights[1] = string(lightData + BytesPerPad16, BytesPerPad16);
-    }
+        iBytesPerPad = BytesPerPad16;
     else if(lightDataSize == 2*BytesPerPad25)
-    {
-        lights[0] = string(lightData, BytesPerPad25);
-        lights[1] = string(lightData + BytesPerPad25, BytesPerPad25);
-    }
+        iBytesPerPad = BytesPerPad25;
     else
     {
-        Log(ssprintf("SMX_SetLights2: lightDataSize is invalid (must be %i or %i)\n",
-            2*BytesPerPad16, 2*BytesPerPad25));
+        Log(ssprintf("SMX_SetLights3: lightDataSize is invalid (must be %i or %i, received %i)\n",
+            2*BytesPerPad16, 2*BytesPerPad25, lightDataSize));
         return;
     }
 
-    SMXManager::g_pSMX->SetLights(lights);
+    const char *pLights[2] = { lightData, lightData + iBytesPerPad };
+    const int iLightsSize[2] = { iBytesPerPad, iBytesPerPad };
+    SMXManager::g_pSMX->SetLights(pLights, iLightsSize, 2, presentTime);
 
     // If we're running auto animations, stop them when we get an API call to set lights.
     SMXAutoPanelAnimations::TemporaryStopAnimating();
 }
 
-// This is internal for SMXConfig.  These lights aren't meant to be animated.
+SMX_API void SMX_SetLightsForPads(const char *const *lightData, const int *lightDataSize, int numPads)
+{
+    SMX_SetLightsForPads2(lightData, lightDataSize, numPads, 0);
+}
+SMX_API void SMX_SetLightsForPads2(const char *const *lightData, const int *lightDataSize, int numPads, double presentTime)
+{
+    SMXManager::g_pSMX->SetLights(lightData, lightDataSize, numPads, presentTime);
+
+    // If we're running auto animations, stop them when we get an API call to set lights.
+    SMXAutoPanelAnimations::TemporaryStopAnimating();
+}
+
+SMX_API void SMX_SetPlatformLightsForPads(const char *lightData, int lightDataSize, int numPads)
+{
+    const int BytesPerPad = 44*3;
+    if(numPads < 0 || lightDataSize != numPads*BytesPerPad)
+    {
+        Log(ssprintf("SMX_SetPlatformLightsForPads: lightDataSize is invalid (must be %i for %i pads, received %i)\n",
+            max(numPads, 0)*BytesPerPad, numPads, lightDataSize));
+        return;
+    }
+
+    vector<string> lights(numPads);
+    for(int pad = 0; pad < numPads; ++pad)
+        lights[pad] = string(lightData + pad*BytesPerPad, BytesPerPad);
+    SMXManager::g_pSMX->SetPlatformLights(lights.data(), numPads);
+}
+
+// This is internal for SMXConfig, which only handles two pads.  These lights aren't meant
+// to be animated.
 SMX_API void SMX_SetPlatformLights(const char lightData[88*3], int lightDataSize)
 {
     if(lightDataSize != 88*3)
@@ -110,12 +239,10 @@ SMX_API void SMX_SetPlatformLights(const char lightData[88*3], int lightDataSize
         return;
     }
 
-    string lights[2];
-    lights[0] = string(lightData, 44*3);
-    lights[1] = string(lightData + 44*3, 44*3);
-    SMXManager::g_pSMX->SetPlatformLights(lights);
+    SMX_SetPlatformLightsForPads(lightData, lightDataSize, 2);
 }
 
+SMX_API void SMX_SetSkipUnchangedLights(bool skip) { SMXManager::g_pSMX->SetSkipUnchangedLights(skip); }
 SMX_API void SMX_ReenableAutoLights() { SMXManager::g_pSMX->ReenableAutoLights(); }
 SMX_API const char *SMX_Version() { return SMX_BUILD_VERSION; }
 
@@ -1,6 +1,7 @@
 #include "SMXConfigPacket.h"
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 
 // The config packet format changed in version 5.  This handles compatibility with
 // the old configuration packet.  The config packet in SMX.h matches the new format.
@@ -119,13 +120,14 @@ void ConvertToNewConfig(const vector<uint8_t> &oldConfigData, SMXConfig &newConf
 // config format and not the new one will be left unchanged.
 void ConvertToOldConfig(const SMXConfig &newConfig, vector<uint8_t> &oldConfigData)
 {
-    OldSMXConfig &oldConfig = (OldSMXConfig &) *oldConfigData.data();
-
     // We don't need to check configVersion here.  It's safe to set all fields in
-    // the output config packet.  If oldConfigData isn't 128 bytes, extend it.
+    // the output config packet.  If oldConfigData isn't 128 bytes, extend it.  Do this
+    // before taking a reference to the data, since resizing can reallocate it.
     if(oldConfigData.size() < 128)
         oldConfigData.resize(128, 0xFF);
 
+    OldSMXConfig &oldConfig = (OldSMXConfig &) *oldConfigData.data();
+
     oldConfig.masterDebounceMilliseconds = newConfig.debounceNodelayMilliseconds;
 
     oldConfig.panelThreshold7Low = newConfig.panelSettings[7].loadCellLowThreshold;
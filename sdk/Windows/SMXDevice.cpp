@@ -3,54 +3,25 @@
 #include "../SMX.h"
 #include "Helpers.h"
 #include "SMXDeviceConnection.h"
-#include "SMXDeviceSearch.h"
+#include "SMXTransport.h"
 #include "SMXConfigPacket.h"
-#include <windows.h>
+#include "SMXSensorTestData.h"
 #include <memory>
 #include <vector>
 #include <map>
+#include <algorithm>
 using namespace std;
 using namespace SMX;
 
-// Extract test data for panel iPanel.
-static void ReadDataForPanel(const vector<uint16_t> &data, int iPanel, void *pOut, int iOutSize)
+shared_ptr<SMXDevice> SMX::SMXDevice::Create(shared_ptr<SMXIOWaiter> pWaiter, Mutex &lock)
 {
-    int m_iBit = 0;
-
-    uint8_t *p = (uint8_t *) pOut;
-
-    // Read each byte.
-    for(int i = 0; i < iOutSize; ++i)
-    {
-        // Read each bit in this byte.
-        uint8_t result = 0;
-        for(int j = 0; j < 8; ++j)
-        {
-            bool bit = false;
-
-            if(m_iBit < data.size())
-            {
-                bit = data[m_iBit] & (1 << iPanel);
-                m_iBit++;
-            }
-
-            result |= bit << j;
-        }
-
-        *p++ = result;
-    }
+    return CreateObj<SMXDevice>(pWaiter, lock);
 }
 
-
-shared_ptr<SMXDevice> SMX::SMXDevice::Create(shared_ptr<AutoCloseHandle> hEvent, Mutex &lock)
-{
-    return CreateObj<SMXDevice>(hEvent, lock);
-}
-
-SMX::SMXDevice::SMXDevice(shared_ptr<SMXDevice> &pSelf, shared_ptr<AutoCloseHandle> hEvent, Mutex &lock):
-    m_pSelf(GetPointers(pSelf, this)),
-    m_hEvent(hEvent),
-    m_Lock(lock)
+SMX::SMXDevice::SMXDevice(shared_ptr<SMXDevice> &pSelf, shared_ptr<SMXIOWaiter> pWaiter, Mutex &lock):
+    m_pWaiter(pWaiter),
+    m_Lock(lock),
+    m_pSelf(GetPointers(pSelf, this))
 {
     m_pConnection = SMXDeviceConnection::Create();
 }
@@ -59,10 +30,19 @@ SMX::SMXDevice::~SMXDevice()
 {
 }
 
-bool SMX::SMXDevice::OpenDeviceHandle(shared_ptr<AutoCloseHandle> pHandle, wstring &sError)
+bool SMX::SMXDevice::OpenDevice(shared_ptr<SMXTransport> pTransport, wstring &sError)
 {
     m_Lock.AssertLockedByCurrentThread();
-    return m_pConnection->Open(pHandle, sError);
+
+    // If the transport receives data from another thread, it'll wake up the communications
+    // thread with this.
+    shared_ptr<SMXIOWaiter> pWaiter = m_pWaiter;
+    pTransport->SetWakeupCallback([pWaiter] {
+        if(pWaiter)
+            pWaiter->Wake();
+    });
+
+    return m_pConnection->Open(pTransport, sError);
 }
 
 void SMX::SMXDevice::CloseDevice()
@@ -75,17 +55,23 @@ void SMX::SMXDevice::CloseDevice()
     m_bSendingConfig = false;
     m_bWaitingForConfigResponse = false;
 
-    CallUpdateCallback(SMXUpdateCallback_Updated);
+    CallUpdateCallback(SMXUpdate_Connection);
 }
 
-shared_ptr<AutoCloseHandle> SMX::SMXDevice::GetDeviceHandle() const
+shared_ptr<SMXTransport> SMX::SMXDevice::GetTransport() const
 {
-    return m_pConnection->GetDeviceHandle();
+    return m_pConnection->GetTransport();
 }
 
-void SMX::SMXDevice::SetUpdateCallback(function<void(int PadNumber, SMXUpdateCallbackReason reason)> pCallback)
+void SMX::SMXDevice::SetUpdateCallback(function<void(int PadNumber, int iChanged)> pCallback)
 {
     LockMutex Lock(m_Lock);
+    SetUpdateCallbackLocked(pCallback);
+}
+
+void SMX::SMXDevice::SetUpdateCallbackLocked(function<void(int PadNumber, int iChanged)> pCallback)
+{
+    m_Lock.AssertLockedByCurrentThread();
     m_pUpdateCallback = pCallback;
 }
 
@@ -104,13 +90,18 @@ bool SMX::SMXDevice::IsConnectedLocked() const
     return m_pConnection->IsConnectedWithDeviceInfo() && m_bHaveConfig;
 }
 
-void SMX::SMXDevice::SendCommand(string cmd, function<void(string response)> pComplete)
+void SMX::SMXDevice::SendCommand(const string &cmd, function<void(string response)> pComplete, CommandPriority priority)
 {
     LockMutex Lock(m_Lock);
-    SendCommandLocked(cmd, pComplete);
+    SendCommandLocked(cmd, pComplete, priority);
+}
+
+void SMX::SMXDevice::SendCommandLocked(const string &cmd, function<void(string response)> pComplete, CommandPriority priority)
+{
+    SendCommandLocked(cmd.data(), cmd.size(), pComplete, priority);
 }
 
-void SMX::SMXDevice::SendCommandLocked(string cmd, function<void(string response)> pComplete)
+void SMX::SMXDevice::SendCommandLocked(const char *pCmd, int iSize, function<void(string response)> pComplete, CommandPriority priority)
 {
     m_Lock.AssertLockedByCurrentThread();
 
@@ -123,11 +114,46 @@ void SMX::SMXDevice::SendCommandLocked(string cmd, function<void(string response
     }
 
     // This call is nonblocking, so it's safe to do this in the UI thread.
-    m_pConnection->SendCommand(cmd, pComplete);
+    m_pConnection->SendCommand(pCmd, iSize, pComplete, priority);
 
     // Wake up the communications thread to send the message.
-    if(m_hEvent)
-        SetEvent(m_hEvent->value());
+    if(m_pWaiter)
+        m_pWaiter->Wake();
+}
+
+void SMX::SMXDevice::SendBulkCommands(const vector<string> &asCommands, function<void(int iCommand)> pComplete)
+{
+    LockMutex Lock(m_Lock);
+
+    auto pBulk = make_shared<BulkCommands>();
+    pBulk->m_asCommands = asCommands;
+    pBulk->m_pComplete = pComplete;
+    QueueBulkCommands(pBulk);
+}
+
+// Queue as many of pBulk's remaining commands as the bulk queue has room for.  This is called
+// again as each one finishes.
+void SMX::SMXDevice::QueueBulkCommands(shared_ptr<BulkCommands> pBulk)
+{
+    m_Lock.AssertLockedByCurrentThread();
+
+    // If we're not connected, commands complete as soon as they're sent, which calls us
+    // again.  The loop below is already sending the rest, so don't recurse.
+    if(pBulk->m_bQueueing)
+        return;
+    pBulk->m_bQueueing = true;
+
+    while(pBulk->m_iNext < pBulk->m_asCommands.size() &&
+        (!m_pConnection->IsConnected() || m_pConnection->GetQueueSpace(CommandPriority_Bulk) > 0))
+    {
+        int iCommand = int(pBulk->m_iNext++);
+        SendCommandLocked(pBulk->m_asCommands[iCommand], [this, pBulk, iCommand](string response) {
+            pBulk->m_pComplete(iCommand);
+            QueueBulkCommands(pBulk);
+        }, CommandPriority_Bulk);
+    }
+
+    pBulk->m_bQueueing = false;
 }
 
 void SMX::SMXDevice::GetInfo(SMXInfo &info)
@@ -188,14 +214,48 @@ void SMX::SMXDevice::SetConfig(const SMXConfig &newConfig)
     LockMutex Lock(m_Lock);
     wanted_config = newConfig;
     m_bSendConfig = true;
+
+    // Wake up the communications thread to send it.
+    if(m_pWaiter)
+        m_pWaiter->Wake();
 }
 
 uint16_t SMX::SMXDevice::GetInputState() const
 {
     LockMutex Lock(m_Lock);
+    return GetInputStateLocked();
+}
+
+uint16_t SMX::SMXDevice::GetInputStateLocked() const
+{
+    m_Lock.AssertLockedByCurrentThread();
     return m_pConnection->GetInputState();
 }
 
+void SMX::SMXDevice::GetStatsLocked(SMXStats &stats) const
+{
+    m_Lock.AssertLockedByCurrentThread();
+    m_pConnection->GetStats(stats);
+}
+
+void SMX::SMXDevice::ResetStatsLocked()
+{
+    m_Lock.AssertLockedByCurrentThread();
+    m_pConnection->ResetStats();
+}
+
+void SMX::SMXDevice::SetTrafficRecorderLocked(shared_ptr<SMXTrafficRecorder> pRecorder, int iDevice)
+{
+    m_Lock.AssertLockedByCurrentThread();
+    m_pConnection->SetTrafficRecorder(pRecorder, iDevice);
+}
+
+int SMX::SMXDevice::GetInputEvents(SMXInputEvent *pEvents, int iMaxEvents)
+{
+    LockMutex Lock(m_InputEventsLock);
+    return m_pConnection->GetInputEvents(pEvents, iMaxEvents);
+}
+
 void SMX::SMXDevice::FactoryReset()
 {
     // Send a factory reset command, and then read the new configuration.
@@ -229,7 +289,7 @@ void SMX::SMXDevice::FactoryReset()
             SendCommandLocked(sLightCommand);
         }
 
-        CallUpdateCallback(SMXUpdateCallback_FactoryResetCommandComplete);
+        CallUpdateCallback(SMXUpdate_Config | SMXUpdate_FactoryResetComplete);
     });
 }
 
@@ -243,6 +303,33 @@ void SMX::SMXDevice::SetSensorTestMode(SensorTestMode mode)
 {
     LockMutex Lock(m_Lock);
     m_SensorTestMode = mode;
+
+    if(m_pWaiter)
+        m_pWaiter->Wake();
+}
+
+void SMX::SMXDevice::SetSensorTestStreaming(bool bStreaming)
+{
+    LockMutex Lock(m_Lock);
+    m_bSensorTestStreaming = bStreaming;
+
+    if(m_pWaiter)
+        m_pWaiter->Wake();
+}
+
+int SMX::SMXDevice::GetTestDataHistory(SMXSensorTestSample *pSamples, int iMaxSamples, double *pfSampleRate)
+{
+    LockMutex Lock(m_TestDataHistoryLock);
+
+    if(pfSampleRate)
+    {
+        // If we haven't received anything for a while, we're not receiving samples anymore.
+        double fLastSampleAt = m_fLastTestDataSampleAt.load();
+        bool bStale = GetMonotonicTime() - fLastSampleAt > TestDataSampleRatePeriod * 2;
+        *pfSampleRate = bStale? 0:m_fTestDataSampleRate.load();
+    }
+
+    return m_TestDataHistory.Pop(pSamples, iMaxSamples);
 }
 
 bool SMX::SMXDevice::GetTestData(SMXSensorTestModeData &data)
@@ -257,7 +344,7 @@ bool SMX::SMXDevice::GetTestData(SMXSensorTestModeData &data)
     return true;
 }
 
-void SMX::SMXDevice::CallUpdateCallback(SMXUpdateCallbackReason reason)
+void SMX::SMXDevice::CallUpdateCallback(int iChanged)
 {
     m_Lock.AssertLockedByCurrentThread();
 
@@ -265,7 +352,7 @@ void SMX::SMXDevice::CallUpdateCallback(SMXUpdateCallbackReason reason)
         return;
 
     SMXDeviceInfo deviceInfo = m_pConnection->GetDeviceInfo();
-    m_pUpdateCallback(deviceInfo.m_bP2? 1:0, reason);
+    m_pUpdateCallback(deviceInfo.m_bP2? 1:0, iChanged);
 }
 
 void SMX::SMXDevice::HandlePackets()
@@ -308,7 +395,7 @@ void SMX::SMXDevice::HandlePackets()
             // Store the raw config data in rawConfig.  For V1-4 firmwares, this is the
             // old config format.
             rawConfig.resize(iSize);
-            memcpy(rawConfig.data(), buf.data()+2, min(iSize, sizeof(config)));
+            memcpy(rawConfig.data(), buf.data()+2, min<size_t>(iSize, sizeof(config)));
 
             if(buf[0] == 'g')
             {
@@ -319,7 +406,7 @@ void SMX::SMXDevice::HandlePackets()
             else
             {
                 // This is the new config format.  Copy it directly into config.
-                memcpy(&config, buf.data()+2, min(iSize, sizeof(config)));
+                memcpy(&config, buf.data()+2, min<size_t>(iSize, sizeof(config)));
             }
 
             m_bHaveConfig = true;
@@ -327,7 +414,7 @@ void SMX::SMXDevice::HandlePackets()
 
             // Log(ssprintf("Read back configuration: %i bytes, first byte %i", iSize, buf[2]));
 
-            CallUpdateCallback(SMXUpdateCallback_Updated);
+            CallUpdateCallback(SMXUpdate_Config);
             break;
         }
         }
@@ -438,10 +525,16 @@ void SMX::SMXDevice::Update(wstring &sError)
 
         // If the inputs changed from packets we just processed, call the update callback.
         if(iOldState != m_pConnection->GetInputState())
-            CallUpdateCallback(SMXUpdateCallback_Updated);
+            CallUpdateCallback(SMXUpdate_Input);
     }
 
     HandlePackets();
+
+    // The packets we just handled may have finished connecting or answered a sensor test
+    // request.  Check again now instead of waiting for the next update.  Any commands this
+    // sends will wake up the I/O thread to send them.
+    CheckActive();
+    UpdateSensorTestMode();
 }
 
 void SMX::SMXDevice::CheckActive()
@@ -469,21 +562,43 @@ void SMX::SMXDevice::UpdateSensorTestMode()
     if(m_SensorTestMode == SensorTestMode_Off)
         return;
 
+    double fNow = GetMonotonicTime();
+
+    // When streaming, keep several requests queued.  The device handles one command at a
+    // time, so this doesn't get responses any faster, but the next request is sent as soon
+    // as the previous one finishes, instead of waiting for us to handle the response.  These
+    // are sent with bulk priority, so streaming doesn't delay lights.
+    if(m_bSensorTestStreaming)
+    {
+        int iRequests = SensorTestStreamingRequests - m_iSensorTestRequestsInFlight;
+        for(int i = 0; i < iRequests; ++i)
+        {
+            m_WaitingForSensorTestModeResponse = m_SensorTestMode;
+            m_fSentSensorTestModeRequestAt = fNow;
+            m_iSensorTestRequestsInFlight++;
+
+            // The completion callback is always called, even if the device disconnects.
+            SendCommandLocked(ssprintf("y%c\n", m_SensorTestMode), [this](string response) {
+                m_iSensorTestRequestsInFlight--;
+            }, CommandPriority_Bulk);
+        }
+        return;
+    }
+
     // Request sensor data from the master.  Don't send this if we have a request outstanding
     // already.
-    uint32_t now = GetTickCount();
     if(m_WaitingForSensorTestModeResponse != SensorTestMode_Off)
     {
         // This request should be quick.  If we haven't received a response in a long
         // time, assume the request wasn't received.
-        if(now - m_SentSensorTestModeRequestAtTicks < 2000)
+        if(fNow - m_fSentSensorTestModeRequestAt < 2.0)
             return;
     }
 
 
     // Send the request.
     m_WaitingForSensorTestModeResponse = m_SensorTestMode;
-    m_SentSensorTestModeRequestAtTicks = now;
+    m_fSentSensorTestModeRequestAt = fNow;
 
     SendCommandLocked(ssprintf("y%c\n", m_SensorTestMode));
 }
@@ -508,35 +623,35 @@ void SMX::SMXDevice::HandleSensorTestDataResponse(const string &sReadBuffer)
 
     SensorTestMode iMode = (SensorTestMode) sReadBuffer[1];
 
-    // Copy off the data and remove it from the serial buffer.
-    vector<uint16_t> data;
-    for(int i = 3; i < iSize + 3; i += 2)
-    {
-        uint16_t iValue =
-            (uint8_t(sReadBuffer[i+1]) << 8) |
-            (uint8_t(sReadBuffer[i+0]) << 0);
-        data.push_back(iValue);
-    }
-
     if(m_WaitingForSensorTestModeResponse == SensorTestMode_Off)
     {
         Log("Ignoring unexpected sensor data request.  It may have been sent by another application.");
         return;
     }
 
-    if(iMode != m_WaitingForSensorTestModeResponse)
+    if(m_bSensorTestStreaming)
     {
-        Log(ssprintf("Ignoring unexpected sensor data request (got %i, expected %i)", iMode, m_WaitingForSensorTestModeResponse));
-        return;
+        // When streaming, several requests are in the air, so if the sensor mode was just
+        // changed, we'll still receive responses for the old mode.  Just ignore them.
+        if(iMode != m_SensorTestMode)
+            return;
     }
+    else
+    {
+        if(iMode != m_WaitingForSensorTestModeResponse)
+        {
+            Log(ssprintf("Ignoring unexpected sensor data request (got %i, expected %i)", iMode, m_WaitingForSensorTestModeResponse));
+            return;
+        }
 
-    m_WaitingForSensorTestModeResponse = SensorTestMode_Off;
+        m_WaitingForSensorTestModeResponse = SensorTestMode_Off;
 
-    // We match m_WaitingForSensorTestModeResponse, which is the sensor request we most
-    // recently sent.  If we don't match g_SensorTestMode, then the sensor mode was changed
-    // while a request was in the air.  Just ignore the response.
-    if(iMode != m_SensorTestMode)
-        return;
+        // We match m_WaitingForSensorTestModeResponse, which is the sensor request we most
+        // recently sent.  If we don't match g_SensorTestMode, then the sensor mode was changed
+        // while a request was in the air.  Just ignore the response.
+        if(iMode != m_SensorTestMode)
+            return;
+    }
 
 #pragma pack(push,1)
     struct detail_data {
@@ -559,6 +674,11 @@ void SMX::SMXDevice::HandleSensorTestDataResponse(const string &sReadBuffer)
     };
 #pragma pack(pop)
 
+    // Decode the response for all panels at once, straight from the read buffer.
+    detail_data all_pad_data[9];
+    TransposeSensorTestData((const uint8_t *) sReadBuffer.data() + 3, iSize / 2,
+        (uint8_t *) all_pad_data, sizeof(detail_data));
+
     m_HaveSensorTestModeData = true;
     SMXSensorTestModeData &output = m_SensorTestData;
 
@@ -574,9 +694,7 @@ void SMX::SMXDevice::HandleSensorTestDataResponse(const string &sReadBuffer)
     int iMasterVersion = m_pConnection->GetDeviceInfo().m_iFirmwareVersion;
     for(int iPanel = 0; iPanel < 9; ++iPanel)
     {
-        // Decode the response from this panel.
-        detail_data pad_data;
-        ReadDataForPanel(data, iPanel, &pad_data, sizeof(pad_data));
+        const detail_data &pad_data = all_pad_data[iPanel];
 
         // Check the header.  This is always 0 1 0, to identify it as a response, and not as random
         // steps from the player.
@@ -612,5 +730,25 @@ void SMX::SMXDevice::HandleSensorTestDataResponse(const string &sReadBuffer)
             output.sensorLevel[iPanel][iSensor] = pad_data.sensors[iSensor];
     }
 
-    CallUpdateCallback(SMXUpdateCallback_Updated);
+    // Add the sample to the history.
+    double fNow = GetMonotonicTime();
+    SMXSensorTestSample sample;
+    sample.m_fTime = fNow;
+    sample.m_Mode = iMode;
+    sample.m_Data = output;
+    m_TestDataHistory.Push(sample);
+
+    // Update the sample rate.  Count the samples received over each period, rather than
+    // timing each sample, since responses are often handled in bursts.
+    m_iTestDataSamplesInPeriod++;
+    if(fNow - m_fTestDataSampleRatePeriodStart >= TestDataSampleRatePeriod)
+    {
+        if(m_fTestDataSampleRatePeriodStart != 0)
+            m_fTestDataSampleRate = m_iTestDataSamplesInPeriod / (fNow - m_fTestDataSampleRatePeriodStart);
+        m_fTestDataSampleRatePeriodStart = fNow;
+        m_iTestDataSamplesInPeriod = 0;
+    }
+    m_fLastTestDataSampleAt = fNow;
+
+    CallUpdateCallback(SMXUpdate_TestData);
 }
@@ -1,17 +1,22 @@
 #ifndef SMXDevice_h
 #define SMXDevice_h
 
-#include <windows.h>
 #include <memory>
 #include <functional>
+#include <atomic>
 using namespace std;
 
 #include "Helpers.h"
+#include "SMXDeviceConnection.h"
+#include "SMXRingBuffer.h"
 #include "../SMX.h"
 
 namespace SMX
 {
 class SMXDeviceConnection;
+class SMXTransport;
+class SMXIOWaiter;
+class SMXTrafficRecorder;
 
 // The high-level interface to a single controller.  This is managed by SMXManager, and uses SMXDeviceConnection
 // for low-level USB communication.
@@ -20,29 +25,41 @@ class SMXDevice
 public:
     // Create an SMXDevice.
     //
-    // lock is our serialization mutex.  This is shared across SMXManager and all SMXDevices.
+    // lock is our serialization mutex.  This is held by the I/O thread that updates this device.
     //
-    // hEvent is signalled when we have new packets to be sent, to wake the communications thread.  The
-    // device handle opened with OpenPort must also be monitored, to check when packets have been received
+    // pWaiter is woken when we have new packets to be sent, to wake the device's I/O thread.  The
+    // transport opened with OpenDevice must also be monitored, to check when packets have been received
     // (or successfully sent).
-    static shared_ptr<SMXDevice> Create(shared_ptr<SMX::AutoCloseHandle> hEvent, SMX::Mutex &lock);
-    SMXDevice(shared_ptr<SMXDevice> &pSelf, shared_ptr<SMX::AutoCloseHandle> hEvent, SMX::Mutex &lock);
+    static shared_ptr<SMXDevice> Create(shared_ptr<SMXIOWaiter> pWaiter, SMX::Mutex &lock);
+    SMXDevice(shared_ptr<SMXDevice> &pSelf, shared_ptr<SMXIOWaiter> pWaiter, SMX::Mutex &lock);
     ~SMXDevice();
 
-    bool OpenDeviceHandle(shared_ptr<SMX::AutoCloseHandle> pHandle, wstring &sError);
+    bool OpenDevice(shared_ptr<SMXTransport> pTransport, wstring &sError);
     void CloseDevice();
-    shared_ptr<SMX::AutoCloseHandle> GetDeviceHandle() const;
+    shared_ptr<SMXTransport> GetTransport() const;
 
     // Set a function to be called when something changes on the device.  This allows efficiently
     // detecting when a panel is pressed or other changes happen on the device.
-    void SetUpdateCallback(function<void(int PadNumber, SMXUpdateCallbackReason reason)> pCallback);
+    // pCallback is called when something changes.  iChanged is a mask of SMXUpdateFlags.
+    void SetUpdateCallback(function<void(int PadNumber, int iChanged)> pCallback);
+    void SetUpdateCallbackLocked(function<void(int PadNumber, int iChanged)> pCallback); // used by SMXManager
 
     // Return true if we're connected.
     bool IsConnected() const;
 
-    // Send a raw command.
-    void SendCommand(string sCmd, function<void(string response)> pComplete=nullptr);
-    void SendCommandLocked(string sCmd, function<void(string response)> pComplete=nullptr);
+    // Send a raw command.  See SMXDeviceConnection::SendCommand for priority.
+    void SendCommand(const string &sCmd, function<void(string response)> pComplete=nullptr,
+        CommandPriority priority=CommandPriority_Control);
+    void SendCommandLocked(const string &sCmd, function<void(string response)> pComplete=nullptr,
+        CommandPriority priority=CommandPriority_Control);
+    void SendCommandLocked(const char *pCmd, int iSize, function<void(string response)> pComplete=nullptr,
+        CommandPriority priority=CommandPriority_Control);
+
+    // Send a list of commands with bulk priority.  Commands are queued as earlier ones finish,
+    // so a long list never fills the bulk queue and nothing in it is discarded.
+    // pComplete is called with the index of each command as it finishes, and like other
+    // completion callbacks, it's always called, even if the device disconnects.
+    void SendBulkCommands(const vector<string> &asCommands, function<void(int iCommand)> pComplete);
 
     // Get basic info about the device.
     void GetInfo(SMXInfo &info);
@@ -63,6 +80,17 @@ public:
 
     // Return a mask of the panels currently pressed.
     uint16_t GetInputState() const;
+    uint16_t GetInputStateLocked() const; // used by SMXManager
+
+    // Read panel press and release events.  See SMX_GetInputEvents.
+    int GetInputEvents(SMXInputEvent *pEvents, int iMaxEvents);
+
+    // Get or reset command statistics.  SMXManager fills in the rest of SMXStats.
+    void GetStatsLocked(SMXStats &stats) const; // used by SMXManager
+    void ResetStatsLocked(); // used by SMXManager
+
+    // Record reports to and from this device.  See SMXDeviceConnection::SetTrafficRecorder.
+    void SetTrafficRecorderLocked(shared_ptr<SMXTrafficRecorder> pRecorder, int iDevice); // used by SMXManager
 
     // Reset the configuration data to what the device used when it was first flashed.
     // GetConfig() will continue to return the previous configuration until this command
@@ -83,6 +111,13 @@ public:
     // received test data since changing the test mode (or if we're not in a test mode).
     bool GetTestData(SMXSensorTestModeData &data);
 
+    // If enabled, keep sensor test requests queued so test data is received as fast as the
+    // device can send it.
+    void SetSensorTestStreaming(bool bStreaming);
+
+    // Read test data samples received since the last call.  See SMX_GetTestDataHistory.
+    int GetTestDataHistory(SMXSensorTestSample *pSamples, int iMaxSamples, double *pfSampleRate);
+
     // Internal:
 
     // Update this device, processing received packets and sending any outbound packets.
@@ -92,10 +127,15 @@ public:
     void Update(wstring &sError);
 
 private:
-    shared_ptr<SMX::AutoCloseHandle> m_hEvent;
+    shared_ptr<SMXIOWaiter> m_pWaiter;
     SMX::Mutex &m_Lock;
 
-    function<void(int PadNumber, SMXUpdateCallbackReason reason)> m_pUpdateCallback;
+    // This serializes GetInputEvents, since input events can only be read by one thread
+    // at a time.  This is separate from m_Lock, so reading events never waits on the I/O
+    // thread.
+    SMX::Mutex m_InputEventsLock;
+
+    function<void(int PadNumber, int iChanged)> m_pUpdateCallback;
     weak_ptr<SMXDevice> m_pSelf;
 
     shared_ptr<SMXDeviceConnection> m_pConnection;
@@ -115,9 +155,19 @@ private:
     bool m_bSendingConfig = false;
     bool m_bWaitingForConfigResponse = false;
 
-    void CallUpdateCallback(SMXUpdateCallbackReason reason);
+    void CallUpdateCallback(int iChanged);
     void HandlePackets();
 
+    // Commands from SendBulkCommands that haven't been queued yet.
+    struct BulkCommands
+    {
+        vector<string> m_asCommands;
+        size_t m_iNext = 0;
+        function<void(int iCommand)> m_pComplete;
+        bool m_bQueueing = false;
+    };
+    void QueueBulkCommands(shared_ptr<BulkCommands> pBulk);
+
     void SendConfig();
     void CheckActive();
     bool IsConnectedLocked() const;
@@ -129,7 +179,25 @@ private:
     SensorTestMode m_SensorTestMode = SensorTestMode_Off;
     bool m_HaveSensorTestModeData = false;
     SMXSensorTestModeData m_SensorTestData;
-    uint32_t m_SentSensorTestModeRequestAtTicks = 0;
+    double m_fSentSensorTestModeRequestAt = 0;
+
+    // Streaming test data.  m_iSensorTestRequestsInFlight is the number of requests queued or
+    // sent that haven't completed yet.
+    static const int SensorTestStreamingRequests = 2;
+    bool m_bSensorTestStreaming = false;
+    int m_iSensorTestRequestsInFlight = 0;
+
+    // Every test data sample we've received.  These are written by the I/O thread and read
+    // by the application, serialized by m_TestDataHistoryLock.
+    SMX::Mutex m_TestDataHistoryLock;
+    SMXRingBuffer<SMXSensorTestSample, 1024> m_TestDataHistory;
+
+    // The rate we're receiving samples, measured over TestDataSampleRatePeriod seconds.
+    static constexpr double TestDataSampleRatePeriod = 1.0;
+    double m_fTestDataSampleRatePeriodStart = 0;
+    int m_iTestDataSamplesInPeriod = 0;
+    atomic<double> m_fTestDataSampleRate{0};
+    atomic<double> m_fLastTestDataSampleAt{0};
 };
 }
 
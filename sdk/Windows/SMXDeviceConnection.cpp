@@ -1,21 +1,30 @@
 #include "SMXDeviceConnection.h"
+#include "SMXTransport.h"
+#include "SMXTrafficCapture.h"
 #include "Helpers.h"
 
 #include <string>
 #include <memory>
+#include <algorithm>
+#include <string.h>
 using namespace std;
 using namespace SMX;
 
-#include <hidsdi.h>
-#include <SetupAPI.h>
+#define PACKET_FLAG_START_OF_COMMAND      0x04
+#define PACKET_FLAG_END_OF_COMMAND        0x01
+#define PACKET_FLAG_HOST_CMD_FINISHED     0x02
+#define PACKET_FLAG_DEVICE_INFO           0x80
 
-SMX::SMXDeviceConnection::PendingCommandPacket::PendingCommandPacket()
-{
-}
+// A queued command is passed over for higher priority commands at most this many times in
+// a row, so bulk transfers keep moving while lights are streaming.
+static const int MaxCommandsSkipped = 4;
+
+// The commands we keep separate round-trip times for.  These are in the order documented
+// for SMXStats::m_Commands, and everything else is counted in the last entry.
+const char SMXDeviceConnection::StatsCommands[] = { '2', '3', '4', 'G', 'W', 'y', 'm', '*' };
 
 SMXDeviceConnection::PendingCommand::PendingCommand()
 {
-    memset(&m_Overlapped, 0, sizeof(m_Overlapped));
 }
 
 shared_ptr<SMX::SMXDeviceConnection> SMXDeviceConnection::Create()
@@ -26,7 +35,6 @@ shared_ptr<SMX::SMXDeviceConnection> SMXDeviceConnection::Create()
 SMX::SMXDeviceConnection::SMXDeviceConnection(shared_ptr<SMXDeviceConnection> &pSelf):
     m_pSelf(GetPointers(pSelf, this))
 {
-    memset(&overlapped_read, 0, sizeof(overlapped_read));
 }
 
 SMX::SMXDeviceConnection::~SMXDeviceConnection()
@@ -34,15 +42,15 @@ SMX::SMXDeviceConnection::~SMXDeviceConnection()
     Close();
 }
 
-bool SMX::SMXDeviceConnection::Open(shared_ptr<AutoCloseHandle> DeviceHandle, wstring &sError)
+bool SMX::SMXDeviceConnection::Open(shared_ptr<SMXTransport> pTransport, wstring &sError)
 {
-    m_hDevice = DeviceHandle;
+    m_pTransport = pTransport;
 
-    if(!HidD_SetNumInputBuffers(DeviceHandle->value(), 512))
-        Log(ssprintf("Error: HidD_SetNumInputBuffers: %ls", GetErrorString(GetLastError()).c_str()));
+    if(!m_pTransport->Open(sError))
+        return false;
 
-    // Begin the first async read.
-    BeginAsyncRead(sError);
+    if(m_pTrafficRecorder)
+        m_pTrafficRecorder->Record(m_iTrafficRecorderDevice, CapturedReport_Opened, string(), GetMonotonicTime());
 
     // Request device info.  Once this finishes, SMXDevice::CheckActive() will request the
     // configuration, and we'll activate the device once that finishes.
@@ -58,30 +66,38 @@ void SMX::SMXDeviceConnection::Close()
 {
     Log("Closing device");
 
-    if(m_hDevice)
-        CancelIo(m_hDevice->value());
+    if(m_pTransport)
+        m_pTransport->Close();
 
     // If we're being closed while a command was in progress, call its completion
     // callback, so it's guaranteed to always be called.
-    if(m_pCurrentCommand && m_pCurrentCommand->m_pComplete)
-        m_pCurrentCommand->m_pComplete("");
+    if(m_pCurrentCommand)
+        FinishCurrentCommand("");
 
     // If any commands were queued with completion callbacks, call their completion
-    // callbacks.
-    for(auto &pendingCommand: m_aPendingCommands)
+    // callbacks.  Completion callbacks can queue more commands, which will be removed
+    // here too.
+    for(CommandQueue &queue: m_CommandQueues)
     {
-        if(pendingCommand->m_pComplete)
-            pendingCommand->m_pComplete("");
+        while(!queue.Empty())
+        {
+            shared_ptr<PendingCommand> pPendingCommand = queue.PopFront();
+            if(pPendingCommand->m_pComplete)
+                pPendingCommand->m_pComplete("");
+            FreeCommand(pPendingCommand);
+        }
+        queue.m_iSkipped = 0;
     }
 
-    m_hDevice.reset();
+    m_pTransport.reset();
     m_sReadBuffers.clear();
-    m_aPendingCommands.clear();
-    memset(&overlapped_read, 0, sizeof(overlapped_read));
+    m_sCurrentReadBuffer.clear();
     m_bActive = false;
     m_bGotInfo = false;
-    m_pCurrentCommand = nullptr;
-    m_iInputState = 0;
+
+    // Release any panels that were held when we disconnected, so the application doesn't
+    // see them as stuck.
+    SetInputState(0, SMX::GetMonotonicTime());
 }
 
 void SMX::SMXDeviceConnection::SetActive(bool bActive)
@@ -97,7 +113,7 @@ void SMX::SMXDeviceConnection::Update(wstring &sError)
     if(!sError.empty())
         return;
 
-    if(m_hDevice == nullptr)
+    if(m_pTransport == nullptr)
     {
         sError = L"Device not open";
         return;
@@ -133,35 +149,28 @@ void SMX::SMXDeviceConnection::CheckReads(wstring &error)
             //
             // if we were delayed and the response is in the queue, we'll get out of sync
             Log("Command timed out.  Retrying...");
-            CancelIoEx(m_hDevice->value(), &m_pCurrentCommand->m_Overlapped);
-
-            // Block until the cancellation completes.  This should happen quickly.
-            DWORD unused;
-            GetOverlappedResult(m_hDevice->value(), &m_pCurrentCommand->m_Overlapped, &unused, true);
+            m_iCommandTimeouts[GetStatsCommandIndex(m_pCurrentCommand->m_cCommand)]++;
+            m_pTransport->CancelWrites();
+            m_pCurrentCommand->m_bWriting = false;
 
-            m_aPendingCommands.push_front(m_pCurrentCommand);
+            m_CommandQueues[m_pCurrentCommand->m_Priority].PushFront(m_pCurrentCommand);
             m_pCurrentCommand = nullptr;
             Log("Command requeued");
         }
     }
 
-    DWORD bytes;
-    int result = GetOverlappedResult(m_hDevice->value(), &overlapped_read, &bytes, FALSE);
-    if(result == 0)
+    // Handle all reports that have been received.  Timestamp each report as we read it,
+    // so input events have the time the input arrived.
+    while(m_pTransport->ReadReport(m_sReport, error))
     {
-        int windows_error = GetLastError();
-        if(windows_error != ERROR_IO_PENDING && windows_error != ERROR_IO_INCOMPLETE)
-            error = wstring(L"Error reading device: ") + GetErrorString(windows_error).c_str();
-        return;
+        double fTime = SMX::GetMonotonicTime();
+        if(m_pTrafficRecorder)
+            m_pTrafficRecorder->Record(m_iTrafficRecorderDevice, 0, m_sReport, fTime);
+        HandleUsbPacket(m_sReport, fTime);
     }
-
-    HandleUsbPacket(string(overlapped_read_buffer, bytes));
-
-    // Start the next read.
-    BeginAsyncRead(error);
 }
 
-void SMX::SMXDeviceConnection::HandleUsbPacket(const string &buf)
+void SMX::SMXDeviceConnection::HandleUsbPacket(const string &buf, double fTime)
 {
     if(buf.empty())
         return;
@@ -172,8 +181,11 @@ void SMX::SMXDeviceConnection::HandleUsbPacket(const string &buf)
     {
     case 3:
         // Input state.  We could also read this as a normal HID button change.
-        m_iInputState = ((buf[2] & 0xFF) << 8) |
-                ((buf[1] & 0xFF) << 0);
+        if(buf.size() < 3)
+            return;
+
+        SetInputState(((buf[2] & 0xFF) << 8) |
+                ((buf[1] & 0xFF) << 0), fTime);
 
         // Log(ssprintf("Input state: %x (%x %x)\n", m_iInputState, buf[2], buf[1]));
         break;
@@ -185,22 +197,17 @@ void SMX::SMXDeviceConnection::HandleUsbPacket(const string &buf)
 
         int cmd = buf[1];
 
-#define PACKET_FLAG_START_OF_COMMAND      0x04
-#define PACKET_FLAG_END_OF_COMMAND        0x01
-#define PACKET_FLAG_HOST_CMD_FINISHED     0x02
-#define PACKET_FLAG_DEVICE_INFO           0x80
-
-        int bytes = buf[2];
+        int bytes = (uint8_t) buf[2];
         if(3 + bytes > buf.size())
         {
             Log("Communication error: oversized packet (ignored)");
             return;
         }
 
-        string sPacket( buf.begin()+3, buf.begin()+3+bytes );
-
         if(cmd & PACKET_FLAG_DEVICE_INFO)
         {
+            string sPacket( buf.begin()+3, buf.begin()+3+bytes );
+
             // This is a response to RequestDeviceInfo.  Since any application can send this,
             // we ignore the packet if we didn't request it, since it might be requested for
             // a different program.
@@ -235,10 +242,7 @@ void SMX::SMXDeviceConnection::HandleUsbPacket(const string &buf)
             string sHexSerial = BinaryToHex(packet->serial, 16);
             memcpy(m_DeviceInfo.m_Serial, sHexSerial.c_str(), 33);
 
-            if(m_pCurrentCommand->m_pComplete)
-                m_pCurrentCommand->m_pComplete(sPacket);
-            m_pCurrentCommand = nullptr;
-
+            FinishCurrentCommand(sPacket);
             break;
         }
 
@@ -259,7 +263,8 @@ void SMX::SMXDeviceConnection::HandleUsbPacket(const string &buf)
             m_sCurrentReadBuffer.clear();
         }
 
-        m_sCurrentReadBuffer.append(sPacket);
+        // Append directly from the report, so we don't make a copy of every packet.
+        m_sCurrentReadBuffer.append(buf, 3, bytes);
 
         // Note that if PACKET_FLAG_HOST_CMD_FINISHED is set, PACKET_FLAG_END_OF_COMMAND
         // will always also be set.
@@ -267,9 +272,12 @@ void SMX::SMXDeviceConnection::HandleUsbPacket(const string &buf)
         {
             // This tells us that a command we wrote to the device has finished executing, and
             // it's safe to start writing another.
-            if(m_pCurrentCommand && m_pCurrentCommand->m_pComplete)
-                m_pCurrentCommand->m_pComplete(m_sCurrentReadBuffer);
-            m_pCurrentCommand = nullptr;
+            if(m_pCurrentCommand)
+            {
+                int iIndex = GetStatsCommandIndex(m_pCurrentCommand->m_cCommand);
+                m_CommandTimes[iIndex].Record(fTime - m_pCurrentCommand->m_fSentAt);
+                FinishCurrentCommand(m_sCurrentReadBuffer);
+            }
         }
 
         if(cmd & PACKET_FLAG_END_OF_COMMAND)
@@ -284,28 +292,22 @@ void SMX::SMXDeviceConnection::HandleUsbPacket(const string &buf)
 
 }
 
-void SMX::SMXDeviceConnection::BeginAsyncRead(wstring &error)
+// Update the input state, and queue an event for each panel that changed.
+void SMX::SMXDeviceConnection::SetInputState(uint16_t iInputState, double fTime)
 {
-    while(1)
-    {
-        // Our read buffer is 64 bytes.  The HID input packet is much smaller than that,
-        // but Windows pads packets to the maximum size of any HID report, and the HID
-        // serial packet is 64 bytes, so we'll get 64 bytes even for 3-byte input packets.
-        // If this didn't happen, we'd have to be smarter about pulling data out of the
-        // read buffer.
-        DWORD bytes;
-        memset(overlapped_read_buffer, sizeof(overlapped_read_buffer), 0);
-        if(!ReadFile(m_hDevice->value(), overlapped_read_buffer, sizeof(overlapped_read_buffer), &bytes, &overlapped_read))
-        {
-            int windows_error = GetLastError();
-            if(windows_error != ERROR_IO_PENDING && windows_error != ERROR_IO_INCOMPLETE)
-                error = wstring(L"Error reading device: ") + GetErrorString(windows_error).c_str();
-            return;
-        }
+    uint16_t iChanged = m_iInputState ^ iInputState;
+    m_iInputState = iInputState;
 
-        // The async read finished synchronously.  This just means that there was already data waiting.
-        // Handle the result, and loop to try to start the next async read again.
-        HandleUsbPacket(string(overlapped_read_buffer, bytes));
+    for(int iPanel = 0; iPanel < 9; ++iPanel)
+    {
+        if(!(iChanged & (1 << iPanel)))
+            continue;
+
+        SMXInputEvent event;
+        event.m_fTime = fTime;
+        event.m_iPanel = iPanel;
+        event.m_bPressed = !!(iInputState & (1 << iPanel));
+        m_InputEvents.Push(event);
     }
 }
 
@@ -316,15 +318,8 @@ void SMX::SMXDeviceConnection::CheckWrites(wstring &error)
         // A command is in progress.  See if its writes have completed.
         if(m_pCurrentCommand->m_bWriting)
         {
-            DWORD bytes;
-            int iResult = GetOverlappedResult(m_hDevice->value(), &m_pCurrentCommand->m_Overlapped, &bytes, FALSE);
-            if(iResult == 0)
-            {
-                int windows_error = GetLastError();
-                if(windows_error != ERROR_IO_PENDING && windows_error != ERROR_IO_INCOMPLETE)
-                    error = wstring(L"Error writing to device: ") + GetErrorString(windows_error).c_str();
+            if(!m_pTransport->GetWritesComplete(error))
                 return;
-            }
 
             m_pCurrentCommand->m_bWriting = false;
         }
@@ -337,39 +332,209 @@ void SMX::SMXDeviceConnection::CheckWrites(wstring &error)
     }
 
     // Stop if we have nothing to do.
-    if(m_aPendingCommands.empty())
+    int iQueue = GetNextCommandQueue();
+    if(iQueue == -1)
         return;
 
     // Send the next command.
-    shared_ptr<PendingCommand> pPendingCommand = m_aPendingCommands.front();
+    shared_ptr<PendingCommand> pPendingCommand = m_CommandQueues[iQueue].PopFront();
+
+    // Count the commands we passed over to send this one.
+    m_CommandQueues[iQueue].m_iSkipped = 0;
+    for(int i = iQueue + 1; i < NUM_CommandPriority; ++i)
+    {
+        if(!m_CommandQueues[i].Empty())
+            m_CommandQueues[i].m_iSkipped++;
+    }
 
     // Record the time.  We can use this for timeouts.
     pPendingCommand->m_fSentAt = SMX::GetMonotonicTime();
 
-    for(shared_ptr<PendingCommandPacket> &pPacket: pPendingCommand->m_Packets)
+    // Store this command in m_pCurrentCommand, and we'll stop sending data until the command finishes.
+    // Do this before writing, so the command isn't lost if the write fails.
+    m_pCurrentCommand = pPendingCommand;
+
+    for(int i = 0; i < pPendingCommand->m_iPackets; ++i)
     {
-        // In theory the API allows this to return success if the write completed successfully without needing to
-        // be async, like reads can.  However, this can't really happen (the write always needs to go to the device
-        // first, unlike reads which might already be buffered), and there's no way to test it if we implement that,
-        // so this assumes all writes are async.
-        DWORD unused;
-        // Log(ssprintf("Write: %s", BinaryToHex(pPacket->sData).c_str()));
-        if(!WriteFile(m_hDevice->value(), pPacket->sData.data(), pPacket->sData.size(), &unused, &pPendingCommand->m_Overlapped))
+        // Log(ssprintf("Write: %s", BinaryToHex(pPendingCommand->m_Packets[i]).c_str()));
+        if(m_pTrafficRecorder)
+            m_pTrafficRecorder->Record(m_iTrafficRecorderDevice, CapturedReport_Outbound, pPendingCommand->m_Packets[i], SMX::GetMonotonicTime());
+        m_pTransport->WriteReport(pPendingCommand->m_Packets[i], error);
+        if(!error.empty())
+            return;
+    }
+
+    pPendingCommand->m_bWriting = true;
+}
+
+// Return the index of the queue to send the next command from, or -1 if nothing is queued.
+int SMX::SMXDeviceConnection::GetNextCommandQueue() const
+{
+    // Send the highest priority command, unless a lower priority command has been passed
+    // over too many times.
+    int iBest = -1;
+    for(int i = 0; i < NUM_CommandPriority; ++i)
+    {
+        if(m_CommandQueues[i].Empty())
+            continue;
+        if(m_CommandQueues[i].m_iSkipped >= MaxCommandsSkipped)
+            return i;
+        if(iBest == -1)
+            iBest = i;
+    }
+    return iBest;
+}
+
+// Add a command to the queue for its priority.  Return false if the queue was full and
+// the command was discarded.
+bool SMX::SMXDeviceConnection::QueueCommand(shared_ptr<PendingCommand> pCommand)
+{
+    CommandQueue &queue = m_CommandQueues[pCommand->m_Priority];
+
+    // A platform lights command sets all of the platform lights, so if one is still waiting
+    // to be sent, replace it with this one rather than letting them pile up while the pad
+    // is slow.  Other commands are never replaced: test mode and auto lights commands have
+    // to arrive, and panel lights are sent in '2'/'3' pairs that can't be split.  Call the
+    // replaced command's completion callback, since that's guaranteed to always be called.
+    if(pCommand->m_cCommand == 'L')
+    {
+        for(size_t i = 0; i < queue.m_iCount; ++i)
         {
-            int windows_error = GetLastError();
-            if(windows_error != ERROR_IO_PENDING && windows_error != ERROR_IO_INCOMPLETE)
-            {
-                error = wstring(L"Error writing to device: ") + GetErrorString(windows_error).c_str();
-                return;
-            }
+            shared_ptr<PendingCommand> &pQueued = queue.At(i);
+            if(pQueued->m_cCommand != 'L')
+                continue;
+
+            shared_ptr<PendingCommand> pDropped = move(pQueued);
+            pQueued = pCommand;
+            if(pDropped->m_pComplete)
+                pDropped->m_pComplete("");
+            FreeCommand(pDropped);
+            m_iCommandsReplaced++;
+            return true;
         }
     }
 
-    pPendingCommand->m_bWriting = true;
+    // If the queue is full, discard the new command rather than one that's already queued,
+    // so a command is never lost from the middle of a sequence.
+    if(queue.m_iCount >= MaxQueuedCommands[pCommand->m_Priority])
+    {
+        Log(ssprintf("Command queue %i is full (%i commands), discarding '%c' command",
+            pCommand->m_Priority, int(queue.m_iCount), pCommand->m_cCommand? pCommand->m_cCommand:'?'));
+        if(pCommand->m_pComplete)
+            pCommand->m_pComplete("");
+        FreeCommand(pCommand);
+        m_iCommandsDropped++;
+        return false;
+    }
 
-    // Remove this command and store it in m_pCurrentCommand, and we'll stop sending data until the command finishes.
-    m_pCurrentCommand = pPendingCommand;
-    m_aPendingCommands.pop_front();
+    queue.PushBack(pCommand);
+    m_iMaxQueuedCommands = max(m_iMaxQueuedCommands, GetQueuedCommandCount());
+    return true;
+}
+
+int SMX::SMXDeviceConnection::GetQueueSpace(CommandPriority priority) const
+{
+    return max(0, MaxQueuedCommands[priority] - int(m_CommandQueues[priority].m_iCount));
+}
+
+// Return the number of commands waiting to be sent, plus the one waiting for a response.
+int SMX::SMXDeviceConnection::GetQueuedCommandCount() const
+{
+    int iCount = m_pCurrentCommand? 1:0;
+    for(const CommandQueue &queue: m_CommandQueues)
+        iCount += int(queue.m_iCount);
+    return iCount;
+}
+
+void SMX::SMXDeviceConnection::CommandQueue::PushBack(shared_ptr<PendingCommand> pCommand)
+{
+    if(m_iCount == m_apCommands.size())
+        Grow();
+
+    m_apCommands[(m_iFirst + m_iCount) % m_apCommands.size()] = pCommand;
+    m_iCount++;
+}
+
+void SMX::SMXDeviceConnection::CommandQueue::PushFront(shared_ptr<PendingCommand> pCommand)
+{
+    if(m_iCount == m_apCommands.size())
+        Grow();
+
+    m_iFirst = (m_iFirst + m_apCommands.size() - 1) % m_apCommands.size();
+    m_apCommands[m_iFirst] = pCommand;
+    m_iCount++;
+}
+
+shared_ptr<SMXDeviceConnection::PendingCommand> &SMX::SMXDeviceConnection::CommandQueue::At(size_t i)
+{
+    return m_apCommands[(m_iFirst + i) % m_apCommands.size()];
+}
+
+shared_ptr<SMXDeviceConnection::PendingCommand> SMX::SMXDeviceConnection::CommandQueue::PopFront()
+{
+    shared_ptr<PendingCommand> pCommand = move(m_apCommands[m_iFirst]);
+    m_iFirst = (m_iFirst + 1) % m_apCommands.size();
+    m_iCount--;
+    return pCommand;
+}
+
+// Double the size of the ring, moving the queued commands to the start.
+void SMX::SMXDeviceConnection::CommandQueue::Grow()
+{
+    vector<shared_ptr<PendingCommand>> apCommands(max<size_t>(m_apCommands.size() * 2, 8));
+    for(size_t i = 0; i < m_iCount; ++i)
+        apCommands[i] = move(m_apCommands[(m_iFirst + i) % m_apCommands.size()]);
+
+    m_apCommands.swap(apCommands);
+    m_iFirst = 0;
+}
+
+shared_ptr<SMXDeviceConnection::PendingCommand> SMX::SMXDeviceConnection::AllocateCommand()
+{
+    if(m_apFreeCommands.empty())
+        return make_shared<PendingCommand>();
+
+    shared_ptr<PendingCommand> pCommand = m_apFreeCommands.back();
+    m_apFreeCommands.pop_back();
+    return pCommand;
+}
+
+// Return a command that's no longer needed to m_apFreeCommands, and clear pCommand.
+void SMX::SMXDeviceConnection::FreeCommand(shared_ptr<PendingCommand> &pCommand)
+{
+    pCommand->m_iPackets = 0;
+    pCommand->m_bWriting = false;
+    pCommand->m_pComplete = nullptr;
+    pCommand->m_bIsDeviceInfoCommand = false;
+    pCommand->m_fSentAt = 0;
+    pCommand->m_cCommand = 0;
+    pCommand->m_Priority = CommandPriority_Control;
+    m_apFreeCommands.push_back(pCommand);
+    pCommand = nullptr;
+}
+
+// The current command has finished.  Call its completion callback and free it.
+void SMX::SMXDeviceConnection::FinishCurrentCommand(const string &sResponse)
+{
+    // Clear m_pCurrentCommand before calling the callback, since the callback might
+    // queue another command.
+    shared_ptr<PendingCommand> pCommand = m_pCurrentCommand;
+    m_pCurrentCommand = nullptr;
+
+    if(pCommand->m_pComplete)
+        pCommand->m_pComplete(sResponse);
+    FreeCommand(pCommand);
+}
+
+// Add a 64-byte report to Packets, reusing a buffer from a previous command if there is one.
+static string &AddPacket(vector<string> &Packets, int &iPackets)
+{
+    if(iPackets == Packets.size())
+        Packets.emplace_back();
+
+    string &sPacket = Packets[iPackets++];
+    sPacket.assign(64, '\0');
+    return sPacket;
 }
 
 // Request device info.  This is the same as sending an 'i' command, but we can send it safely
@@ -377,62 +542,111 @@ void SMX::SMXDeviceConnection::CheckWrites(wstring &error)
 // enumeration.
 void SMX::SMXDeviceConnection::RequestDeviceInfo(function<void(string response)> pComplete)
 {
-    shared_ptr<PendingCommand> pPendingCommand = make_shared<PendingCommand>();
+    shared_ptr<PendingCommand> pPendingCommand = AllocateCommand();
     pPendingCommand->m_pComplete = pComplete;
     pPendingCommand->m_bIsDeviceInfoCommand = true;
 
-    shared_ptr<PendingCommandPacket> pCommandPacket = make_shared<PendingCommandPacket>();
+    string &sPacket = AddPacket(pPendingCommand->m_Packets, pPendingCommand->m_iPackets);
+    sPacket[0] = 5; // report ID
+    sPacket[1] = (char) (uint8_t) PACKET_FLAG_DEVICE_INFO; // flags
+    sPacket[2] = 0; // bytes in packet
 
-    string sPacket({
-        5, // report ID
-        (char) (uint8_t) PACKET_FLAG_DEVICE_INFO, // flags
-        (char) 0, // bytes in packet
-    });
-    sPacket.resize(64, 0);
-    pCommandPacket->sData = sPacket;
-
-    pPendingCommand->m_Packets.push_back(pCommandPacket);
+    QueueCommand(pPendingCommand);
+}
 
-    m_aPendingCommands.push_back(pPendingCommand);
+bool SMX::SMXDeviceConnection::SendCommand(const string &cmd, function<void(string response)> pComplete,
+    CommandPriority priority)
+{
+    return SendCommand(cmd.data(), cmd.size(), pComplete, priority);
 }
 
-void SMX::SMXDeviceConnection::SendCommand(const string &cmd, function<void(string response)> pComplete)
+bool SMX::SMXDeviceConnection::SendCommand(const char *pCmd, int iSize, function<void(string response)> pComplete,
+    CommandPriority priority)
 {
-    shared_ptr<PendingCommand> pPendingCommand = make_shared<PendingCommand>();
+    shared_ptr<PendingCommand> pPendingCommand = AllocateCommand();
     pPendingCommand->m_pComplete = pComplete;
+    pPendingCommand->m_Priority = priority;
+    pPendingCommand->m_cCommand = iSize > 0? pCmd[0]:0;
 
     // Send the command in packets.  We allow sending zero-length packets here
     // for testing purposes.
     int i = 0;
     do {
-        shared_ptr<PendingCommandPacket> pCommandPacket = make_shared<PendingCommandPacket>();
-
         int iFlags = 0;
-        int iPacketSize = min(cmd.size() - i, 61);
+        int iPacketSize = min<int>(iSize - i, 61);
 
         bool bFirstPacket = (i == 0);
         if(bFirstPacket)
             iFlags |= PACKET_FLAG_START_OF_COMMAND;
 
-        bool bLastPacket = (i + iPacketSize == cmd.size());
+        bool bLastPacket = (i + iPacketSize == iSize);
         if(bLastPacket)
             iFlags |= PACKET_FLAG_END_OF_COMMAND;
 
-        string sPacket({
-            5, // report ID
-            (char) iFlags,
-            (char) iPacketSize, // bytes in packet
-        });
+        string &sPacket = AddPacket(pPendingCommand->m_Packets, pPendingCommand->m_iPackets);
+        sPacket[0] = 5; // report ID
+        sPacket[1] = (char) iFlags;
+        sPacket[2] = (char) iPacketSize; // bytes in packet
+        memcpy(&sPacket[3], pCmd + i, iPacketSize);
+
+        i += iPacketSize;
+    }
+    while(i < iSize);
+
+    return QueueCommand(pPendingCommand);
+}
 
-        sPacket.append(cmd.begin() + i, cmd.begin() + i + iPacketSize);
-        sPacket.resize(64, 0);
-        pCommandPacket->sData = sPacket;
+int SMX::SMXDeviceConnection::GetStatsCommandIndex(char cCommand)
+{
+    for(int i = 0; i < NumStatsCommands - 1; ++i)
+        if(StatsCommands[i] == cCommand)
+            return i;
+    return NumStatsCommands - 1;
+}
 
-        pPendingCommand->m_Packets.push_back(pCommandPacket);
+void SMX::SMXDeviceConnection::GetStats(SMXStats &stats) const
+{
+    for(int i = 0; i < NumStatsCommands; ++i)
+    {
+        const SMXLatencyHistogram &times = m_CommandTimes[i];
+        SMXCommandStats &command = stats.m_Commands[i];
+        command.m_cCommand = StatsCommands[i];
+        command.m_iCount = times.GetCount();
+        command.m_iTimeouts = m_iCommandTimeouts[i];
+        command.m_fMin = times.GetMin();
+        command.m_fMean = times.GetMean();
+        command.m_fMax = times.GetMax();
+        command.m_fP50 = times.GetPercentile(50);
+        command.m_fP90 = times.GetPercentile(90);
+        command.m_fP99 = times.GetPercentile(99);
+    }
 
-        i += iPacketSize;
+    stats.m_iQueuedCommands = GetQueuedCommandCount();
+    stats.m_iMaxQueuedCommands = m_iMaxQueuedCommands;
+    stats.m_iCommandsDropped = m_iCommandsDropped;
+    stats.m_iCommandsReplaced = m_iCommandsReplaced;
+}
+
+void SMX::SMXDeviceConnection::ResetStats()
+{
+    for(int i = 0; i < NumStatsCommands; ++i)
+    {
+        m_CommandTimes[i].Reset();
+        m_iCommandTimeouts[i] = 0;
     }
-    while(i < cmd.size());
 
-    m_aPendingCommands.push_back(pPendingCommand);
+    // Start the maximum from what's queued now, not from zero.
+    m_iMaxQueuedCommands = GetQueuedCommandCount();
+    m_iCommandsDropped = 0;
+    m_iCommandsReplaced = 0;
+}
+
+void SMX::SMXDeviceConnection::SetTrafficRecorder(shared_ptr<SMXTrafficRecorder> pRecorder, int iDevice)
+{
+    m_pTrafficRecorder = pRecorder;
+    m_iTrafficRecorderDevice = iDevice;
+
+    // If we're already connected, the capture starts partway through this connection.
+    if(m_pTrafficRecorder && m_pTransport)
+        m_pTrafficRecorder->Record(m_iTrafficRecorderDevice, CapturedReport_RecordingStarted, string(), GetMonotonicTime());
 }
@@ -1,7 +1,6 @@
 #ifndef SMXDevice_H
 #define SMXDevice_H
 
-#include <windows.h>
 #include <vector>
 #include <memory>
 #include <string>
@@ -10,9 +9,14 @@
 using namespace std;
 
 #include "Helpers.h"
+#include "SMXLatencyHistogram.h"
+#include "SMXRingBuffer.h"
+#include "../SMX.h"
 
 namespace SMX
 {
+class SMXTransport;
+class SMXTrafficRecorder;
 
 struct SMXDeviceInfo
 {
@@ -26,7 +30,37 @@ struct SMXDeviceInfo
     uint16_t m_iFirmwareVersion;
 };
 
-// Low-level SMX device handling.
+// Commands are sent in priority order.  Only one command is sent to the device at a time,
+// so this decides which queued command goes next.
+//
+// Each priority has its own queue, and each queue has a limit on how many commands can wait
+// in it (see MaxQueuedCommands).  A command sent to a full queue isn't queued, and is
+// counted in SMXStats::m_iCommandsDropped.
+enum CommandPriority
+{
+    // Configuration, device info, sensor test mode, factory reset and other control
+    // commands.  These are always sent first.  These are only sent occasionally, so the
+    // limit is only hit if the device stops responding, and it's logged.
+    CommandPriority_Control,
+
+    // Realtime lights, and commands that need to stay in order with them.  SMXManager only
+    // queues one lights update at a time and a newer platform lights command replaces an
+    // older one, so this limit is only a safety net.
+    CommandPriority_Lights,
+
+    // Large transfers that can wait, like animation uploads.  Bulk commands can't be lost,
+    // so senders must check GetQueueSpace and hold back commands until there's room.  See
+    // SMXDevice::SendBulkCommands.
+    CommandPriority_Bulk,
+
+    NUM_CommandPriority
+};
+
+// The most commands that can wait in each priority's queue.
+static const int MaxQueuedCommands[NUM_CommandPriority] = { 32, 16, 32 };
+
+// Low-level SMX device handling.  This implements the HID serial protocol.  The actual
+// report I/O is handled by an SMXTransport.
 class SMXDeviceConnection
 {
 public:
@@ -34,12 +68,12 @@ public:
     SMXDeviceConnection(shared_ptr<SMXDeviceConnection> &pSelf);
     ~SMXDeviceConnection();
 
-    bool Open(shared_ptr<AutoCloseHandle> DeviceHandle, wstring &error);
+    bool Open(shared_ptr<SMXTransport> pTransport, wstring &error);
 
     void Close();
     
-    // Get the device handle opened by Open(), or NULL if we're not open.
-    shared_ptr<AutoCloseHandle> GetDeviceHandle() const { return m_hDevice; }
+    // Get the transport opened by Open(), or NULL if we're not open.
+    shared_ptr<SMXTransport> GetTransport() const { return m_pTransport; }
 
     void Update(wstring &sError);
 
@@ -50,8 +84,8 @@ public:
     void SetActive(bool bActive);
     bool GetActive() const { return m_bActive; }
 
-    bool IsConnected() const { return m_hDevice != nullptr; }
-    bool IsConnectedWithDeviceInfo() const { return m_hDevice != nullptr && m_bGotInfo; }
+    bool IsConnected() const { return m_pTransport != nullptr; }
+    bool IsConnectedWithDeviceInfo() const { return m_pTransport != nullptr && m_bGotInfo; }
     SMXDeviceInfo GetDeviceInfo() const { return m_DeviceInfo; }
 
     // Read from the read buffer.  This only returns data that we've already read, so there aren't
@@ -60,20 +94,44 @@ public:
 
     // Send a command.  This must be a single complete command: partial writes and multiple
     // commands in a call aren't allowed.
-    void SendCommand(const string &cmd, function<void(string response)> pComplete=nullptr);
+    //
+    // Commands with the same priority are sent in order.  Higher priority commands can be
+    // sent ahead of lower priority commands that were queued earlier.
+    //
+    // If the queue for priority is full, the command is discarded, pComplete is called
+    // with an empty response, and false is returned.
+    bool SendCommand(const string &cmd, function<void(string response)> pComplete=nullptr,
+        CommandPriority priority=CommandPriority_Control);
+    bool SendCommand(const char *pCmd, int iSize, function<void(string response)> pComplete=nullptr,
+        CommandPriority priority=CommandPriority_Control);
+
+    // Return how many more commands can be queued with priority.
+    int GetQueueSpace(CommandPriority priority) const;
 
     uint16_t GetInputState() const { return m_iInputState; }
 
+    // Read input events that have been received.  This can be called from any thread, but
+    // only one thread should call it at a time.
+    int GetInputEvents(SMXInputEvent *pEvents, int iMaxEvents) { return m_InputEvents.Pop(pEvents, iMaxEvents); }
+
+    // Fill in the command and command queue fields of stats, or reset them.
+    void GetStats(SMXStats &stats) const;
+    void ResetStats();
+
+    // Record every report we read and write to pRecorder as device iDevice, or stop
+    // recording if pRecorder is null.
+    void SetTrafficRecorder(shared_ptr<SMXTrafficRecorder> pRecorder, int iDevice);
+
 private:
     void RequestDeviceInfo(function<void(string response)> pComplete = nullptr);
 
     void CheckReads(wstring &error);
-    void BeginAsyncRead(wstring &error);
     void CheckWrites(wstring &error);
-    void HandleUsbPacket(const string &buf);
+    void HandleUsbPacket(const string &buf, double fTime);
+    void SetInputState(uint16_t iInputState, double fTime);
 
     weak_ptr<SMXDeviceConnection> m_pSelf;
-    shared_ptr<AutoCloseHandle> m_hDevice;
+    shared_ptr<SMXTransport> m_pTransport;
 
     bool m_bActive = false;
 
@@ -83,21 +141,17 @@ private:
     list<string> m_sReadBuffers;
     string m_sCurrentReadBuffer;
 
-    struct PendingCommandPacket {
-        PendingCommandPacket();
-
-        string sData;
-    };
-
     // Commands that are waiting to be sent:
     struct PendingCommand {
         PendingCommand();
 
-        list<shared_ptr<PendingCommandPacket>> m_Packets;
+        // The reports to send for this command.  Commands are reused, and each report
+        // keeps its buffer, so only the first m_iPackets entries are used.
+        vector<string> m_Packets;
+        int m_iPackets = 0;
 
-        // The overlapped struct for writing this command's packets.  m_bWriting is true
-        // if we're waiting for the write to complete.
-        OVERLAPPED m_Overlapped;
+        // m_bWriting is true if we're waiting for this command's packets to finish
+        // being written.
         bool m_bWriting = false;
 
         // This is only called if m_bWaitForResponse if true.  Otherwise, we send the command
@@ -110,21 +164,79 @@ private:
 
         // The SMX::GetMonotonicTime when we started sending this command.
         double m_fSentAt = 0;
+
+        // The first character of the command, for statistics.
+        char m_cCommand = 0;
+
+        CommandPriority m_Priority = CommandPriority_Control;
     };
-    list<shared_ptr<PendingCommand>> m_aPendingCommands;
 
-    // If set, we've sent a command out of m_aPendingCommands and we're waiting for a response.  We
+    // The commands waiting to be sent with one priority, oldest first.  This is a ring
+    // buffer that grows as needed and is never shrunk, so queueing commands doesn't allocate
+    // memory once it's large enough.
+    struct CommandQueue
+    {
+        vector<shared_ptr<PendingCommand>> m_apCommands;
+        size_t m_iFirst = 0;
+        size_t m_iCount = 0;
+
+        // The number of commands sent from other queues while this one was waiting.
+        int m_iSkipped = 0;
+
+        bool Empty() const { return m_iCount == 0; }
+        void PushBack(shared_ptr<PendingCommand> pCommand);
+        void PushFront(shared_ptr<PendingCommand> pCommand);
+        shared_ptr<PendingCommand> PopFront();
+
+        // Return the command at index i, counting from the oldest.
+        shared_ptr<PendingCommand> &At(size_t i);
+
+    private:
+        void Grow();
+    };
+    CommandQueue m_CommandQueues[NUM_CommandPriority];
+
+    bool QueueCommand(shared_ptr<PendingCommand> pCommand);
+    int GetNextCommandQueue() const;
+
+    // If set, we've sent a command out of m_CommandQueues and we're waiting for a response.  We
     // can't send another command until the previous one has completed.
     shared_ptr<PendingCommand> m_pCurrentCommand = nullptr;
 
-    // We always have a read in progress.
-    OVERLAPPED overlapped_read;
-    char overlapped_read_buffer[64];
+    // Commands are reused once they complete, so sending commands doesn't allocate memory
+    // once we've sent a few.
+    vector<shared_ptr<PendingCommand>> m_apFreeCommands;
+    shared_ptr<PendingCommand> AllocateCommand();
+    void FreeCommand(shared_ptr<PendingCommand> &pCommand);
+    void FinishCurrentCommand(const string &sResponse);
+
+    // The buffer we read reports into.
+    string m_sReport;
+
+    shared_ptr<SMXTrafficRecorder> m_pTrafficRecorder;
+    int m_iTrafficRecorderDevice = 0;
 
     uint16_t m_iInputState = 0;
 
+    // Press and release events for each change to m_iInputState.  These are written by
+    // the I/O thread and read by the application.
+    SMXRingBuffer<SMXInputEvent, 256> m_InputEvents;
+
     // The current device info.  We retrieve this when we connect.
     SMXDeviceInfo m_DeviceInfo;
+
+    // Statistics for GetStats.  These are kept across reconnections.  Each entry in
+    // m_CommandTimes is for the command in StatsCommands at the same index.
+    static const char StatsCommands[];
+    static const int NumStatsCommands = 8;
+    static int GetStatsCommandIndex(char cCommand);
+    int GetQueuedCommandCount() const;
+
+    SMXLatencyHistogram m_CommandTimes[NumStatsCommands];
+    int m_iCommandTimeouts[NumStatsCommands] = { };
+    int m_iMaxQueuedCommands = 0;
+    int m_iCommandsDropped = 0;
+    int m_iCommandsReplaced = 0;
 };
 }
 
@@ -1,6 +1,7 @@
 #include "SMXDeviceSearch.h"
 
 #include "SMXDeviceConnection.h"
+#include "SMXHIDTransport.h"
 #include "Helpers.h"
 
 #include <string>
@@ -12,18 +13,21 @@ using namespace SMX;
 #include <hidsdi.h>
 #include <SetupAPI.h>
 
-// Return all USB HID device paths.  This doesn't open the device to filter just our devices.
-static set<wstring> GetAllHIDDevicePaths(wstring &error)
+// Find all USB HID device paths.  This doesn't open the device to filter just our devices.
+// Return false if the list couldn't be read.
+static bool GetAllHIDDevicePaths(set<wstring> &paths, wstring &error)
 {
     HDEVINFO DeviceInfoSet = NULL;
 
     GUID HidGuid;
     HidD_GetHidGuid(&HidGuid);
     DeviceInfoSet = SetupDiGetClassDevs(&HidGuid, NULL, NULL, DIGCF_DEVICEINTERFACE | DIGCF_PRESENT);
-    if(DeviceInfoSet == NULL)
-        return {};
+    if(DeviceInfoSet == INVALID_HANDLE_VALUE)
+    {
+        error = L"SetupDiGetClassDevs failed: " + GetErrorString(GetLastError());
+        return false;
+    }
 
-    set<wstring> paths;
     SP_DEVICE_INTERFACE_DATA DeviceInterfaceData;
     DeviceInterfaceData.cbSize = sizeof(SP_DEVICE_INTERFACE_DATA);
     for(DWORD iIndex = 0;
@@ -59,11 +63,16 @@ static set<wstring> GetAllHIDDevicePaths(wstring &error)
 
     SetupDiDestroyDeviceInfoList(DeviceInfoSet);
 
-    return paths;
+    return true;
 }
 
-static shared_ptr<AutoCloseHandle> OpenUSBDevice(LPCTSTR DevicePath, wstring &error)
+// Open the device at sDevicePath, and return it if it's ours.  Whatever we find out about
+// it is stored in info, so we remember it even if it isn't ours.  Failures are only logged,
+// since many unrelated devices will fail to open.
+static shared_ptr<AutoCloseHandle> OpenUSBDevice(const wstring &sDevicePath, SMXDeviceSearch::CachedDevice &info)
 {
+    LPCWSTR DevicePath = sDevicePath.c_str();
+
     // Log(ssprintf("Opening device: %ls", DevicePath));
     HANDLE OpenDevice = CreateFile(
         DevicePath,
@@ -74,7 +83,6 @@ static shared_ptr<AutoCloseHandle> OpenUSBDevice(LPCTSTR DevicePath, wstring &er
 
     if(OpenDevice == INVALID_HANDLE_VALUE)
     {
-        // Many unrelated devices will fail to open, so don't return this as an error.
         Log(wssprintf(L"Error opening device %ls: %ls", DevicePath, GetErrorString(GetLastError()).c_str()));
         return nullptr;
     }
@@ -87,10 +95,11 @@ static shared_ptr<AutoCloseHandle> OpenUSBDevice(LPCTSTR DevicePath, wstring &er
     if(!HidD_GetAttributes(result->value(), &HidAttributes))
     {
         Log(ssprintf("Error opening device %ls: HidD_GetAttributes failed", DevicePath));
-        error = L"HidD_GetAttributes failed";
         return nullptr;
     }
 
+    info.m_iVendorID = HidAttributes.VendorID;
+    info.m_iProductID = HidAttributes.ProductID;
     if(HidAttributes.VendorID != 0x2341 || HidAttributes.ProductID != 0x8037)
     {
         Log(ssprintf("Device %ls: not our device (ID %04x:%04x)", DevicePath, HidAttributes.VendorID, HidAttributes.ProductID));
@@ -107,68 +116,97 @@ static shared_ptr<AutoCloseHandle> OpenUSBDevice(LPCTSTR DevicePath, wstring &er
         return nullptr;
     }
 
-    if(wstring(ProductName) != L"StepManiaX")
+    info.m_sProductName = ProductName;
+    if(info.m_sProductName != L"StepManiaX")
     {
         Log(ssprintf("Device %ls: not our device (%ls)", DevicePath, ProductName));
         return nullptr;
     }
 
+    // The serial number is only informational, so it's not an error if there isn't one.
+    WCHAR SerialNumber[255];
+    ZeroMemory(SerialNumber, sizeof(SerialNumber));
+    if(HidD_GetSerialNumberString(result->value(), SerialNumber, sizeof(SerialNumber)))
+        info.m_sSerialNumber = SerialNumber;
+
     return result;
 }
 
-vector<shared_ptr<AutoCloseHandle>> SMX::SMXDeviceSearch::GetDevices(wstring &error)
+SMX::SMXDeviceSearch::SMXDeviceSearch()
+{
+}
+
+// We don't register for device notifications on Windows yet, so SMXDeviceSearchThreaded
+// polls.
+HANDLE SMX::SMXDeviceSearch::GetChangeHandle() const
+{
+    return INVALID_HANDLE_VALUE;
+}
+
+bool SMX::SMXDeviceSearch::CheckForChanges()
 {
-    set<wstring> aDevicePaths = GetAllHIDDevicePaths(error);
+    return true;
+}
+
+vector<shared_ptr<SMXTransport>> SMX::SMXDeviceSearch::GetDevices(wstring &error)
+{
+    // If we couldn't get the device list, leave the cache alone.  If we cleared it, we'd
+    // open every device again next time.
+    set<wstring> aDevicePaths;
+    if(!GetAllHIDDevicePaths(aDevicePaths, error))
+        return {};
 
-    // Remove any entries in m_Devices that are no longer in the list.
-    for(wstring sPath: m_setLastDevicePaths)
+    // Forget about paths that are gone.
+    for(auto it = m_DeviceCache.begin(); it != m_DeviceCache.end(); )
     {
-        if(aDevicePaths.find(sPath) != aDevicePaths.end())
+        if(aDevicePaths.find(it->first) != aDevicePaths.end())
+        {
+            ++it;
             continue;
+        }
 
-        Log(ssprintf("Device removed: %ls", sPath.c_str()));
-        m_Devices.erase(sPath);
+        if(it->second.m_pTransport)
+            Log(ssprintf("Device removed: %ls", it->first.c_str()));
+        it = m_DeviceCache.erase(it);
     }
 
-    // Check for new entries.
-    for(wstring sPath: aDevicePaths)
+    // Check paths we haven't seen before.  Paths we've already seen are in the cache
+    // whether or not they're ours, since OpenUSBDevice has to open the device and causes
+    // requests to be sent to it.
+    for(const wstring &sPath: aDevicePaths)
     {
-        // Only look at devices that weren't in the list last time.  OpenUSBDevice has
-        // to open the device and causes requests to be sent to it.
-        if(m_setLastDevicePaths.find(sPath) != m_setLastDevicePaths.end())
+        if(m_DeviceCache.find(sPath) != m_DeviceCache.end())
             continue;
 
         // This will return NULL if this isn't our device.
-        shared_ptr<AutoCloseHandle> hDevice = OpenUSBDevice(sPath.c_str(), error);
+        CachedDevice &device = m_DeviceCache[sPath];
+        shared_ptr<AutoCloseHandle> hDevice = OpenUSBDevice(sPath, device);
         if(hDevice == nullptr)
             continue;
 
         Log(ssprintf("Device added: %ls", sPath.c_str()));
-        m_Devices[sPath] = hDevice;
+        device.m_pTransport = make_shared<SMXHIDTransport>(hDevice);
     }
 
-    m_setLastDevicePaths = aDevicePaths;
-
-    vector<shared_ptr<AutoCloseHandle>> aDevices;
-    for(auto it: m_Devices)
-        aDevices.push_back(it.second);
+    vector<shared_ptr<SMXTransport>> aDevices;
+    for(const auto &it: m_DeviceCache)
+    {
+        if(it.second.m_pTransport)
+            aDevices.push_back(it.second.m_pTransport);
+    }
 
     return aDevices;
 }
 
-void SMX::SMXDeviceSearch::DeviceWasClosed(shared_ptr<AutoCloseHandle> pDevice)
+void SMX::SMXDeviceSearch::DeviceWasClosed(shared_ptr<SMXTransport> pDevice)
 {
-    map<wstring, shared_ptr<AutoCloseHandle>> aDevices;
-    for(auto it: m_Devices)
+    // Forget about the device, so we'll open it again if it's still there.
+    for(auto it = m_DeviceCache.begin(); it != m_DeviceCache.end(); ++it)
     {
-        if(it.second == pDevice)
-        {
-            m_setLastDevicePaths.erase(it.first);
-        }
-        else
+        if(it->second.m_pTransport == pDevice)
         {
-            aDevices[it.first] = it.second;
+            m_DeviceCache.erase(it);
+            break;
         }
     }
-    m_Devices = aDevices;
 }
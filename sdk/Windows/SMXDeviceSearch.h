@@ -6,27 +6,68 @@
 #include <vector>
 #include <set>
 #include <map>
+#include <stdint.h>
 using namespace std;
 
 #include "Helpers.h"
 
 namespace SMX {
+class SMXTransport;
 
+// Find connected devices.  This is platform-specific: SMXDeviceSearch.cpp searches HID
+// devices on Windows, and Linux/SMXDeviceSearchLinux.cpp searches hidraw devices.
+//
+// The functions are virtual so tests can substitute simulated devices.
 class SMXDeviceSearch
 {
 public:
+    SMXDeviceSearch();
+    virtual ~SMXDeviceSearch() { }
+
     // Return a list of connected devices.  If the same device stays connected and this
-    // is called multiple times, the same handle will be returned.
-    vector<shared_ptr<AutoCloseHandle>> GetDevices(wstring &error);
+    // is called multiple times, the same transport will be returned.
+    virtual vector<shared_ptr<SMXTransport>> GetDevices(wstring &error);
 
     // After a device is opened and then closed, tell this class that the device was closed.
     // We'll discard our record of it, so we'll notice a new device plugged in on the same
     // path.
-    void DeviceWasClosed(shared_ptr<AutoCloseHandle> pDevice);
+    virtual void DeviceWasClosed(shared_ptr<SMXTransport> pDevice);
+
+    // Return a handle that's signalled (Windows) or readable (Linux) when devices may have
+    // been added or removed, for SMXIOWaiter::AddHandle.  If we can't be notified about
+    // devices changing, return INVALID_HANDLE_VALUE, and the caller needs to poll.
+    virtual HANDLE GetChangeHandle() const;
+
+    // Clear the change handle, and return true if devices may have changed since the last
+    // call, so GetDevices needs to be called.  If there's no change handle, this always
+    // returns true.
+    virtual bool CheckForChanges();
+
+    // What we know about a device path.
+    struct CachedDevice
+    {
+        // Our transport for the device, or null if the device isn't ours or couldn't be
+        // opened.
+        shared_ptr<SMXTransport> m_pTransport;
+
+        // The device's IDs, product name and USB serial number, if we could read them.  The
+        // serial number is only read for our devices, and is empty if the device has none.
+        uint16_t m_iVendorID = 0;
+        uint16_t m_iProductID = 0;
+        wstring m_sProductName;
+        wstring m_sSerialNumber;
+    };
 
 private:
-    set<wstring> m_setLastDevicePaths;
-    map<wstring, shared_ptr<AutoCloseHandle>> m_Devices;
+    // Every device path we've seen.  A path is only opened the first time it's seen, so
+    // devices that aren't ours aren't opened again on every search.  Entries are removed
+    // when the path goes away, or when our device on it is closed.
+    map<wstring, CachedDevice> m_DeviceCache;
+
+#ifndef _WIN32
+    // An inotify handle watching /dev for hidraw devices.
+    shared_ptr<AutoCloseHandle> m_hDeviceNotify;
+#endif
 };
 }
 
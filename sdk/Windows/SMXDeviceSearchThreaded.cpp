@@ -1,21 +1,28 @@
 #include "SMXDeviceSearchThreaded.h"
 #include "SMXDeviceSearch.h"
-#include "SMXDeviceConnection.h"
+#include "SMXTransport.h"
 
-#include <windows.h>
 #include <memory>
+#include <algorithm>
 using namespace std;
 using namespace SMX;
 
-SMX::SMXDeviceSearchThreaded::SMXDeviceSearchThreaded()
+SMX::SMXDeviceSearchThreaded::SMXDeviceSearchThreaded(function<void()> pDevicesChanged, shared_ptr<SMXDeviceSearch> pDeviceList):
+    SMXThread(m_Lock),
+    m_pDeviceList(pDeviceList),
+    m_pDevicesChanged(pDevicesChanged)
 {
-    m_hEvent = make_shared<AutoCloseHandle>(CreateEvent(NULL, false, false, NULL));
-    m_pDeviceList = make_shared<SMXDeviceSearch>();
+    if(m_pDeviceList == nullptr)
+        m_pDeviceList = make_shared<SMXDeviceSearch>();
+
+    // Wake up when devices change, if the platform can tell us.
+    m_pWaiter = make_shared<SMXIOWaiter>();
+    HANDLE hChangeHandle = m_pDeviceList->GetChangeHandle();
+    if(hChangeHandle != INVALID_HANDLE_VALUE)
+        m_pWaiter->AddHandle(hChangeHandle);
 
     // Start the thread.
-    DWORD id;
-    m_hThread = CreateThread(NULL, 0, ThreadMainStart, this, 0, &id);
-    SMX::SetThreadName(id, "SMXDeviceSearch");
+    Start("SMXDeviceSearch");
 }
 
 SMX::SMXDeviceSearchThreaded::~SMXDeviceSearchThreaded()
@@ -26,22 +33,15 @@ SMX::SMXDeviceSearchThreaded::~SMXDeviceSearchThreaded()
 
 void SMX::SMXDeviceSearchThreaded::Shutdown()
 {
-    if(m_hThread == INVALID_HANDLE_VALUE)
-        return;
+    m_Lock.AssertNotLockedByCurrentThread();
 
-    // Tell the thread to shut down, and wait for it before returning.
-    m_bShutdown = true;
-    SetEvent(m_hEvent->value());
+    {
+        LockMutex L(m_Lock);
+        m_bShutdown = true;
+    }
+    m_pWaiter->Wake();
 
-    WaitForSingleObject(m_hThread, INFINITE);
-    m_hThread = INVALID_HANDLE_VALUE;
-}
-
-DWORD WINAPI SMX::SMXDeviceSearchThreaded::ThreadMainStart(void *self_)
-{
-    SMXDeviceSearchThreaded *self = (SMXDeviceSearchThreaded *) self_;
-    self->ThreadMain();
-    return 0;
+    SMXThread::Shutdown();
 }
 
 void SMX::SMXDeviceSearchThreaded::UpdateDeviceList()
@@ -58,7 +58,7 @@ void SMX::SMXDeviceSearchThreaded::UpdateDeviceList()
 
     // Get the current device list.
     wstring sError;
-    vector<shared_ptr<AutoCloseHandle>> apDevices = m_pDeviceList->GetDevices(sError);
+    vector<shared_ptr<SMXTransport>> apDevices = m_pDeviceList->GetDevices(sError);
     if(!sError.empty())
     {
         Log(ssprintf("Error listing USB devices: %ls", sError.c_str()));
@@ -67,31 +67,93 @@ void SMX::SMXDeviceSearchThreaded::UpdateDeviceList()
 
     // Update the device list returned by GetDevices.
     m_Lock.Lock();
+    bool bChanged = apDevices != m_apDevices;
     m_apDevices = apDevices;
     m_Lock.Unlock();
+
+    // Let the caller know, so it doesn't have to poll GetDevices.
+    if(bChanged && m_pDevicesChanged)
+        m_pDevicesChanged();
 }
 
 void SMX::SMXDeviceSearchThreaded::ThreadMain()
 {
+    static const vector<shared_ptr<SMXTransport>> apNoTransports;
+
+    // If we're notified about changes, we only need a full search occasionally.  Otherwise,
+    // CheckForChanges always returns true and we search every PollInterval.
+    const bool bNotified = m_pDeviceList->GetChangeHandle() != INVALID_HANDLE_VALUE;
+    const double fSearchInterval = bNotified? FullSearchInterval:PollInterval;
+    double fNextSearch = 0;
+    double fNextClosedSearch = 0;
+
+    m_Lock.Lock();
     while(!m_bShutdown)
     {
-        UpdateDeviceList();
-        WaitForSingleObjectEx(m_hEvent->value(), 250, true);
+        // If a device was closed, search now unless we already did recently for another
+        // closed device.  In that case, leave the request set until it's time.
+        double fNow = GetMonotonicTime();
+        bool bSearch = false;
+        if(m_bSearchRequested && fNow >= fNextClosedSearch)
+        {
+            bSearch = true;
+            m_bSearchRequested = false;
+            fNextClosedSearch = fNow + ClosedSearchInterval;
+        }
+        bool bSearchPending = m_bSearchRequested;
+        m_Lock.Unlock();
+
+        // Always call CheckForChanges, so the change handle is cleared.
+        if(m_pDeviceList->CheckForChanges())
+            bSearch = true;
+
+        if(fNow >= fNextSearch)
+            bSearch = true;
+
+        if(bSearch)
+        {
+            UpdateDeviceList();
+            fNextSearch = fNow + fSearchInterval;
+        }
+
+        double fWakeAt = bSearchPending? min(fNextSearch, fNextClosedSearch):fNextSearch;
+        int iDelayMS = int(max(0.0, fWakeAt - GetMonotonicTime()) * 1000) + 1;
+        m_pWaiter->Wait(apNoTransports, iDelayMS);
+
+        m_Lock.Lock();
     }
+    m_Lock.Unlock();
 }
 
-void SMX::SMXDeviceSearchThreaded::DeviceWasClosed(shared_ptr<AutoCloseHandle> pDevice)
+void SMX::SMXDeviceSearchThreaded::DeviceWasClosed(shared_ptr<SMXTransport> pDevice)
 {
     // Add pDevice to the list of closed devices.  We'll call m_pDeviceList->DeviceWasClosed
     // on these from the scanning thread.
+    LockMutex L(m_Lock);
     m_apClosedDevices.push_back(pDevice);
+
+    // Search again soon.  If the device was closed because of an error and it's still
+    // connected, this reconnects it without waiting for the next full search.  ThreadMain
+    // limits how often this happens, in case the device keeps failing.
+    m_bSearchRequested = true;
+    m_pWaiter->Wake();
+
+    // Added devices go away once they're closed.
+    auto it = find(m_apAddedDevices.begin(), m_apAddedDevices.end(), pDevice);
+    if(it != m_apAddedDevices.end())
+        m_apAddedDevices.erase(it);
+}
+
+void SMX::SMXDeviceSearchThreaded::AddDevice(shared_ptr<SMXTransport> pDevice)
+{
+    LockMutex L(m_Lock);
+    m_apAddedDevices.push_back(pDevice);
 }
 
-vector<shared_ptr<AutoCloseHandle>> SMX::SMXDeviceSearchThreaded::GetDevices()
+void SMX::SMXDeviceSearchThreaded::GetDevices(vector<shared_ptr<SMXTransport>> &apDevices)
 {
     // Lock to make a copy of the device list.
-    m_Lock.Lock();
-    vector<shared_ptr<AutoCloseHandle>> apResult = m_apDevices;
-    m_Lock.Unlock();
-    return apResult;
+    LockMutex L(m_Lock);
+    apDevices.assign(m_apDevices.begin(), m_apDevices.end());
+    apDevices.insert(apDevices.end(), m_apAddedDevices.begin(), m_apAddedDevices.end());
 }
@@ -2,7 +2,8 @@
 #define SMXDeviceSearchThreaded_h
 
 #include "Helpers.h"
-#include <windows.h>
+#include "SMXThread.h"
+#include <functional>
 #include <memory>
 #include <vector>
 using namespace std;
@@ -10,36 +11,62 @@ using namespace std;
 namespace SMX {
 
 class SMXDeviceSearch;
+class SMXIOWaiter;
+class SMXTransport;
 
 // This is a wrapper around SMXDeviceSearch which performs USB scanning in a thread.
 // It's free on Win10, but takes a while on Windows 7 (about 8ms), so running it on
 // a separate thread prevents random timing errors when reading HID updates.
-class SMXDeviceSearchThreaded
+//
+// If the platform tells us when devices are added or removed, we only search when that
+// happens, with an occasional full search in case we missed something.  Otherwise, we
+// poll.
+class SMXDeviceSearchThreaded: public SMXThread
 {
 public:
-    SMXDeviceSearchThreaded();
+    // pDevicesChanged is called from the search thread when the list returned by
+    // GetDevices changes.  If pDeviceList is null, a normal SMXDeviceSearch is used.
+    SMXDeviceSearchThreaded(function<void()> pDevicesChanged = nullptr, shared_ptr<SMXDeviceSearch> pDeviceList = nullptr);
     ~SMXDeviceSearchThreaded();
 
-    // The same interface as SMXDeviceSearch:
-    vector<shared_ptr<SMX::AutoCloseHandle>> GetDevices();
-    void DeviceWasClosed(shared_ptr<SMX::AutoCloseHandle> pDevice);
-
-    // Synchronously shut down the thread.
+    // Shut down the thread.  This hides SMXThread::Shutdown, since we wait on m_pWaiter
+    // and not m_Event.
     void Shutdown();
 
+    // The same interface as SMXDeviceSearch, except GetDevices fills in a list instead
+    // of returning one, so the caller can reuse it without allocating.
+    void GetDevices(vector<shared_ptr<SMXTransport>> &apDevices);
+    void DeviceWasClosed(shared_ptr<SMXTransport> pDevice);
+
+    // Add a device that isn't found by searching, like an SMXSimulatedDevice.  It'll be
+    // returned by GetDevices until it's closed.
+    void AddDevice(shared_ptr<SMXTransport> pDevice);
+
 private:
     void UpdateDeviceList();
-
-    static DWORD WINAPI ThreadMainStart(void *self_);
     void ThreadMain();
 
+    // How often we search when we can't be notified about changes, and how often we do a
+    // full search when we can, in seconds.
+    static constexpr double PollInterval = 0.25;
+    static constexpr double FullSearchInterval = 5;
+
+    // Searches requested because a device was closed are at most this often, so a device
+    // that fails as soon as it's opened isn't reopened in a tight loop.
+    static constexpr double ClosedSearchInterval = PollInterval;
+
     SMX::Mutex m_Lock;
     shared_ptr<SMXDeviceSearch> m_pDeviceList;
-    shared_ptr<SMX::AutoCloseHandle> m_hEvent;
-    vector<shared_ptr<SMX::AutoCloseHandle>> m_apDevices;
-    vector<shared_ptr<SMX::AutoCloseHandle>> m_apClosedDevices;
-    bool m_bShutdown = false;
-    HANDLE m_hThread = INVALID_HANDLE_VALUE;
+    shared_ptr<SMXIOWaiter> m_pWaiter;
+    function<void()> m_pDevicesChanged;
+
+    // This is set when a device is closed, so we search again right away, or once
+    // ClosedSearchInterval has passed since the last search for a closed device.
+    bool m_bSearchRequested = false;
+
+    vector<shared_ptr<SMXTransport>> m_apDevices;
+    vector<shared_ptr<SMXTransport>> m_apClosedDevices;
+    vector<shared_ptr<SMXTransport>> m_apAddedDevices;
 };
 }
 
@@ -1,15 +1,21 @@
 #include "SMXGif.h"
+#include <limits.h>
 #include <stdint.h>
+#include <algorithm>
+#include <memory>
 #include <string>
 #include <vector>
 using namespace std;
 
-// This is a simple animated GIF decoder.  It always decodes to RGBA color,
-// discarding palettes, and decodes the whole file at once.
+// This is a simple animated GIF decoder.  It decodes the whole file at once.  Frames
+// are decoded to 8-bit indexes into a single palette for the whole animation, so the
+// GIF's global and local palettes are merged as frames are decoded.
 
 class GIFError: public exception { };
 
-struct Palette
+// A palette stored in the GIF.  Entries past the end of the GIF's palette are
+// transparent.
+struct GIFPalette
 {
     SMXGif::Color color[256];
 };
@@ -21,11 +27,9 @@ void SMXGif::GIFImage::Init(int width_, int height_)
     image.resize(width * height);
 }
 
-void SMXGif::GIFImage::Clear(const Color &color)
+void SMXGif::GIFImage::Clear(uint8_t index)
 {
-    for(int y = 0; y < height; ++y)
-        for(int x = 0; x < width; ++x)
-            get(x,y) = color;
+    fill(image.begin(), image.end(), index);
 }
 
 void SMXGif::GIFImage::CropImage(SMXGif::GIFImage &dst, int crop_left, int crop_top, int crop_width, int crop_height) const
@@ -33,20 +37,15 @@ void SMXGif::GIFImage::CropImage(SMXGif::GIFImage &dst, int crop_left, int crop_
     dst.Init(crop_width, crop_height);
 
     for(int y = 0; y < crop_height; ++y)
-    {
-        for(int x = 0; x < crop_width; ++x)
-            dst.get(x,y) = get(x + crop_left, y + crop_top);
-    }
+        memcpy(dst.image.data() + y*crop_width, image.data() + (crop_top + y)*width + crop_left, crop_width);
 }
 
-void SMXGif::GIFImage::Blit(SMXGif::GIFImage &src, int dst_left, int dst_top, int dst_width, int dst_height)
+void SMXGif::GIFImage::Blit(const SMXGif::GIFImage &src, int dst_left, int dst_top, int dst_width, int dst_height)
 {
     for(int y = 0; y < dst_height; ++y)
-    {
-        for(int x = 0; x < dst_width; ++x)
-            get(x + dst_left, y + dst_top) = src.get(x, y);
-    }
+        memcpy(image.data() + (dst_top + y)*width + dst_left, src.image.data() + y*src.width, dst_width);
 }
+
 bool SMXGif::GIFImage::operator==(const GIFImage &rhs) const
 {
     return
@@ -55,17 +54,19 @@ bool SMXGif::GIFImage::operator==(const GIFImage &rhs) const
         image == rhs.image;
 }
 
+// A bounds-checked cursor over the GIF data.  This doesn't own or copy the data, which
+// must stay valid while it's being decoded.
 class DataStream
 {
 public:
-    DataStream(const string &data_):
-        data(data_)
+    DataStream(const uint8_t *data_, size_t size_):
+        data(data_), size(size_)
     {
     }
 
     uint8_t ReadByte()
     {
-        if(pos >= data.size())
+        if(pos >= size)
             throw GIFError();
 
         uint8_t result = data[pos];
@@ -80,55 +81,58 @@ public:
         return byte1 | (byte2 << 8);
     }
 
-    void ReadBytes(string &s, int count)
+    // Return a pointer to the next count bytes, and advance past them.
+    const uint8_t *ReadBytes(size_t count)
+    {
+        if(count > size - pos)
+            throw GIFError();
+
+        const uint8_t *result = data + pos;
+        pos += count;
+        return result;
+    }
+
+    // Return a stream for the next count bytes, and advance past them.
+    DataStream ReadBlock(size_t count)
     {
-        s.clear();
-        while(count--)
-            s.push_back(ReadByte());
+        return DataStream(ReadBytes(count), count);
     }
 
-    void skip(int bytes)
+    void skip(size_t bytes)
     {
-        pos += bytes;
+        ReadBytes(bytes);
     }
 
 private:
-    const string &data;
-    uint32_t pos = 0;
+    const uint8_t *data;
+    size_t size;
+    size_t pos = 0;
 };
 
-class LWZStream
+// Read LZW codes from GIF data sub-blocks.  Bits are buffered up to 64 at a time, so
+// most codes are read without touching the stream.
+class LZWStream
 {
 public:
-    LWZStream(DataStream &stream_):
+    LZWStream(DataStream &stream_):
         stream(stream_)
     {
     }
 
     // Read one LZW code from the input data.
-    uint32_t ReadLZWCode(uint32_t bit_count)
+    uint32_t ReadLZWCode(int bit_count)
     {
-        while(bits_in_buffer < bit_count)
+        if(bits_in_buffer < bit_count)
         {
-            if(bytes_remaining == 0)
-            {
-                // Read the next block's byte count.
-                bytes_remaining = stream.ReadByte();
-                if(bytes_remaining == 0)
-                    throw GIFError();
-            }
-
-            // Shift in another 8 bits into the end of self.bits.
-            bits |= stream.ReadByte() << bits_in_buffer;
-            bits_in_buffer += 8;
-            bytes_remaining -= 1;
+            Refill();
+            if(bits_in_buffer < bit_count)
+                throw GIFError();
         }
 
         // Shift out bit_count worth of data from the end.
-        uint32_t result = bits & ((1 << bit_count) - 1);
+        uint32_t result = uint32_t(bits) & ((1 << bit_count) - 1);
         bits >>= bit_count;
         bits_in_buffer -= bit_count;
-
         return result;
     }
 
@@ -137,6 +141,8 @@ public:
     {
         stream.skip(bytes_remaining);
         bytes_remaining = 0;
+        if(terminated)
+            return;
 
         // If there are any blocks past the end of data, skip them.
         while(1)
@@ -149,113 +155,181 @@ public:
     }
 
 private:
+    // Fill the bit buffer with as many whole bytes as fit, or until the data ends.
+    void Refill()
+    {
+        while(bits_in_buffer <= 56)
+        {
+            if(bytes_remaining == 0)
+            {
+                if(terminated)
+                    return;
+
+                // Read the next block's byte count.  A zero-length block ends the data.
+                bytes_remaining = stream.ReadByte();
+                if(bytes_remaining == 0)
+                {
+                    terminated = true;
+                    return;
+                }
+            }
+
+            int count = min(bytes_remaining, (64 - bits_in_buffer) / 8);
+            const uint8_t *data = stream.ReadBytes(count);
+            for(int i = 0; i < count; ++i)
+            {
+                bits |= uint64_t(data[i]) << bits_in_buffer;
+                bits_in_buffer += 8;
+            }
+            bytes_remaining -= count;
+        }
+    }
+
     DataStream &stream;
-    uint32_t bits = 0;
+    uint64_t bits = 0;
     int bytes_remaining = 0;
     int bits_in_buffer = 0;
+    bool terminated = false;
 };
 
-struct LWZDecoder
-{
-    LWZDecoder(DataStream &stream):
-        lzw_stream(LWZStream(stream))
-    {
-        // Each frame has a single bits field.
-        code_bits = stream.ReadByte();
-    }
-
-    string DecodeImage();
+static const int GIFBITS = 12;
 
-private:
-    uint16_t code_bits;
-    LWZStream lzw_stream;
+// The LZW dictionary.  Each code is a previous code plus one byte.  We also store the
+// length of each code's string and its first byte, so a string can be written straight
+// into place without walking the list first, and a code's first byte is known without
+// walking it at all.
+struct LZWTable
+{
+    uint16_t prefix[1 << GIFBITS];
+    uint8_t suffix[1 << GIFBITS];
+    uint8_t first[1 << GIFBITS];
+    uint16_t length[1 << GIFBITS];
 };
 
+// Write the string for code into out[pos, pos+len).  Anything past out_size is dropped.
+static void WriteLZWString(const LZWTable &table, uint32_t code, int len, uint8_t *out, int pos, int out_size)
+{
+    int i = pos + len - 1;
 
-static const int GIFBITS = 12;
+    // Skip any part of the string that's past the end of the image.
+    while(i >= out_size)
+    {
+        code = table.prefix[code];
+        --i;
+    }
 
-string LWZDecoder::DecodeImage()
+    while(i >= pos)
+    {
+        out[i] = table.suffix[code];
+        code = table.prefix[code];
+        --i;
+    }
+}
+
+// Decode one image's LZW data from stream into out.  Return the number of pixels the
+// data contained, which can be more than out_size.  Pixels past out_size are discarded.
+static int DecodeLZWImage(DataStream &stream, LZWTable &table, uint8_t *out, int out_size)
 {
-    uint32_t dictionary_bits = code_bits + 1;
-    int prev_code1 = -1;
-    int prev_code2 = -1;
+    // Each frame has a single bits field.
+    int code_bits = stream.ReadByte();
+    if(code_bits >= GIFBITS)
+        throw GIFError();
 
-    uint32_t clear = 1 << code_bits;
-    uint32_t end = clear + 1;
-    uint32_t next_free_slot = clear + 2;
+    LZWStream lzw_stream(stream);
 
-    vector<pair<int,int>> dictionary;
-    dictionary.resize(1 << GIFBITS);
+    const uint32_t clear = 1 << code_bits;
+    const uint32_t end = clear + 1;
+    int dictionary_bits = code_bits + 1;
+    uint32_t next_free_slot = clear + 2;
+    int prev_code = -1;
 
-    // We append to this buffer as we decode data, then append the data in reverse
-    // order.
-    string append_buffer;
+    for(uint32_t code = 0; code < clear; ++code)
+    {
+        table.suffix[code] = uint8_t(code);
+        table.first[code] = uint8_t(code);
+        table.length[code] = 1;
+    }
 
-    string result;
+    // This is 64-bit, since a large enough file can hold more than 2^31 pixels.
+    int64_t pos = 0;
     while(1)
     {
-        // Flush append_buffer.
-        for(int i = append_buffer.size() - 1; i >= 0; --i)
-            result.push_back(append_buffer[i]);
-        append_buffer.clear();
-
-        int code1 = lzw_stream.ReadLZWCode(dictionary_bits);
-        // printf("%02x");
-        if(code1 == end)
+        uint32_t code = lzw_stream.ReadLZWCode(dictionary_bits);
+        if(code == end)
             break;
 
-        if(code1 == clear)
+        if(code == clear)
         {
             // Clear the dictionary and reset.
             dictionary_bits = code_bits + 1;
             next_free_slot = clear + 2;
-            prev_code1 = -1;
-            prev_code2 = -1;
+            prev_code = -1;
             continue;
         }
 
-        int code2;
-        if(code1 < next_free_slot)
-            code2 = code1;
-        else if(code1 == next_free_slot && prev_code2 != -1)
+        int len;
+        uint8_t first_byte;
+        if(code < next_free_slot)
         {
-            append_buffer.push_back(prev_code2);
-            code2 = prev_code1;
+            len = table.length[code];
+            first_byte = table.first[code];
+            if(pos < out_size)
+                WriteLZWString(table, code, len, out, int(pos), out_size);
+        }
+        else if(code == next_free_slot && prev_code != -1)
+        {
+            // This code is the one we're about to add: the previous string plus its own
+            // first byte.
+            len = table.length[prev_code] + 1;
+            first_byte = table.first[prev_code];
+            if(pos < out_size)
+            {
+                WriteLZWString(table, prev_code, len - 1, out, int(pos), out_size);
+                if(pos + len - 1 < out_size)
+                    out[pos + len - 1] = first_byte;
+            }
         }
         else
             throw GIFError();
 
-        // Walk through the linked list of codes in the dictionary and append.
-        while(code2 >= clear + 2)
-        {
-            uint8_t append_char = dictionary[code2].first;
-            code2 = dictionary[code2].second;
-            append_buffer.push_back(append_char);
-        }
-        append_buffer.push_back(code2);
+        pos += len;
 
         // If we're already at the last free slot, the dictionary is full and can't be expanded.
-        if(next_free_slot < (1 << dictionary_bits))
+        if(next_free_slot < uint32_t(1 << dictionary_bits))
         {
             // If we have any free dictionary slots, save.
-            if(prev_code1 != -1)
+            if(prev_code != -1)
             {
-                dictionary[next_free_slot] = make_pair(code2, prev_code1);
+                table.prefix[next_free_slot] = uint16_t(prev_code);
+                table.suffix[next_free_slot] = first_byte;
+                table.first[next_free_slot] = table.first[prev_code];
+                table.length[next_free_slot] = table.length[prev_code] + 1;
                 next_free_slot += 1;
             }
+
             // If we've just filled the last dictionary slot, expand the dictionary size if possible.
-            if(next_free_slot >= (1 << dictionary_bits) && dictionary_bits < GIFBITS)
+            if(next_free_slot >= uint32_t(1 << dictionary_bits) && dictionary_bits < GIFBITS)
                 dictionary_bits += 1;
         }
 
-        prev_code1 = code1;
-        prev_code2 = code2;
+        prev_code = code;
     }
 
     // Skip any remaining data in this block.
     lzw_stream.Flush();
 
-    return result;
+    return int(min<int64_t>(pos, INT_MAX));
+}
+
+int SMXGif::DecodeLZW(const uint8_t *data, size_t size, uint8_t *pixels, int pixel_count)
+{
+    DataStream stream(data, size);
+    unique_ptr<LZWTable> table(new LZWTable);
+    try {
+        return DecodeLZWImage(stream, *table, pixels, pixel_count);
+    } catch(GIFError &) {
+        return -1;
+    }
 }
 
 struct GlobalGIFData
@@ -267,7 +341,7 @@ struct GlobalGIFData
     int duration = 0;
     int disposal_method = 0;
     bool have_global_palette = false;
-    Palette palette;
+    GIFPalette palette;
 };
 
 class GIFDecoder
@@ -281,21 +355,35 @@ public:
     void ReadAllFrames(vector<SMXGif::SMXGifFrame> &frames);
 
 private:
-    bool ReadPacket(string &packet);
-    Palette ReadPalette(int palette_size);
+    bool ReadPacket(DataStream &packet);
+    GIFPalette ReadPalette(int palette_size);
     void DecodeImage(GlobalGIFData global_data, SMXGif::GIFImage &out);
+    uint8_t AddColor(const SMXGif::Color &color);
+    uint8_t MapColor(const GIFPalette &gif_palette, uint8_t gif_index);
 
     DataStream &stream;
     SMXGif::GIFImage image;
     int frame;
+
+    // The palette shared by all frames, and the index in it of each color in the
+    // current frame's GIF palette, or -1 if it hasn't been added yet.  If
+    // palette_map_is_global is true, palette_map is for the global palette, and can
+    // be reused by the next frame if it uses the global palette too.
+    shared_ptr<SMXGif::Palette> palette;
+    int16_t palette_map[256];
+    bool palette_map_is_global = false;
+
+    // These are reused for each frame.
+    LZWTable lzw_table;
+    vector<uint8_t> decompressed_data;
 };
 
 // Read a palette with size colors.
 //
 // This is a simple string, with 4 RGBA bytes per color.
-Palette GIFDecoder::ReadPalette(int palette_size)
+GIFPalette GIFDecoder::ReadPalette(int palette_size)
 {
-    Palette result;
+    GIFPalette result;
     for(int i = 0; i < palette_size; ++i)
     {
         result.color[i].color[0] = stream.ReadByte(); // R
@@ -306,22 +394,47 @@ Palette GIFDecoder::ReadPalette(int palette_size)
     return result;
 }
 
-bool GIFDecoder::ReadPacket(string &packet)
+// Return the index of color in the shared palette, adding it if needed.
+uint8_t GIFDecoder::AddColor(const SMXGif::Color &color)
+{
+    // This only happens once per color per frame, so a linear search is fine.
+    for(size_t i = 0; i < palette->size(); ++i)
+    {
+        if((*palette)[i] == color)
+            return uint8_t(i);
+    }
+
+    if(palette->size() == 256)
+        throw GIFError();
+
+    palette->push_back(color);
+    return uint8_t(palette->size() - 1);
+}
+
+// Return the shared palette index for an index into the frame's GIF palette.
+uint8_t GIFDecoder::MapColor(const GIFPalette &gif_palette, uint8_t gif_index)
+{
+    if(palette_map[gif_index] == -1)
+        palette_map[gif_index] = AddColor(gif_palette.color[gif_index]);
+    return uint8_t(palette_map[gif_index]);
+}
+
+// Read a data sub-block.  Return false at the block terminator.
+bool GIFDecoder::ReadPacket(DataStream &packet)
 {
     uint8_t packet_size = stream.ReadByte();
     if(packet_size == 0)
         return false;
 
-    stream.ReadBytes(packet, packet_size);
+    packet = stream.ReadBlock(packet_size);
     return true;
 }
 
 void GIFDecoder::ReadAllFrames(vector<SMXGif::SMXGifFrame> &frames)
 {
-    string header;
-    stream.ReadBytes(header, 6);
+    const uint8_t *header = stream.ReadBytes(6);
 
-    if(header != "GIF87a" && header != "GIF89a")
+    if(memcmp(header, "GIF87a", 6) && memcmp(header, "GIF89a", 6))
         throw GIFError();
 
     GlobalGIFData global_data;
@@ -329,6 +442,7 @@ void GIFDecoder::ReadAllFrames(vector<SMXGif::SMXGifFrame> &frames)
     global_data.width = stream.ReadLE16();
     global_data.height = stream.ReadLE16();
     image.Init(global_data.width, global_data.height);
+    palette = make_shared<SMXGif::Palette>();
 
     // Ignore the aspect ratio field.  (Supporting pixel aspect ratios in a format
     // this rudimentary was almost ambitious of them...)
@@ -365,12 +479,10 @@ void GIFDecoder::ReadAllFrames(vector<SMXGif::SMXGifFrame> &frames)
 
             if(extension_type == 0xF9)
             {
-                string packet;
-                if(!ReadPacket(packet))
+                DataStream packet_buf(nullptr, 0);
+                if(!ReadPacket(packet_buf))
                     throw GIFError();
 
-                DataStream packet_buf(packet);
-
                 // Graphics control extension
                 uint8_t gce_flags = packet_buf.ReadByte();
                 global_data.duration = packet_buf.ReadLE16();
@@ -385,7 +497,7 @@ void GIFDecoder::ReadAllFrames(vector<SMXGif::SMXGifFrame> &frames)
             // Read any remaining packets in this extension packet.
             while(1)
             {
-                string packet;
+                DataStream packet(nullptr, 0);
                 if(!ReadPacket(packet))
                     break;
             }
@@ -400,7 +512,8 @@ void GIFDecoder::ReadAllFrames(vector<SMXGif::SMXGifFrame> &frames)
             gif_frame.width = global_data.width;
             gif_frame.height = global_data.height;
             gif_frame.milliseconds = global_data.duration * 10;
-            gif_frame.frame = frame_image;
+            gif_frame.frame = move(frame_image);
+            gif_frame.palette = palette;
 
             // If this frame is identical to the previous one, just extend the previous frame.
             if(!frames.empty() && gif_frame.frame == frames.back().frame)
@@ -409,7 +522,7 @@ void GIFDecoder::ReadAllFrames(vector<SMXGif::SMXGifFrame> &frames)
                 continue;
             }
 
-            frames.push_back(gif_frame);
+            frames.push_back(move(gif_frame));
 
             frame++;
 
@@ -436,6 +549,10 @@ void GIFDecoder::DecodeImage(GlobalGIFData global_data, SMXGif::GIFImage &out)
     uint16_t block_height = stream.ReadLE16();
     uint8_t local_flags = stream.ReadByte();
 
+    // Images that go outside the animation are invalid.
+    if(block_left + block_width > image.width || block_top + block_height > image.height)
+        throw GIFError();
+
     // area = (block_left, block_top, block_left + block_width, block_top + block_height)
     // Extract flags:
     uint8_t have_local_palette = (local_flags >> 7) & 1;
@@ -447,10 +564,18 @@ void GIFDecoder::DecodeImage(GlobalGIFData global_data, SMXGif::GIFImage &out)
     // assert interlaced == 0
 
     // If this frame has a local palette, use it.  Otherwise, use the global palette.
-    Palette active_palette = global_data.palette;
+    GIFPalette active_palette = global_data.palette;
     if(have_local_palette)
         active_palette = ReadPalette(1 << (local_palette_size + 1));
 
+    // Colors are added to the shared palette as this frame uses them.
+    if(have_local_palette || !palette_map_is_global)
+    {
+        for(int16_t &index: palette_map)
+            index = -1;
+    }
+    palette_map_is_global = !have_local_palette;
+
     if(!global_data.have_global_palette && !have_local_palette)
     {
         // We have no palette.  This is an invalid file.
@@ -462,16 +587,15 @@ void GIFDecoder::DecodeImage(GlobalGIFData global_data, SMXGif::GIFImage &out)
         // On the first frame, clear the buffer.  If we have a transparency index,
         // clear to transparent.  Otherwise, clear to the background color.
         if(global_data.transparency_index != -1)
-            image.Clear(SMXGif::Color(0,0,0,0));
+            image.Clear(AddColor(SMXGif::Color(0,0,0,0)));
         else
-            image.Clear(active_palette.color[global_data.background_index]);
+            image.Clear(MapColor(active_palette, global_data.background_index));
     }
 
     // Decode the compressed image data.
-    LWZDecoder decoder(stream);
-    string decompressed_data = decoder.DecodeImage();
-
-    if(decompressed_data.size() < block_width*block_height)
+    int pixel_count = block_width*block_height;
+    decompressed_data.resize(pixel_count);
+    if(DecodeLZWImage(stream, lzw_table, decompressed_data.data(), pixel_count) < pixel_count)
         throw GIFError();
 
     // Save the region to restore after decoding.
@@ -486,12 +610,9 @@ void GIFDecoder::DecodeImage(GlobalGIFData global_data, SMXGif::GIFImage &out)
         dispose.Init(block_width, block_height);
 
         if(global_data.transparency_index != -1)
-            dispose.Clear(SMXGif::Color(0,0,0,0));
+            dispose.Clear(AddColor(SMXGif::Color(0,0,0,0)));
         else
-        {
-            uint8_t palette_idx = global_data.background_index;
-            dispose.Clear(active_palette.color[palette_idx]);
-        }
+            dispose.Clear(MapColor(active_palette, global_data.background_index));
 
     }
     else if(global_data.disposal_method == 3)
@@ -518,7 +639,7 @@ void GIFDecoder::DecodeImage(GlobalGIFData global_data, SMXGif::GIFImage &out)
             }
             else
             {
-                image.get(x,y) = active_palette.color[palette_idx];
+                image.get(x,y) = MapColor(active_palette, palette_idx);
             }
         }
     }
@@ -531,9 +652,9 @@ void GIFDecoder::DecodeImage(GlobalGIFData global_data, SMXGif::GIFImage &out)
         image.Blit(dispose, block_left, block_top, block_width, block_height);
 }
 
-bool SMXGif::DecodeGIF(string buf, vector<SMXGif::SMXGifFrame> &frames)
+bool SMXGif::DecodeGIF(const uint8_t *data, size_t size, vector<SMXGif::SMXGifFrame> &frames)
 {
-    DataStream stream(buf);
+    DataStream stream(data, size);
     GIFDecoder gif(stream);
     try {
         gif.ReadAllFrames(frames);
@@ -2,6 +2,8 @@
 #define SMXGif_h
 
 #include <stdint.h>
+#include <string.h>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -30,27 +32,34 @@ namespace SMXGif
         }
     };
 
+    // The colors used by an animation.  Frames are stored as indexes into a palette
+    // shared by the whole animation.  Each color appears only once, so frames with the
+    // same indexes have the same colors.  Transparent pixels use a color with an alpha
+    // of 0.
+    typedef std::vector<Color> Palette;
+
+    // An image of palette indexes.
     struct GIFImage
     {
         int width = 0, height = 0;
         void Init(int width, int height);
 
-        Color get(int x, int y) const { return image[y*width+x]; }
-        Color &get(int x, int y) { return image[y*width+x]; }
+        uint8_t get(int x, int y) const { return image[y*width+x]; }
+        uint8_t &get(int x, int y) { return image[y*width+x]; }
 
         // Clear to a solid color.
-        void Clear(const Color &color);
+        void Clear(uint8_t index);
 
         // Copy a rectangle from this image into dst.
         void CropImage(GIFImage &dst, int crop_left, int crop_top, int crop_width, int crop_height) const;
 
         // Copy src into a rectangle in this image.
-        void Blit(GIFImage &src, int dst_left, int dst_top, int dst_width, int dst_height);
+        void Blit(const GIFImage &src, int dst_left, int dst_top, int dst_width, int dst_height);
 
         bool operator==(const GIFImage &rhs) const;
 
     private:
-        std::vector<Color> image;
+        std::vector<uint8_t> image;
     };
 
     struct SMXGifFrame
@@ -61,10 +70,30 @@ namespace SMXGif
         int milliseconds = 0;
 
         GIFImage frame;
+
+        // The palette for frame.  This is shared by every frame in the animation.
+        std::shared_ptr<const Palette> palette;
+
+        Color GetColor(int x, int y) const { return (*palette)[frame.get(x, y)]; }
     };
 
-    // Decode a GIF into a list of frames.
-    bool DecodeGIF(std::string buf, std::vector<SMXGifFrame> &frames);
+    // Decode a GIF into a list of frames.  The data is read in place, so it can come
+    // straight from the caller's buffer or a mapped file without being copied.
+    //
+    // An animation can use up to 256 colors, counting transparency.  GIFs with local
+    // palettes can use more than this, and will fail to load.
+    bool DecodeGIF(const uint8_t *data, size_t size, std::vector<SMXGifFrame> &frames);
+
+    inline bool DecodeGIF(const std::string &buf, std::vector<SMXGifFrame> &frames)
+    {
+        return DecodeGIF((const uint8_t *) buf.data(), buf.size(), frames);
+    }
+
+    // Decode the LZW data of a single image, starting with its code size byte, into
+    // pixel_count palette indices.  Return the number of pixels in the data, which can
+    // be more than pixel_count, or -1 on error.  This is used by DecodeGIF, and is exposed
+    // for testing.
+    int DecodeLZW(const uint8_t *data, size_t size, uint8_t *pixels, int pixel_count);
 }
 
 void gif_test();
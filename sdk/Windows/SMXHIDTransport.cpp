@@ -0,0 +1,189 @@
+#include "SMXHIDTransport.h"
+#include "Helpers.h"
+
+#include <string>
+#include <memory>
+using namespace std;
+using namespace SMX;
+
+#include <hidsdi.h>
+#include <SetupAPI.h>
+
+SMX::SMXHIDTransport::SMXHIDTransport(shared_ptr<AutoCloseHandle> hDevice):
+    m_hDevice(hDevice)
+{
+    memset(&m_OverlappedRead, 0, sizeof(m_OverlappedRead));
+    memset(&m_OverlappedWrite, 0, sizeof(m_OverlappedWrite));
+}
+
+SMX::SMXHIDTransport::~SMXHIDTransport()
+{
+    Close();
+}
+
+bool SMX::SMXHIDTransport::Open(wstring &sError)
+{
+    if(!HidD_SetNumInputBuffers(m_hDevice->value(), 512))
+        Log(ssprintf("Error: HidD_SetNumInputBuffers: %ls", GetErrorString(GetLastError()).c_str()));
+
+    return true;
+}
+
+void SMX::SMXHIDTransport::Close()
+{
+    CancelIo(m_hDevice->value());
+
+    // Wait for any cancelled I/O to finish, so the kernel is done with our buffers.
+    DWORD unused;
+    if(m_bReadPending)
+        GetOverlappedResult(m_hDevice->value(), &m_OverlappedRead, &unused, true);
+    if(!m_sWriteBuffers.empty())
+        GetOverlappedResult(m_hDevice->value(), &m_OverlappedWrite, &unused, true);
+
+    m_bReadPending = false;
+    m_sFreeWriteBuffers.splice(m_sFreeWriteBuffers.end(), m_sWriteBuffers);
+    memset(&m_OverlappedRead, 0, sizeof(m_OverlappedRead));
+    memset(&m_OverlappedWrite, 0, sizeof(m_OverlappedWrite));
+}
+
+bool SMX::SMXHIDTransport::ReadReport(string &sReport, wstring &sError)
+{
+    DWORD bytes;
+    if(!m_bReadPending)
+    {
+        // Start the next read.
+        //
+        // Our read buffer is 64 bytes.  The HID input packet is much smaller than that,
+        // but Windows pads packets to the maximum size of any HID report, and the HID
+        // serial packet is 64 bytes, so we'll get 64 bytes even for 3-byte input packets.
+        // If this didn't happen, we'd have to be smarter about pulling data out of the
+        // read buffer.
+        memset(m_ReadBuffer, 0, sizeof(m_ReadBuffer));
+        if(!ReadFile(m_hDevice->value(), m_ReadBuffer, sizeof(m_ReadBuffer), &bytes, &m_OverlappedRead))
+        {
+            int windows_error = GetLastError();
+            if(windows_error != ERROR_IO_PENDING && windows_error != ERROR_IO_INCOMPLETE)
+                sError = wstring(L"Error reading device: ") + GetErrorString(windows_error).c_str();
+            else
+                m_bReadPending = true;
+            return false;
+        }
+
+        // The async read finished synchronously.  This just means that there was already data waiting.
+        // Return it, and the next call will start another read.
+        sReport.assign(m_ReadBuffer, bytes);
+        return true;
+    }
+
+    int result = GetOverlappedResult(m_hDevice->value(), &m_OverlappedRead, &bytes, FALSE);
+    if(result == 0)
+    {
+        int windows_error = GetLastError();
+        if(windows_error != ERROR_IO_PENDING && windows_error != ERROR_IO_INCOMPLETE)
+            sError = wstring(L"Error reading device: ") + GetErrorString(windows_error).c_str();
+        return false;
+    }
+
+    m_bReadPending = false;
+    sReport.assign(m_ReadBuffer, bytes);
+    return true;
+}
+
+void SMX::SMXHIDTransport::WriteReport(const string &sReport, wstring &sError)
+{
+    // Keep the data around until the write completes.
+    if(m_sFreeWriteBuffers.empty())
+        m_sWriteBuffers.push_back(sReport);
+    else
+    {
+        m_sWriteBuffers.splice(m_sWriteBuffers.end(), m_sFreeWriteBuffers, m_sFreeWriteBuffers.begin());
+        m_sWriteBuffers.back() = sReport;
+    }
+    const string &sData = m_sWriteBuffers.back();
+
+    // In theory the API allows this to return success if the write completed successfully without needing to
+    // be async, like reads can.  However, this can't really happen (the write always needs to go to the device
+    // first, unlike reads which might already be buffered), and there's no way to test it if we implement that,
+    // so this assumes all writes are async.
+    DWORD unused;
+    if(!WriteFile(m_hDevice->value(), sData.data(), sData.size(), &unused, &m_OverlappedWrite))
+    {
+        int windows_error = GetLastError();
+        if(windows_error != ERROR_IO_PENDING && windows_error != ERROR_IO_INCOMPLETE)
+            sError = wstring(L"Error writing to device: ") + GetErrorString(windows_error).c_str();
+    }
+}
+
+bool SMX::SMXHIDTransport::GetWritesComplete(wstring &sError)
+{
+    if(m_sWriteBuffers.empty())
+        return true;
+
+    DWORD bytes;
+    int iResult = GetOverlappedResult(m_hDevice->value(), &m_OverlappedWrite, &bytes, FALSE);
+    if(iResult == 0)
+    {
+        int windows_error = GetLastError();
+        if(windows_error != ERROR_IO_PENDING && windows_error != ERROR_IO_INCOMPLETE)
+            sError = wstring(L"Error writing to device: ") + GetErrorString(windows_error).c_str();
+        return false;
+    }
+
+    m_sFreeWriteBuffers.splice(m_sFreeWriteBuffers.end(), m_sWriteBuffers);
+    return true;
+}
+
+void SMX::SMXHIDTransport::CancelWrites()
+{
+    if(m_sWriteBuffers.empty())
+        return;
+
+    CancelIoEx(m_hDevice->value(), &m_OverlappedWrite);
+
+    // Block until the cancellation completes.  This should happen quickly.
+    DWORD unused;
+    GetOverlappedResult(m_hDevice->value(), &m_OverlappedWrite, &unused, true);
+    m_sFreeWriteBuffers.splice(m_sFreeWriteBuffers.end(), m_sWriteBuffers);
+}
+
+SMX::SMXIOWaiter::SMXIOWaiter()
+{
+    m_hEvent = make_shared<AutoCloseHandle>(CreateEvent(NULL, false, false, NULL));
+}
+
+SMX::SMXIOWaiter::~SMXIOWaiter()
+{
+}
+
+void SMX::SMXIOWaiter::Wake()
+{
+    SetEvent(m_hEvent->value());
+}
+
+void SMX::SMXIOWaiter::AddHandle(HANDLE hHandle)
+{
+    m_aExtraHandles.push_back(hHandle);
+}
+
+void SMX::SMXIOWaiter::Wait(const vector<shared_ptr<SMXTransport>> &apTransports, int iDelayMS)
+{
+    // Make a list of handles for WaitForMultipleObjectsEx.  Transports without a handle
+    // tell us how long we can wait instead.
+    vector<HANDLE> aHandles = { m_hEvent->value() };
+    aHandles.insert(aHandles.end(), m_aExtraHandles.begin(), m_aExtraHandles.end());
+    for(const shared_ptr<SMXTransport> &pTransport: apTransports)
+    {
+        HANDLE hHandle = pTransport->GetWaitHandle();
+        if(hHandle != INVALID_HANDLE_VALUE)
+            aHandles.push_back(hHandle);
+
+        int iWakeupDelayMS = pTransport->GetWakeupDelayMS();
+        if(iWakeupDelayMS != -1 && (iDelayMS == -1 || iWakeupDelayMS < iDelayMS))
+            iDelayMS = iWakeupDelayMS;
+    }
+
+    if(iDelayMS == -1)
+        iDelayMS = INFINITE;
+
+    WaitForMultipleObjectsEx(aHandles.size(), aHandles.data(), false, iDelayMS, true);
+}
@@ -0,0 +1,49 @@
+#ifndef SMXHIDTransport_h
+#define SMXHIDTransport_h
+
+#include <windows.h>
+#include <memory>
+#include <string>
+#include <list>
+using namespace std;
+
+#include "Helpers.h"
+#include "SMXTransport.h"
+
+namespace SMX
+{
+
+// The Windows transport, using overlapped I/O on a HID device handle.
+class SMXHIDTransport: public SMXTransport
+{
+public:
+    SMXHIDTransport(shared_ptr<AutoCloseHandle> hDevice);
+    ~SMXHIDTransport();
+
+    bool Open(wstring &sError) override;
+    void Close() override;
+    bool ReadReport(string &sReport, wstring &sError) override;
+    void WriteReport(const string &sReport, wstring &sError) override;
+    bool GetWritesComplete(wstring &sError) override;
+    void CancelWrites() override;
+    HANDLE GetWaitHandle() const override { return m_hDevice->value(); }
+
+private:
+    shared_ptr<AutoCloseHandle> m_hDevice;
+
+    // We always have a read in progress.  m_bReadPending is true if the read in
+    // m_OverlappedRead hasn't completed yet.
+    OVERLAPPED m_OverlappedRead;
+    char m_ReadBuffer[64];
+    bool m_bReadPending = false;
+
+    // The overlapped struct for writes.  All reports for a command are written with
+    // this, and m_sWriteBuffers holds the data until the writes complete.  Buffers are
+    // then moved to m_sFreeWriteBuffers and reused for later reports.
+    OVERLAPPED m_OverlappedWrite;
+    list<string> m_sWriteBuffers;
+    list<string> m_sFreeWriteBuffers;
+};
+}
+
+#endif
@@ -1,9 +1,21 @@
 #include "SMXHelperThread.h"
 using namespace SMX;
 
-SMX::SMXHelperThread::SMXHelperThread(const string &sThreadName):
-    SMXThread(m_Lock)
+SMX::SMXHelperThread::SMXHelperThread(const string &sThreadName, OverflowPolicy policy, int iQueueSize):
+    SMXThread(m_Lock),
+    m_Policy(policy)
 {
+    size_t iSize = 1;
+    while(iSize < size_t(iQueueSize))
+        iSize *= 2;
+
+    m_pCells.reset(new Cell[iSize]);
+    m_iQueueMask = iSize - 1;
+    for(size_t i = 0; i < iSize; ++i)
+        m_pCells[i].m_iSequence = i;
+    for(int i = 0; i < NumCoalesceKeys; ++i)
+        m_aCoalesceKeys[i] = 0;
+
     Start(sThreadName);
 }
 
@@ -12,31 +24,225 @@ void SMX::SMXHelperThread::ThreadMain()
     m_Lock.Lock();
     while(true)
     {
-        vector<function<void()>> funcs;
-        swap(m_FunctionsToCall, funcs);
+        // Call everything that's queued.  Don't hold the lock while calling functions.
+        m_Lock.Unlock();
+        while(RunNextTask())
+            ;
+        m_Lock.Lock();
 
         // If we're shutting down and have no more functions to call, stop.
-        if(funcs.empty() && m_bShutdown)
+        if(m_bShutdown)
             break;
 
-        // Unlock while we call the queued functions.
-        m_Lock.Unlock();
-        for(auto &func: funcs)
-            func();
-        m_Lock.Lock();
+        // Functions are often queued in bursts.  Poll briefly before going to sleep, so
+        // producers don't have to wake us up for each one.
+        double fSpinUntil = GetMonotonicTime() + SpinTime;
+        while(!HasTask() && GetMonotonicTime() < fSpinUntil)
+            this_thread::yield();
+        if(HasTask())
+            continue;
+
+        // Tell producers to wake us up, then check again, so we don't miss a function
+        // that was queued before they saw m_bSleeping.
+        m_bSleeping = true;
+        atomic_thread_fence(memory_order_seq_cst);
+        if(HasTask())
+        {
+            m_bSleeping = false;
+            continue;
+        }
 
         m_Event.Wait(250);
+        m_bSleeping = false;
     }
+
+    m_bStopped = true;
     m_Lock.Unlock();
 }
 
-void SMX::SMXHelperThread::RunInThread(function<void()> func)
+// Return true if a function is ready to be popped.
+bool SMX::SMXHelperThread::HasTask() const
 {
-    m_Lock.AssertNotLockedByCurrentThread();
+    size_t iPos = m_iDequeuePos.load(memory_order_relaxed);
+    return m_pCells[iPos & m_iQueueMask].m_iSequence.load(memory_order_acquire) == iPos + 1;
+}
 
-    // Add func to the list, and poke the event to wake up the thread if needed.
-    m_Lock.Lock();
-    m_FunctionsToCall.push_back(func);
-    m_Event.Set();
-    m_Lock.Unlock();
+// Claim a cell to queue a function in.  Return null if the function shouldn't be queued.
+SMXHelperThread::Cell *SMX::SMXHelperThread::BeginPush(uint64_t iCoalesceKey, size_t &iPos)
+{
+    int iCoalesceSlot = -1;
+    if(m_Policy == OverflowPolicy_Coalesce && iCoalesceKey != 0 && !TryClaimCoalesceKey(iCoalesceKey, iCoalesceSlot))
+    {
+        m_iTasksCoalesced++;
+        return nullptr;
+    }
+
+    iPos = m_iEnqueuePos.load(memory_order_relaxed);
+    while(true)
+    {
+        Cell *pCell = &m_pCells[iPos & m_iQueueMask];
+        size_t iSequence = pCell->m_iSequence.load(memory_order_acquire);
+        intptr_t iDiff = intptr_t(iSequence) - intptr_t(iPos);
+        if(iDiff == 0)
+        {
+            // The cell is free.  Claim it, unless another producer got to it first.
+            if(!m_iEnqueuePos.compare_exchange_weak(iPos, iPos + 1, memory_order_relaxed))
+                continue;
+
+            pCell->m_fQueuedAt = GetMonotonicTime();
+            pCell->m_iCoalesceSlot = iCoalesceSlot;
+
+            int iDepth = int(iPos + 1 - m_iDequeuePos.load(memory_order_relaxed));
+            int iMaxDepth = m_iMaxQueueDepth.load(memory_order_relaxed);
+            while(iDepth > iMaxDepth && !m_iMaxQueueDepth.compare_exchange_weak(iMaxDepth, iDepth, memory_order_relaxed))
+                ;
+            return pCell;
+        }
+
+        if(iDiff < 0)
+        {
+            // The queue is full.  If we're the helper thread, we can't wait for ourself
+            // to make room, so discard the oldest function instead.
+            if(m_Policy == OverflowPolicy_DropOldest || IsCurrentThread())
+                DiscardOldestTask();
+            else if(m_bStopped)
+            {
+                // The helper thread has exited and will never make room.
+                if(iCoalesceSlot != -1)
+                    m_aCoalesceKeys[iCoalesceSlot] = 0;
+                m_iTasksDropped++;
+                return nullptr;
+            }
+            else
+                this_thread::yield();
+        }
+
+        iPos = m_iEnqueuePos.load(memory_order_relaxed);
+    }
+}
+
+// Publish a cell filled in after BeginPush, and wake up the helper thread if it's waiting.
+void SMX::SMXHelperThread::EndPush(Cell *pCell, size_t iPos)
+{
+    pCell->m_iSequence.store(iPos + 1, memory_order_release);
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if(m_bSleeping.load(memory_order_relaxed) && m_bSleeping.exchange(false))
+        m_Event.Set();
+}
+
+// Claim the oldest queued cell.  Return null if the queue is empty.
+SMXHelperThread::Cell *SMX::SMXHelperThread::BeginPop(size_t &iPos)
+{
+    iPos = m_iDequeuePos.load(memory_order_relaxed);
+    while(true)
+    {
+        Cell *pCell = &m_pCells[iPos & m_iQueueMask];
+        size_t iSequence = pCell->m_iSequence.load(memory_order_acquire);
+        intptr_t iDiff = intptr_t(iSequence) - intptr_t(iPos + 1);
+        if(iDiff == 0)
+        {
+            if(m_iDequeuePos.compare_exchange_weak(iPos, iPos + 1, memory_order_relaxed))
+                return pCell;
+        }
+        else if(iDiff < 0)
+            return nullptr;
+        else
+            iPos = m_iDequeuePos.load(memory_order_relaxed);
+    }
+}
+
+// Release a cell claimed by BeginPop, so it can be reused once the queue wraps around.
+void SMX::SMXHelperThread::EndPop(Cell *pCell, size_t iPos)
+{
+    pCell->m_iSequence.store(iPos + m_iQueueMask + 1, memory_order_release);
+}
+
+// Claim a slot in m_aCoalesceKeys for iCoalesceKey, and return true.  If a waiting function
+// already has this key, return false.  If there are no free slots, return true without
+// claiming one, and the function won't be coalesced.
+bool SMX::SMXHelperThread::TryClaimCoalesceKey(uint64_t iCoalesceKey, int &iSlot)
+{
+    iSlot = -1;
+    for(int i = 0; i < NumCoalesceKeys; ++i)
+    {
+        int iProbe = int((iCoalesceKey + i) % NumCoalesceKeys);
+        uint64_t iKey = m_aCoalesceKeys[iProbe].load(memory_order_acquire);
+        if(iKey == 0 && m_aCoalesceKeys[iProbe].compare_exchange_strong(iKey, iCoalesceKey))
+        {
+            iSlot = iProbe;
+            return true;
+        }
+
+        if(iKey == iCoalesceKey)
+            return false;
+    }
+    return true;
+}
+
+// Let new functions with pCell's key be queued.  This is done before the function is
+// called, so changes made after it starts will queue another call.
+void SMX::SMXHelperThread::ReleaseCoalesceKey(Cell *pCell)
+{
+    if(pCell->m_iCoalesceSlot == -1)
+        return;
+
+    m_aCoalesceKeys[pCell->m_iCoalesceSlot].store(0, memory_order_release);
+    pCell->m_iCoalesceSlot = -1;
+}
+
+// Discard the oldest queued function to make room for a new one.
+bool SMX::SMXHelperThread::DiscardOldestTask()
+{
+    size_t iPos;
+    Cell *pCell = BeginPop(iPos);
+    if(pCell == nullptr)
+        return false;
+
+    ReleaseCoalesceKey(pCell);
+    pCell->m_Task.Clear();
+    EndPop(pCell, iPos);
+    m_iTasksDropped++;
+    return true;
+}
+
+// Call the oldest queued function.  Return false if the queue is empty.
+bool SMX::SMXHelperThread::RunNextTask()
+{
+    size_t iPos;
+    Cell *pCell = BeginPop(iPos);
+    if(pCell == nullptr)
+        return false;
+
+    double fLatency = GetMonotonicTime() - pCell->m_fQueuedAt;
+    m_fTotalLatency.store(m_fTotalLatency.load(memory_order_relaxed) + fLatency, memory_order_relaxed);
+    if(fLatency > m_fMaxLatency.load(memory_order_relaxed))
+        m_fMaxLatency.store(fLatency, memory_order_relaxed);
+
+    // Move the function out of the queue before calling it, so the cell can be reused
+    // while it runs.
+    SMXHelperTask task;
+    ReleaseCoalesceKey(pCell);
+    pCell->m_Task.MoveTo(task);
+    EndPop(pCell, iPos);
+
+    task.Run();
+    m_iTasksRun++;
+    return true;
+}
+
+SMXHelperThreadStats SMX::SMXHelperThread::GetStats() const
+{
+    SMXHelperThreadStats stats;
+    size_t iDequeuePos = m_iDequeuePos.load(memory_order_relaxed);
+    size_t iEnqueuePos = m_iEnqueuePos.load(memory_order_relaxed);
+    stats.m_iQueueDepth = iEnqueuePos > iDequeuePos? int(iEnqueuePos - iDequeuePos):0;
+    stats.m_iMaxQueueDepth = m_iMaxQueueDepth;
+    stats.m_iTasksRun = m_iTasksRun;
+    stats.m_iTasksDropped = m_iTasksDropped;
+    stats.m_iTasksCoalesced = m_iTasksCoalesced;
+    if(stats.m_iTasksRun > 0)
+        stats.m_fAverageLatency = m_fTotalLatency / stats.m_iTasksRun;
+    stats.m_fMaxLatency = m_fMaxLatency;
+    return stats;
 }
@@ -5,26 +5,234 @@
 #include "SMXThread.h"
 
 #include <functional>
-#include <vector>
 #include <memory>
+#include <atomic>
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+#include <type_traits>
 using namespace std;
 
 namespace SMX
 {
+// A function to call in a helper thread.  Functions small enough to fit in InlineSize are
+// stored inline, so queueing them doesn't allocate.  Larger ones are allocated on the heap.
+class SMXHelperTask
+{
+public:
+    static const int InlineSize = 64;
+
+    SMXHelperTask() { }
+    ~SMXHelperTask() { Clear(); }
+    SMXHelperTask(const SMXHelperTask &) = delete;
+    SMXHelperTask &operator=(const SMXHelperTask &) = delete;
+
+    template<typename F>
+    void Set(F &&func)
+    {
+        typedef typename decay<F>::type Func;
+        Clear();
+        Store<Func>(forward<F>(func), integral_constant<bool, FitsInline<Func>::value>());
+    }
+
+    // Call the function.
+    void Run() { m_pOps->Run(m_Storage); }
+
+    // Move the function into other, leaving this empty.
+    void MoveTo(SMXHelperTask &other)
+    {
+        other.Clear();
+        if(m_pOps == nullptr)
+            return;
+        m_pOps->Move(m_Storage, other.m_Storage);
+        other.m_pOps = m_pOps;
+        m_pOps = nullptr;
+    }
+
+    void Clear()
+    {
+        if(m_pOps == nullptr)
+            return;
+        m_pOps->Destroy(m_Storage);
+        m_pOps = nullptr;
+    }
+
+private:
+    template<typename Func>
+    struct FitsInline
+    {
+        static const bool value = sizeof(Func) <= InlineSize &&
+            alignof(Func) <= alignof(max_align_t) &&
+            is_nothrow_move_constructible<Func>::value;
+    };
+
+    struct Ops
+    {
+        void (*Run)(void *pStorage);
+        void (*Move)(void *pFrom, void *pTo);
+        void (*Destroy)(void *pStorage);
+    };
+
+    // Functions stored in m_Storage:
+    template<typename Func>
+    struct InlineOps
+    {
+        static void Run(void *pStorage) { (*(Func *) pStorage)(); }
+        static void Move(void *pFrom, void *pTo) { new(pTo) Func(move(*(Func *) pFrom)); Destroy(pFrom); }
+        static void Destroy(void *pStorage) { ((Func *) pStorage)->~Func(); }
+        static const Ops ops;
+    };
+
+    // Functions on the heap, with a pointer to them in m_Storage:
+    template<typename Func>
+    struct HeapOps
+    {
+        static Func *&Get(void *pStorage) { return *(Func **) pStorage; }
+        static void Run(void *pStorage) { (*Get(pStorage))(); }
+        static void Move(void *pFrom, void *pTo) { Get(pTo) = Get(pFrom); }
+        static void Destroy(void *pStorage) { delete Get(pStorage); }
+        static const Ops ops;
+    };
+
+    template<typename Func, typename F>
+    void Store(F &&func, true_type)
+    {
+        new(m_Storage) Func(forward<F>(func));
+        m_pOps = &InlineOps<Func>::ops;
+    }
+
+    template<typename Func, typename F>
+    void Store(F &&func, false_type)
+    {
+        HeapOps<Func>::Get(m_Storage) = new Func(forward<F>(func));
+        m_pOps = &HeapOps<Func>::ops;
+    }
+
+    alignas(max_align_t) char m_Storage[InlineSize];
+    const Ops *m_pOps = nullptr;
+};
+
+template<typename Func>
+const SMXHelperTask::Ops SMXHelperTask::InlineOps<Func>::ops = { Run, Move, Destroy };
+template<typename Func>
+const SMXHelperTask::Ops SMXHelperTask::HeapOps<Func>::ops = { Run, Move, Destroy };
+
+// Counters for an SMXHelperThread.  These are returned by SMXHelperThread::GetStats.
+struct SMXHelperThreadStats
+{
+    // The number of functions waiting to be called, and the most that have ever been waiting.
+    int m_iQueueDepth = 0;
+    int m_iMaxQueueDepth = 0;
+
+    // The number of functions that have been called, discarded by OverflowPolicy_DropOldest,
+    // and merged by OverflowPolicy_Coalesce.
+    uint64_t m_iTasksRun = 0;
+    uint64_t m_iTasksDropped = 0;
+    uint64_t m_iTasksCoalesced = 0;
+
+    // The time between queueing a function and calling it, in seconds.
+    double m_fAverageLatency = 0;
+    double m_fMaxLatency = 0;
+};
+
+// A thread that calls functions queued from other threads.  Functions are queued in a
+// fixed-size lock-free queue, so RunInThread never waits on a lock and doesn't allocate
+// unless the function is too big for SMXHelperTask.
 class SMXHelperThread: public SMXThread
 {
 public:
-    SMXHelperThread(const string &sThreadName);
-   
-    // Call func asynchronously from the helper thread.
-    void RunInThread(function<void()> func);
+    // What to do when RunInThread is called and the queue is full.
+    enum OverflowPolicy
+    {
+        // Wait for the helper thread to make room.
+        OverflowPolicy_Block,
+
+        // Discard the oldest function in the queue.
+        OverflowPolicy_DropOldest,
+
+        // Wait like OverflowPolicy_Block.  Additionally, if a function is queued with a
+        // coalesce key while another function with the same key is still waiting, the new
+        // one is discarded.  This is for functions that read the latest state when they're
+        // called, so one waiting call is as good as many.
+        OverflowPolicy_Coalesce,
+    };
+
+    // iQueueSize is rounded up to a power of two.
+    SMXHelperThread(const string &sThreadName, OverflowPolicy policy = OverflowPolicy_Block, int iQueueSize = 256);
+
+    // Call func asynchronously from the helper thread.  If iCoalesceKey is nonzero and the
+    // policy is OverflowPolicy_Coalesce, func is merged with other functions with the same key.
+    template<typename F>
+    void RunInThread(F &&func, uint64_t iCoalesceKey = 0)
+    {
+        size_t iPos;
+        Cell *pCell = BeginPush(iCoalesceKey, iPos);
+        if(pCell == nullptr)
+            return;
+
+        pCell->m_Task.Set(forward<F>(func));
+        EndPush(pCell, iPos);
+    }
+
+    SMXHelperThreadStats GetStats() const;
 
 private:
     void ThreadMain();
 
-    // Helper threads use their independent lock.
+    struct Cell
+    {
+        // The queue position this cell is ready for.  See BeginPush and BeginPop.
+        atomic<size_t> m_iSequence;
+        SMXHelperTask m_Task;
+        double m_fQueuedAt = 0;
+
+        // The index into m_aCoalesceKeys this task holds, or -1.
+        int m_iCoalesceSlot = -1;
+    };
+
+    Cell *BeginPush(uint64_t iCoalesceKey, size_t &iPos);
+    void EndPush(Cell *pCell, size_t iPos);
+    Cell *BeginPop(size_t &iPos);
+    void EndPop(Cell *pCell, size_t iPos);
+    bool TryClaimCoalesceKey(uint64_t iCoalesceKey, int &iSlot);
+    void ReleaseCoalesceKey(Cell *pCell);
+    bool HasTask() const;
+    bool DiscardOldestTask();
+    bool RunNextTask();
+
+    // Helper threads use their independent lock.  This is only used to wait for work.
     SMX::Mutex m_Lock;
-    vector<function<void()>> m_FunctionsToCall;
+
+    const OverflowPolicy m_Policy;
+
+    // The queue.  This is a bounded multi-producer queue: producers claim a position in
+    // m_iEnqueuePos, write the cell, then publish it by setting its sequence number.  Cells
+    // are popped by the helper thread, and by producers discarding old tasks.
+    unique_ptr<Cell[]> m_pCells;
+    size_t m_iQueueMask;
+    atomic<size_t> m_iEnqueuePos{0};
+    atomic<size_t> m_iDequeuePos{0};
+
+    // Coalesce keys of waiting tasks.  Zero is an unused slot.
+    static const int NumCoalesceKeys = 64;
+    atomic<uint64_t> m_aCoalesceKeys[NumCoalesceKeys];
+
+    // How long the helper thread polls for more work before going to sleep, in seconds.
+    static constexpr double SpinTime = 0.00005;
+
+    // This is true while the helper thread is waiting for work, so producers know to wake it.
+    atomic<bool> m_bSleeping{false};
+
+    // This is set once the helper thread has exited, so producers don't wait on it.
+    atomic<bool> m_bStopped{false};
+
+    // Counters for GetStats.  The latency counters are only written by the helper thread.
+    atomic<int> m_iMaxQueueDepth{0};
+    atomic<uint64_t> m_iTasksRun{0};
+    atomic<uint64_t> m_iTasksDropped{0};
+    atomic<uint64_t> m_iTasksCoalesced{0};
+    atomic<double> m_fTotalLatency{0};
+    atomic<double> m_fMaxLatency{0};
 };
 }
 
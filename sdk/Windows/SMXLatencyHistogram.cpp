@@ -0,0 +1,81 @@
+#include "SMXLatencyHistogram.h"
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+using namespace std;
+using namespace SMX;
+
+void SMX::SMXLatencyHistogram::Reset()
+{
+    memset(m_iBuckets, 0, sizeof(m_iBuckets));
+    m_iCount = 0;
+    m_fTotal = 0;
+    m_fMin = 0;
+    m_fMax = 0;
+}
+
+// Values below SubBuckets have a bucket each.  Above that, the bucket is the position of
+// the highest set bit, followed by the next SubBucketBits bits.
+int SMX::SMXLatencyHistogram::GetBucket(uint64_t iMicroseconds)
+{
+    if(iMicroseconds < SubBuckets)
+        return int(iMicroseconds);
+
+    int iHighBit = SubBucketBits;
+    while(iHighBit < MaxBits - 1 && (iMicroseconds >> (iHighBit + 1)) != 0)
+        iHighBit++;
+    if((iMicroseconds >> (iHighBit + 1)) != 0)
+        return NumBuckets - 1;
+
+    int iSubBucket = int(iMicroseconds >> (iHighBit - SubBucketBits)) & (SubBuckets - 1);
+    return SubBuckets + (iHighBit - SubBucketBits) * SubBuckets + iSubBucket;
+}
+
+// Return the middle of the range of values in a bucket, in seconds.
+double SMX::SMXLatencyHistogram::GetBucketValue(int iBucket)
+{
+    if(iBucket < SubBuckets)
+        return iBucket / 1000000.0;
+
+    int iHighBit = (iBucket - SubBuckets) / SubBuckets + SubBucketBits;
+    int iSubBucket = (iBucket - SubBuckets) % SubBuckets;
+    uint64_t iWidth = uint64_t(1) << (iHighBit - SubBucketBits);
+    uint64_t iStart = (uint64_t(1) << iHighBit) + iSubBucket * iWidth;
+    return (iStart + iWidth / 2.0) / 1000000.0;
+}
+
+void SMX::SMXLatencyHistogram::Record(double fSeconds)
+{
+    fSeconds = max(fSeconds, 0.0);
+    if(m_iCount == 0 || fSeconds < m_fMin)
+        m_fMin = fSeconds;
+    if(m_iCount == 0 || fSeconds > m_fMax)
+        m_fMax = fSeconds;
+    m_iCount++;
+    m_fTotal += fSeconds;
+
+    double fMicroseconds = min(fSeconds * 1000000, 1e18);
+    m_iBuckets[GetBucket(uint64_t(fMicroseconds))]++;
+}
+
+double SMX::SMXLatencyHistogram::GetPercentile(double fPercentile) const
+{
+    if(m_iCount == 0)
+        return 0;
+
+    // Find the bucket containing the value fPercentile of the way through the recorded values.
+    int iTarget = max(1, int(ceil(m_iCount * fPercentile / 100)));
+    int iSeen = 0;
+    for(int iBucket = 0; iBucket < NumBuckets; ++iBucket)
+    {
+        iSeen += m_iBuckets[iBucket];
+        if(iSeen >= iTarget)
+        {
+            // Buckets are wider than the range of values actually recorded at the ends.
+            return min(max(GetBucketValue(iBucket), m_fMin), m_fMax);
+        }
+    }
+
+    return m_fMax;
+}
@@ -0,0 +1,51 @@
+#ifndef SMXLatencyHistogram_h
+#define SMXLatencyHistogram_h
+
+#include <stdint.h>
+
+namespace SMX
+{
+// A histogram of durations, for round-trip times and other latency statistics.
+//
+// This works like HdrHistogram: values are recorded in microseconds, and each power of two
+// is split into SubBuckets linear buckets, so percentiles are accurate to within about 3%
+// whether they're 50us or 5 seconds.  Recording doesn't allocate memory or loop over the
+// buckets, so it's cheap enough to do for every command.
+//
+// This isn't thread-safe.  The owner locks around it.
+class SMXLatencyHistogram
+{
+public:
+    SMXLatencyHistogram() { Reset(); }
+
+    // Record a duration in seconds.
+    void Record(double fSeconds);
+    void Reset();
+
+    int GetCount() const { return m_iCount; }
+
+    // These return 0 if nothing has been recorded.  fPercentile is from 0 to 100.
+    double GetMin() const { return m_iCount? m_fMin:0; }
+    double GetMax() const { return m_iCount? m_fMax:0; }
+    double GetMean() const { return m_iCount? m_fTotal / m_iCount:0; }
+    double GetPercentile(double fPercentile) const;
+
+private:
+    static const int SubBucketBits = 4;
+    static const int SubBuckets = 1 << SubBucketBits;
+
+    // Values up to 2^MaxBits microseconds (about 19 hours) are recorded separately.
+    // Anything larger is counted in the last bucket.
+    static const int MaxBits = 36;
+    static const int NumBuckets = SubBuckets + (MaxBits - SubBucketBits) * SubBuckets;
+
+    static int GetBucket(uint64_t iMicroseconds);
+    static double GetBucketValue(int iBucket);
+
+    uint32_t m_iBuckets[NumBuckets];
+    int m_iCount;
+    double m_fTotal, m_fMin, m_fMax;
+};
+}
+
+#endif
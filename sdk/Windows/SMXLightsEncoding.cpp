@@ -0,0 +1,117 @@
+#include "SMXLightsEncoding.h"
+#include "Helpers.h"
+
+#include <string.h>
+#include <algorithm>
+using namespace std;
+
+#if defined(SMX_SSE2)
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    // SetLights has always scaled with uint8_t(iColor * 0.6666f), and the output needs to
+    // stay exactly the same.  Build a table from that expression, so the scalar path uses
+    // it directly.
+    struct ScaleTable
+    {
+        uint8_t m_iScale[256];
+        ScaleTable()
+        {
+            for(int i = 0; i < 256; ++i)
+                m_iScale[i] = uint8_t(uint8_t(i) * 0.6666f);
+        }
+    };
+    const ScaleTable g_ScaleTable;
+
+#if defined(SMX_SSE2)
+    // (iColor * 0xAAAA) >> 16 gives the same result as the table for every input.  The
+    // LightsEncoding benchmark checks this.
+    const uint16_t FixedPointScale = 0xAAAA;
+
+    // Scale 16 colors.
+    inline void ScaleLightColors16(const uint8_t *pIn, uint8_t *pOut)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i scale = _mm_set1_epi16((short) FixedPointScale);
+
+        __m128i colors = _mm_loadu_si128((const __m128i *) pIn);
+        __m128i lo = _mm_mulhi_epu16(_mm_unpacklo_epi8(colors, zero), scale);
+        __m128i hi = _mm_mulhi_epu16(_mm_unpackhi_epi8(colors, zero), scale);
+        _mm_storeu_si128((__m128i *) pOut, _mm_packus_epi16(lo, hi));
+    }
+#endif
+}
+
+uint8_t SMX::ScaleLightColor(uint8_t iColor)
+{
+    return g_ScaleTable.m_iScale[iColor];
+}
+
+void SMX::ScaleLightColorsScalar(const uint8_t *pIn, uint8_t *pOut, int iSize)
+{
+    for(int i = 0; i < iSize; ++i)
+        pOut[i] = g_ScaleTable.m_iScale[pIn[i]];
+}
+
+void SMX::ScaleLightColors(const uint8_t *pIn, uint8_t *pOut, int iSize)
+{
+    int i = 0;
+#if defined(SMX_SSE2)
+    for(; i + 16 <= iSize; i += 16)
+        ScaleLightColors16(pIn + i, pOut + i);
+
+    // If there's a partial block left over, scale the last 16 bytes.  This overlaps
+    // bytes we've already done, which is fine since pIn and pOut don't overlap.
+    if(i < iSize && iSize >= 16)
+    {
+        ScaleLightColors16(pIn + iSize - 16, pOut + iSize - 16);
+        return;
+    }
+#endif
+    ScaleLightColorsScalar(pIn + i, pOut + i, iSize - i);
+}
+
+namespace
+{
+    // Scale iSize bytes starting at iOffset in the input into pOut.  Anything past the
+    // end of the input is zero.
+    void ScaleRun(const uint8_t *pLights, int iLightsSize, int iOffset, int iSize, uint8_t *pOut)
+    {
+        int iAvailable = max(0, min(iSize, iLightsSize - iOffset));
+        SMX::ScaleLightColors(pLights + iOffset, pOut, iAvailable);
+        memset(pOut + iAvailable, 0, iSize - iAvailable);
+    }
+}
+
+void SMX::EncodeLightsCommands(const uint8_t *pLights, int iSize,
+    uint8_t *pCommand4, uint8_t *pCommand2, uint8_t *pCommand3)
+{
+    *pCommand4++ = '4';
+    *pCommand2++ = '2';
+    *pCommand3++ = '3';
+
+    // Each panel's data is contiguous, so rather than splitting it byte by byte, scale it
+    // in runs straight into each command: the top half of the 4x4 grid to '2', the bottom
+    // half to '3', and the 3x3 grid to '4'.
+    int iOffset = 0;
+    for(int iPanel = 0; iPanel < 9; ++iPanel)
+    {
+        ScaleRun(pLights, iSize, iOffset, 4*2*3, pCommand2);
+        iOffset += 4*2*3;
+        pCommand2 += 4*2*3;
+
+        ScaleRun(pLights, iSize, iOffset, 4*2*3, pCommand3);
+        iOffset += 4*2*3;
+        pCommand3 += 4*2*3;
+
+        ScaleRun(pLights, iSize, iOffset, 3*3*3, pCommand4);
+        iOffset += 3*3*3;
+        pCommand4 += 3*3*3;
+    }
+
+    *pCommand4++ = '\n';
+    *pCommand2++ = '\n';
+    *pCommand3++ = '\n';
+}
@@ -0,0 +1,47 @@
+#ifndef SMXLightsEncoding_h
+#define SMXLightsEncoding_h
+
+#include <stdint.h>
+
+namespace SMX
+{
+// Lights are sent to a pad in three commands:
+//
+// 4: the 3x3 inner grid
+// 2: the top 4x2 lights
+// 3: the bottom 4x2 lights
+//
+// Each command is the command character, RGB for each light on each of the 9 panels,
+// and '\n'.
+const int LightsCommand4Size = 1 + 9*3*3*3 + 1;
+const int LightsCommand2Size = 1 + 9*4*2*3 + 1;
+const int LightsCommand3Size = 1 + 9*4*2*3 + 1;
+
+// The '4', '2' and '3' lights commands for one pad, as built by EncodeLightsCommands.
+struct EncodedLights
+{
+    uint8_t m_Command4[LightsCommand4Size];
+    uint8_t m_Command2[LightsCommand2Size];
+    uint8_t m_Command3[LightsCommand3Size];
+};
+
+// Apply color scaling.  Values over about 170 don't make the LEDs any brighter, so this
+// gives better contrast and draws less power.
+uint8_t ScaleLightColor(uint8_t iColor);
+
+// Apply ScaleLightColor to iSize bytes.  ScaleLightColorsScalar does the same thing without
+// SIMD, and the results are always identical.  pIn and pOut must not overlap.
+void ScaleLightColors(const uint8_t *pIn, uint8_t *pOut, int iSize);
+void ScaleLightColorsScalar(const uint8_t *pIn, uint8_t *pOut, int iSize);
+
+// Build the '4', '2' and '3' lights commands for one pad.
+//
+// pLights is 25-light data (9*5*5*3 bytes): for each panel, the 4x4 grid followed by
+// the 3x3 grid.  16-light data (9*4*4*3 bytes) is treated as 25-light data with zeroes
+// at the end.  pCommand4, pCommand2 and pCommand3 receive LightsCommand4Size,
+// LightsCommand2Size and LightsCommand3Size bytes.
+void EncodeLightsCommands(const uint8_t *pLights, int iSize,
+    uint8_t *pCommand4, uint8_t *pCommand2, uint8_t *pCommand3);
+}
+
+#endif
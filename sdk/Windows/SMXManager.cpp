@@ -2,11 +2,15 @@
 #include "SMXDevice.h"
 #include "SMXDeviceConnection.h"
 #include "SMXDeviceSearchThreaded.h"
+#include "SMXLightsEncoding.h"
+#include "SMXTransport.h"
 #include "Helpers.h"
 
-#include <windows.h>
 #include <stdexcept>
+#include <math.h>
+#include <string.h>
 #include <memory>
+#include <algorithm>
 using namespace std;
 using namespace SMX;
 
@@ -16,43 +20,44 @@ namespace {
 
 shared_ptr<SMXManager> SMXManager::g_pSMX;
 
-SMX::SMXManager::SMXManager(function<void(int PadNumber, SMXUpdateCallbackReason reason)> pCallback):
-    m_UserCallbackThread("SMXUserCallbackThread")
+SMX::SMXManager::SMXManager(function<void(int PadNumber, const SMXUpdateDetails &details)> pCallback,
+    shared_ptr<SMXDeviceSearch> pDeviceSearch):
+    m_UserCallbackThread("SMXUserCallbackThread", SMXHelperThread::OverflowPolicy_Coalesce),
+    m_pUpdateCallback(pCallback)
 {
     // Raise the priority of the user callback thread, since we don't want input
     // events to be preempted by other things and reduce timing accuracy.
     m_UserCallbackThread.SetHighPriority(true);
-    m_hEvent = make_shared<AutoCloseHandle>(CreateEvent(NULL, false, false, NULL));
-    m_pSMXDeviceSearchThreaded = make_shared<SMXDeviceSearchThreaded>();
+    m_pWaiter = make_shared<SMXIOWaiter>();
 
-    // Create the SMXDevices.  We don't create these as we connect, we just reuse the same
-    // ones.
-    for(int i = 0; i < 2; ++i)
+    // Wake up the manager thread to connect to devices as soon as they're found.
+    m_pSMXDeviceSearchThreaded = make_shared<SMXDeviceSearchThreaded>([this] { m_pWaiter->Wake(); }, pDeviceSearch);
+
+    for(int pad = 0; pad < MaxPads; ++pad)
     {
-        shared_ptr<SMXDevice> pDevice = SMXDevice::Create(m_hEvent, g_Lock);
-        m_pDevices.push_back(pDevice);
+        PadState state;
+        state.info = SMXInfo();
+        state.iInputState = 0;
+        m_PadState[pad].Store(state);
+
+        m_pPadSlots[pad] = nullptr;
+        m_iUndeliveredUpdates[pad] = 0;
+        m_fUpdateTime[pad] = 0;
+        m_iUploadProgress[pad] = 0;
     }
 
-    // The callback we send to SMXDeviceConnection will be called from our thread.  Wrap
-    // it so it's called from UserCallbackThread instead.
-    auto pCallbackInThread = [this, pCallback](int PadNumber, SMXUpdateCallbackReason reason) {
-        m_UserCallbackThread.RunInThread([pCallback, PadNumber, reason]() {
-            pCallback(PadNumber, reason);
-        });
-    };
-
-    // Set the update callbacks.  Do this before starting the thread, to avoid race conditions.
-    for(int pad = 0; pad < 2; ++pad)
-        m_pDevices[pad]->SetUpdateCallback(pCallbackInThread);
+    // Create the devices for player 1 and player 2.  We don't create these as we connect,
+    // we just reuse the same ones.  More are added by AttemptConnections if more devices are
+    // connected.  Do this before starting the thread, to avoid race conditions.
+    {
+        LockMutex L(g_Lock);
+        for(int i = 0; i < 2; ++i)
+            AddSlot();
+    }
 
     // Start the thread.
-    DWORD id;
-    m_hThread = CreateThread(NULL, 0, ThreadMainStart, this, 0, &id);
-    SMX::SetThreadName(id, "SMXManager");
-
-    // Raise the priority of the I/O thread, since we don't want input
-    // events to be preempted by other things and reduce timing accuracy.
-    SetThreadPriority( m_hThread, THREAD_PRIORITY_HIGHEST );
+    m_Thread = thread([this] { ThreadMain(); });
+    SMX::SetThreadName(m_Thread, "SMXManager");
 }
 
 SMX::SMXManager::~SMXManager()
@@ -63,7 +68,90 @@ SMX::SMXManager::~SMXManager()
 
 shared_ptr<SMXDevice> SMX::SMXManager::GetDevice(int pad)
 {
-    return m_pDevices[pad];
+    if(pad < 0 || pad >= GetPadCount())
+        return nullptr;
+
+    return m_pPadSlots[pad].load()->m_pDevice;
+}
+
+// Add a device slot, and start its thread.  This is called before the manager thread
+// starts, and from the manager thread.
+void SMX::SMXManager::AddSlot()
+{
+    g_Lock.AssertLockedByCurrentThread();
+
+    int iSlot = m_iNumPads;
+    m_pSlots[iSlot].reset(new DeviceSlot);
+    DeviceSlot *pSlot = m_pSlots[iSlot].get();
+    pSlot->m_iPad = iSlot;
+    pSlot->m_iPublishedPad = iSlot;
+    pSlot->m_LastPublishedPadState.info = SMXInfo();
+    pSlot->m_LastPublishedPadState.iInputState = 0;
+    pSlot->m_pWaiter = make_shared<SMXIOWaiter>();
+    pSlot->m_pDevice = SMXDevice::Create(pSlot->m_pWaiter, pSlot->m_Lock);
+
+    // SetLights never queues more than MaxQueuedLightsUpdates updates for a pad.  Reserve
+    // this up front, so queueing lights never allocates.
+    pSlot->m_Lights.m_aPendingCommands.reserve(MaxQueuedLightsUpdates*3);
+
+    {
+        LockMutex L(pSlot->m_Lock);
+
+        // If we're recording traffic, record this slot too.
+        if(m_pTrafficRecorder)
+            pSlot->m_pDevice->SetTrafficRecorderLocked(m_pTrafficRecorder, iSlot);
+
+        // The update callback is called from the device's thread, and is sent to the user
+        // from UserCallbackThread.
+        pSlot->m_pDevice->SetUpdateCallbackLocked([this, pSlot](int PadNumber, int iChanged) {
+            QueueUpdate(*pSlot, iChanged);
+        });
+    }
+
+    pSlot->m_Thread = thread([this, pSlot] { DeviceThreadMain(*pSlot); });
+    SMX::SetThreadName(pSlot->m_Thread, ssprintf("SMXDevice%i", iSlot));
+
+    // Raise the priority of the I/O thread, since we don't want input
+    // events to be preempted by other things and reduce timing accuracy.
+    SMX::SetThreadHighPriority(pSlot->m_Thread);
+
+    m_pPadSlots[iSlot] = pSlot;
+    m_iNumPads = iSlot + 1;
+}
+
+int SMX::SMXManager::FindPadBySerial(const char *szSerial) const
+{
+    if(szSerial == nullptr || szSerial[0] == 0)
+        return -1;
+
+    int iNumPads = m_iNumPads;
+    for(int pad = 0; pad < iNumPads; ++pad)
+    {
+        SMXInfo info;
+        GetInfo(pad, info);
+        if(info.m_bConnected && !strncmp(info.m_Serial, szSerial, sizeof(info.m_Serial)))
+            return pad;
+    }
+    return -1;
+}
+
+uint16_t SMX::SMXManager::GetInputState(int pad) const
+{
+    if(pad < 0 || pad >= GetPadCount())
+        return 0;
+
+    return m_PadState[pad].Load().iInputState;
+}
+
+void SMX::SMXManager::GetInfo(int pad, SMXInfo &info) const
+{
+    if(pad < 0 || pad >= GetPadCount())
+    {
+        info = SMXInfo();
+        return;
+    }
+
+    info = m_PadState[pad].Load().info;
 }
 
 void SMX::SMXManager::Shutdown()
@@ -81,119 +169,349 @@ void SMX::SMXManager::Shutdown()
     // Shut down the device search thread.
     m_pSMXDeviceSearchThreaded->Shutdown();
 
-    if(m_hThread == INVALID_HANDLE_VALUE)
+    if(!m_Thread.joinable())
         return;
 
-    // Tell the thread to shut down, and wait for it before returning.
-    m_bShutdown = true;
-    SetEvent(m_hEvent->value());
-
-    WaitForSingleObject(m_hThread, INFINITE);
-    m_hThread = INVALID_HANDLE_VALUE;
-}
+    // Tell the thread to shut down, and wait for it before returning.  It shuts down the
+    // device threads before it exits.
+    {
+        LockMutex L(g_Lock);
+        m_bShutdown = true;
+    }
+    m_pWaiter->Wake();
 
-DWORD WINAPI SMX::SMXManager::ThreadMainStart(void *self_)
-{
-    SMXManager *self = (SMXManager *) self_;
-    self->ThreadMain();
-    return 0;
+    m_Thread.join();
 }
 
 // When we connect to a device, we don't know whether it's P1 or P2, since we get that
 // info from the device after we connect to it.  If we have a P2 device in SMX_PadNumber_1
-// or a P1 device in SMX_PadNumber_2, swap the two.  
+// or a P1 device in SMX_PadNumber_2, swap the two.  Any pads after the first two are
+// left in the order they connected.
 void SMX::SMXManager::CorrectDeviceOrder()
 {
-    // We're still holding the lock from when we updated the devices, so the application
-    // won't see the devices out of order before we do this.
+    // Device threads don't publish connection changes themselves.  They leave them for us,
+    // and we publish them after this, so the application won't see the devices out of order.
     g_Lock.AssertLockedByCurrentThread();
 
+    // The first two slots are always pads 0 and 1, in some order.  Lock them in slot order
+    // rather than pad order, so swapping them doesn't change the order they're locked in.
+    LockMutex L0(m_pSlots[0]->m_Lock);
+    LockMutex L1(m_pSlots[1]->m_Lock);
+    DeviceSlot &slot0 = *m_pPadSlots[0];
+    DeviceSlot &slot1 = *m_pPadSlots[1];
+
     SMXInfo info[2];
-    m_pDevices[0]->GetInfoLocked(info[0]);
-    m_pDevices[1]->GetInfoLocked(info[1]);
+    slot0.m_pDevice->GetInfoLocked(info[0]);
+    slot1.m_pDevice->GetInfoLocked(info[1]);
 
     // If we have two P1s or two P2s, the pads are misconfigured and we'll just leave the order alone.
     bool Player2[2] = {
-        m_pDevices[0]->IsPlayer2Locked(),
-        m_pDevices[1]->IsPlayer2Locked(),
+        slot0.m_pDevice->IsPlayer2Locked(),
+        slot1.m_pDevice->IsPlayer2Locked(),
     };
     if(info[0].m_bConnected && info[1].m_bConnected && Player2[0] == Player2[1])
         return;
 
     bool bP1NeedsSwap = info[0].m_bConnected && Player2[0];
     bool bP2NeedsSwap = info[1].m_bConnected && !Player2[1];
-    if(bP1NeedsSwap || bP2NeedsSwap)
-        swap(m_pDevices[0], m_pDevices[1]);
+    if(!bP1NeedsSwap && !bP2NeedsSwap)
+        return;
+
+    m_pPadSlots[0] = &slot1;
+    m_pPadSlots[1] = &slot0;
+    slot0.m_iPad = 1;
+    slot1.m_iPad = 0;
 }
 
 void SMX::SMXManager::ThreadMain()
 {
+    static const vector<shared_ptr<SMXTransport>> apNoTransports;
+
     g_Lock.Lock();
 
     while(!m_bShutdown)
     {
-        // If there are any lights commands to be sent, send them now.  Do this before callig Update(),
-        // since this actually just queues commands, which are actually handled in Update.
-        SendLightUpdates();
-
         // Send panel test mode commands if needed.
         UpdatePanelTestMode();
 
         // See if there are any new devices.
         AttemptConnections();
 
-        // Update all connected devices.
-        for(shared_ptr<SMXDevice> pDevice: m_pDevices)
+        // Devices may have finished initializing, so see if we need to update the ordering.
+        CorrectDeviceOrder();
+
+        // Publish connection changes that device threads have left for us, then tell the
+        // user about them.
+        for(int pad = 0; pad < m_iNumPads; ++pad)
         {
-            wstring sError;
-            pDevice->Update(sError);
+            DeviceSlot &slot = *m_pPadSlots[pad];
+            LockMutex L(slot.m_Lock);
+            PublishPadState(slot, true);
+            FlushUserCallbacks(slot);
+        }
 
-            if(!sError.empty())
-            {
-                Log(ssprintf("Device error: %ls", sError.c_str()));
+        // Wait until a device thread or the application wakes us up.  Wake up at least once a
+        // second, to check for new devices and to repeat panel test mode.
+        g_Lock.Unlock();
+        m_pWaiter->Wait(apNoTransports, 1000);
+        g_Lock.Lock();
+    }
 
-                // Tell m_pDeviceList that the device was closed, so it'll discard the device
-                // and notice if a new device shows up on the same path.
-                m_pSMXDeviceSearchThreaded->DeviceWasClosed(pDevice->GetDeviceHandle());
-                pDevice->CloseDevice();
-            }
+    // Shut down the device threads.  They close their devices before they exit.
+    for(int iSlot = 0; iSlot < m_iNumPads; ++iSlot)
+    {
+        DeviceSlot &slot = *m_pSlots[iSlot];
+        {
+            LockMutex L(slot.m_Lock);
+            slot.m_bShutdown = true;
         }
+        slot.m_pWaiter->Wake();
+        slot.m_Thread.join();
+    }
 
-        // Devices may have finished initializing, so see if we need to update the ordering.
-        CorrectDeviceOrder();
+    g_Lock.Unlock();
+}
+
+// The I/O thread for a device.  This sends queued commands and lights, reads packets,
+// and publishes the device's state.
+void SMX::SMXManager::DeviceThreadMain(DeviceSlot &slot)
+{
+    vector<shared_ptr<SMXTransport>> apTransports;
+
+    slot.m_Lock.Lock();
 
-        // Make a list of handles for WaitForMultipleObjectsEx.
-        vector<HANDLE> aHandles = { m_hEvent->value() };
-        for(shared_ptr<SMXDevice> pDevice: m_pDevices)
+    while(!slot.m_bShutdown)
+    {
+        // If there are any lights commands to be sent, send them now.  Do this before callig Update(),
+        // since this actually just queues commands, which are actually handled in Update.
+        SendLightUpdates(slot);
+
+        wstring sError;
+        slot.m_pDevice->Update(sError);
+
+        if(!sError.empty())
         {
-            shared_ptr<AutoCloseHandle> pHandle = pDevice->GetDeviceHandle();
-            if(pHandle)
-                aHandles.push_back(pHandle->value());
+            Log(ssprintf("Device error: %ls", sError.c_str()));
+
+            // Tell m_pDeviceList that the device was closed, so it'll discard the device
+            // and notice if a new device shows up on the same path.
+            m_pSMXDeviceSearchThreaded->DeviceWasClosed(slot.m_pDevice->GetTransport());
+            slot.m_pDevice->CloseDevice();
         }
 
+        // Publish the new state, then tell the user about it.
+        PublishPadState(slot, false);
+        FlushUserCallbacks(slot);
+
+        // Wait on the device's transport.  Reuse the list, so we don't allocate every time
+        // we wake up.
+        apTransports.clear();
+        shared_ptr<SMXTransport> pTransport = slot.m_pDevice->GetTransport();
+        if(pTransport)
+            apTransports.push_back(pTransport);
+
         // See how long we should block waiting for I/O.  If we have any scheduled lights commands,
         // wait until the next command should be sent, otherwise wait for a second.
         int iDelayMS = 1000;
-        if(!m_aPendingLightsCommands.empty())
+        if(!slot.m_Lights.m_aPendingCommands.empty())
         {
-            double fSendIn = m_aPendingLightsCommands[0].fTimeToSend - GetMonotonicTime();
+            double fSendIn = slot.m_Lights.m_aPendingCommands[0].fTimeToSend - GetMonotonicTime();
 
             // Add 1ms to the delay time.  We're using a high resolution timer, but
-            // WaitForMultipleObjectsEx only has 1ms resolution, so this keeps us from
+            // waits only have 1ms resolution, so this keeps us from
             // repeatedly waking up slightly too early.
             iDelayMS = int(fSendIn * 1000) + 1;
             iDelayMS = max(0, iDelayMS);
         }
 
-        // Wait until there's something to do for a connected device, or delay briefly if we're
-        // not connected to anything.  Unlock while we block.  Devices are only ever opened or
-        // closed from within this thread, so the handles won't go away while we're waiting on
-        // them.
-        g_Lock.Unlock();
-        WaitForMultipleObjectsEx(aHandles.size(), aHandles.data(), false, iDelayMS, true);
-        g_Lock.Lock();
+        // Wait until there's something to do for the device.  Unlock while we block.  Devices
+        // are only closed from within this thread, so the transport won't go away while we're
+        // waiting on it.
+        slot.m_Lock.Unlock();
+        slot.m_pWaiter->Wait(apTransports, iDelayMS);
+        slot.m_Lock.Lock();
     }
-    g_Lock.Unlock();
+
+    // Close the device while we still hold the lock.  Closing a device calls the completion
+    // callbacks of any commands still in flight, which expect to be called from this thread.
+    // The user callback thread has already shut down, so any updates this queues are never
+    // sent.
+    if(slot.m_pDevice->GetTransport())
+        slot.m_pDevice->CloseDevice();
+
+    slot.m_Lock.Unlock();
+}
+
+// Update the state returned by GetInputState and GetInfo.  This is only written if it's
+// changed, so readers polling it don't have to re-read the cache line every time.
+//
+// Connection changes are only published by the manager thread, after CorrectDeviceOrder.
+// If the device thread sees one, it wakes up the manager thread and leaves the state
+// alone until then.
+void SMX::SMXManager::PublishPadState(DeviceSlot &slot, bool bFromManagerThread)
+{
+    slot.m_Lock.AssertLockedByCurrentThread();
+
+    PadState state;
+    slot.m_pDevice->GetInfoLocked(state.info);
+    state.iInputState = slot.m_pDevice->GetInputStateLocked();
+
+    // The input state is reported by the device.  Anything else that changed here is
+    // a connection change, such as finishing connecting once the config is read, or the
+    // device changing pads.
+    const PadState &last = slot.m_LastPublishedPadState;
+    bool bConnectionChanged = slot.m_iPad != slot.m_iPublishedPad ||
+        state.info.m_bConnected != last.info.m_bConnected ||
+        state.info.m_iFirmwareVersion != last.info.m_iFirmwareVersion ||
+        memcmp(state.info.m_Serial, last.info.m_Serial, sizeof(state.info.m_Serial));
+    if(!bConnectionChanged && state.iInputState == last.iInputState)
+        return;
+
+    if(bConnectionChanged && !bFromManagerThread)
+    {
+        if(!slot.m_bPublishPending)
+        {
+            slot.m_bPublishPending = true;
+            m_pWaiter->Wake();
+        }
+        return;
+    }
+
+    if(bConnectionChanged)
+        QueueUpdate(slot, SMXUpdate_Connection);
+
+    slot.m_LastPublishedPadState = state;
+    slot.m_iPublishedPad = slot.m_iPad;
+    slot.m_bPublishPending = false;
+    m_PadState[slot.m_iPad].Store(state);
+}
+
+// Remember that something changed on a device.  This is sent to the user by FlushUserCallbacks.
+void SMX::SMXManager::QueueUpdate(DeviceSlot &slot, int iChanged)
+{
+    slot.m_Lock.AssertLockedByCurrentThread();
+
+    slot.m_iUnflushedUpdates |= iChanged;
+    slot.m_fUnflushedUpdateTime = GetMonotonicTime();
+}
+
+void SMX::SMXManager::QueueUploadProgress(int pad, int iProgress)
+{
+    m_iUploadProgress[pad] = iProgress;
+    QueueDeliverUpdate(pad, SMXUpdate_UploadProgress, GetMonotonicTime());
+}
+
+void SMX::SMXManager::FlushUserCallbacks(DeviceSlot &slot)
+{
+    slot.m_Lock.AssertLockedByCurrentThread();
+
+    // Don't tell the user about changes to a device whose state hasn't been published yet.
+    if(slot.m_iUnflushedUpdates == 0 || slot.m_bPublishPending)
+        return;
+
+    QueueDeliverUpdate(slot.m_iPad, slot.m_iUnflushedUpdates, slot.m_fUnflushedUpdateTime);
+    slot.m_iUnflushedUpdates = 0;
+}
+
+// Merge changes with any that haven't been delivered yet, and queue a callback to deliver
+// them.  The callback is coalesced by pad, so if one is already waiting this doesn't queue
+// another.  This can be called from any thread.
+void SMX::SMXManager::QueueDeliverUpdate(int pad, int iChanged, double fTime)
+{
+    m_fUpdateTime[pad] = fTime;
+    m_iUndeliveredUpdates[pad].fetch_or(iChanged);
+    m_UserCallbackThread.RunInThread([this, pad] { DeliverUpdate(pad); }, pad + 1);
+}
+
+// Send changes queued by FlushUserCallbacks to the user.  This is called from
+// m_UserCallbackThread.
+void SMX::SMXManager::DeliverUpdate(int pad)
+{
+    SMXUpdateDetails details;
+    details.m_iChanged = m_iUndeliveredUpdates[pad].exchange(0);
+
+    // If the previous callback picked up these changes after we queued this one, there's
+    // nothing new to tell the user.
+    if(details.m_iChanged == 0)
+        return;
+
+    details.m_iInputState = GetInputState(pad);
+    details.m_fTime = m_fUpdateTime[pad];
+    details.m_iUploadProgress = m_iUploadProgress[pad];
+
+    {
+        LockMutex L(m_CallbackStatsLock);
+        m_CallbackLag[pad].Record(GetMonotonicTime() - details.m_fTime);
+    }
+
+    m_pUpdateCallback(pad, details);
+}
+
+bool SMX::SMXManager::GetStats(int pad, SMXStats &stats) const
+{
+    g_Lock.AssertNotLockedByCurrentThread();
+    LockMutex L(g_Lock);
+
+    if(pad < 0 || pad >= GetPadCount())
+        return false;
+
+    stats = SMXStats();
+    {
+        DeviceSlot &slot = *m_pPadSlots[pad];
+        LockMutex L2(slot.m_Lock);
+        slot.m_pDevice->GetStatsLocked(stats);
+        const PadLights &lights = slot.m_Lights;
+        stats.m_iLightsUpdatesReplaced = lights.m_iUpdatesReplaced;
+        stats.m_iLightsCommandsSkipped = lights.m_iCommandsSkipped;
+        stats.m_fLightsLatencyMean = lights.m_Latency.GetMean();
+        stats.m_fLightsLatencyP99 = lights.m_Latency.GetPercentile(99);
+        stats.m_fLightsJitter = lights.m_fJitter;
+        stats.m_fLightsTimingErrorMean = lights.m_TimingError.GetMean();
+        stats.m_fLightsTimingErrorMax = lights.m_TimingError.GetMax();
+    }
+
+    LockMutex L3(m_CallbackStatsLock);
+    const SMXLatencyHistogram &lag = m_CallbackLag[pad];
+    stats.m_iCallbacks = lag.GetCount();
+    stats.m_fCallbackLagMean = lag.GetMean();
+    stats.m_fCallbackLagP99 = lag.GetPercentile(99);
+    stats.m_fCallbackLagMax = lag.GetMax();
+    return true;
+}
+
+void SMX::SMXManager::SetTrafficRecorder(shared_ptr<SMXTrafficRecorder> pRecorder)
+{
+    g_Lock.AssertNotLockedByCurrentThread();
+    LockMutex L(g_Lock);
+
+    m_pTrafficRecorder = pRecorder;
+    for(int iSlot = 0; iSlot < m_iNumPads; ++iSlot)
+    {
+        DeviceSlot &slot = *m_pSlots[iSlot];
+        LockMutex L2(slot.m_Lock);
+        slot.m_pDevice->SetTrafficRecorderLocked(pRecorder, iSlot);
+    }
+}
+
+void SMX::SMXManager::ResetStats()
+{
+    g_Lock.AssertNotLockedByCurrentThread();
+    LockMutex L(g_Lock);
+
+    for(int iPad = 0; iPad < GetPadCount(); ++iPad)
+    {
+        DeviceSlot &slot = *m_pPadSlots[iPad];
+        LockMutex L2(slot.m_Lock);
+        slot.m_pDevice->ResetStatsLocked();
+        slot.m_Lights.m_iUpdatesReplaced = 0;
+        slot.m_Lights.m_iCommandsSkipped = 0;
+        slot.m_Lights.m_Latency.Reset();
+        slot.m_Lights.m_TimingError.Reset();
+    }
+
+    LockMutex L3(m_CallbackStatsLock);
+    for(SMXLatencyHistogram &lag: m_CallbackLag)
+        lag.Reset();
 }
 
 // Lights are updated with two commands.  The top two rows of LEDs in each panel are
@@ -243,74 +561,86 @@ void SMX::SMXManager::ThreadMain()
 // we don't get weird interlacing effects.
 // - If SMX_ReenableAutoLights is called between the two commands, we need to guarantee
 // that we don't send the second lights commands, since that may re-disable auto lights.
-// - If we have two pads, the lights update is for both pads and we'll send both commands
-// for both pads at the same time, so both pads update lights simultaneously.
-void SMX::SMXManager::SetLights(const string sPanelLights[2])
+// - Each pad is paced separately.  A lights update for several pads is queued for all of
+// them at once, so pads that are keeping up update together, but a pad that's slow to
+// acknowledge commands only delays its own lights.
+void SMX::SMXManager::SetLights(const string *sPanelLights, int iNumPads)
+{
+    const char *pPanelLights[MaxPads];
+    int iPanelLightsSize[MaxPads];
+    iNumPads = min(iNumPads, int(MaxPads));
+    for(int iPad = 0; iPad < iNumPads; ++iPad)
+    {
+        pPanelLights[iPad] = sPanelLights[iPad].data();
+        iPanelLightsSize[iPad] = (int) sPanelLights[iPad].size();
+    }
+    SetLights(pPanelLights, iPanelLightsSize, iNumPads);
+}
+
+namespace
+{
+    // FNV-1a, used to tell if a lights command has changed.
+    uint64_t HashLightsCommand(const char *pData, int iSize)
+    {
+        uint64_t iHash = 0xcbf29ce484222325ULL;
+        for(int i = 0; i < iSize; ++i)
+        {
+            iHash ^= (uint8_t) pData[i];
+            iHash *= 0x100000001b3ULL;
+        }
+        return iHash;
+    }
+}
+
+// This is called for every lights update, so it doesn't allocate memory.  Commands are
+// built in fixed-size buffers and queued in each pad's m_aPendingCommands, which never
+// grows past its initial reservation.
+void SMX::SMXManager::SetLights(const char *const *pPanelLights, const int *iPanelLightsSize, int iNumPads, double fPresentAt)
 {
     g_Lock.AssertNotLockedByCurrentThread();
-    LockMutex L(g_Lock);
 
-    // Don't send lights when a panel test mode is active.
-    if(m_PanelTestMode != PanelTestMode_Off)
-        return;
+    // Ignore data for pads that don't exist.
+    iNumPads = min(iNumPads, GetPadCount());
 
     // If m_bOnlySendLightsOnChange is true, only send lights commands if the lights have
     // actually changed.  This is only used for internal testing, and the controllers normally
     // expect to receive regular lights updates, even if the lights aren't actually changing.
     if(m_bOnlySendLightsOnChange)
     {
-        static string sLastPanelLights[2];
-        if(sPanelLights[0] == sLastPanelLights[0] && sPanelLights[1] == sLastPanelLights[1])
+        LockMutex L(g_Lock);
+        if(m_PanelTestMode != PanelTestMode_Off)
+            return;
+
+        static string sLastPanelLights[MaxPads];
+        bool bChanged = false;
+        for(int iPad = 0; iPad < iNumPads; ++iPad)
+        {
+            if(sLastPanelLights[iPad].compare(0, string::npos, pPanelLights[iPad], iPanelLightsSize[iPad]))
+                bChanged = true;
+        }
+
+        if(!bChanged)
         {
             Log("no change");
             return;
         }
 
-        sLastPanelLights[0] = sPanelLights[0];
-        sLastPanelLights[1] = sPanelLights[1];
+        for(int iPad = 0; iPad < iNumPads; ++iPad)
+            sLastPanelLights[iPad].assign(pPanelLights[iPad], iPanelLightsSize[iPad]);
     }
 
-    // Separate top and bottom lights commands.
-    //
-    // sPanelLights[iPad] is
-    //
-    // 0123 0123 0123
-    // 4567 4567 4567
-    // 89AB 89AB 89AB
-    // CDEF CDEF CDEF
-    //
-    // 0123 0123 0123
-    // 4567 4567 4567
-    // 89AB 89AB 89AB
-    // CDEF CDEF CDEF
-    //
-    // 0123 0123 0123
-    // 4567 4567 4567
-    // 89AB 89AB 89AB
-    // CDEF CDEF CDEF
-    //
-    // If we're on a 25-light device, we have an additional grid of 3x3 LEDs:
-    //
-    //
-    // x x x x
-    //  0 1 2
-    // x x x x
-    //  3 4 5
-    // x x x x
-    //  6 7 8
-    // x x x x
-    //
-    // Set sLightsCommand[iPad][0] to include 0123 4567, [1] to 89AB CDEF,
-    // and [2] to the 3x3 grid.
-    string sLightCommands[3][2]; // sLightCommands[command][pad]
-
-    // Read the linearly arranged color data we've been given and split it into top and
-    // bottom commands for each pad.
-    for(int iPad = 0; iPad < 2; ++iPad)
+    // Read the linearly arranged color data we've been given and split it into lights
+    // commands for each pad.  See SMXLightsEncoding.h for the layout.  This is done before
+    // taking any locks, so each pad's lock only covers queueing the commands and doesn't
+    // hold up its I/O thread while other pads are encoded.
+    EncodedLights aLights[MaxPads];
+    const EncodedLights *apLights[MaxPads] = { };
+    for(int iPad = 0; iPad < iNumPads; ++iPad)
     {
-        // If there's no data for this pad, leave the command empty.
-        string sLightsDataForPad = sPanelLights[iPad];
-        if(sLightsDataForPad.empty())
+        // If there's no data for this pad, leave any commands already queued for it alone.
+        const uint8_t *pLightsDataForPad = (const uint8_t *) pPanelLights[iPad];
+        int iLightsDataSize = iPanelLightsSize[iPad];
+        if(iLightsDataSize == 0)
             continue;
 
         // Sanity check the lights data.  For 4x4 lights, it should have 9*4*4*3 bytes of
@@ -318,77 +648,135 @@ void SMX::SMXManager::SetLights(const string sPanelLights[2])
         // be 4x4+3x3 (25) lights of data.
         int LightSize4x4 = 9*4*4*3;
         int LightSize25 = 9*5*5*3;
-        if(sLightsDataForPad.size() != LightSize4x4 && sLightsDataForPad.size() != LightSize25)
+        if(iLightsDataSize != LightSize4x4 && iLightsDataSize != LightSize25)
         {
             Log(ssprintf("SetLights: Lights data should be %i or %i bytes, received %i",
-                LightSize4x4, LightSize25, sLightsDataForPad.size()));
+                LightSize4x4, LightSize25, iLightsDataSize));
             continue;
         }
 
-        // If we've been given 16 lights, pad to 25.
-        if(sLightsDataForPad.size() == LightSize4x4)
-            sLightsDataForPad.append(LightSize25 - LightSize4x4, '\0');
+        EncodedLights &lights = aLights[iPad];
+        EncodeLightsCommands(pLightsDataForPad, iLightsDataSize, lights.m_Command4, lights.m_Command2, lights.m_Command3);
+        apLights[iPad] = &lights;
+    }
 
-        // Lights are sent in three commands:
-        // 
-        // 4: the 3x3 inner grid
-        // 2: the top 4x2 lights
-        // 3: the bottom 4x2 lights
-        //
-        // Command 4 is only used by firmware version 4+.
-        //
-        // Always send all three commands if the firmware expects it, even if we've
-        // been given 4x4 data.
-        sLightCommands[0][iPad] = "4";
-        sLightCommands[1][iPad] = "2";
-        sLightCommands[2][iPad] = "3";
-        int iNextInputByte = 0;
-        auto scaleLight = [](uint8_t iColor) {
-            // Apply color scaling.  Values over about 170 don't make the LEDs any brighter, so this
-            // gives better contrast and draws less power.
-            return uint8_t(iColor * 0.6666f);
-        };
-        for(int iPanel = 0; iPanel < 9; ++iPanel)
+    SetEncodedLights(apLights, iNumPads, fPresentAt);
+}
+
+// This is like SetLights, but takes commands that have already been encoded, so they're
+// copied into the queue as they are.  m_bOnlySendLightsOnChange isn't checked here:
+// unchanged commands are skipped per command by m_bSkipUnchangedLights instead.
+void SMX::SMXManager::SetEncodedLights(const EncodedLights *const *pLights, int iNumPads, double fPresentAt)
+{
+    g_Lock.AssertNotLockedByCurrentThread();
+
+    // The I/O threads of pads we queued lights for.  These are woken after we've released
+    // our locks, so they don't wake up just to wait for them.
+    SMXIOWaiter *apWaiters[MaxPads];
+    int iWaiters = 0;
+
+    {
+        LockMutex L(g_Lock);
+
+        // Don't send lights when a panel test mode is active.
+        if(m_PanelTestMode != PanelTestMode_Off)
+            return;
+
+        // Ignore data for pads that don't exist.
+        iNumPads = min(iNumPads, GetPadCount());
+
+        // Use the same time for every pad, so pads that are keeping up are sent lights
+        // together.
+        double fNow = GetMonotonicTime();
+        for(int iPad = 0; iPad < iNumPads; ++iPad)
         {
-            // Create the 2 and 3 commands.
-            for(int iByte = 0; iByte < 4*4*3; ++iByte)
-            {
-                uint8_t iColor = sLightsDataForPad[iNextInputByte++];
-                iColor = scaleLight(iColor);
-                
-                int iCommandIndex = iByte < 4*2*3? 1:2;
-                sLightCommands[iCommandIndex][iPad].append(1, iColor);
-            }
+            // If there's no data for this pad, leave any commands already queued for it alone.
+            if(pLights[iPad] == nullptr)
+                continue;
 
-            // Create the 4 command.
-            for(int iByte = 0; iByte < 3*3*3; ++iByte)
+            // If we don't have the config yet, the master is in the process of connecting, so
+            // don't queue lights.
+            DeviceSlot &slot = *m_pPadSlots[iPad];
+            LockMutex L2(slot.m_Lock);
+            SMXConfig config;
+            if(!slot.m_pDevice->GetConfigLocked(config))
+                continue;
+
+            PendingCommand *pCommands = QueueLightsForPad(slot, fNow, config, fPresentAt);
+            if(pCommands != nullptr)
             {
-                uint8_t iColor = sLightsDataForPad[iNextInputByte++];
-                iColor = scaleLight(iColor);
-                sLightCommands[0][iPad].append(1, iColor);
+                memcpy(pCommands[0].sCommand, pLights[iPad]->m_Command4, LightsCommand4Size);
+                memcpy(pCommands[1].sCommand, pLights[iPad]->m_Command2, LightsCommand2Size);
+                memcpy(pCommands[2].sCommand, pLights[iPad]->m_Command3, LightsCommand3Size);
+                FinishLightsCommands(config, pCommands);
             }
-        }
 
-        sLightCommands[0][iPad].push_back('\n');
-        sLightCommands[1][iPad].push_back('\n');
-        sLightCommands[2][iPad].push_back('\n');
+            apWaiters[iWaiters++] = slot.m_pWaiter.get();
+        }
     }
 
-    // Each update adds one entry to m_aPendingLightsCommands for each lights command.
+    // Wake up each device's I/O thread if it's blocking.
+    for(int i = 0; i < iWaiters; ++i)
+        apWaiters[i]->Wake();
+}
+
+// Queue a lights update for a pad, and return the three commands for it, which the caller
+// fills in before calling FinishLightsCommands.  If the update was dropped, return null.
+SMX::SMXManager::PendingCommand *SMX::SMXManager::QueueLightsForPad(DeviceSlot &slot, double fNow, const SMXConfig &config, double fPresentAt)
+{
+    g_Lock.AssertLockedByCurrentThread();
+    slot.m_Lock.AssertLockedByCurrentThread();
+
+    PadLights &lights = slot.m_Lights;
+
+    // Each update adds one entry to m_aPendingCommands for each lights command.
     //
-    // If there are at least as many entries in m_aPendingLightsCommands as there are
-    // commands to send, then lights updates are happening faster than they can be sent
-    // to the pad.  If that happens, replace the existing commands rather than adding
-    // new ones.
+    // If there are at least as many entries in m_aPendingCommands as there are commands
+    // to send, then lights updates are happening faster than they can be sent to the pad.
+    // If that happens, replace the existing commands rather than adding new ones.
     //
     // Make sure we always finish a lights update once we start it, so if we receive lights
     // updates very quickly we won't just keep sending the first half and never finish one.
     // Otherwise, we'll update with the newest data we have available.
     //
-    // Note that m_aPendingLightsCommands contains the update for both pads, to guarantee
-    // we always send light updates for both pads together and they never end up out of
-    // phase.
-    if(m_aPendingLightsCommands.size() < 3)
+    // Updates with a presentation time are only replaced by updates for the same frame
+    // or an earlier one.  An update for a later frame that's too soon after the queued
+    // one is discarded, so the queued update is still shown at its own time.  One that's
+    // far enough after it is queued behind it.
+    bool bAppend = lights.m_aPendingCommands.size() < 3;
+    if(!bAppend && fPresentAt > 0)
+    {
+        PendingCommand *pQueued = &lights.m_aPendingCommands[lights.m_aPendingCommands.size()-3];
+        double fQueuedPresentAt = pQueued[2].fPresentAt;
+        if(fQueuedPresentAt > 0 && fPresentAt > fQueuedPresentAt)
+        {
+            // Allow for rounding in the caller's frame times.
+            const double fTolerance = 0.001;
+            if(fPresentAt < fQueuedPresentAt + LightsInterval - fTolerance)
+            {
+                lights.m_iUpdatesReplaced++;
+                return nullptr;
+            }
+
+            bAppend = int(lights.m_aPendingCommands.size()/3) < MaxQueuedLightsUpdates;
+            if(!bAppend)
+                ScheduleLightsUpdate(lights, config, pQueued[1].fTimeToSend, fPresentAt, pQueued);
+        }
+    }
+
+    if(!bAppend)
+        lights.m_iUpdatesReplaced++;
+    else if(fPresentAt > 0)
+    {
+        // This update has a presentation time.  Show it then, or on the next frame the pad
+        // can show if that's too soon after the previous update.
+        lights.m_aPendingCommands.push_back(PendingCommand(fNow));
+        lights.m_aPendingCommands.push_back(PendingCommand(fNow));
+        lights.m_aPendingCommands.push_back(PendingCommand(fNow));
+        PendingCommand *pCommands = &lights.m_aPendingCommands[lights.m_aPendingCommands.size()-3];
+        ScheduleLightsUpdate(lights, config, fNow, max(fPresentAt, lights.m_fNextPresentAt), pCommands);
+    }
+    else
     {
         // There's a subtle but important difference between command timing in
         // firmware version 4 compared to earlier versions:
@@ -413,90 +801,106 @@ void SMX::SMXManager::SetLights(const string sPanelLights[2])
         // panels, the timing requirements are tighter.  Doing it in the same manual-delay
         // fashion causes too much latency and makes it harder to maintain 30 FPS.
         //
-        // If two controllers are connected, they should either both be 4+ or not.  We
-        // don't handle the case where they're different and both timings are needed.
-        double fNow = GetMonotonicTime();
-        double fSendCommandAt = max(fNow, m_fDelayLightCommandsUntil);
+        // Since each pad is paced separately, pads with different firmware versions each
+        // get the timing they need.
+        double fSendCommandAt = max(fNow, lights.m_fDelayCommandsUntil);
         double fCommandTimes[3] = { fNow, fNow, fNow };
 
-        bool masterIsV4 = false;
-        bool anyMasterConnected = false;
-        for(int iPad = 0; iPad < 2; ++iPad)
-        {
-            SMXConfig config;
-            if(!m_pDevices[iPad]->GetConfigLocked(config))
-                continue;
-
-            anyMasterConnected = true;
-            if(config.masterVersion >= 4)
-                masterIsV4 = true;
-        }
-
-        // If we don't have the config yet, the master is in the process of connecting, so don't
-        // queue lights.
-        if(!anyMasterConnected)
-            return;
-
         // If we're on master firmware < 4, set delay times.  For 4+, just queue commands.
         // We don't need to set fCommandTimes[0] since the '4' packet won't be sent.
-        if(!masterIsV4)
+        if(config.masterVersion < 4)
         {
-            const double fDelayBetweenLightsCommands = 1/60.0;
             fCommandTimes[1] = fSendCommandAt;
-            fCommandTimes[2] = fCommandTimes[1] + fDelayBetweenLightsCommands;
+            fCommandTimes[2] = fCommandTimes[1] + DelayBetweenLightsCommands;
         }
 
-        // Update m_fDelayLightCommandsUntil, so we know when the next
-        // lights command can be sent.
-        m_fDelayLightCommandsUntil = fSendCommandAt + 1/30.0f;
+        // Update m_fDelayCommandsUntil, so we know when the next lights command can be sent.
+        // If the next update has a presentation time, keep it a frame after we expect this
+        // one to be shown.
+        lights.m_fDelayCommandsUntil = fSendCommandAt + LightsInterval;
+        lights.m_fNextPresentAt = fCommandTimes[2] + lights.m_fLatency + LightsInterval;
 
-        // Add three commands to the list, scheduled at fFirstCommandTime and fSecondCommandTime.
-        m_aPendingLightsCommands.push_back(PendingCommand(fCommandTimes[0]));
-        m_aPendingLightsCommands.push_back(PendingCommand(fCommandTimes[1]));
-        m_aPendingLightsCommands.push_back(PendingCommand(fCommandTimes[2]));
+        // Add three commands to the list, scheduled at fCommandTimes.
+        lights.m_aPendingCommands.push_back(PendingCommand(fCommandTimes[0]));
+        lights.m_aPendingCommands.push_back(PendingCommand(fCommandTimes[1]));
+        lights.m_aPendingCommands.push_back(PendingCommand(fCommandTimes[2]));
     }
 
-    // Set the pad commands.
-    for(int iPad = 0; iPad < 2; ++iPad)
+    // The update's commands are always the last three entries.
+    return &lights.m_aPendingCommands[lights.m_aPendingCommands.size()-3];
+}
+
+// Set the size of commands returned by QueueLightsForPad once they've been filled in.
+// Command 4 is only used by firmware version 4+.  All three commands are always created,
+// even for 4x4 data, and the 4 command is left empty if the firmware doesn't use it, so
+// it isn't sent.
+void SMX::SMXManager::FinishLightsCommands(const SMXConfig &config, PendingCommand *pCommands)
+{
+    const int iLightCommandSizes[3] = { LightsCommand4Size, LightsCommand2Size, LightsCommand3Size };
+    for(int iCommand = 0; iCommand < 3; ++iCommand)
     {
-        // If the command for this pad is empty, leave any existing pad command alone.
-        if(sLightCommands[0][iPad].empty())
-            continue;
+        PendingCommand &pending = pCommands[iCommand];
+        pending.iCommandSize = iCommand == 0 && config.masterVersion < 4? 0:iLightCommandSizes[iCommand];
+        if(m_bSkipUnchangedLights && pending.iCommandSize > 0)
+            pending.iCommandHash = HashLightsCommand(pending.sCommand, pending.iCommandSize);
+    }
+}
 
-        SMXConfig config;
-        if(!m_pDevices[iPad]->GetConfigLocked(config))
-            continue;
+// Schedule the three commands in pCommands so the update finishes at fPresentAt, based on
+// how long the pad has been taking to acknowledge lights.  Commands aren't sent before
+// fEarliest.
+//
+// Pads are scheduled separately, so a pad that takes longer is sent lights earlier, and
+// pads given the same presentation time show their lights together.
+void SMX::SMXManager::ScheduleLightsUpdate(PadLights &lights, const SMXConfig &config, double fEarliest, double fPresentAt, PendingCommand *pCommands)
+{
+    double fDelayBetweenCommands = config.masterVersion < 4? DelayBetweenLightsCommands:0;
+    double fSendAt = max(fEarliest, fPresentAt - lights.m_fLatency - fDelayBetweenCommands);
+
+    pCommands[0].fTimeToSend = fSendAt;
+    pCommands[1].fTimeToSend = fSendAt;
+    pCommands[2].fTimeToSend = fSendAt + fDelayBetweenCommands;
+    for(int iCommand = 0; iCommand < 3; ++iCommand)
+        pCommands[iCommand].fPresentAt = fPresentAt;
 
-        // If this pad is firmware version 4, send the 4 command.  Otherwise, leave the 4 command
-        // empty and no command will be sent.
-        PendingCommand *pPending4Commands = &m_aPendingLightsCommands[m_aPendingLightsCommands.size()-3]; // 3
-        if(config.masterVersion >= 4)
-            pPending4Commands->sPadCommand[iPad] = sLightCommands[0][iPad];
-        else
-            pPending4Commands->sPadCommand[iPad] = "";
+    lights.m_fDelayCommandsUntil = fSendAt + LightsInterval;
+    lights.m_fNextPresentAt = fPresentAt + LightsInterval;
+}
 
-        PendingCommand *pPending2Commands = &m_aPendingLightsCommands[m_aPendingLightsCommands.size()-2]; // 2
-        pPending2Commands->sPadCommand[iPad] = sLightCommands[1][iPad];
+// The pad has acknowledged all lights commands in progress.  Update the latency estimate
+// used by ScheduleLightsUpdate.
+void SMX::SMXManager::LightsBatchFinished(PadLights &lights)
+{
+    double fNow = GetMonotonicTime();
+    double fLatency = fNow - lights.m_fBatchSentAt;
+    if(fLatency > MaxLightsLatency)
+        return;
 
-        PendingCommand *pPending3Commands = &m_aPendingLightsCommands[m_aPendingLightsCommands.size()-1]; // 3
-        pPending3Commands->sPadCommand[iPad] = sLightCommands[2][iPad];
+    lights.m_Latency.Record(fLatency);
+    if(lights.m_fLastLatency >= 0)
+    {
+        lights.m_fJitter += (fabs(fLatency - lights.m_fLastLatency) - lights.m_fJitter) / 16;
+        lights.m_fLatency += (fLatency - lights.m_fLatency) / 8;
     }
+    else
+        lights.m_fLatency = fLatency;
+    lights.m_fLastLatency = fLatency;
 
-    // Wake up the I/O thread if it's blocking on WaitForMultipleObjectsEx.
-    SetEvent(m_hEvent->value());
+    if(lights.m_fBatchPresentAt > 0)
+        lights.m_TimingError.Record(fabs(fNow - lights.m_fBatchPresentAt));
 }
 
-void SMX::SMXManager::SetPlatformLights(const string sPanelLights[2])
+void SMX::SMXManager::SetPlatformLights(const string *sPanelLights, int iNumPads)
 {
     g_Lock.AssertNotLockedByCurrentThread();
     LockMutex L(g_Lock);
 
-    // Read the linearly arranged color data we've been given and split it into top and
-    // bottom commands for each pad.
-    for(int iPad = 0; iPad < 2; ++iPad)
+    // Read the linearly arranged color data we've been given and send it to each pad.
+    iNumPads = min(iNumPads, GetPadCount());
+    for(int iPad = 0; iPad < iNumPads; ++iPad)
     {
         // If there's no data for this pad, skip it.
-        string sLightsDataForPad = sPanelLights[iPad];
+        const string &sLightsDataForPad = sPanelLights[iPad];
         if(sLightsDataForPad.empty())
             continue;
 
@@ -508,8 +912,10 @@ void SMX::SMXManager::SetPlatformLights(const string sPanelLights[2])
         }
 
         // If this master doesn't support this, skip it.
+        DeviceSlot &slot = *m_pPadSlots[iPad];
+        LockMutex L2(slot.m_Lock);
         SMXConfig config;
-        if(!m_pDevices[iPad]->GetConfigLocked(config))
+        if(!slot.m_pDevice->GetConfigLocked(config))
             continue;
         if(config.masterVersion < 4)
             continue;
@@ -520,11 +926,8 @@ void SMX::SMXManager::SetPlatformLights(const string sPanelLights[2])
         sLightCommand.push_back(44); // number of LEDs to set
         sLightCommand += sLightsDataForPad;
 
-        m_pDevices[iPad]->SendCommandLocked(sLightCommand);
+        slot.m_pDevice->SendCommandLocked(sLightCommand, nullptr, CommandPriority_Lights);
     }
-
-    // Wake up the I/O thread if it's blocking on WaitForMultipleObjectsEx.
-    SetEvent(m_hEvent->value());
 }
 
 void SMX::SMXManager::ReenableAutoLights()
@@ -535,54 +938,153 @@ void SMX::SMXManager::ReenableAutoLights()
     // Clear any pending lights commands, so we don't re-disable auto-lighting by sending a
     // lights command after we enable it.  If we've sent the first half of a lights update
     // and this causes us to not send the second half, the controller will just discard it.
-    m_aPendingLightsCommands.clear();
-    for(int iPad = 0; iPad < 2; ++iPad)
-        m_pDevices[iPad]->SendCommandLocked(string("S 1\n", 4));
+    //
+    // This is queued with lights priority, so it's sent after lights commands that are
+    // already queued.
+    for(int iPad = 0; iPad < GetPadCount(); ++iPad)
+    {
+        DeviceSlot &slot = *m_pPadSlots[iPad];
+        LockMutex L2(slot.m_Lock);
+        slot.m_Lights.m_aPendingCommands.clear();
+        slot.m_pDevice->SendCommandLocked(string("S 1\n", 4), nullptr, CommandPriority_Lights);
+
+        // The pad is back to auto lighting, so the next lights need to be sent even if
+        // they haven't changed.
+        ResetSentLights(slot);
+    }
 }
 
-// Check to see if we should send any commands in m_aPendingLightsCommands.
-void SMX::SMXManager::SendLightUpdates()
+void SMX::SMXManager::SetSkipUnchangedLights(bool bSkip)
 {
-    g_Lock.AssertLockedByCurrentThread();
+    g_Lock.AssertNotLockedByCurrentThread();
+    LockMutex L(g_Lock);
+
+    m_bSkipUnchangedLights = bSkip;
+    for(int iPad = 0; iPad < GetPadCount(); ++iPad)
+    {
+        DeviceSlot &slot = *m_pPadSlots[iPad];
+        LockMutex L2(slot.m_Lock);
+        ResetSentLights(slot);
+    }
+}
+
+// Forget which lights commands we've sent to a pad, so the next ones are sent even if they
+// haven't changed.
+void SMX::SMXManager::ResetSentLights(DeviceSlot &slot)
+{
+    slot.m_Lock.AssertLockedByCurrentThread();
+
+    PadLights &lights = slot.m_Lights;
+    for(int iCommand = 0; iCommand < 3; ++iCommand)
+        lights.m_SentCommands[iCommand] = SentLightsCommand();
+    lights.m_pSentTransport.reset();
+}
+
+// Return true if command can be skipped for a pad, because the pad already has the
+// same lights.  If the command will be sent, remember it.
+bool SMX::SMXManager::ShouldSkipLightsCommand(DeviceSlot &slot, const PendingCommand &command)
+{
+    slot.m_Lock.AssertLockedByCurrentThread();
+
+    if(!m_bSkipUnchangedLights)
+        return false;
+
+    // If this pad has reconnected, or the pads have been swapped, the lights we sent
+    // before are for a different connection.
+    PadLights &lights = slot.m_Lights;
+    shared_ptr<SMXTransport> pTransport = slot.m_pDevice->GetTransport();
+    weak_ptr<SMXTransport> &pSentTransport = lights.m_pSentTransport;
+    if(pSentTransport.owner_before(pTransport) || pTransport.owner_before(pSentTransport))
+    {
+        for(int iCommand = 0; iCommand < 3; ++iCommand)
+            lights.m_SentCommands[iCommand] = SentLightsCommand();
+        pSentTransport = pTransport;
+    }
+
+    int iCommand;
+    switch(command.sCommand[0])
+    {
+    case '4': iCommand = 0; break;
+    case '2': iCommand = 1; break;
+    case '3': iCommand = 2; break;
+    default: return false;
+    }
+
+    SMXConfig config;
+    if(!slot.m_pDevice->GetConfigLocked(config))
+        return false;
+
+    // The master returns to auto lighting if it doesn't receive lights for
+    // autoLightsTimeout (in 128ms units).  Resend unchanged lights at half that, so
+    // they're refreshed well before it times out.  If the timeout is 0, don't skip
+    // anything.
+    double fRefreshInterval = config.autoLightsTimeout * 0.128 / 2;
+    double fNow = GetMonotonicTime();
+
+    SentLightsCommand &sent = lights.m_SentCommands[iCommand];
+    if(sent.fSentAt >= 0 && sent.iHash == command.iCommandHash &&
+        fNow - sent.fSentAt < fRefreshInterval)
+        return true;
+
+    sent.iHash = command.iCommandHash;
+    sent.fSentAt = fNow;
+    return false;
+}
+
+// Check to see if we should send any queued lights commands to a device.
+void SMX::SMXManager::SendLightUpdates(DeviceSlot &slot)
+{
+    slot.m_Lock.AssertLockedByCurrentThread();
 
     // If previous lights commands are being sent, wait for them to complete before
     // queueing more.
-    if(m_iLightsCommandsInProgress > 0)
+    PadLights &lights = slot.m_Lights;
+    if(lights.m_iCommandsInProgress > 0)
         return;
 
     // If we have more than one command queued, we can queue several of them if we're
     // before fTimeToSend.  For the V4 pads that require more commands, this lets us queue
     // the whole lights update at once.  V3 pads require us to time commands, so we can't
     // spam both lights commands at once, which is handled by fTimeToSend.
-    while( !m_aPendingLightsCommands.empty() )
+    double fNow = GetMonotonicTime();
+    while(!lights.m_aPendingCommands.empty())
     {
-        // Send the lights command for each pad.  If either pad isn't connected, this won't do
-        // anything.
-        const PendingCommand &command = m_aPendingLightsCommands[0];
+        const PendingCommand &command = lights.m_aPendingCommands[0];
 
         // See if it's time to send this command.
-        if(command.fTimeToSend > GetMonotonicTime())
+        if(command.fTimeToSend > fNow)
             break;
 
-        for(int iPad = 0; iPad < 2; ++iPad)
+        // If the pad isn't connected, this won't do anything.
+        if(command.iCommandSize > 0 && ShouldSkipLightsCommand(slot, command))
+            lights.m_iCommandsSkipped++;
+        else if(command.iCommandSize > 0)
         {
-            if(!command.sPadCommand[iPad].empty())
+            // Remember when this batch of commands started, and if it finishes an update
+            // that has a presentation time, when that was.
+            if(lights.m_iCommandsInProgress == 0)
             {
-                // Count the number of commands we've queued.  We won't send any more until
-                // this reaches 0 and all queued commands were sent.
-                m_iLightsCommandsInProgress++;
-
-                // The completion callback is guaranteed to always be called, even if the controller
-                // disconnects and the command wasn't sent.
-                m_pDevices[iPad]->SendCommandLocked(command.sPadCommand[iPad], [this, iPad](string response) {
-                    g_Lock.AssertLockedByCurrentThread();
-                    m_iLightsCommandsInProgress--;
-                });
+                lights.m_fBatchSentAt = fNow;
+                lights.m_fBatchPresentAt = 0;
             }
+            if(command.sCommand[0] == '3')
+                lights.m_fBatchPresentAt = command.fPresentAt;
+
+            // Count the number of commands we've queued.  We won't send any more until
+            // this reaches 0 and all queued commands were sent.
+            lights.m_iCommandsInProgress++;
+
+            // The completion callback is guaranteed to always be called, even if the controller
+            // disconnects and the command wasn't sent.
+            slot.m_pDevice->SendCommandLocked(command.sCommand, command.iCommandSize, [&slot](string response) {
+                slot.m_Lock.AssertLockedByCurrentThread();
+                if(--slot.m_Lights.m_iCommandsInProgress == 0)
+                    LightsBatchFinished(slot.m_Lights);
+            }, CommandPriority_Lights);
         }
 
         // Remove the command we've sent.
-        m_aPendingLightsCommands.erase(m_aPendingLightsCommands.begin(), m_aPendingLightsCommands.begin()+1);
+        lights.m_aPendingCommands.erase(lights.m_aPendingCommands.begin());
     }
 }
 
@@ -591,6 +1093,7 @@ void SMX::SMXManager::SetPanelTestMode(PanelTestMode mode)
     g_Lock.AssertNotLockedByCurrentThread();
     LockMutex Lock(g_Lock);
     m_PanelTestMode = mode;
+    m_pWaiter->Wake();
 }
 
 void SMX::SMXManager::UpdatePanelTestMode()
@@ -600,27 +1103,36 @@ void SMX::SMXManager::UpdatePanelTestMode()
     // When the test mode is enabled, send the test mode again periodically, or it'll time
     // out on the master and be turned off.  Don't repeat the PanelTestMode_Off command.
     g_Lock.AssertLockedByCurrentThread();
-    uint32_t now = GetTickCount();
+    double fNow = GetMonotonicTime();
     if(m_PanelTestMode == m_LastSentPanelTestMode && 
-        (m_PanelTestMode == PanelTestMode_Off || now - m_SentPanelTestModeAtTicks < 1000))
+        (m_PanelTestMode == PanelTestMode_Off || fNow - m_fSentPanelTestModeAt < 1.0))
         return;
 
+    // These commands are queued with lights priority, so they stay in order with lights
+    // commands that are already queued.
+    //
     // When we first send the test mode command (not for repeats), turn off lights.
-    if(m_LastSentPanelTestMode == PanelTestMode_Off)
+    bool bTurnOffLights = m_LastSentPanelTestMode == PanelTestMode_Off;
+    m_fSentPanelTestModeAt = fNow;
+    m_LastSentPanelTestMode = m_PanelTestMode;
+
+    for(int iPad = 0; iPad < GetPadCount(); ++iPad)
     {
-        // The 'l' command used to set lights, but it's now only used to turn lights off
-        // for cases like this.
-        string sData = "l";
-        sData.append(108, 0);
-        sData += "\n";
-        for(int iPad = 0; iPad < 2; ++iPad)
-            m_pDevices[iPad]->SendCommandLocked(sData);
-    }
+        DeviceSlot &slot = *m_pPadSlots[iPad];
+        LockMutex L(slot.m_Lock);
+        if(bTurnOffLights)
+        {
+            // The 'l' command used to set lights, but it's now only used to turn lights off
+            // for cases like this.
+            string sData = "l";
+            sData.append(108, 0);
+            sData += "\n";
+            slot.m_pDevice->SendCommandLocked(sData, nullptr, CommandPriority_Lights);
+            ResetSentLights(slot);
+        }
 
-    m_SentPanelTestModeAtTicks = now;
-    m_LastSentPanelTestMode = m_PanelTestMode;
-    for(int iPad = 0; iPad < 2; ++iPad)
-        m_pDevices[iPad]->SendCommandLocked(ssprintf("t %c\n", m_PanelTestMode));
+        slot.m_pDevice->SendCommandLocked(ssprintf("t %c\n", m_PanelTestMode), nullptr, CommandPriority_Lights);
+    }
 }
 
 // Assign a serial number to master controllers if one isn't already assigned.  This
@@ -633,8 +1145,7 @@ void SMX::SMXManager::SetSerialNumbers()
     g_Lock.AssertNotLockedByCurrentThread();
     LockMutex L(g_Lock);
 
-    m_aPendingLightsCommands.clear();
-    for(int iPad = 0; iPad < 2; ++iPad)
+    for(int iPad = 0; iPad < GetPadCount(); ++iPad)
     {
         string sData = "s";
         uint8_t serial[16];
@@ -642,63 +1153,76 @@ void SMX::SMXManager::SetSerialNumbers()
         sData.append((char *) serial, sizeof(serial));
         sData.append(1, '\n');
 
-        m_pDevices[iPad]->SendCommandLocked(sData);
+        DeviceSlot &slot = *m_pPadSlots[iPad];
+        LockMutex L2(slot.m_Lock);
+        slot.m_Lights.m_aPendingCommands.clear();
+        slot.m_pDevice->SendCommandLocked(sData);
     }
 }
 
-void SMX::SMXManager::RunInHelperThread(function<void()> func)
+void SMX::SMXManager::AddSimulatedDevice(shared_ptr<SMXTransport> pDevice)
 {
-    m_UserCallbackThread.RunInThread(func);
+    m_pSMXDeviceSearchThreaded->AddDevice(pDevice);
+
+    // Wake up the manager thread so it connects to the device.
+    m_pWaiter->Wake();
 }
 
+
 // See if there are any new devices to connect to.
 void SMX::SMXManager::AttemptConnections()
 {
     g_Lock.AssertLockedByCurrentThread();
 
-    vector<shared_ptr<AutoCloseHandle>> apDevices = m_pSMXDeviceSearchThreaded->GetDevices();
+    m_pSMXDeviceSearchThreaded->GetDevices(m_apFoundDevices);
+
+    // Get the device each slot has open.  Only we open devices, so a slot without a device
+    // stays that way until we open one in it.  Device threads may close devices while we're
+    // doing this, which we'll see the next time we're called.
+    m_apOpenDevices.clear();
+    for(int iSlot = 0; iSlot < m_iNumPads; ++iSlot)
+    {
+        DeviceSlot &slot = *m_pSlots[iSlot];
+        LockMutex L(slot.m_Lock);
+        m_apOpenDevices.push_back(slot.m_pDevice->GetTransport());
+    }
 
     // Check each device that we've found.  This will include ones we already have open.
-    for(shared_ptr<AutoCloseHandle> pHandle: apDevices)
+    for(shared_ptr<SMXTransport> pTransport: m_apFoundDevices)
     {
         // See if this device is already open.  If it is, we don't need to do anything with it.
-        bool bAlreadyOpen = false;
-        for(shared_ptr<SMXDevice> pDevice: m_pDevices)
-        {
-            if(pDevice->GetDeviceHandle() == pHandle)
-                bAlreadyOpen = true;
-        }
-        if(bAlreadyOpen)
+        if(find(m_apOpenDevices.begin(), m_apOpenDevices.end(), pTransport) != m_apOpenDevices.end())
             continue;
 
-        // Find an open device slot.
-        shared_ptr<SMXDevice> pDeviceToOpen;
-        for(shared_ptr<SMXDevice> pDevice: m_pDevices)
+        // Find an open device slot.  Note that we check whether the device has a transport rather
+        // than calling IsConnected, since devices aren't actually considered connected until
+        // they've read the configuration.
+        int iSlot = int(find(m_apOpenDevices.begin(), m_apOpenDevices.end(), nullptr) - m_apOpenDevices.begin());
+
+        // If all device slots are used, add another pad.
+        if(iSlot == m_iNumPads && m_iNumPads < MaxPads)
         {
-            // Note that we check whether the device has a handle rather than calling IsConnected, since
-            // devices aren't actually considered connected until they've read the configuration.
-            if(pDevice->GetDeviceHandle() == NULL)
-            {
-                pDeviceToOpen = pDevice;
-                break;
-            }
+            AddSlot();
+            m_apOpenDevices.push_back(nullptr);
         }
 
-        if(pDeviceToOpen == nullptr)
+        if(iSlot == m_iNumPads)
         {
-            // All device slots are used.  Are there more than two devices plugged in?
-            Log("Error: No available slots for device.  Are more than two devices connected?");
+            Log(ssprintf("Error: No available slots for device.  Are more than %i devices connected?", MaxPads));
             break;
         }
 
-        // Open the device in this slot.
+        // Open the device in this slot, and wake up its thread to start talking to it.
         Log("Opening SMX device");
-        wstring sError;
-        pDeviceToOpen->OpenDeviceHandle(pHandle, sError);
-        if(!sError.empty())
-            Log(ssprintf("Error opening device: %ls", sError.c_str()));
+        DeviceSlot &slot = *m_pSlots[iSlot];
+        {
+            LockMutex L(slot.m_Lock);
+            wstring sError;
+            slot.m_pDevice->OpenDevice(pTransport, sError);
+            if(!sError.empty())
+                Log(ssprintf("Error opening device: %ls", sError.c_str()));
+        }
+        slot.m_pWaiter->Wake();
+        m_apOpenDevices[iSlot] = pTransport;
     }
 }
-
-
-
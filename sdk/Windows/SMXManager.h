@@ -1,19 +1,27 @@
 #ifndef SMXManager_h
 #define SMXManager_h
 
-#include <windows.h>
 #include <memory>
 #include <vector>
 #include <functional>
+#include <thread>
+#include <atomic>
 using namespace std;
 
 #include "Helpers.h"
 #include "../SMX.h"
 #include "SMXHelperThread.h"
+#include "SMXLatencyHistogram.h"
+#include "SMXLightsEncoding.h"
+#include "SMXSeqLock.h"
 
 namespace SMX {
 class SMXDevice;
+class SMXDeviceSearch;
 class SMXDeviceSearchThreaded;
+class SMXIOWaiter;
+class SMXTrafficRecorder;
+class SMXTransport;
 
 struct SMXControllerState
 {
@@ -24,72 +32,280 @@ struct SMXControllerState
     uint16_t m_Inputs[2];
 };
 
-// This implements the main thread that controller communication and device searching
-// happens in, finding and opening devices, and running device updates.
+// This finds and opens devices, and runs a thread for each device to communicate with it.
+//
+// Each device has its own I/O thread and lock, so a slow write or a long command on one
+// pad doesn't hold up input from the others.  The manager thread only finds and opens
+// devices, keeps player 1 and player 2 in order, and sends panel test mode.  Lights for
+// several pads are queued together, so they stay in sync.
 //
 // Connected controllers can be accessed with GetDevice(), 
 // This also abstracts controller numbers.  GetDevice(SMX_PadNumber_1) will return the
 // first device that connected, 
+//
+// There are always at least two pads, for player 1 and player 2.  If more devices are
+// connected, more pads are added, up to MaxPads.  Pads are never removed, so pad numbers
+// stay valid.
 class SMXManager
 {
 public:
     // Our singleton:
     static shared_ptr<SMXManager> g_pSMX;
 
+    static const int MaxPads = 16;
+
     // pCallback is a function to be called when something changes on any device.  This allows
-    // efficiently detecting when a panel is pressed or other changes happen.
-    SMXManager(function<void(int PadNumber, SMXUpdateCallbackReason reason)> pCallback);
+    // efficiently detecting when a panel is pressed or other changes happen.  Changes that
+    // happen before the callback is called for a pad are merged into one call.
+    //
+    // pDeviceSearch can be set to find devices with something other than SMXDeviceSearch,
+    // for testing.
+    SMXManager(function<void(int PadNumber, const SMXUpdateDetails &details)> pCallback,
+        shared_ptr<SMXDeviceSearch> pDeviceSearch = nullptr);
     ~SMXManager();
 
     void Shutdown();
     shared_ptr<SMXDevice> GetDevice(int pad);
-    void SetLights(const string sLights[2]);
-    void SetPlatformLights(const string sLights[2]);
+
+    // Return the number of pads.  Pads 0 to GetPadCount()-1 can be passed to GetDevice,
+    // which returns null for any other pad.
+    int GetPadCount() const { return m_iNumPads; }
+
+    // Return the pad connected with the given serial number, or -1 if there isn't one.
+    int FindPadBySerial(const char *szSerial) const;
+
+    // Return the input state and info for a pad.  These don't lock, so they never wait on
+    // the I/O thread.
+    uint16_t GetInputState(int pad) const;
+    void GetInfo(int pad, SMXInfo &info) const;
+
+    // Set lights for the first iNumPads pads.  Pads with no data are left alone.
+    //
+    // If fPresentAt isn't 0, it's the time on the GetMonotonicTime clock the lights should
+    // be shown at, and commands are scheduled to finish then.  Otherwise, they're sent as
+    // soon as possible.
+    void SetLights(const string *sLights, int iNumPads);
+    void SetLights(const char *const *pLights, const int *iLightsSize, int iNumPads, double fPresentAt = 0);
+
+    // Set lights from commands that are already encoded.  Pads whose entry is null are
+    // left alone.  This is used by lights animations, which encode their frames in advance.
+    void SetEncodedLights(const EncodedLights *const *pLights, int iNumPads, double fPresentAt = 0);
+
+    void SetPlatformLights(const string *sLights, int iNumPads);
     void ReenableAutoLights();
     void SetPanelTestMode(PanelTestMode mode);
     void SetSerialNumbers();
     void SetOnlySendLightsOnChange(bool value) { m_bOnlySendLightsOnChange = value; }
+    void SetSkipUnchangedLights(bool bSkip);
+
+    // Connect to a device that isn't a real USB device, like an SMXSimulatedDevice.  This
+    // is used for testing without hardware.
+    void AddSimulatedDevice(shared_ptr<SMXTransport> pDevice);
     
     // Run a function in the user callback thread.
-    void RunInHelperThread(function<void()> func);
+    template<typename F>
+    void RunInHelperThread(F &&func) { m_UserCallbackThread.RunInThread(forward<F>(func)); }
+
+    // Return counters for the user callback thread.
+    SMXHelperThreadStats GetUserCallbackStats() const { return m_UserCallbackThread.GetStats(); }
+
+    // Tell the update callback about upload progress.  This can be called from any thread.
+    void QueueUploadProgress(int pad, int iProgress);
+
+    // See SMX_GetStats and SMX_ResetStats.
+    bool GetStats(int pad, SMXStats &stats) const;
+    void ResetStats();
+
+    // Record reports to and from all devices, including ones that connect later.  Each
+    // device is recorded as its device slot.  If pRecorder is null, stop recording.
+    void SetTrafficRecorder(shared_ptr<SMXTrafficRecorder> pRecorder);
 
 private:
-    static DWORD WINAPI ThreadMainStart(void *self_);
+    struct DeviceSlot;
+
     void ThreadMain();
+    void DeviceThreadMain(DeviceSlot &slot);
     void AttemptConnections();
     void CorrectDeviceOrder();
-    void SendLightUpdates();
+    void PublishPadState(DeviceSlot &slot, bool bFromManagerThread);
+    void QueueUpdate(DeviceSlot &slot, int iChanged);
+    void FlushUserCallbacks(DeviceSlot &slot);
+    void QueueDeliverUpdate(int pad, int iChanged, double fTime);
+    void DeliverUpdate(int pad);
+    void SendLightUpdates(DeviceSlot &slot);
 
-    HANDLE m_hThread = INVALID_HANDLE_VALUE;
-    shared_ptr<SMX::AutoCloseHandle> m_hEvent;
+    // The manager thread.  This and the manager state below are protected by g_Lock in
+    // SMXManager.cpp.  g_Lock can be held while locking a DeviceSlot, but a DeviceSlot's
+    // lock is never held while locking g_Lock.
+    thread m_Thread;
+    shared_ptr<SMXIOWaiter> m_pWaiter;
     shared_ptr<SMXDeviceSearchThreaded> m_pSMXDeviceSearchThreaded;
+    vector<shared_ptr<SMXTransport>> m_apFoundDevices; // used by AttemptConnections
+    vector<shared_ptr<SMXTransport>> m_apOpenDevices; // used by AttemptConnections
     bool m_bShutdown = false;
-    vector<shared_ptr<SMXDevice>> m_pDevices;
 
-    // We make user callbacks asynchronously in this thread, to avoid any locking or timing
-    // issues that could occur by calling them in our I/O thread.
-    SMXHelperThread m_UserCallbackThread;
+    // The state of each pad, as seen by GetInputState and GetInfo.  This is updated by
+    // PublishPadState, and can be read from any thread without locking.
+    struct PadState
+    {
+        SMXInfo info;
+        uint16_t iInputState;
+    };
+    SMXSeqLock<PadState> m_PadState[MaxPads];
 
-    // A list of queued lights commands to send to the controllers.  This is always sorted
-    // by iTimeToSend.
+    // Queued lights commands for a pad.  Each pad is paced separately, so a slow pad
+    // doesn't hold back lights on the others.
+    //
+    // The largest lights command is '4'.  See SMXLightsEncoding.h.
+    static const int MaxLightsCommandSize = 1 + 9*3*3*3 + 1;
+
+    // Lights are sent at up to 30 FPS.  Firmware before version 4 needs time between the
+    // '2' and '3' commands, see QueueLightsForPad.
+    static constexpr double LightsInterval = 1/30.0;
+    static constexpr double DelayBetweenLightsCommands = 1/60.0;
+
+    // Each lights update is three commands.  An update with a presentation time can be
+    // queued behind the one before it, so up to this many can be waiting for a pad.
+    static const int MaxQueuedLightsUpdates = 2;
+
+    // The lights latency we assume until we've measured it, and the longest acknowledgement
+    // we'll count.  Anything longer is a timeout or disconnect, not the pad's normal timing.
+    static constexpr double DefaultLightsLatency = 0.005;
+    static constexpr double MaxLightsLatency = 0.25;
     struct PendingCommand
     {
-        PendingCommand(float fTime): fTimeToSend(fTime) { }
+        PendingCommand(double fTime): fTimeToSend(fTime) { }
         double fTimeToSend = 0;
-        string sPadCommand[2];
+
+        // The time the update this command is part of should be shown, or 0 if it should
+        // be shown as soon as possible.
+        double fPresentAt = 0;
+
+        // If iCommandSize is 0, nothing is sent.
+        char sCommand[MaxLightsCommandSize];
+        int iCommandSize = 0;
+        uint64_t iCommandHash = 0;
+    };
+    struct SentLightsCommand
+    {
+        uint64_t iHash = 0;
+        double fSentAt = -1;
     };
-    vector<PendingCommand> m_aPendingLightsCommands;
-    int m_iLightsCommandsInProgress = 0;
-    double m_fDelayLightCommandsUntil = 0;
+    struct PadLights
+    {
+        // Commands waiting to be sent.  This is always sorted by fTimeToSend.
+        vector<PendingCommand> m_aPendingCommands;
+        int m_iCommandsInProgress = 0;
+        double m_fDelayCommandsUntil = 0;
+
+        // The earliest time the next update can be shown.  Updates with a presentation time
+        // are kept at least LightsInterval apart here, so they land on the caller's frames.
+        double m_fNextPresentAt = 0;
+
+        // How long the pad takes to acknowledge a batch of lights commands, smoothed, and
+        // how much that varies from one batch to the next (RFC 3550 interarrival jitter).
+        // Updates with a presentation time are sent m_fLatency before it.
+        double m_fLatency = DefaultLightsLatency;
+        double m_fLastLatency = -1;
+        double m_fJitter = 0;
+
+        // When the commands in progress were sent, and the presentation time of the update
+        // they finish, if any.
+        double m_fBatchSentAt = 0;
+        double m_fBatchPresentAt = 0;
+
+        // The last '4', '2' and '3' command sent to the pad, for m_bSkipUnchangedLights, and
+        // the connection they were sent to.
+        SentLightsCommand m_SentCommands[3];
+        weak_ptr<SMXTransport> m_pSentTransport;
+
+        // Counters for GetStats.
+        int m_iUpdatesReplaced = 0;
+        int m_iCommandsSkipped = 0;
+        SMXLatencyHistogram m_Latency;
+        SMXLatencyHistogram m_TimingError;
+    };
+
+    // A connected device, and the thread that communicates with it.  Everything here is
+    // protected by m_Lock, which is also the device's lock.
+    struct DeviceSlot
+    {
+        SMX::Mutex m_Lock;
+        shared_ptr<SMXIOWaiter> m_pWaiter;
+        shared_ptr<SMXDevice> m_pDevice;
+        thread m_Thread;
+        bool m_bShutdown = false;
+
+        // The pad this device is.  This only changes in CorrectDeviceOrder, with g_Lock held
+        // as well.
+        int m_iPad = 0;
+
+        // Changes from the device are collected in m_iUnflushedUpdates, and sent to
+        // m_UserCallbackThread once PublishPadState has published the state they're telling
+        // the user about.
+        int m_iUnflushedUpdates = 0;
+        double m_fUnflushedUpdateTime = 0;
+
+        // The state last stored in m_PadState, and the pad it was stored for.  If this is
+        // true, a connection change is waiting for the manager thread to publish it.
+        PadState m_LastPublishedPadState;
+        int m_iPublishedPad = -1;
+        bool m_bPublishPending = false;
+
+        PadLights m_Lights;
+    };
+
+    // The device slots, in the order they were created.  Slots are never removed, so they
+    // don't move once they're created.
+    unique_ptr<DeviceSlot> m_pSlots[MaxPads];
+
+    // The slot for each pad.  This is written with g_Lock and the slots' locks held, and
+    // can be read without locking.  m_iNumPads is increased after a slot is added, so other
+    // threads only read pads that exist.
+    atomic<DeviceSlot *> m_pPadSlots[MaxPads];
+    atomic<int> m_iNumPads{0};
+    void AddSlot();
+
+    // We make user callbacks asynchronously in this thread, to avoid any locking or timing
+    // issues that could occur by calling them in our I/O threads.
+    SMXHelperThread m_UserCallbackThread;
+
+    function<void(int PadNumber, const SMXUpdateDetails &details)> m_pUpdateCallback;
+
+    // m_iUndeliveredUpdates holds changes that have been sent to m_UserCallbackThread, but
+    // not yet given to the user.  Callbacks for each pad are coalesced, so only one is ever
+    // waiting, and it picks up all changes made before it runs.
+    atomic<int> m_iUndeliveredUpdates[MaxPads];
+    atomic<double> m_fUpdateTime[MaxPads];
+    atomic<int> m_iUploadProgress[MaxPads];
+
+    // The time from each change to the callback telling the user about it, for GetStats.
+    // This is written from m_UserCallbackThread.
+    mutable SMX::Mutex m_CallbackStatsLock;
+    SMXLatencyHistogram m_CallbackLag[MaxPads];
 
     // Panel test mode.  This is separate from the sensor test mode (pressure display),
     // which is handled in SMXDevice.
     void UpdatePanelTestMode();
-    uint32_t m_SentPanelTestModeAtTicks = 0;
+    double m_fSentPanelTestModeAt = 0;
     PanelTestMode m_PanelTestMode = PanelTestMode_Off;
     PanelTestMode m_LastSentPanelTestMode = PanelTestMode_Off;
 
     bool m_bOnlySendLightsOnChange = false;
+
+    // The recorder set with SetTrafficRecorder.  This is protected by g_Lock.
+    shared_ptr<SMXTrafficRecorder> m_pTrafficRecorder;
+
+    // If m_bSkipUnchangedLights is true, lights commands that are the same as the last
+    // one sent to a pad are skipped, except to refresh them before the master's auto
+    // lights timeout.
+    atomic<bool> m_bSkipUnchangedLights{false};
+    void ResetSentLights(DeviceSlot &slot);
+    bool ShouldSkipLightsCommand(DeviceSlot &slot, const PendingCommand &command);
+    PendingCommand *QueueLightsForPad(DeviceSlot &slot, double fNow, const SMXConfig &config, double fPresentAt);
+    void FinishLightsCommands(const SMXConfig &config, PendingCommand *pCommands);
+    static void ScheduleLightsUpdate(PadLights &lights, const SMXConfig &config, double fEarliest, double fPresentAt, PendingCommand *pCommands);
+    static void LightsBatchFinished(PadLights &lights);
 };
 }
 
@@ -44,6 +44,10 @@
 #include "SMXManager.h"
 #include "SMXDevice.h"
 #include "SMXThread.h"
+#include "SMXLightsEncoding.h"
+#include <math.h>
+#include <string.h>
+#include <algorithm>
 using namespace std;
 using namespace SMX;
 
@@ -55,120 +59,138 @@ namespace {
 
 // XXX: go to sleep if there are no pads connected
 
+namespace {
+    // Auto animations play on a shared timeline of 30 FPS ticks, the rate the panels
+    // update at, counted from g_fTimelineStart.  Frames are chosen from the tick, not
+    // from the time between updates, so animations don't drift when updates are late.
+    const int TicksPerSecond = 30;
+    double g_fTimelineStart = -1;
+
+    double GetTimelineStart()
+    {
+        g_Lock.AssertLockedByCurrentThread();
+
+        // Start the timeline the first time it's used.
+        if(g_fTimelineStart == -1)
+            g_fTimelineStart = SMX::GetMonotonicTime();
+        return g_fTimelineStart;
+    }
+
+    // Return the tick on the timeline at fTime.
+    int64_t GetTickAt(double fTime)
+    {
+        return (int64_t) floor((fTime - GetTimelineStart()) * TicksPerSecond);
+    }
+}
+
 struct AnimationState
 {
     SMXPanelAnimation animation;
 
-    // Seconds into the animation:
-    float fTime = 0;
-
-    // The currently displayed frame:
-    int iCurrentFrame = 0;
-
+    // The tick on the timeline the animation started on, if it's playing.
     bool bPlaying = false;
+    int64_t iStartTick = 0;
 
-    double m_fLastUpdateTime = -1;
-
-    // Return the current animation frame.
-    const vector<SMXGif::Color> &GetAnimationFrame() const
+    // Return the animation frame at iTick, encoded for lights commands.
+    const SMXPanelAnimation::EncodedFrame *GetEncodedFrame(int64_t iTick) const
     {
-        // If we're not playing, return an empty array.  As a sanity check, do this
-        // if the frame is out of bounds too.
-        if(!bPlaying || iCurrentFrame >= animation.m_aPanelGraphics.size())
-        {
-            static vector<SMXGif::Color> dummy;
-            return dummy;
-        }
+        // If we're not playing or nothing is loaded, return null.
+        if(!bPlaying)
+            return nullptr;
 
-        return animation.m_aPanelGraphics[iCurrentFrame];
+        int iFrame = animation.GetFrameAtTick(iTick - iStartTick);
+        if(iFrame == -1)
+            return nullptr;
+
+        return &animation.m_aEncodedFrames[iFrame];
     }
 
-    // Start the animation if it's not playing.
-    void Play()
+    // Start the animation at iTick if it's not playing.
+    void Play(int64_t iTick)
     {
+        if(bPlaying)
+            return;
+
         bPlaying = true;
+        iStartTick = iTick;
     }
 
-    // Stop and disable the animation.
+    // Stop the animation.  It'll start from the beginning the next time it's played.
     void Stop()
     {
         bPlaying = false;
-        Rewind();
-    }
-
-    // Reset to the first frame.
-    void Rewind()
-    {
-        fTime = 0;
-        iCurrentFrame = 0;
     }
+};
 
-    // Advance the animation by fSeconds.
-    void Update()
+namespace
+{
+    // Each panel's lights are split across the three lights commands: the first 8 lights
+    // go to '2', the next 8 to '3', and the 3x3 grid to '4'.  See SMXLightsEncoding.h.
+    const int LightsCommandRuns = 3;
+    const int LightsCommandRunStart[LightsCommandRuns] = { 0, 8, 16 };
+    const int LightsCommandRunLength[LightsCommandRuns] = { 8, 8, 9 };
+
+    // Copy iSize bytes of pColors over pOut where pMask is 0xFF.  This works eight bytes
+    // at a time, since runs aren't long enough for the compiler to vectorize.
+    void BlendLights(uint8_t *pOut, const uint8_t *pColors, const uint8_t *pMask, int iSize)
     {
-        // fSeconds is the time since the last update:
-        double fNow = SMX::GetMonotonicTime();
-        double fSeconds = m_fLastUpdateTime == -1? 0: (fNow - m_fLastUpdateTime);
-        m_fLastUpdateTime = fNow;
-
-        if(!bPlaying || animation.m_aPanelGraphics.empty())
-            return;
-
-        // If the current frame is past the end, a new animation was probably
-        // loaded.
-        if(iCurrentFrame >= animation.m_aPanelGraphics.size())
-            Rewind();
-
-        // Advance time.
-        fTime += fSeconds;
-
-        // If we're still on this frame, we're done.
-        float fFrameDuration = animation.m_iFrameDurations[iCurrentFrame];
-        if(fTime - 0.00001f < fFrameDuration)
-            return;
-
-        // If we've passed the end of the frame, move to the next frame.  Don't
-        // skip frames if we're updating too quickly.
-        fTime -= fFrameDuration;
-        if(fTime > 0)
-            fTime = 0;
-
-        // Advance the frame.
-        iCurrentFrame++;
+        int i = 0;
+        for(; i + 8 <= iSize; i += 8)
+        {
+            uint64_t iOut, iColors, iMask;
+            memcpy(&iOut, pOut + i, 8);
+            memcpy(&iColors, pColors + i, 8);
+            memcpy(&iMask, pMask + i, 8);
+            iOut = (iOut & ~iMask) | iColors;
+            memcpy(pOut + i, &iOut, 8);
+        }
 
-        // If we're at the end of the frame, rewind to the loop frame.
-        if(iCurrentFrame == animation.m_aPanelGraphics.size())
-            iCurrentFrame = animation.m_iLoopFrame;
+        for(; i < iSize; ++i)
+            pOut[i] = (pOut[i] & ~pMask[i]) | pColors[i];
     }
-};
+}
 
 struct AnimationStateForPad
 {
-    // asLightsData is an array of lights data to send to the pad and graphic
-    // is an animation graphic.  Overlay graphic on top of the lights.
-    void OverlayLights(char *asLightsData, const vector<SMXGif::Color> &graphic) const
+    // apOut points to this panel's lights in each of the '2', '3' and '4' commands.
+    // Overlay the frame of animation at iTick on top of the lights.
+    void OverlayLights(uint8_t *const *apOut, const AnimationState &animation, int64_t iTick) const
     {
         // Stop if this graphic isn't loaded or is paused.
-        if(graphic.empty())
+        const SMXPanelAnimation::EncodedFrame *pFrame = animation.GetEncodedFrame(iTick);
+        if(pFrame == nullptr)
             return;
 
-        for(int i = 0; i < graphic.size(); ++i)
+        // Transparent lights are black with a zero mask, so this leaves them alone without
+        // any branches.
+        for(int run = 0; run < LightsCommandRuns; ++run)
         {
-            if(i >= LIGHTS_PER_PANEL)
-                return;
+            int iStart = LightsCommandRunStart[run]*3;
+            BlendLights(apOut[run], &pFrame->m_iColors[iStart], &pFrame->m_iMask[iStart], LightsCommandRunLength[run]*3);
+        }
+    }
 
-            // If this color is transparent, leave the released animation alone.
-            if(graphic[i].color[3] == 0)
-                continue;
+    // Make sure the correct animations are playing for the given input state at iTick.
+    void SetPadState(int iPadState, int64_t iTick)
+    {
+        for(int panel = 0; panel < 9; ++panel)
+        {
+            // The released animation is always playing.  It plays from the start of the
+            // timeline, so released animations on every panel and pad are in sync.
+            animations[SMX_LightsType_Released][panel].Play(0);
 
-            asLightsData[i*3+0] = graphic[i].color[0];
-            asLightsData[i*3+1] = graphic[i].color[1];
-            asLightsData[i*3+2] = graphic[i].color[2];
+            // The pressed animation only plays while the button is pressed, starting
+            // on the tick it was pressed, and rewinds when it's released.
+            bool bPressed = iPadState & (1 << panel);
+            if(bPressed)
+                animations[SMX_LightsType_Pressed][panel].Play(iTick);
+            else
+                animations[SMX_LightsType_Pressed][panel].Stop();
         }
     }
 
-    // Return the command to set the current animation state as pad lights.
-    string GetLightsCommand(int iPadState, const SMXConfig &config) const
+    // Build the commands to set the animation state at iTick as pad lights.
+    void GetLightsCommands(int iPadState, int64_t iTick, const SMXConfig &config, EncodedLights &out) const
     {
         g_Lock.AssertLockedByCurrentThread();
 
@@ -178,46 +200,53 @@ struct AnimationStateForPad
         // animation will always be used.
         bool bUsePressedAnimations = config.flags & PlatformFlags_AutoLightingUsePressedAnimations;
 
-        const int iBytesPerPanel = LIGHTS_PER_PANEL*3;
-        const int iTotalLights = 9*iBytesPerPanel;
-        string result(iTotalLights, 0);
+        // Frames are already scaled, so they're copied straight into the commands.
+        memset(&out, 0, sizeof(out));
+        out.m_Command4[0] = '4';
+        out.m_Command2[0] = '2';
+        out.m_Command3[0] = '3';
+        out.m_Command4[LightsCommand4Size-1] = '\n';
+        out.m_Command2[LightsCommand2Size-1] = '\n';
+        out.m_Command3[LightsCommand3Size-1] = '\n';
 
         for(int panel = 0; panel < 9; ++panel)
         {
-            // The portion of lights data for this panel:
-            char *out = &result[panel*iBytesPerPanel];
+            // The portion of each command for this panel:
+            uint8_t *apOut[LightsCommandRuns] = {
+                &out.m_Command2[1 + panel*8*3],
+                &out.m_Command3[1 + panel*8*3],
+                &out.m_Command4[1 + panel*9*3],
+            };
 
             // Skip this panel if it's not in autoLightPanelMask.
             if(!(config.autoLightPanelMask & (1 << panel)))
                 continue;
 
             // Add the released animation, then overlay the pressed animation if we're pressed.
-            OverlayLights(out, animations[SMX_LightsType_Released][panel].GetAnimationFrame());
+            OverlayLights(apOut, animations[SMX_LightsType_Released][panel], iTick);
             bool bPressed = bool(iPadState & (1 << panel));
             if(bPressed && bUsePressedAnimations)
-                OverlayLights(out, animations[SMX_LightsType_Pressed][panel].GetAnimationFrame());
+                OverlayLights(apOut, animations[SMX_LightsType_Pressed][panel], iTick);
             else if(bPressed && !bUsePressedAnimations)
             {
                 // Light all LEDs on this panel using stepColor.
                 double LightsScaleFactor = 0.666666f;
                 const uint8_t *color = &config.stepColor[panel*3];
 
-                for(int light = 0; light < LIGHTS_PER_PANEL; ++light)
+                // stepColor is scaled to the 0-170 range.  Scale it back to the 0-255 range,
+                // then scale it like any other color.  User applications don't need to worry
+                // about this since they normally don't need to care about stepColor.
+                uint8_t scaled[3];
+                for(int i = 0; i < 3; ++i)
+                    scaled[i] = ScaleLightColor((uint8_t) lrintf(min(255.0, color[i] / LightsScaleFactor)));
+
+                for(int run = 0; run < LightsCommandRuns; ++run)
                 {
-                    for(int i = 0; i < 3; ++i)
-                    {
-                        // stepColor is scaled to the 0-170 range.  Scale it back to the 0-255 range.
-                        // User applications don't need to worry about this since they normally don't
-                        // need to care about stepColor.
-                        uint8_t c = color[i];
-                        c = (uint8_t) lrintf(min(255.0f, c / LightsScaleFactor));
-                        out[light*3+i] = c;
-                    }
+                    for(int light = 0; light < LightsCommandRunLength[run]; ++light)
+                        memcpy(&apOut[run][light*3], scaled, 3);
                 }
             }
         }
-
-        return result;
     }
 
     // State for both animations on each panel:
@@ -226,8 +255,8 @@ struct AnimationStateForPad
 
 namespace
 {
-    // Animations and animation states for both pads.
-    AnimationStateForPad pad_states[2];
+    // Animations and animation states for each pad.
+    AnimationStateForPad pad_states[SMXManager::MaxPads];
 }
 
 namespace {
@@ -244,9 +273,11 @@ namespace {
         { 2,2 },
     };
 
-    // Given a 14x15 graphic frame and a panel number, return an array of 16 colors, containing
-    // each light in the order it's sent to the master controller.
-    void ConvertToPanelGraphic16(const SMXGif::GIFImage &src, vector<SMXGif::Color> &dst, int panel)
+    // Given a 14x15 graphic frame and a panel number, return an array of 16 palette indexes,
+    // containing each light in the order it's sent to the master controller.  These animations
+    // have no data for the 3x3 grid, so those lights are left off the end, which makes them
+    // transparent.
+    void ConvertToPanelGraphic16(const SMXGif::GIFImage &src, vector<uint8_t> &dst, int panel)
     {
         dst.clear();
 
@@ -258,16 +289,11 @@ namespace {
         for(int dy = 0; dy < 4; ++dy)
             for(int dx = 0; dx < 4; ++dx)
                 dst.push_back(src.get(x+dx, y+dy));
-
-        // These animations have no data for the 3x3 grid, so just set them to transparent.
-        for(int dy = 0; dy < 3; ++dy)
-            for(int dx = 0; dx < 3; ++dx)
-                dst.push_back(SMXGif::Color(0,0,0,0));
     }
 
-    // Given a 23x24 graphic frame and a panel number, return an array of 25 colors, containing
-    // each light in the order it's sent to the master controller.
-    void ConvertToPanelGraphic25(const SMXGif::GIFImage &src, vector<SMXGif::Color> &dst, int panel)
+    // Given a 23x24 graphic frame and a panel number, return an array of 25 palette indexes,
+    // containing each light in the order it's sent to the master controller.
+    void ConvertToPanelGraphic25(const SMXGif::GIFImage &src, vector<uint8_t> &dst, int panel)
     {
         dst.clear();
 
@@ -292,9 +318,16 @@ namespace {
 void SMXPanelAnimation::Load(const vector<SMXGif::SMXGifFrame> &frames, int panel)
 {
     m_aPanelGraphics.clear();
-    m_iFrameDurations.clear();
+    m_aEncodedFrames.clear();
+    m_iFrameTicks.clear();
+    m_iFrameStartTicks.clear();
+    m_iTotalTicks = 0;
     m_iLoopFrame = -1;
 
+    // All frames share the same palette.
+    m_pPalette = frames.empty()? nullptr:frames[0].palette;
+
+    vector<float> frame_durations;
     for(int frame_no = 0; frame_no < frames.size(); ++frame_no)
     {
         const SMXGif::SMXGifFrame &gif_frame = frames[frame_no];
@@ -302,7 +335,7 @@ void SMXPanelAnimation::Load(const vector<SMXGif::SMXGifFrame> &frames, int pane
         // If the bottom-left pixel is white, this is the loop frame, which marks the
         // frame the animation should start at after a loop.  This is global to the
         // animation, not specific to each panel.
-        SMXGif::Color marker = gif_frame.frame.get(0, gif_frame.frame.height-1);
+        SMXGif::Color marker = gif_frame.GetColor(0, gif_frame.frame.height-1);
         if(marker.color[3] == 0xFF && marker.color[0] >= 0x80)
         {
             // We shouldn't see more than one of these.  If we do, use the first.
@@ -312,7 +345,7 @@ void SMXPanelAnimation::Load(const vector<SMXGif::SMXGifFrame> &frames, int pane
 
         // Extract this frame.  If the graphic is 14x15 it's a 4x4 animation,
         // and if it's 23x24 it's 25-light.
-        vector<SMXGif::Color> panel_graphic;
+        vector<uint8_t> panel_graphic;
         if(frames[0].width == 14)
             ConvertToPanelGraphic16(gif_frame.frame, panel_graphic, panel);
         else
@@ -329,8 +362,62 @@ void SMXPanelAnimation::Load(const vector<SMXGif::SMXGifFrame> &frames, int pane
         else
             seconds = gif_frame.milliseconds / 1000.0;
 
+        // Encode the frame for lights commands, so it doesn't need to be looked up in the
+        // palette and scaled each time it's shown.
+        EncodedFrame encoded = {};
+        for(int light = 0; light < panel_graphic.size(); ++light)
+        {
+            const SMXGif::Color &color = (*m_pPalette)[panel_graphic[light]];
+            if(color.color[3] == 0)
+                continue;
+
+            for(int i = 0; i < 3; ++i)
+            {
+                encoded.m_iColors[light*3+i] = ScaleLightColor(color.color[i]);
+                encoded.m_iMask[light*3+i] = 0xFF;
+            }
+        }
+
         m_aPanelGraphics.push_back(panel_graphic);
-        m_iFrameDurations.push_back(seconds);
+        m_aEncodedFrames.push_back(encoded);
+        frame_durations.push_back(seconds);
+    }
+
+    // Convert the durations to 30 FPS ticks, the same way the panels play them.  Each frame
+    // is shown for at least one tick, and time left over from a frame carries into the
+    // next one.
+    if(!frame_durations.empty())
+    {
+        int current_frame = 0;
+        float time_left_in_frame = frame_durations[0];
+        m_iFrameTicks.push_back(0);
+        while(1)
+        {
+            // Advance time by one tick.
+            time_left_in_frame -= 1.0f / 30;
+            m_iFrameTicks.back()++;
+
+            if(time_left_in_frame <= 0.00001f)
+            {
+                // We've displayed this frame long enough, so advance to the next frame.
+                if(current_frame + 1 == frame_durations.size())
+                    break;
+
+                current_frame += 1;
+                m_iFrameTicks.push_back(0);
+                time_left_in_frame += frame_durations[current_frame];
+
+                // If time_left_in_frame is still negative, the animation is too fast.
+                if(time_left_in_frame < 0.00001)
+                    time_left_in_frame = 0;
+            }
+        }
+    }
+
+    for(int ticks: m_iFrameTicks)
+    {
+        m_iFrameStartTicks.push_back(m_iTotalTicks);
+        m_iTotalTicks += ticks;
     }
 
     // By default, loop back to the first frame.
@@ -338,15 +425,38 @@ void SMXPanelAnimation::Load(const vector<SMXGif::SMXGifFrame> &frames, int pane
         m_iLoopFrame = 0;
 }
 
+int SMXPanelAnimation::GetFrameAtTick(int64_t iTick) const
+{
+    if(m_iFrameStartTicks.empty())
+        return -1;
+
+    // After the first time through, loop from m_iLoopFrame.
+    iTick = max<int64_t>(iTick, 0);
+    if(iTick >= m_iTotalTicks)
+    {
+        int64_t iLoopStart = m_iFrameStartTicks[m_iLoopFrame];
+        iTick = iLoopStart + (iTick - iLoopStart) % (m_iTotalTicks - iLoopStart);
+    }
+
+    // Find the last frame starting at or before iTick.
+    auto it = upper_bound(m_iFrameStartTicks.begin(), m_iFrameStartTicks.end(), iTick);
+    return int(it - m_iFrameStartTicks.begin()) - 1;
+}
+
 #include "SMXPanelAnimationUpload.h"
 
 // Load a GIF into SMXLoadedPanelAnimations::animations.
-bool SMX_LightsAnimation_Load(const char *gif, int size, int pad, SMX_LightsType type, const char **error)
+static bool LoadAnimation(const uint8_t *gif, size_t size, int pad, SMX_LightsType type, const char **error)
 {
-    // Parse the GIF.
-    string buf(gif, size);
+    if(pad < 0 || pad >= SMXManager::MaxPads || type < 0 || type >= NUM_SMX_LightsType)
+    {
+        *error = "Invalid pad or animation type.";
+        return false;
+    }
+
+    // Parse the GIF.  This reads the data in place.
     vector<SMXGif::SMXGifFrame> frames;
-    if(!SMXGif::DecodeGIF(buf, frames) || frames.empty())
+    if(!SMXGif::DecodeGIF(gif, size, frames) || frames.empty())
     {
         *error = "The GIF couldn't be read.";
         return false;
@@ -383,6 +493,25 @@ bool SMX_LightsAnimation_Load(const char *gif, int size, int pad, SMX_LightsType
     return true;
 }
 
+bool SMX_LightsAnimation_Load(const char *gif, int size, int pad, SMX_LightsType type, const char **error)
+{
+    return LoadAnimation((const uint8_t *) gif, size, pad, type, error);
+}
+
+bool SMX_LightsAnimation_LoadFile(const char *path, int pad, SMX_LightsType type, const char **error)
+{
+    // Map the file and decode it directly, rather than reading it into memory first.
+    MappedFile file;
+    string sError;
+    if(!file.Open(path, sError))
+    {
+        *error = CreateError(sError);
+        return false;
+    }
+
+    return LoadAnimation(file.data(), file.size(), pad, type, error);
+}
+
 namespace
 {
     double g_fStopAnimatingUntil = -1;
@@ -395,6 +524,16 @@ void SMXAutoPanelAnimations::TemporaryStopAnimating()
     g_fStopAnimatingUntil = SMX::GetMonotonicTime() + fStopForSeconds;
 }
 
+void SMXAutoPanelAnimations::GetLightsCommands(int pad, int iPadState, const SMXConfig &config, EncodedLights &out)
+{
+    g_Lock.AssertNotLockedByCurrentThread();
+    LockMutex L(g_Lock);
+
+    int64_t iTick = GetTickAt(SMX::GetMonotonicTime());
+    pad_states[pad].SetPadState(iPadState, iTick);
+    pad_states[pad].GetLightsCommands(iPadState, iTick, config, out);
+}
+
 // A thread to handle setting light animations.  We do this in a separate
 // thread rather than in the SMXManager thread so this can be treated as
 // if it's external application thread, and it's making normal threaded
@@ -409,34 +548,51 @@ public:
         Start("SMX light animations");
     }
 
+    // Wake the thread, so it recalculates when to run the next update.
+    void Wake()
+    {
+        m_Event.Set();
+    }
+
 private:
     void ThreadMain()
     {
         m_Lock.Lock();
-        
-        // Update lights at 30 FPS.
-        const int iDelayMS = 33;
 
+        // Update lights once per tick of the animation timeline.
+        //
+        // Each update shows the frames for the tick it runs on.  If a wait oversleeps,
+        // the next wait is shorter, since it's to the next tick rather than a fixed delay.
+        // If we fall a whole tick or more behind, the ticks we missed are skipped rather
+        // than shown late, so animations stay on the timeline.
+        int64_t iLastTick = -1;
         while(!m_bShutdown)
         {
-            // Check if we've temporarily stopped updating lights.
-            bool bSkipUpdate = g_fStopAnimatingUntil > SMX::GetMonotonicTime();
+            double fNow = SMX::GetMonotonicTime();
+            int64_t iTick = GetTickAt(fNow);
 
-            // Run a single panel lights update.
-            if(!bSkipUpdate)
-                UpdateLights();
-
-            // Wait up to 30 FPS, or until we're signalled.  We can only be signalled
-            // if we're shutting down, so we don't need to worry about partial frame
-            // delays.
-            m_Event.Wait(iDelayMS);
+            // Check if we've temporarily stopped updating lights.
+            bool bSkipUpdate = g_fStopAnimatingUntil > fNow;
+
+            // Run a single panel lights update, unless we woke up early and have already
+            // updated for this tick.
+            if(!bSkipUpdate && iTick != iLastTick)
+                UpdateLights(iTick);
+            iLastTick = iTick;
+
+            // Wait until the next tick, or until we're signalled because we're shutting down
+            // or the timeline was moved.
+            double fNextTick = GetTimelineStart() + double(iTick + 1) / TicksPerSecond;
+            int iDelayMS = (int) ceil((fNextTick - SMX::GetMonotonicTime()) * 1000);
+            m_Event.Wait(max(iDelayMS, 0));
         }
 
         m_Lock.Unlock();
     }
 
-    // Return lights for the given pad and pad state, using the loaded panel animations.
-    bool GetCurrentLights(string &asLightsDataOut, int pad, int iPadState)
+    // Return lights for the given pad and pad state at iTick, using the loaded panel
+    // animations.
+    bool GetCurrentLights(EncodedLights &lightsOut, int pad, int iPadState, int64_t iTick)
     {
         m_Lock.AssertLockedByCurrentThread();
 
@@ -453,49 +609,34 @@ private:
 
         AnimationStateForPad &pad_state = pad_states[pad];
 
-        // Make sure the correct animations are playing.
-        for(int panel = 0; panel < 9; ++panel)
-        {
-            // The released animation is always playing.
-            pad_state.animations[SMX_LightsType_Released][panel].Play();
-
-            // The pressed animation only plays while the button is pressed,
-            // and rewind when it's released.
-            bool bPressed = iPadState & (1 << panel);
-            if(bPressed)
-                pad_state.animations[SMX_LightsType_Pressed][panel].Play();
-            else
-                pad_state.animations[SMX_LightsType_Pressed][panel].Stop();
-        }
-
-        // Set the current state.
-        asLightsDataOut = pad_state.GetLightsCommand(iPadState, config);
-
-        // Advance animations.
-        for(int type = 0; type < NUM_SMX_LightsType; ++type)
-        {
-            for(int panel = 0; panel < 9; ++panel)
-                pad_state.animations[type][panel].Update();
-        }
-
+        // Make sure the correct animations are playing, and set the current state.
+        pad_state.SetPadState(iPadState, iTick);
+        pad_state.GetLightsCommands(iPadState, iTick, config, lightsOut);
         return true;
     }
 
-    // Run a single light animation update.
-    void UpdateLights()
+    // Run a single light animation update for iTick.
+    void UpdateLights(int64_t iTick)
     {
-        string asLightsData[2];
+        // Commands are built here and copied into the queue, so this doesn't allocate.
+        // Pads we don't have lights for are left null, so they're left alone.
+        EncodedLights aLights[SMXManager::MaxPads];
+        const EncodedLights *apLights[SMXManager::MaxPads] = { };
+        int iNumPads = SMXManager::g_pSMX->GetPadCount();
         bool bHaveLights = false;
-        for(int pad = 0; pad < 2; pad++)
+        for(int pad = 0; pad < iNumPads; pad++)
         {
-            int iPadState = SMXManager::g_pSMX->GetDevice(pad)->GetInputState();
-            if(GetCurrentLights(asLightsData[pad], pad, iPadState))
+            int iPadState = SMXManager::g_pSMX->GetInputState(pad);
+            if(GetCurrentLights(aLights[pad], pad, iPadState, iTick))
+            {
+                apLights[pad] = &aLights[pad];
                 bHaveLights = true;
+            }
         }
 
         // Update lights.
         if(bHaveLights)
-            SMXManager::g_pSMX->SetLights(asLightsData);
+            SMXManager::g_pSMX->SetEncodedLights(apLights, iNumPads);
     }
 };
 
@@ -516,4 +657,38 @@ void SMX_LightsAnimation_SetAuto(bool enable)
     PanelAnimationThread::g_pSingleton.reset(new PanelAnimationThread());
 }
 
+double SMX_LightsAnimation_GetPhase()
+{
+    g_Lock.AssertNotLockedByCurrentThread();
+    LockMutex L(g_Lock);
+
+    return SMX::GetMonotonicTime() - GetTimelineStart();
+}
+
+void SMX_LightsAnimation_SetPhase(double seconds)
+{
+    g_Lock.AssertNotLockedByCurrentThread();
+    LockMutex L(g_Lock);
+
+    double fNow = SMX::GetMonotonicTime();
+    int64_t iOldTick = GetTickAt(fNow);
+    g_fTimelineStart = fNow - max(seconds, 0.0);
+    int64_t iNewTick = GetTickAt(fNow);
+
+    // Move pressed animations that are playing along with the timeline, so they don't
+    // jump to a different frame.
+    for(AnimationStateForPad &pad_state: pad_states)
+    {
+        for(AnimationState &state: pad_state.animations[SMX_LightsType_Pressed])
+        {
+            if(state.bPlaying)
+                state.iStartTick += iNewTick - iOldTick;
+        }
+    }
+
+    // Wake the animation thread, so it waits for the new timeline's next tick.
+    if(PanelAnimationThread::g_pSingleton)
+        PanelAnimationThread::g_pSingleton->Wake();
+}
+
 shared_ptr<PanelAnimationThread> PanelAnimationThread::g_pSingleton;
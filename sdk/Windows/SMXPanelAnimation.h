@@ -1,8 +1,12 @@
 #ifndef SMXPanelAnimation_h
 #define SMXPanelAnimation_h
 
+#include <memory>
 #include <vector>
 #include "SMXGif.h"
+#include "SMXLightsEncoding.h"
+
+struct SMXConfig;
 
 enum SMX_LightsType
 {
@@ -17,15 +21,38 @@ class SMXPanelAnimation
 public:
     void Load(const std::vector<SMXGif::SMXGifFrame> &frames, int panel);
 
-    // The high-level animated GIF frames:
-    std::vector<std::vector<SMXGif::Color>> m_aPanelGraphics;
+    // The high-level animated GIF frames.  Each frame has an index into m_pPalette for
+    // each light, in the order they're sent to the master controller.  Lights past the end
+    // of a frame are transparent.
+    std::vector<std::vector<uint8_t>> m_aPanelGraphics;
+    std::shared_ptr<const SMXGif::Palette> m_pPalette;
+
+    // m_aPanelGraphics as scaled colors, ready to copy into lights commands.  Each frame
+    // has RGB for all 25 lights in the order they're sent, with transparent lights black.
+    // m_iMask is 0xFF for each byte of a light that isn't transparent, and 0 otherwise.
+    struct EncodedFrame
+    {
+        uint8_t m_iColors[25*3];
+        uint8_t m_iMask[25*3];
+    };
+    std::vector<EncodedFrame> m_aEncodedFrames;
 
     // The animation starts on frame 0.  When it reaches the end, it loops
     // back to this frame.
     int m_iLoopFrame = 0;
 
-    // The duration of each frame in seconds.
-    std::vector<float> m_iFrameDurations;
+    // The number of 30 FPS ticks each frame is shown for.  This is the timing the panels
+    // use for uploaded animations.
+    std::vector<int> m_iFrameTicks;
+
+    // Return the frame shown iTick ticks after the animation starts, including loops, or
+    // -1 if there are no frames.
+    int GetFrameAtTick(int64_t iTick) const;
+
+private:
+    // The tick each frame starts on the first time through, and the total length.
+    std::vector<int64_t> m_iFrameStartTicks;
+    int64_t m_iTotalTicks = 0;
 };
 
 namespace SMXAutoPanelAnimations
@@ -33,6 +60,12 @@ namespace SMXAutoPanelAnimations
     // If SMX_LightsAnimation_SetAuto is active, stop sending animations briefly.  This is
     // called when lights are set directly, so they don't compete with the animation.
     void TemporaryStopAnimating();
+
+    // Build the lights commands SMX_LightsAnimation_SetAuto would send for a pad with the
+    // given input state and configuration.  Like an update, this starts pressed animations
+    // for newly pressed panels and stops them for released ones, but it doesn't send
+    // anything or move the timeline.  This is exposed for testing.
+    void GetLightsCommands(int pad, int iPadState, const SMXConfig &config, SMX::EncodedLights &out);
 }
 
 // For SMX_API:
@@ -47,6 +80,10 @@ namespace SMXAutoPanelAnimations
 // SMX_LightsUpload_BeginUpload, or used directly with SMX_LightsAnimation_SetAuto.
 SMX_API bool SMX_LightsAnimation_Load(const char *gif, int size, int pad, SMX_LightsType type, const char **error);
 
+// Load an animated GIF from a file, like SMX_LightsAnimation_Load.  path is UTF-8.  The
+// file is mapped and decoded in place, so it's never copied into memory as a whole.
+SMX_API bool SMX_LightsAnimation_LoadFile(const char *path, int pad, SMX_LightsType type, const char **error);
+
 // Enable or disable automatically handling lights animations.  If enabled, any animations
 // loaded with SMX_LightsAnimation_Load will run automatically as long as the SDK is loaded.
 // This only has an effect if the platform doesn't handle animations directly.  On newer firmware,
@@ -54,4 +91,12 @@ SMX_API bool SMX_LightsAnimation_Load(const char *gif, int size, int pad, SMX_Li
 // XXX: should we automatically disable SMX_SetLights when this is enabled?
 SMX_API void SMX_LightsAnimation_SetAuto(bool enable);
 
+// Get or set the position of automatic animations, in seconds.  Animations run on a single
+// timeline at the panels' 30 FPS.  Released animations on every panel and pad play from the
+// start of the timeline, so they're always in sync.  Pressed animations start when the
+// panel is pressed, and change frames on the same ticks.  Setting the phase can be used to
+// line animations up with music, or with another machine.  Negative values are treated as 0.
+SMX_API double SMX_LightsAnimation_GetPhase();
+SMX_API void SMX_LightsAnimation_SetPhase(double seconds);
+
 #endif
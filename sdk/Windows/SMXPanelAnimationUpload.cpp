@@ -3,9 +3,12 @@
 #include "SMXGif.h"
 #include "SMXManager.h"
 #include "SMXDevice.h"
+#include "SMXLightsEncoding.h"
 #include "Helpers.h"
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <math.h>
 using namespace std;
 using namespace SMX;
 
@@ -108,81 +111,65 @@ namespace PanelLightGraphic
     static_assert(sizeof(upload_packet) <= 0xFF, "");
 }
 
-// The GIFs can use variable framerates.  The panels update at 30 FPS.
-#define FPS 30
-
 // Helpers for converting PanelGraphics to the packed sprite representation
 // we give to the pad.
 namespace ProtocolHelpers
 {
-    // Return a color's index in palette.  If the color isn't found, return 0xFF.
-    // We can use a dumb linear search here since the graphics are so small.
-    uint8_t GetColorIndex(const PanelLightGraphic::palette_t &palette, const SMXGif::Color &color)
-    {
-        // Transparency is always palette index 15.
-        if(color.color[3] == 0)
-            return 15;
-
-        for(int idx = 0; idx < 15; ++idx)
-        {
-            PanelLightGraphic::color_t pad_color = palette.colors[idx];
-            if(pad_color.rgb[0] == color.color[0] &&
-                pad_color.rgb[1] == color.color[1] &&
-                pad_color.rgb[2] == color.color[2])
-                return idx;
-        }
-        return 0xFF;
-    }
-
     // Create a palette for an animation.
     //
-    // We're loading from paletted GIFs, but we create a separate small palette
-    // for each panel's animation, so we don't use the GIF's palette.
-    bool CreatePalette(const SMXPanelAnimation &animation, PanelLightGraphic::palette_t &palette)
+    // The animation has a palette of up to 256 colors, but we create a separate small
+    // palette for each panel's animation, since the panels only have 4-bit color.
+    // index_map is set to the panel palette index for each animation palette index.
+    // Transparency is always palette index 15.
+    bool CreatePalette(const SMXPanelAnimation &animation, PanelLightGraphic::palette_t &palette,
+        uint8_t index_map[256])
     {
+        memset(index_map, 0xFF, 256);
+
         int next_color = 0;
         for(const auto &panel_graphic: animation.m_aPanelGraphics)
         {
-            for(const SMXGif::Color &color: panel_graphic)
+            for(uint8_t animation_idx: panel_graphic)
             {
-                // If this color is transparent, leave it out of the palette.
-                if(color.color[3] == 0)
+                // Skip colors we've already added.
+                if(index_map[animation_idx] != 0xFF)
                     continue;
 
-                // Check if this color is already in the palette.
-                uint8_t existing_idx = GetColorIndex(palette, color);
-                if(existing_idx != 0xFF)
+                // If this color is transparent, leave it out of the palette.
+                const SMXGif::Color &color = (*animation.m_pPalette)[animation_idx];
+                if(color.color[3] == 0)
+                {
+                    index_map[animation_idx] = 15;
                     continue;
+                }
 
                 // Return false if we're using too many colors.
                 if(next_color == 15)
                     return false;
 
-                // Add this color.
+                // Add this color.  Each color appears in the animation palette once, so
+                // this is always a new color.
                 PanelLightGraphic::color_t pad_color;
                 pad_color.rgb[0] = color.color[0];
                 pad_color.rgb[1] = color.color[1];
                 pad_color.rgb[2] = color.color[2];
                 palette.colors[next_color] = pad_color;
+                index_map[animation_idx] = next_color;
                 next_color++;
             }
         }
         return true;
     }
 
-    // Return packed paletted graphics for each frame, using a palette created
-    // with CreatePalette.  The palette must have fewer than 16 colors.
-    void CreatePackedGraphic(const vector<SMXGif::Color> &image, const PanelLightGraphic::palette_t &palette,
+    // Return a packed paletted graphic for a frame, using an index_map created with
+    // CreatePalette.  Lights past the end of the frame are transparent.
+    void CreatePackedGraphic(const vector<uint8_t> &image, const uint8_t index_map[256],
         PanelLightGraphic::graphic_t &out)
     {
-        int position = 0;
         memset(out.data, 0, sizeof(out.data));
-        for(auto color: image)
+        for(int position = 0; position < 25; ++position)
         {
-            // Transparency is always palette index 15.
-            uint8_t palette_idx = GetColorIndex(palette, color);
-            if(palette_idx == 0xFF)
-                palette_idx = 0;
+            uint8_t palette_idx = position < image.size()? index_map[image[position]]:15;
 
             // If this is an odd index, put the palette index in the low 4
             // bits.  Otherwise, put it in the high 4 bits.
@@ -190,41 +177,9 @@ namespace ProtocolHelpers
                 out.data[position/2] |= (palette_idx & 0x0F) << 0;
             else
                 out.data[position/2] |= (palette_idx & 0x0F) << 4;
-            position++;
         }
     }
 
-    vector<uint8_t> get_frame_delays(const SMXPanelAnimation &animation)
-    {
-        vector<uint8_t> result;
-        int current_frame = 0;
-        
-        float time_left_in_frame = animation.m_iFrameDurations[0];
-        result.push_back(0);
-        while(1)
-        {
-            // Advance time by 1/FPS seconds.
-            time_left_in_frame -= 1.0f / FPS;
-            result.back()++;
-
-            if(time_left_in_frame <= 0.00001f)
-            {
-                // We've displayed this frame long enough, so advance to the next frame.
-                if(current_frame + 1 == animation.m_iFrameDurations.size())
-                    break;
-
-                current_frame += 1;
-                result.push_back(0);
-                time_left_in_frame += animation.m_iFrameDurations[current_frame];
-
-                // If time_left_in_frame is still negative, the animation is too fast.
-                if(time_left_in_frame < 0.00001)
-                    time_left_in_frame = 0;
-            }
-        }
-        return result;
-    }
-
     // Create the master data.  This just has timing information.
     bool CreateMasterAnimationData(SMX_LightsType type,
         const SMXPanelAnimation &animation,
@@ -249,9 +204,8 @@ namespace ProtocolHelpers
 
         // Set frame delays.
         memset(&animation_timing.delay[0], 0, sizeof(animation_timing.delay));
-        vector<uint8_t> delays = get_frame_delays(animation);
-        for(int i = 0; i < delays.size() && i < 64; ++i)
-            animation_timing.delay[i] = delays[i];
+        for(int i = 0; i < animation.m_iFrameTicks.size() && i < 64; ++i)
+            animation_timing.delay[i] = uint8_t(animation.m_iFrameTicks[i]);
 
         // These frame numbers are relative to the animation, so don't add first_graphic.
         animation_timing.loop_animation_frame = animation.m_iLoopFrame;
@@ -269,7 +223,8 @@ namespace ProtocolHelpers
         int next_graphic_idx = type == SMX_LightsType_Released? 0:32;
 
         // Create this animation's 4-bit palette.
-        if(!ProtocolHelpers::CreatePalette(animation, panel_data.palettes[type]))
+        uint8_t index_map[256];
+        if(!ProtocolHelpers::CreatePalette(animation, panel_data.palettes[type], index_map))
         {
             *error = SMX::CreateError(SMX::ssprintf("The %s panel uses too many colors.", panel_names[panel]));
             return false;
@@ -285,7 +240,7 @@ namespace ProtocolHelpers
                 return false;
             }
 
-            ProtocolHelpers::CreatePackedGraphic(panel_graphic, panel_data.palettes[type], panel_data.graphics[next_graphic_idx]);
+            ProtocolHelpers::CreatePackedGraphic(panel_graphic, index_map, panel_data.graphics[next_graphic_idx]);
             next_graphic_idx++;
         }
 
@@ -295,7 +250,7 @@ namespace ProtocolHelpers
         for(PanelLightGraphic::color_t &color: panel_data.palettes[type].colors)
         {
             for(int i = 0; i < 3; ++i)
-                color.rgb[i] = uint8_t(color.rgb[i] * 0.6666f);
+                color.rgb[i] = ScaleLightColor(color.rgb[i]);
         }
 
         return true;
@@ -315,7 +270,7 @@ namespace ProtocolHelpers
             packet.offset = start + offset;
 
             int bytes_left = size - offset;
-            packet.size = min(sizeof(PanelLightGraphic::upload_packet::data), bytes_left);
+            packet.size = min<int>(sizeof(PanelLightGraphic::upload_packet::data), bytes_left);
             memcpy(packet.data, buf, packet.size);
             packets.push_back(packet);
 
@@ -327,12 +282,18 @@ namespace ProtocolHelpers
 
 namespace LightsUploadData
 {
-    vector<string> commands[2];
+    vector<string> commands[SMXManager::MaxPads];
 }
 
 // Prepare the loaded graphics for upload.
 bool SMX_LightsUpload_PrepareUpload(int pad, SMX_LightsType type, const SMXPanelAnimation animations[9], const char **error)
 {
+    if(pad < 0 || pad >= SMXManager::MaxPads)
+    {
+        *error = "Invalid pad.";
+        return false;
+    }
+
     // Create master animation data.
     PanelLightGraphic::animation_timing_t master_animation_data;
     memset(&master_animation_data, 0xFF, sizeof(master_animation_data));
@@ -386,13 +347,13 @@ bool SMX_LightsUpload_PrepareUpload(int pad, SMX_LightsType type, const SMXPanel
         {
             int first_graphic = type == SMX_LightsType_Released? 0:32;
             const PanelLightGraphic::graphic_t *graphics = &panel_data_block.graphics[first_graphic];
-            int offset = offsetof(PanelLightGraphic::panel_animation_data_t, graphics[first_graphic]);
+            int offset = offsetof(PanelLightGraphic::panel_animation_data_t, graphics) + sizeof(PanelLightGraphic::graphic_t) * first_graphic;
             ProtocolHelpers::CreateUploadPackets(packetsPerPanel[panel], graphics, offset, sizeof(PanelLightGraphic::graphic_t) * 32, panel, type);
         }
 
         {
             const PanelLightGraphic::palette_t *palette = &panel_data_block.palettes[type];
-            int offset = offsetof(PanelLightGraphic::panel_animation_data_t, palettes[type]);
+            int offset = offsetof(PanelLightGraphic::panel_animation_data_t, palettes) + sizeof(PanelLightGraphic::palette_t) * type;
             ProtocolHelpers::CreateUploadPackets(packetsPerPanel[panel], palette, offset, sizeof(PanelLightGraphic::palette_t), panel, type);
         }
     }
@@ -424,7 +385,7 @@ bool SMX_LightsUpload_PrepareUpload(int pad, SMX_LightsType type, const SMXPanel
             PanelLightGraphic::upload_packet packet = packets.back();
             packets.pop_back();
             add_packet_command(packet);
-            max_size = max(max_size, packet.size);
+            max_size = max<int>(max_size, packet.size);
             added_any_packets = true;
         }
 
@@ -461,30 +422,34 @@ bool SMX_LightsUpload_PrepareUpload(int pad, SMX_LightsType type, const SMXPanel
 void SMX_LightsUpload_BeginUpload(int pad, SMX_LightsUploadCallback pCallback, void *pUser)
 {
     shared_ptr<SMXDevice> pDevice = SMXManager::g_pSMX->GetDevice(pad);
-    vector<string> asCommands = LightsUploadData::commands[pad];
-    int iTotalCommands = asCommands.size();
-
-    // Queue all commands at once.  As each command finishes, our callback
-    // will be called.
-    for(int i = 0; i < asCommands.size(); ++i)
+    if(pDevice == nullptr)
     {
-        const string &sCommand = asCommands[i];
-        pDevice->SendCommand(sCommand, [i, iTotalCommands, pCallback, pUser](string response) {
-            // Command #i has finished being sent.
-            //
-            // If this isn't the last command, make sure progress isn't 100.
-            // Once we send 100%, the callback is no longer valid.
-            int progress;
-            if(i != iTotalCommands-1)
-                progress = min((i*100) / (iTotalCommands - 1), 99);
-            else
-                progress = 100;
+        SMX::Log(SMX::ssprintf("SMX_LightsUpload_BeginUpload: invalid pad %i", pad));
+        return;
+    }
+
+    const vector<string> &asCommands = LightsUploadData::commands[pad];
+    int iTotalCommands = asCommands.size();
 
-            // We're currently in the SMXManager thread.  Call the user thread from
-            // the user callback thread.
-            SMXManager::g_pSMX->RunInHelperThread([pCallback, pUser, progress]() {
-                pCallback(progress, pUser);
-            });
+    // Send the commands with bulk priority, so lights and other commands aren't held up
+    // while the upload is in progress.  As each command finishes, our callback will be
+    // called.
+    pDevice->SendBulkCommands(asCommands, [pad, iTotalCommands, pCallback, pUser](int i) {
+        // Command #i has finished being sent.
+        //
+        // If this isn't the last command, make sure progress isn't 100.
+        // Once we send 100%, the callback is no longer valid.
+        int progress;
+        if(i != iTotalCommands-1)
+            progress = min((i*100) / (iTotalCommands - 1), 99);
+        else
+            progress = 100;
+
+        // We're currently in the SMXManager thread.  Call the user thread from
+        // the user callback thread, and tell the update callback too.
+        SMXManager::g_pSMX->QueueUploadProgress(pad, progress);
+        SMXManager::g_pSMX->RunInHelperThread([pCallback, pUser, progress]() {
+            pCallback(progress, pUser);
         });
-    }
+    });
 }
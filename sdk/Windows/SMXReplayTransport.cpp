@@ -0,0 +1,150 @@
+#include "SMXReplayTransport.h"
+
+#include <algorithm>
+#include <math.h>
+using namespace std;
+using namespace SMX;
+
+SMX::SMXReplayTransport::SMXReplayTransport(const vector<SMXCapturedReport> &aReports, int iDevice, bool bOriginalSpeed):
+    m_bOriginalSpeed(bOriginalSpeed)
+{
+    // Find the first connection to this device, and take the reports up to the next one.
+    bool bOpened = false;
+    for(const SMXCapturedReport &report: aReports)
+    {
+        if(report.iDevice != iDevice)
+            continue;
+
+        if(report.iFlags & CapturedReport_Opened)
+        {
+            if(bOpened)
+                break;
+            bOpened = true;
+            m_fCaptureStartTime = report.fTime;
+            continue;
+        }
+
+        if(!bOpened || (report.iFlags & CapturedReport_RecordingStarted))
+            continue;
+
+        if(report.iFlags & CapturedReport_Outbound)
+        {
+            OutboundReport outbound;
+            outbound.sReport = report.sReport;
+            outbound.fTime = report.fTime;
+            m_aOutbound.push_back(outbound);
+        }
+        else
+        {
+            InboundReport inbound;
+            inbound.sReport = report.sReport;
+            inbound.fTime = report.fTime;
+            inbound.iWritesBefore = (int) m_aOutbound.size();
+            m_aInbound.push_back(inbound);
+        }
+    }
+
+    m_Stats.bFinished = m_aInbound.empty();
+}
+
+bool SMX::SMXReplayTransport::Open(wstring &sError)
+{
+    LockMutex L(m_Lock);
+    m_fOpenedAt = m_fLastProgressAt = GetMonotonicTime();
+    return true;
+}
+
+void SMX::SMXReplayTransport::Close()
+{
+}
+
+// Return the time the next report can be read, or -1 if there are no more reports.
+double SMX::SMXReplayTransport::GetReadTime(double fNow) const
+{
+    if(m_iNextInbound >= (int) m_aInbound.size())
+        return -1;
+
+    // If we're still waiting for writes the capture made before this report, wait for them
+    // until we time out.
+    const InboundReport &inbound = m_aInbound[m_iNextInbound];
+    if(m_iNextOutbound < inbound.iWritesBefore)
+        return m_fLastProgressAt + WriteTimeout;
+
+    if(!m_bOriginalSpeed)
+        return fNow;
+
+    // Read the report when it was originally read.  If it came after a write, also wait as
+    // long after our write as it originally did, in case the SDK wrote it later than the
+    // capture did.
+    double fReadAt = m_fOpenedAt + (inbound.fTime - m_fCaptureStartTime);
+    if(inbound.iWritesBefore > 0)
+    {
+        const OutboundReport &outbound = m_aOutbound[inbound.iWritesBefore-1];
+        if(outbound.fWrittenAt >= 0)
+            fReadAt = max(fReadAt, outbound.fWrittenAt + (inbound.fTime - outbound.fTime));
+    }
+    return fReadAt;
+}
+
+bool SMX::SMXReplayTransport::ReadReport(string &sReport, wstring &sError)
+{
+    LockMutex L(m_Lock);
+
+    double fNow = GetMonotonicTime();
+    double fReadAt = GetReadTime(fNow);
+    if(fReadAt < 0 || fReadAt > fNow)
+        return false;
+
+    const InboundReport &inbound = m_aInbound[m_iNextInbound];
+    if(m_iNextOutbound < inbound.iWritesBefore)
+    {
+        // We gave up waiting for the SDK to make the writes the capture made before this.
+        // Skip them, so later writes are compared with the right reports.
+        m_Stats.iWriteTimeouts++;
+        m_iNextOutbound = inbound.iWritesBefore;
+    }
+
+    sReport = inbound.sReport;
+    m_iNextInbound++;
+    m_fLastProgressAt = fNow;
+    m_Stats.iReportsRead++;
+    m_Stats.bFinished = m_iNextInbound >= (int) m_aInbound.size();
+    return true;
+}
+
+int SMX::SMXReplayTransport::GetWakeupDelayMS() const
+{
+    LockMutex L(m_Lock);
+    double fNow = GetMonotonicTime();
+    double fReadAt = GetReadTime(fNow);
+    if(fReadAt < 0)
+        return -1;
+
+    return max(0, int(ceil((fReadAt - fNow) * 1000)));
+}
+
+void SMX::SMXReplayTransport::WriteReport(const string &sReport, wstring &sError)
+{
+    LockMutex L(m_Lock);
+
+    double fNow = GetMonotonicTime();
+    m_Stats.iReportsWritten++;
+    m_fLastProgressAt = fNow;
+
+    if(m_iNextOutbound >= (int) m_aOutbound.size())
+    {
+        m_Stats.iWritesExtra++;
+        return;
+    }
+
+    OutboundReport &outbound = m_aOutbound[m_iNextOutbound++];
+    outbound.fWrittenAt = fNow;
+    if(sReport != outbound.sReport)
+        m_Stats.iWritesMismatched++;
+}
+
+SMXReplayStats SMX::SMXReplayTransport::GetStats() const
+{
+    LockMutex L(m_Lock);
+    return m_Stats;
+}
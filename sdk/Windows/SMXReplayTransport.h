@@ -0,0 +1,100 @@
+#ifndef SMXReplayTransport_h
+#define SMXReplayTransport_h
+
+#include "SMXTransport.h"
+#include "SMXTrafficCapture.h"
+
+namespace SMX
+{
+struct SMXReplayStats
+{
+    int iReportsRead = 0;
+    int iReportsWritten = 0;
+
+    // Writes that were different from the ones in the capture, and writes after the
+    // capture ran out.
+    int iWritesMismatched = 0;
+    int iWritesExtra = 0;
+
+    // The number of times we gave up waiting for a write the capture had, and replayed
+    // the next report anyway.
+    int iWriteTimeouts = 0;
+
+    // True once every report in the capture has been read.
+    bool bFinished = false;
+};
+
+// A transport that plays back one device from a capture recorded with SMXTrafficRecorder.
+// Add it with SMXManager::AddSimulatedDevice.
+//
+// Reports read from the device are played back in order, but each one is held until the
+// SDK has written everything the capture wrote before it.  This keeps responses after the
+// commands they answer, so the SDK goes through the same states it did when the capture
+// was recorded.  Writes are compared against the capture, so differences show up in
+// GetStats.
+//
+// If bOriginalSpeed is true, reports are played back at the times they were recorded, and
+// responses come as long after the command as they originally did.  Otherwise, they're
+// played back as fast as the SDK accepts them.
+//
+// Only the first connection for the device in the capture is played back.  If recording
+// started after the device connected, the reports before the next connection are skipped,
+// since they don't start with the device info request the SDK sends.
+class SMXReplayTransport: public SMXTransport
+{
+public:
+    SMXReplayTransport(const vector<SMXCapturedReport> &aReports, int iDevice, bool bOriginalSpeed);
+
+    // SMXTransport:
+    bool Open(wstring &sError) override;
+    void Close() override;
+    bool ReadReport(string &sReport, wstring &sError) override;
+    void WriteReport(const string &sReport, wstring &sError) override;
+    bool GetWritesComplete(wstring &sError) override { return true; }
+    void CancelWrites() override { }
+    HANDLE GetWaitHandle() const override { return INVALID_HANDLE_VALUE; }
+    int GetWakeupDelayMS() const override;
+    void SetWakeupCallback(function<void()> pCallback) override { }
+
+    SMXReplayStats GetStats() const;
+
+private:
+    // If the SDK doesn't write what the capture expects within this long, stop waiting for
+    // it.  This happens if the application doesn't make the same calls it did when the
+    // capture was recorded.
+    static constexpr double WriteTimeout = 1.0;
+
+    double GetReadTime(double fNow) const;
+
+    const bool m_bOriginalSpeed;
+
+    // The reports to read.  iWritesBefore is the number of writes in the capture before
+    // the report was read.
+    struct InboundReport
+    {
+        string sReport;
+        double fTime;
+        int iWritesBefore;
+    };
+    vector<InboundReport> m_aInbound;
+
+    // The writes in the capture, and when the SDK made each one.
+    struct OutboundReport
+    {
+        string sReport;
+        double fTime;
+        double fWrittenAt = -1;
+    };
+    vector<OutboundReport> m_aOutbound;
+    double m_fCaptureStartTime = 0;
+
+    mutable SMX::Mutex m_Lock;
+    double m_fOpenedAt = 0;
+    double m_fLastProgressAt = 0;
+    int m_iNextInbound = 0;
+    int m_iNextOutbound = 0;
+    SMXReplayStats m_Stats;
+};
+}
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef SMXRingBuffer_h
+#define SMXRingBuffer_h
+
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+using namespace std;
+
+namespace SMX
+{
+
+// A lock-free ring buffer with one producer and one consumer.  The producer never blocks
+// or fails: if the consumer falls more than iSize entries behind, the oldest entries are
+// overwritten, and the consumer skips them and is told how many it missed.
+//
+// Each slot has a sequence number, which is odd while the producer is writing it.  The
+// consumer checks it before and after copying a slot, and discards the copy if the slot
+// was overwritten while it was reading.  T must be trivially copyable.
+template<typename T, int iSize>
+class SMXRingBuffer
+{
+public:
+    static_assert(is_trivially_copyable<T>::value, "SMXRingBuffer requires a trivially copyable type");
+
+    // Add an entry.  This must only be called by the producer thread.
+    void Push(const T &value)
+    {
+        uint64_t iHead = m_iHead.load(memory_order_relaxed);
+        Slot &slot = m_Slots[iHead % iSize];
+
+        slot.m_iSequence.store(iHead*2 + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        memcpy(&slot.m_Value, &value, sizeof(T));
+        slot.m_iSequence.store(iHead*2 + 2, memory_order_release);
+
+        m_iHead.store(iHead + 1, memory_order_release);
+    }
+
+    // Read up to iMax entries into pOut, oldest first, and return the number read.  If
+    // piDropped is non-null, the number of entries that were overwritten before we could
+    // read them is added to it.  This must only be called by one thread at a time.
+    int Pop(T *pOut, int iMax, int *piDropped = nullptr)
+    {
+        int iCount = 0;
+        uint64_t iTail = m_iTail;
+        while(iCount < iMax)
+        {
+            uint64_t iHead = m_iHead.load(memory_order_acquire);
+
+            // If the producer has lapped us, skip to the oldest entry that's still there.
+            if(iHead - iTail > iSize)
+            {
+                if(piDropped)
+                    *piDropped += int(iHead - iSize - iTail);
+                iTail = iHead - iSize;
+            }
+
+            if(iTail == iHead)
+                break;
+
+            Slot &slot = m_Slots[iTail % iSize];
+            uint64_t iSequence = slot.m_iSequence.load(memory_order_acquire);
+            memcpy(&pOut[iCount], &slot.m_Value, sizeof(T));
+            atomic_thread_fence(memory_order_acquire);
+
+            // If the slot isn't the entry we expected, or it changed while we were copying
+            // it, the producer overwrote it.  Go back and skip ahead.
+            if(iSequence != iTail*2 + 2 || slot.m_iSequence.load(memory_order_relaxed) != iSequence)
+            {
+                if(m_iHead.load(memory_order_acquire) - iTail <= iSize)
+                {
+                    // This shouldn't happen: the slot is in range but wasn't written.
+                    break;
+                }
+                continue;
+            }
+
+            iCount++;
+            iTail++;
+        }
+
+        m_iTail = iTail;
+        return iCount;
+    }
+
+    // Discard all entries.  This must only be called by the consumer.
+    void Clear()
+    {
+        m_iTail = m_iHead.load(memory_order_acquire);
+    }
+
+private:
+    struct Slot
+    {
+        atomic<uint64_t> m_iSequence{0};
+        T m_Value;
+    };
+    Slot m_Slots[iSize];
+
+    // The number of entries ever pushed.  This is written by the producer.
+    atomic<uint64_t> m_iHead{0};
+
+    // The index of the next entry to read.  This is only used by the consumer.
+    uint64_t m_iTail = 0;
+};
+}
+
+#endif
@@ -0,0 +1,134 @@
+#include "SMXSensorTestData.h"
+#include "Helpers.h"
+
+#include <string.h>
+#include <algorithm>
+using namespace std;
+
+#if defined(SMX_SSE2)
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    // Return the low byte of each of 4 little-endian words in pWords, packed into 32 bits.
+    // If bHigh is true, return the high bytes instead.
+    inline uint64_t PackBytes(const uint8_t *pWords, bool bHigh)
+    {
+        uint64_t iWords;
+        memcpy(&iWords, pWords, sizeof(iWords));
+        if(bHigh)
+            iWords >>= 8;
+
+        iWords &= 0x00FF00FF00FF00FFull;
+        iWords = (iWords | (iWords >> 8)) & 0x0000FFFF0000FFFFull;
+        iWords = (iWords | (iWords >> 16)) & 0x00000000FFFFFFFFull;
+        return iWords;
+    }
+
+    // Transpose 8 words, giving 8 bits for each panel.  This works on the whole block in a
+    // 64-bit integer, so it's fast without SIMD.
+    inline void Transpose8(const uint8_t *pWords, uint8_t iBits[9])
+    {
+        // Transpose the low bytes as an 8x8 bit matrix.  Byte N of the result has bit N of
+        // each word.
+        uint64_t x = PackBytes(pWords, false) | (PackBytes(pWords + 8, false) << 32);
+        uint64_t t;
+        t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAull;
+        x = x ^ t ^ (t << 7);
+        t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCull;
+        x = x ^ t ^ (t << 14);
+        t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ull;
+        x = x ^ t ^ (t << 28);
+        for(int iPanel = 0; iPanel < 8; ++iPanel)
+            iBits[iPanel] = uint8_t(x >> (iPanel*8));
+
+        // Panel 8 is the low bit of each high byte.  Gather them into the top byte.
+        uint64_t iHigh = PackBytes(pWords, true) | (PackBytes(pWords + 8, true) << 32);
+        iBits[8] = uint8_t(((iHigh & 0x0101010101010101ull) * 0x0102040810204080ull) >> 56);
+    }
+
+#if defined(SMX_SSE2)
+    // Transpose 16 words, giving 16 bits for each panel.
+    inline void Transpose16(const uint8_t *pWords, uint16_t iBits[9])
+    {
+        __m128i words0 = _mm_loadu_si128((const __m128i *) pWords);
+        __m128i words1 = _mm_loadu_si128((const __m128i *) (pWords + 16));
+
+        // Split the low bytes (panels 0-7) and high bytes (panel 8) of each word.
+        const __m128i lowMask = _mm_set1_epi16(0xFF);
+        __m128i lo = _mm_packus_epi16(_mm_and_si128(words0, lowMask), _mm_and_si128(words1, lowMask));
+        __m128i hi = _mm_packus_epi16(_mm_srli_epi16(words0, 8), _mm_srli_epi16(words1, 8));
+
+        // movemask takes the high bit of each byte.  Read panel 7, then shift each byte left
+        // to read panel 6, and so on.
+        for(int iPanel = 7; iPanel >= 0; --iPanel)
+        {
+            iBits[iPanel] = (uint16_t) _mm_movemask_epi8(lo);
+            lo = _mm_add_epi8(lo, lo);
+        }
+        iBits[8] = (uint16_t) _mm_movemask_epi8(_mm_slli_epi16(hi, 7));
+    }
+#endif
+}
+
+void SMX::TransposeSensorTestDataScalar(const uint8_t *pWords, int iWords, uint8_t *pOut, int iBytesPerPanel)
+{
+    iWords = min(iWords, iBytesPerPanel*8);
+
+    // Each block of 8 words gives one byte for each panel.  If there's a partial block
+    // at the end, copy it into a zeroed buffer, so bits past the end are zero.
+    for(int i = 0; i < iBytesPerPanel*8; i += 8)
+    {
+        uint8_t block[16];
+        const uint8_t *pBlock = pWords + i*2;
+        if(i + 8 > iWords)
+        {
+            memset(block, 0, sizeof(block));
+            if(i < iWords)
+                memcpy(block, pWords + i*2, (iWords - i)*2);
+            pBlock = block;
+        }
+
+        uint8_t iBits[9];
+        Transpose8(pBlock, iBits);
+        for(int iPanel = 0; iPanel < 9; ++iPanel)
+            pOut[iPanel*iBytesPerPanel + i/8] = iBits[iPanel];
+    }
+}
+
+void SMX::TransposeSensorTestData(const uint8_t *pWords, int iWords, uint8_t *pOut, int iBytesPerPanel)
+{
+#if defined(SMX_SSE2)
+    iWords = min(iWords, iBytesPerPanel*8);
+
+    // Each block of 16 words gives two bytes for each panel.  If there's a partial block
+    // at the end, copy it into a zeroed buffer, so bits past the end are zero.
+    for(int i = 0; i < iBytesPerPanel*8; i += 16)
+    {
+        uint8_t block[32];
+        const uint8_t *pBlock = pWords + i*2;
+        if(i + 16 > iWords)
+        {
+            memset(block, 0, sizeof(block));
+            if(i < iWords)
+                memcpy(block, pWords + i*2, (iWords - i)*2);
+            pBlock = block;
+        }
+
+        uint16_t iBits[9];
+        Transpose16(pBlock, iBits);
+
+        int iByte = i/8;
+        for(int iPanel = 0; iPanel < 9; ++iPanel)
+        {
+            uint8_t *pPanel = pOut + iPanel*iBytesPerPanel;
+            pPanel[iByte] = uint8_t(iBits[iPanel]);
+            if(iByte + 1 < iBytesPerPanel)
+                pPanel[iByte+1] = uint8_t(iBits[iPanel] >> 8);
+        }
+    }
+#else
+    TransposeSensorTestDataScalar(pWords, iWords, pOut, iBytesPerPanel);
+#endif
+}
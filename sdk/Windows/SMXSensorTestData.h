@@ -0,0 +1,23 @@
+#ifndef SMXSensorTestData_h
+#define SMXSensorTestData_h
+
+#include <stdint.h>
+
+namespace SMX
+{
+// Sensor test data ('y' responses) is sent as a list of little-endian 16-bit words.  Bit N
+// of each word is the next bit of panel N's data, least significant bit first, so each word
+// is one bit from every panel.
+//
+// Transpose iWords words at pWords into a byte stream for each of the 9 panels.  Panel N's
+// data is written to pOut + N*iBytesPerPanel.  Bits past the end of the input are zero, and
+// extra input is ignored.
+//
+// TransposeSensorTestDataScalar handles 8 words at a time in general-purpose registers.
+// TransposeSensorTestData uses it when SSE2 isn't available, and the benchmarks check
+// the two against each other.
+void TransposeSensorTestData(const uint8_t *pWords, int iWords, uint8_t *pOut, int iBytesPerPanel);
+void TransposeSensorTestDataScalar(const uint8_t *pWords, int iWords, uint8_t *pOut, int iBytesPerPanel);
+}
+
+#endif
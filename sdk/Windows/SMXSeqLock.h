@@ -0,0 +1,66 @@
+#ifndef SMXSeqLock_h
+#define SMXSeqLock_h
+
+#include <atomic>
+#include <thread>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+using namespace std;
+
+namespace SMX
+{
+
+// A value written by one thread and read by any number of threads without locking.
+//
+// The writer makes the sequence number odd while it's writing.  Readers copy the value
+// and retry if the sequence number was odd or changed during the copy.  Readers never
+// block the writer, and writes are short, so readers almost never retry.  T must be
+// trivially copyable.
+template<typename T>
+class SMXSeqLock
+{
+public:
+    static_assert(is_trivially_copyable<T>::value, "SMXSeqLock requires a trivially copyable type");
+
+    // Set the value.  This must only be called by one thread.
+    void Store(const T &value)
+    {
+        uint32_t iSequence = m_iSequence.load(memory_order_relaxed);
+        m_iSequence.store(iSequence + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        memcpy(&m_Value, &value, sizeof(T));
+        m_iSequence.store(iSequence + 2, memory_order_release);
+    }
+
+    // Return the most recently stored value.  This can be called from any thread.
+    T Load() const
+    {
+        T value;
+        int iTries = 0;
+        while(1)
+        {
+            uint32_t iSequence = m_iSequence.load(memory_order_acquire);
+            if(!(iSequence & 1))
+            {
+                memcpy(&value, &m_Value, sizeof(T));
+                atomic_thread_fence(memory_order_acquire);
+                if(m_iSequence.load(memory_order_relaxed) == iSequence)
+                    return value;
+            }
+
+            // The writer is in the middle of a write.  If it was preempted, give it a
+            // chance to finish.
+            if(++iTries > 100)
+                this_thread::yield();
+        }
+    }
+
+private:
+    // Keep this on its own cache line, so readers don't contend with unrelated writes.
+    alignas(64) atomic<uint32_t> m_iSequence{0};
+    T m_Value{};
+};
+}
+
+#endif
@@ -0,0 +1,442 @@
+#include "SMXSimulatedDevice.h"
+#include "SMXConfigPacket.h"
+#include "Helpers.h"
+
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <math.h>
+using namespace std;
+using namespace SMX;
+
+// These match the flags in SMXDeviceConnection.cpp.
+#define PACKET_FLAG_START_OF_COMMAND      0x04
+#define PACKET_FLAG_END_OF_COMMAND        0x01
+#define PACKET_FLAG_HOST_CMD_FINISHED     0x02
+#define PACKET_FLAG_DEVICE_INFO           0x80
+
+SMX::SMXSimulatedDevice::SMXSimulatedDevice(const SMXSimulatedDeviceOptions &options):
+    m_Options(options),
+    m_Random(options.iRandomSeed)
+{
+    m_sSerial = options.sSerial;
+    if(m_sSerial.empty())
+    {
+        m_sSerial.resize(16);
+        GenerateRandom(&m_sSerial[0], 16);
+    }
+    m_sSerial.resize(16, '\0');
+
+    // Start with the default configuration, like a newly flashed master.
+    m_Config = SMXConfig();
+    m_Config.masterVersion = (uint8_t) options.iFirmwareVersion;
+    memset(m_Config.enabledSensors, 0xFF, sizeof(m_Config.enabledSensors));
+    m_OldConfig.clear();
+    ConvertToOldConfig(m_Config, m_OldConfig);
+}
+
+bool SMX::SMXSimulatedDevice::Open(wstring &sError)
+{
+    return true;
+}
+
+void SMX::SMXSimulatedDevice::Close()
+{
+    LockMutex L(m_Lock);
+    m_sCurrentCommand.clear();
+    m_pWakeupCallback = nullptr;
+}
+
+void SMX::SMXSimulatedDevice::SetWakeupCallback(function<void()> pCallback)
+{
+    LockMutex L(m_Lock);
+    m_pWakeupCallback = pCallback;
+}
+
+bool SMX::SMXSimulatedDevice::ReadReport(string &sReport, wstring &sError)
+{
+    LockMutex L(m_Lock);
+    if(m_bDisconnected)
+    {
+        sError = L"Device disconnected";
+        return false;
+    }
+
+    if(m_QueuedReports.empty() || m_QueuedReports.front().fTime > GetMonotonicTime())
+        return false;
+
+    sReport = m_QueuedReports.front().sReport;
+    m_QueuedReports.pop_front();
+    m_Stats.iReportsRead++;
+    return true;
+}
+
+int SMX::SMXSimulatedDevice::GetWakeupDelayMS() const
+{
+    LockMutex L(m_Lock);
+    if(m_bDisconnected)
+        return 0;
+    if(m_QueuedReports.empty())
+        return -1;
+
+    double fDelay = m_QueuedReports.front().fTime - GetMonotonicTime();
+    return max(0, int(ceil(fDelay * 1000)));
+}
+
+void SMX::SMXSimulatedDevice::WriteReport(const string &sReport, wstring &sError)
+{
+    LockMutex L(m_Lock);
+    if(m_bDisconnected)
+    {
+        sError = L"Device disconnected";
+        return;
+    }
+
+    m_Stats.iReportsWritten++;
+
+    // We only receive report 5: report ID, flags, size, then up to 61 bytes of data.
+    if(sReport.size() < 3 || sReport[0] != 5)
+        return;
+
+    uint8_t iFlags = (uint8_t) sReport[1];
+    int iSize = min<int>((uint8_t) sReport[2], sReport.size() - 3);
+
+    if(iFlags & PACKET_FLAG_DEVICE_INFO)
+    {
+        HandleDeviceInfoRequest();
+        return;
+    }
+
+    if(iFlags & PACKET_FLAG_START_OF_COMMAND)
+        m_sCurrentCommand.clear();
+
+    m_sCurrentCommand.append(sReport, 3, iSize);
+
+    if(iFlags & PACKET_FLAG_END_OF_COMMAND)
+    {
+        string sCommand;
+        swap(sCommand, m_sCurrentCommand);
+        HandleCommand(sCommand);
+    }
+}
+
+// Decide when to respond to cCommand.  Return false if the command should be dropped.
+bool SMX::SMXSimulatedDevice::ScheduleResponse(char cCommand, double *pfResponseTime)
+{
+    m_Lock.AssertLockedByCurrentThread();
+
+    auto it = m_Options.CommandTiming.find(cCommand);
+    const SMXSimulatedCommandTiming &timing = it != m_Options.CommandTiming.end()? it->second:m_Options.DefaultTiming;
+
+    uniform_real_distribution<double> random(0, 1);
+    if(timing.fDropRate > 0 && random(m_Random) < timing.fDropRate)
+    {
+        m_Stats.iCommandsDropped++;
+        return false;
+    }
+
+    // The master handles one command at a time, so a command can't finish before the
+    // previous one.
+    double fStartTime = max(GetMonotonicTime(), m_fBusyUntil);
+    double fResponseTime = fStartTime + timing.fLatency;
+    if(timing.fJitter > 0)
+        fResponseTime += random(m_Random) * timing.fJitter;
+
+    m_fBusyUntil = fResponseTime;
+    *pfResponseTime = fResponseTime;
+    return true;
+}
+
+void SMX::SMXSimulatedDevice::HandleDeviceInfoRequest()
+{
+    m_Lock.AssertLockedByCurrentThread();
+
+    m_Stats.iCommandsReceived['I']++;
+
+    double fResponseTime;
+    if(!ScheduleResponse('I', &fResponseTime))
+        return;
+
+    QueueResponse(fResponseTime, GetDeviceInfoPacket(), true);
+}
+
+void SMX::SMXSimulatedDevice::HandleCommand(const string &sCommand)
+{
+    m_Lock.AssertLockedByCurrentThread();
+
+    // Empty commands are allowed, and just return an empty response.
+    char cCommand = sCommand.empty()? 0:sCommand[0];
+    m_Stats.iCommandsReceived[(uint8_t) cCommand]++;
+    m_LastCommands[cCommand] = sCommand;
+
+    double fResponseTime;
+    if(!ScheduleResponse(cCommand, &fResponseTime))
+        return;
+
+    string sResponse;
+    switch(cCommand)
+    {
+    case 'i':
+        sResponse = GetDeviceInfoPacket();
+        break;
+
+    case 'g':
+    case 'G':
+        sResponse = GetConfigResponse();
+        break;
+
+    case 'w':
+    case 'W':
+    {
+        // w/W, size, config data
+        if(sCommand.size() < 2)
+            break;
+        int iSize = min<int>((uint8_t) sCommand[1], sCommand.size() - 2);
+        const uint8_t *pData = (const uint8_t *) sCommand.data() + 2;
+        if(cCommand == 'W')
+        {
+            memcpy(&m_Config, pData, min<int>(iSize, sizeof(m_Config)));
+        }
+        else
+        {
+            m_OldConfig.assign(pData, pData + iSize);
+            ConvertToNewConfig(m_OldConfig, m_Config);
+        }
+
+        // The master always reports its own version.
+        m_Config.masterVersion = (uint8_t) m_Options.iFirmwareVersion;
+        m_OldConfig.clear();
+        ConvertToOldConfig(m_Config, m_OldConfig);
+        break;
+    }
+
+    case 'y':
+        if(sCommand.size() >= 2)
+            sResponse = GetSensorTestResponse(sCommand[1]);
+        break;
+
+    case 'f':
+        // Factory reset.
+        m_Config = SMXConfig();
+        m_Config.masterVersion = (uint8_t) m_Options.iFirmwareVersion;
+        memset(m_Config.enabledSensors, 0xFF, sizeof(m_Config.enabledSensors));
+        m_OldConfig.clear();
+        ConvertToOldConfig(m_Config, m_OldConfig);
+        break;
+
+    case 'd':
+    {
+        // Delay before finishing the command: d, milliseconds (uint16).
+        if(sCommand.size() < 3)
+            break;
+        uint16_t iMilliseconds = (uint8_t) sCommand[1] | ((uint8_t) sCommand[2] << 8);
+        fResponseTime += iMilliseconds / 1000.0;
+        m_fBusyUntil = fResponseTime;
+        break;
+    }
+
+    // These are accepted and recorded, but don't return anything.  Lights commands
+    // ('2', '3', '4', 'L', 'l') can be read back with GetLastCommand.
+    case '2':
+    case '3':
+    case '4':
+    case 'L':
+    case 'l':
+    case 'm':
+    case 'C':
+    case 'S':
+    case 't':
+    case 's':
+    default:
+        break;
+    }
+
+    QueueResponse(fResponseTime, sResponse, false);
+}
+
+string SMX::SMXSimulatedDevice::GetDeviceInfoPacket() const
+{
+    // This matches data_info_packet in SMXDeviceConnection::HandleUsbPacket.
+    string sPacket;
+    sPacket.push_back('I');
+    sPacket.push_back(23); // packet size
+    sPacket.push_back(m_Options.bPlayer2? '1':'0');
+    sPacket.push_back(0);
+    sPacket.append(m_sSerial);
+    sPacket.push_back((char) (m_Options.iFirmwareVersion & 0xFF));
+    sPacket.push_back((char) (m_Options.iFirmwareVersion >> 8));
+    sPacket.push_back('\n');
+    return sPacket;
+}
+
+string SMX::SMXSimulatedDevice::GetConfigResponse() const
+{
+    // Firmware version 5 and newer sends the new config format with 'G'.  Older versions
+    // send the old format with 'g'.
+    string sResponse;
+    if(m_Options.iFirmwareVersion >= 5)
+    {
+        sResponse.push_back('G');
+        sResponse.push_back((char) sizeof(m_Config));
+        sResponse.append((const char *) &m_Config, sizeof(m_Config));
+    }
+    else
+    {
+        sResponse.push_back('g');
+        sResponse.push_back((char) m_OldConfig.size());
+        sResponse.append((const char *) m_OldConfig.data(), m_OldConfig.size());
+    }
+    return sResponse;
+}
+
+string SMX::SMXSimulatedDevice::GetSensorTestResponse(char cMode) const
+{
+    // Build the detail_data struct that SMXDevice::HandleSensorTestDataResponse reads for
+    // each panel.  This is 10 bytes: a signature byte (0 1 0 in the low bits), four
+    // int16_t sensor values, and the DIP switch byte.
+    const int iBytesPerPanel = 10;
+    uint8_t PanelData[9][iBytesPerPanel];
+    for(int iPanel = 0; iPanel < 9; ++iPanel)
+    {
+        uint8_t *p = PanelData[iPanel];
+        memset(p, 0, iBytesPerPanel);
+        p[0] = 0x02;
+        for(int iSensor = 0; iSensor < 4; ++iSensor)
+        {
+            uint16_t iValue = (uint16_t) m_iSensorLevel[iPanel][iSensor];
+            p[1 + iSensor*2 + 0] = iValue & 0xFF;
+            p[1 + iSensor*2 + 1] = iValue >> 8;
+        }
+        p[9] = iPanel & 0xF;
+    }
+
+    // The data is sent one bit at a time, with one 16-bit word per bit containing that bit
+    // from every panel.
+    const int iBits = iBytesPerPanel * 8;
+    string sResponse;
+    sResponse.push_back('y');
+    sResponse.push_back(cMode);
+    sResponse.push_back((char) iBits);
+    for(int iBit = 0; iBit < iBits; ++iBit)
+    {
+        uint16_t iWord = 0;
+        for(int iPanel = 0; iPanel < 9; ++iPanel)
+        {
+            if(PanelData[iPanel][iBit / 8] & (1 << (iBit % 8)))
+                iWord |= 1 << iPanel;
+        }
+        sResponse.push_back((char) (iWord & 0xFF));
+        sResponse.push_back((char) (iWord >> 8));
+    }
+    sResponse.push_back('\n');
+    return sResponse;
+}
+
+// Queue sResponse to be sent as HID serial packets (report 6) at fTime.  The last
+// packet tells the host that the command has finished.
+void SMX::SMXSimulatedDevice::QueueResponse(double fTime, const string &sResponse, bool bDeviceInfo)
+{
+    m_Lock.AssertLockedByCurrentThread();
+
+    int i = 0;
+    do {
+        int iPacketSize = min<int>(sResponse.size() - i, 61);
+
+        int iFlags = 0;
+        if(bDeviceInfo)
+            iFlags |= PACKET_FLAG_DEVICE_INFO;
+        else
+        {
+            if(i == 0)
+                iFlags |= PACKET_FLAG_START_OF_COMMAND;
+            if(i + iPacketSize == sResponse.size())
+                iFlags |= PACKET_FLAG_END_OF_COMMAND | PACKET_FLAG_HOST_CMD_FINISHED;
+        }
+
+        string sReport({
+            6, // report ID
+            (char) iFlags,
+            (char) iPacketSize,
+        });
+        sReport.append(sResponse, i, iPacketSize);
+        sReport.resize(64, 0);
+        QueueReport(fTime, sReport);
+
+        i += iPacketSize;
+    } while(i < sResponse.size());
+}
+
+void SMX::SMXSimulatedDevice::QueueReport(double fTime, const string &sReport)
+{
+    m_Lock.AssertLockedByCurrentThread();
+
+    // Keep the queue sorted by time.  Reports with the same time stay in order.
+    auto it = m_QueuedReports.end();
+    while(it != m_QueuedReports.begin())
+    {
+        auto prev = it;
+        --prev;
+        if(prev->fTime <= fTime)
+            break;
+        it = prev;
+    }
+
+    QueuedReport report;
+    report.fTime = fTime;
+    report.sReport = sReport;
+    m_QueuedReports.insert(it, report);
+}
+
+void SMX::SMXSimulatedDevice::SetInputState(uint16_t iInputState)
+{
+    LockMutex L(m_Lock);
+    m_iInputState = iInputState;
+
+    string sReport({
+        3, // report ID
+        (char) (iInputState & 0xFF),
+        (char) (iInputState >> 8),
+    });
+    QueueReport(GetMonotonicTime(), sReport);
+
+    if(m_pWakeupCallback)
+        m_pWakeupCallback();
+}
+
+void SMX::SMXSimulatedDevice::SetSensorLevel(int iPanel, int iSensor, int16_t iLevel)
+{
+    LockMutex L(m_Lock);
+    if(iPanel < 0 || iPanel >= 9 || iSensor < 0 || iSensor >= 4)
+        return;
+    m_iSensorLevel[iPanel][iSensor] = iLevel;
+}
+
+void SMX::SMXSimulatedDevice::Disconnect()
+{
+    LockMutex L(m_Lock);
+    m_bDisconnected = true;
+
+    if(m_pWakeupCallback)
+        m_pWakeupCallback();
+}
+
+string SMX::SMXSimulatedDevice::GetLastCommand(char cCommand) const
+{
+    LockMutex L(m_Lock);
+    auto it = m_LastCommands.find(cCommand);
+    if(it == m_LastCommands.end())
+        return "";
+    return it->second;
+}
+
+SMXConfig SMX::SMXSimulatedDevice::GetConfig() const
+{
+    LockMutex L(m_Lock);
+    return m_Config;
+}
+
+SMXSimulatedDeviceStats SMX::SMXSimulatedDevice::GetStats() const
+{
+    LockMutex L(m_Lock);
+    return m_Stats;
+}
@@ -0,0 +1,144 @@
+#ifndef SMXSimulatedDevice_h
+#define SMXSimulatedDevice_h
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <random>
+#include <functional>
+using namespace std;
+
+#include "Helpers.h"
+#include "SMXTransport.h"
+#include "../SMX.h"
+
+namespace SMX
+{
+
+// How long the simulated master takes to respond to a command.
+struct SMXSimulatedCommandTiming
+{
+    // The time between the command being received and the response, in seconds.  A
+    // random amount from 0 to fJitter is added to this for each command.
+    double fLatency = 0.001;
+    double fJitter = 0;
+
+    // The chance (0-1) of dropping a command entirely.  Dropped commands are never
+    // answered, so the SDK will time out and retry them.
+    double fDropRate = 0;
+};
+
+struct SMXSimulatedDeviceOptions
+{
+    bool bPlayer2 = false;
+    uint16_t iFirmwareVersion = 5;
+
+    // The binary serial number.  If this is empty, a random one is generated.
+    string sSerial;
+
+    // The timing for each command, indexed by the command character ('g', '2', etc).
+    // The device info request is 'I'.  Commands not listed here use DefaultTiming.
+    SMXSimulatedCommandTiming DefaultTiming;
+    map<char, SMXSimulatedCommandTiming> CommandTiming;
+
+    // The seed for latency jitter and drops, so runs are reproducible.
+    uint32_t iRandomSeed = 0;
+};
+
+// Counters for what the simulated device has received.  These can be read with GetStats.
+struct SMXSimulatedDeviceStats
+{
+    // The number of commands received, indexed by the command character.  Device info
+    // requests are counted as 'I'.
+    int iCommandsReceived[256] = { };
+    int iCommandsDropped = 0;
+    int iReportsWritten = 0;
+    int iReportsRead = 0;
+};
+
+// A virtual master controller.  This implements the firmware side of the HID serial
+// protocol behind the transport interface, so SMXManager and SMXDevice can be run and
+// benchmarked without hardware.
+//
+// Add it with SMXManager::AddSimulatedDevice.  Input and test data can be changed from
+// any thread.
+class SMXSimulatedDevice: public SMXTransport
+{
+public:
+    SMXSimulatedDevice(const SMXSimulatedDeviceOptions &options = SMXSimulatedDeviceOptions());
+
+    // SMXTransport:
+    bool Open(wstring &sError) override;
+    void Close() override;
+    bool ReadReport(string &sReport, wstring &sError) override;
+    void WriteReport(const string &sReport, wstring &sError) override;
+    bool GetWritesComplete(wstring &sError) override { return true; }
+    void CancelWrites() override { }
+    HANDLE GetWaitHandle() const override { return INVALID_HANDLE_VALUE; }
+    int GetWakeupDelayMS() const override;
+    void SetWakeupCallback(function<void()> pCallback) override;
+
+    // Change the pressed panels.  This sends an input report immediately.
+    void SetInputState(uint16_t iInputState);
+
+    // Set the sensor value returned for each sensor by 'y' commands.
+    void SetSensorLevel(int iPanel, int iSensor, int16_t iLevel);
+
+    // Simulate unplugging the device.  Reads will return an error, and SMXManager will
+    // close the device.
+    void Disconnect();
+
+    // Return the most recent command received starting with cCommand, or an empty string
+    // if none has been received.  This can be used to check lights data.
+    string GetLastCommand(char cCommand) const;
+
+    // Return the current configuration.
+    SMXConfig GetConfig() const;
+
+    SMXSimulatedDeviceStats GetStats() const;
+
+private:
+    void HandleCommand(const string &sCommand);
+    void HandleDeviceInfoRequest();
+    string GetDeviceInfoPacket() const;
+    string GetConfigResponse() const;
+    string GetSensorTestResponse(char cMode) const;
+    bool ScheduleResponse(char cCommand, double *pfResponseTime);
+    void QueueResponse(double fTime, const string &sResponse, bool bDeviceInfo);
+    void QueueReport(double fTime, const string &sReport);
+
+    const SMXSimulatedDeviceOptions m_Options;
+
+    mutable SMX::Mutex m_Lock;
+    function<void()> m_pWakeupCallback;
+    bool m_bDisconnected = false;
+
+    // The command being received, if a command has been started but not finished.
+    string m_sCurrentCommand;
+
+    // Reports waiting to be read, in the order they'll be read.  Commands are processed
+    // one at a time like the real master, so responses are always scheduled after the
+    // previous one.
+    struct QueuedReport
+    {
+        double fTime;
+        string sReport;
+    };
+    list<QueuedReport> m_QueuedReports;
+    double m_fBusyUntil = 0;
+    mt19937 m_Random;
+
+    // The device's state:
+    string m_sSerial;
+    SMXConfig m_Config;
+    vector<uint8_t> m_OldConfig;
+    uint16_t m_iInputState = 0;
+    int16_t m_iSensorLevel[9][4] = { };
+    map<char, string> m_LastCommands;
+    SMXSimulatedDeviceStats m_Stats;
+};
+}
+
+#endif
@@ -1,5 +1,6 @@
 #include "SMXThread.h"
 
+#include <stdexcept>
 using namespace std;
 using namespace SMX;
 
@@ -11,22 +12,22 @@ SMXThread::SMXThread(Mutex &lock):
 
 void SMX::SMXThread::SetHighPriority(bool bHighPriority)
 {
-    if(m_hThread == INVALID_HANDLE_VALUE)
-        throw exception("SetHighPriority called while the thread isn't running");
+    if(!m_Thread.joinable())
+        throw runtime_error("SetHighPriority called while the thread isn't running");
 
-    SetThreadPriority(m_hThread, THREAD_PRIORITY_HIGHEST);
+    SetThreadHighPriority(m_Thread);
 }
 
 bool SMX::SMXThread::IsCurrentThread() const
 {
-    return GetCurrentThreadId() == m_iThreadId;
+    return this_thread::get_id() == m_Thread.get_id();
 }
 
 void SMXThread::Start(string name)
 {
     // Start the thread.
-    m_hThread = CreateThread(NULL, 0, ThreadMainStart, this, 0, &m_iThreadId);
-    SMX::SetThreadName(m_iThreadId, name);
+    m_Thread = thread([this] { ThreadMain(); });
+    SMX::SetThreadName(m_Thread, name);
 }
 
 void SMXThread::Shutdown()
@@ -37,13 +38,6 @@ void SMXThread::Shutdown()
     m_bShutdown = true;
     m_Event.Set();
 
-    WaitForSingleObject(m_hThread, INFINITE);
-    m_hThread = INVALID_HANDLE_VALUE;
-}
-
-DWORD WINAPI SMXThread::ThreadMainStart(void *self_)
-{
-    SMXThread *self = (SMXThread *) self_;
-    self->ThreadMain();
-    return 0;
+    if(m_Thread.joinable())
+        m_Thread.join();
 }
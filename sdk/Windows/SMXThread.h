@@ -4,6 +4,7 @@
 // A base class for a thread.
 #include "Helpers.h"
 #include <string>
+#include <thread>
 
 namespace SMX
 {
@@ -30,15 +31,12 @@ public:
     virtual void ThreadMain() = 0;
 
 protected:
-    static DWORD WINAPI ThreadMainStart(void *self);
-
     SMX::Mutex &m_Lock;
     SMX::Event m_Event;
     bool m_bShutdown = false;
 
 private:
-    HANDLE m_hThread = INVALID_HANDLE_VALUE;
-    DWORD m_iThreadId = 0;
+    std::thread m_Thread;
 };
 }
 
@@ -0,0 +1,132 @@
+#include "SMXTrafficCapture.h"
+
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+using namespace std;
+using namespace SMX;
+
+static const char CaptureMagic[6] = { 'S', 'M', 'X', 'C', 'A', 'P' };
+static const int CaptureVersion = 1;
+static const int RecordHeaderSize = 8;
+
+shared_ptr<SMXTrafficRecorder> SMX::SMXTrafficRecorder::Create(const string &sPath, string &sError)
+{
+    FILE *pFile = fopen(sPath.c_str(), "wb");
+    if(pFile == nullptr)
+    {
+        sError = ssprintf("Couldn't create %s: %s", sPath.c_str(), strerror(errno));
+        return nullptr;
+    }
+
+    uint8_t header[8];
+    memcpy(header, CaptureMagic, sizeof(CaptureMagic));
+    header[6] = CaptureVersion & 0xFF;
+    header[7] = CaptureVersion >> 8;
+    if(fwrite(header, sizeof(header), 1, pFile) != 1)
+    {
+        sError = ssprintf("Couldn't write %s: %s", sPath.c_str(), strerror(errno));
+        fclose(pFile);
+        return nullptr;
+    }
+
+    return shared_ptr<SMXTrafficRecorder>(new SMXTrafficRecorder(pFile));
+}
+
+SMX::SMXTrafficRecorder::SMXTrafficRecorder(FILE *pFile):
+    m_pFile(pFile)
+{
+    m_fStartTime = m_fLastTime = GetMonotonicTime();
+}
+
+SMX::SMXTrafficRecorder::~SMXTrafficRecorder()
+{
+    fclose(m_pFile);
+}
+
+void SMX::SMXTrafficRecorder::Record(int iDevice, int iFlags, const string &sReport, double fTime)
+{
+    LockMutex L(m_Lock);
+
+    // Devices are recorded from different threads, so times can arrive slightly out of
+    // order.  Keep them in order in the file.
+    fTime = max(fTime, m_fLastTime);
+    uint64_t iDelta = uint64_t((fTime - m_fLastTime) * 1000000);
+    iDelta = min<uint64_t>(iDelta, 0xFFFFFFFF);
+
+    // Only count the time we actually stored, so rounding doesn't accumulate.
+    m_fLastTime += iDelta / 1000000.0;
+
+    int iSize = min<int>(sReport.size(), 0xFF);
+    int iStoredSize = iSize;
+    while(iStoredSize > 0 && sReport[iStoredSize-1] == 0)
+        iStoredSize--;
+
+    uint8_t record[RecordHeaderSize + 0xFF];
+    record[0] = (iDelta >> 0) & 0xFF;
+    record[1] = (iDelta >> 8) & 0xFF;
+    record[2] = (iDelta >> 16) & 0xFF;
+    record[3] = (iDelta >> 24) & 0xFF;
+    record[4] = (uint8_t) iDevice;
+    record[5] = (uint8_t) iFlags;
+    record[6] = (uint8_t) iSize;
+    record[7] = (uint8_t) iStoredSize;
+    memcpy(record + RecordHeaderSize, sReport.data(), iStoredSize);
+
+    // If the disk is full, we'll just have a truncated capture.  Don't spam the log about it.
+    fwrite(record, RecordHeaderSize + iStoredSize, 1, m_pFile);
+}
+
+bool SMX::LoadTrafficCapture(const string &sPath, vector<SMXCapturedReport> &aReports, string &sError)
+{
+    aReports.clear();
+
+    FILE *pFile = fopen(sPath.c_str(), "rb");
+    if(pFile == nullptr)
+    {
+        sError = ssprintf("Couldn't open %s: %s", sPath.c_str(), strerror(errno));
+        return false;
+    }
+
+    uint8_t header[8];
+    if(fread(header, sizeof(header), 1, pFile) != 1 || memcmp(header, CaptureMagic, sizeof(CaptureMagic)))
+    {
+        sError = ssprintf("%s isn't a capture file", sPath.c_str());
+        fclose(pFile);
+        return false;
+    }
+
+    int iVersion = header[6] | (header[7] << 8);
+    if(iVersion != CaptureVersion)
+    {
+        sError = ssprintf("%s has unsupported version %i", sPath.c_str(), iVersion);
+        fclose(pFile);
+        return false;
+    }
+
+    // A capture that was still being written may end partway through a record.  Keep
+    // everything before it.
+    double fTime = 0;
+    uint8_t record[RecordHeaderSize];
+    while(fread(record, sizeof(record), 1, pFile) == 1)
+    {
+        uint32_t iDelta = record[0] | (record[1] << 8) | (record[2] << 16) | (uint32_t(record[3]) << 24);
+        fTime += iDelta / 1000000.0;
+
+        SMXCapturedReport report;
+        report.fTime = fTime;
+        report.iDevice = record[4];
+        report.iFlags = record[5];
+
+        int iSize = record[6];
+        int iStoredSize = min<int>(record[7], iSize);
+        report.sReport.resize(iSize);
+        if(iStoredSize > 0 && fread(&report.sReport[0], iStoredSize, 1, pFile) != 1)
+            break;
+
+        aReports.push_back(report);
+    }
+
+    fclose(pFile);
+    return true;
+}
@@ -0,0 +1,78 @@
+#ifndef SMXTrafficCapture_h
+#define SMXTrafficCapture_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "Helpers.h"
+
+namespace SMX
+{
+// Captures of the raw HID reports sent to and received from devices, so problems can be
+// reproduced without the pad they happened on.  See SMX_StartRecording.  Captures can be
+// played back with SMXReplayTransport.
+//
+// The file starts with the 8-byte header "SMXCAP" followed by a 16-bit version.  Each
+// report is then stored as:
+//
+// uint32_t: microseconds since the previous record
+// uint8_t: the device, which is the SMXManager device slot
+// uint8_t: CapturedReportFlags
+// uint8_t: the size of the report
+// uint8_t: the number of bytes stored, followed by that many bytes of the report
+//
+// Trailing zeroes aren't stored, since most reports are padded to 64 bytes.  Values are
+// little-endian.
+enum CapturedReportFlags
+{
+    // This report was written to the device.  Otherwise, it was read from it.
+    CapturedReport_Outbound = 0x01,
+
+    // The device was opened.  This has no data, and reports after it are for the new
+    // connection.
+    CapturedReport_Opened = 0x02,
+
+    // Recording started while the device was already open.  This has no data.
+    CapturedReport_RecordingStarted = 0x04,
+};
+
+struct SMXCapturedReport
+{
+    // The time of the report, in seconds from the start of the capture.
+    double fTime = 0;
+    int iDevice = 0;
+    int iFlags = 0;
+    string sReport;
+};
+
+// Record reports to a capture file.  This is shared by all devices, and can be called
+// from any thread.
+class SMXTrafficRecorder
+{
+public:
+    // Create a capture file.  Return null and set sError on error.
+    static shared_ptr<SMXTrafficRecorder> Create(const string &sPath, string &sError);
+    ~SMXTrafficRecorder();
+
+    // Record a report.  fTime is on the GetMonotonicTime clock.  This doesn't allocate
+    // memory, so it can be called for every report.
+    void Record(int iDevice, int iFlags, const string &sReport, double fTime);
+
+private:
+    SMXTrafficRecorder(FILE *pFile);
+
+    SMX::Mutex m_Lock;
+    FILE *m_pFile;
+    double m_fStartTime;
+    double m_fLastTime;
+};
+
+// Read a capture file.  Return false and set sError on error.
+bool LoadTrafficCapture(const string &sPath, vector<SMXCapturedReport> &aReports, string &sError);
+}
+
+#endif
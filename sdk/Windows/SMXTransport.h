@@ -0,0 +1,122 @@
+#ifndef SMXTransport_h
+#define SMXTransport_h
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+using namespace std;
+
+#include "Helpers.h"
+
+namespace SMX
+{
+
+// SMXTransport is the platform-specific part of talking to a device: reading and
+// writing raw HID reports.  SMXDeviceConnection implements the protocol on top of
+// this, so packet framing and command handling are the same on every platform.
+//
+// Reports always begin with the report ID.  We write 64-byte reports (report 5),
+// and read input state (report 3) and HID serial packets (report 6).  Depending on
+// the platform, input reports may be padded to 64 bytes.
+//
+// Transports are created by SMXDeviceSearch, and are only used by the SMXManager
+// thread after that.
+class SMXTransport
+{
+public:
+    virtual ~SMXTransport() { }
+
+    // Prepare the device for I/O.  This is called by SMXDeviceConnection::Open.
+    virtual bool Open(wstring &sError) = 0;
+
+    // Cancel any I/O in progress.  The device itself is closed when the transport
+    // is destroyed.
+    virtual void Close() = 0;
+
+    // Read one report, if one has been received.  Return false if no report is
+    // available yet, or on error.  This never blocks.
+    virtual bool ReadReport(string &sReport, wstring &sError) = 0;
+
+    // Start writing a report.  This doesn't wait for the write to complete.  Reports
+    // are always written in the order they're given.
+    virtual void WriteReport(const string &sReport, wstring &sError) = 0;
+
+    // Return true if all reports given to WriteReport have been written.
+    virtual bool GetWritesComplete(wstring &sError) = 0;
+
+    // Cancel any writes that haven't completed yet.  This blocks until the cancellation
+    // finishes, which should be quick.
+    virtual void CancelWrites() = 0;
+
+    // Return the handle SMXIOWaiter waits on to know when this device has I/O to process,
+    // or INVALID_HANDLE_VALUE if this transport isn't backed by a real device.
+    virtual HANDLE GetWaitHandle() const = 0;
+
+    // Transports without a wait handle return the number of milliseconds until they'll
+    // have a report to read, so SMXIOWaiter doesn't sleep past it.  Return -1 if nothing
+    // is scheduled.
+    virtual int GetWakeupDelayMS() const { return -1; }
+
+    // Transports without a wait handle call this when a report arrives from another
+    // thread, to wake up SMXIOWaiter.  This is set by SMXDevice when it opens the device.
+    virtual void SetWakeupCallback(function<void()> pCallback) { }
+
+    // Return true if we're waiting for the device to accept more writes.  This is only
+    // used on platforms where writes can be refused, so we can wait for the device to
+    // become writable.
+    virtual bool GetWantsWriteWakeup() const { return false; }
+};
+
+// This waits for I/O on any of a set of transports, or for another thread to wake us
+// up.  On Windows, this uses WaitForMultipleObjectsEx with an event.  On Linux, this
+// uses epoll with an eventfd.
+class SMXIOWaiter
+{
+public:
+    SMXIOWaiter();
+    ~SMXIOWaiter();
+
+    // Wake up a thread blocking in Wait().  If nothing is waiting, the next call to
+    // Wait() will return immediately.  This can be called from any thread.
+    void Wake();
+
+    // Block until one of apTransports has I/O, Wake() is called, or iDelayMS elapses.
+    // If iDelayMS is -1, wait forever.  This must only be called from one thread.
+    void Wait(const vector<shared_ptr<SMXTransport>> &apTransports, int iDelayMS);
+
+    // Also wake up Wait() when hHandle is signalled (Windows) or readable (Linux).  This is
+    // for handles that aren't transports, like device change notifications.  The handle
+    // must stay open as long as this object exists.
+    void AddHandle(HANDLE hHandle);
+
+private:
+    SMXIOWaiter(const SMXIOWaiter &rhs);
+    SMXIOWaiter &operator=(const SMXIOWaiter &rhs);
+
+#ifdef _WIN32
+    shared_ptr<AutoCloseHandle> m_hEvent;
+    vector<HANDLE> m_aExtraHandles;
+#else
+    shared_ptr<AutoCloseHandle> m_hEventFd;
+    shared_ptr<AutoCloseHandle> m_hEpoll;
+
+    // The file descriptors currently registered with epoll, the transport each
+    // belongs to, and the events we registered for.
+    //
+    // There are only ever a couple of these, so they're kept in vectors and reused, and
+    // Wait doesn't allocate memory.
+    struct RegisteredHandle
+    {
+        int m_iFd = -1;
+        weak_ptr<SMXTransport> m_pTransport;
+        uint32_t m_iEvents = 0;
+    };
+    vector<RegisteredHandle> m_RegisteredHandles;
+    vector<RegisteredHandle> m_NewHandles;
+#endif
+};
+}
+
+#endif